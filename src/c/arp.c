@@ -5,13 +5,13 @@
  *  the list of pending ARP requests.
  *
  *  Most importantly, this module defines a function chirouter_arp_process
- *  that is run as a separate thread, and which will wake up every second
- *  to purge stale entries in the ARP cache (entries that are more than 15 seconds
- *  old) and to traverse the list of pending ARP requests. For each pending
- *  request in the list, it will call chirouter_arp_process_pending_req,
- *  which must either re-send the pending ARP request or cancel the
- *  request and send ICMP Host Unreachable messages in reply to all
- *  the withheld frames.
+ *  that is run as a separate thread (shared by all the routers), and which
+ *  runs the routers' ARP timers as they expire: it purges stale entries in
+ *  the ARP cache (entries that are more than 15 seconds old) and, for each
+ *  pending ARP request whose retransmission timer expires, it will call
+ *  chirouter_arp_process_pending_req, which must either re-send the pending
+ *  ARP request or cancel the request and send ICMP Host Unreachable messages
+ *  in reply to all the withheld frames.
  *
  */
 
@@ -61,6 +61,7 @@
  */
 
 #include <netinet/in.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
@@ -69,9 +70,11 @@
 #include <sched.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 
 #include "arp.h"
 #include "chirouter.h"
+#include "pktbuf.h"
 #include "server.h"
 #include "utils.h"
 #include "utlist.h"
@@ -101,26 +104,292 @@
  */
 int chirouter_arp_process_pending_req(chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req)
 {
-    /* Your code goes here */
+    if(pending_req->times_sent >= ARP_REQ_MAX_TIMES_SENT)
+    {
+        for(uint32_t i = 0; i < pending_req->num_withheld; i++)
+        {
+            ethernet_frame_t *withheld = chirouter_arp_pending_req_withheld_frame(pending_req, i);
+            ethernet_frame_t *reply = chirouter_icmp_build(ctx, withheld,
+                                                           ICMPTYPE_DEST_UNREACHABLE,
+                                                           ICMPCODE_DEST_HOST_UNREACHABLE);
+            if(reply)
+            {
+                chirouter_send_frame(ctx, reply->in_interface, reply->raw, reply->length);
+                chirouter_pktbuf_frame_free(&ctx->server->pool, reply);
+            }
+        }
+
+        chirouter_arp_negcache_add(ctx, &pending_req->ip);
+
+        return ARP_REQ_REMOVE;
+    }
 
-    /* You will be able to write the rest of the code while having
-     * this function always return ARP_REQ_KEEP, but make sure you
-     * return the correct return value when you implement this function */
+    ethernet_frame_t *request = chirouter_arp_build_request(ctx, pending_req->out_interface, &pending_req->ip);
+    if(request)
+    {
+        chirouter_send_frame(ctx, pending_req->out_interface, request->raw, request->length);
+        chirouter_pktbuf_frame_free(&ctx->server->pool, request);
+    }
+
+    pending_req->times_sent++;
 
     return ARP_REQ_KEEP;
 }
-      
 
 
-/***** DO NOT MODIFY THE CODE BELOW *****/
+/* See arp.h */
+ethernet_frame_t* chirouter_arp_build_request(chirouter_ctx_t *ctx, chirouter_interface_t *iface, struct in_addr *ip)
+{
+    ethernet_frame_t *frame = chirouter_pktbuf_frame_alloc(&ctx->server->pool);
+    if(frame == NULL)
+        return NULL;
+
+    ethhdr_t *eth = (ethhdr_t *) frame->raw;
+    arp_packet_t *arp = (arp_packet_t *) ETHER_PAYLOAD_START(frame->raw);
+
+    memset(eth->dst, 0xFF, ETHER_ADDR_LEN);
+    memcpy(eth->src, iface->mac, ETHER_ADDR_LEN);
+    eth->type = htons(ETHERTYPE_ARP);
+
+    arp->hrd = htons(ARP_HRD_ETHERNET);
+    arp->pro = htons(ETHERTYPE_IP);
+    arp->hln = ETHER_ADDR_LEN;
+    arp->pln = IPV4_ADDR_LEN;
+    arp->op = htons(ARP_OP_REQUEST);
+    memcpy(arp->sha, iface->mac, ETHER_ADDR_LEN);
+    arp->spa = iface->ip.s_addr;
+    memset(arp->tha, 0, ETHER_ADDR_LEN);
+    arp->tpa = ip->s_addr;
+
+    frame->length = sizeof(ethhdr_t) + sizeof(arp_packet_t);
+    frame->in_interface = iface;
+
+    return frame;
+}
+
+
+/* Timer used to refresh and expire an ARP cache entry. Entries move
+ * around in the cache, so the timer refers to the entry by IP address,
+ * and remembers the expiry time it was set up for. Each entry points to
+ * its timer: if the entry is evicted (and maybe added again, with a new
+ * timer) before the timer expires, the timer finds that it no longer
+ * belongs to the entry, and does nothing. If the entry is refreshed,
+ * the timer finds that the entry's expiry time has changed, and is
+ * set up again for the new expiry time. */
+typedef struct chirouter_arp_expiry_timer
+{
+    chirouter_timer_t timer;
+    struct in_addr ip;
+    uint64_t expires;
+} chirouter_arp_expiry_timer_t;
+
+
+/*
+ * chirouter_arp_timer_add - Adds a timer to a router's ARP timer wheel
+ *
+ * Wakes up the ARP thread if the timer expires before
+ * the thread was going to wake up.
+ *
+ * Note: The lock_arp mutex must be held.
+ *
+ * ctx: Router context
+ *
+ * timer: Timer
+ *
+ * expires_ms: Expiry time
+ *
+ * Returns: nothing.
+ */
+static void chirouter_arp_timer_add(chirouter_ctx_t *ctx, chirouter_timer_t *timer, uint64_t expires_ms)
+{
+    server_ctx_t *server = ctx->server;
+
+    chirouter_timer_add(&ctx->arp_timers, timer, expires_ms);
+
+    /* Most timers expire after the ARP thread's next wakeup, so the
+     * thread's mutex only has to be taken for the few that don't */
+    if(expires_ms < atomic_load_explicit(&server->arp_next_wakeup, memory_order_relaxed))
+    {
+        pthread_mutex_lock(&server->lock_arp_thread);
+        if(expires_ms < atomic_load_explicit(&server->arp_next_wakeup, memory_order_relaxed))
+        {
+            atomic_store_explicit(&server->arp_next_wakeup, expires_ms, memory_order_relaxed);
+            pthread_cond_signal(&server->arp_cond);
+        }
+        pthread_mutex_unlock(&server->lock_arp_thread);
+    }
+}
+
+
+/*
+ * chirouter_arp_cache_refresh - Sends a unicast ARP request to refresh an ARP cache entry
+ *
+ * The request is sent to the MAC address in the entry (which is still
+ * used until the reply arrives), on the interface the entry was
+ * learned on.
+ */
+static void chirouter_arp_cache_refresh(chirouter_ctx_t *ctx, chirouter_arpcache_entry_t *entry)
+{
+    ethernet_frame_t *request = chirouter_arp_build_request(ctx, entry->iface, &entry->ip);
+    if(request == NULL)
+        return;
+
+    ethhdr_t *eth = (ethhdr_t *) request->raw;
+    memcpy(eth->dst, entry->mac, ETHER_ADDR_LEN);
+
+    chirouter_send_frame(ctx, entry->iface, request->raw, request->length);
+    chirouter_pktbuf_frame_free(&ctx->server->pool, request);
+}
+
+
+/*
+ * chirouter_arp_cache_expire - Timer function that refreshes or expires an ARP cache entry
+ *
+ * The timer first expires ARPCACHE_REFRESH_AHEAD_MS before the entry
+ * does. At that point, if the entry has been used since it was added
+ * (or last refreshed), a unicast ARP request is sent to refresh it, and
+ * is retransmitted until the entry expires or is refreshed by a reply.
+ * If the entry is not refreshed, it is removed when it expires.
+ */
+static void chirouter_arp_cache_expire(chirouter_timer_t *timer, void *arg)
+{
+    chirouter_ctx_t *ctx = (chirouter_ctx_t *) arg;
+    chirouter_arp_expiry_timer_t *expiry = (chirouter_arp_expiry_timer_t *) timer;
+    uint64_t now = chirouter_timer_now_ms();
+
+    chirouter_arpcache_entry_t *entry = chirouter_arp_cache_lookup(ctx, &expiry->ip);
+    if(entry == NULL || entry->expiry_timer != timer)
+    {
+        free(expiry);
+        return;
+    }
+
+    if(entry->expires != expiry->expires)
+    {
+        /* The entry has been refreshed */
+        expiry->expires = entry->expires;
+        chirouter_arp_timer_add(ctx, timer, expiry->expires - ARPCACHE_REFRESH_AHEAD_MS);
+        return;
+    }
+
+    if(now < entry->expires)
+    {
+        if(entry->iface && atomic_load_explicit(&entry->used, memory_order_relaxed))
+        {
+            chilog(DEBUG, "Refreshing ARP cache entry for %s", inet_ntoa(entry->ip));
+            chirouter_arp_cache_refresh(ctx, entry);
+
+            uint64_t retransmit = now + ctx->server->arp_retransmit_ms;
+            chirouter_arp_timer_add(ctx, timer, retransmit < entry->expires ? retransmit : entry->expires);
+        }
+        else
+            chirouter_arp_timer_add(ctx, timer, entry->expires);
+
+        return;
+    }
+
+    chirouter_arp_cache_remove(ctx, entry);
+    free(expiry);
+}
+
+
+/*
+ * chirouter_arp_expiry_timer_free - Frees an ARP cache expiry timer
+ */
+static void chirouter_arp_expiry_timer_free(chirouter_timer_t *timer)
+{
+    free((chirouter_arp_expiry_timer_t *) timer);
+}
+
+
+/*
+ * chirouter_arp_pending_req_retransmit - Timer function that processes a pending ARP request
+ *
+ * Calls chirouter_arp_process_pending_req and, depending on its
+ * return value, re-arms the timer or removes the request.
+ */
+static void chirouter_arp_pending_req_retransmit(chirouter_timer_t *timer, void *arg)
+{
+    chirouter_pending_arp_req_t *pending_req = (chirouter_pending_arp_req_t *)
+            ((uint8_t *) timer - offsetof(chirouter_pending_arp_req_t, timer));
+    chirouter_ctx_t *ctx = (chirouter_ctx_t *) arg;
+
+    if(chirouter_arp_process_pending_req(ctx, pending_req) == ARP_REQ_REMOVE)
+        chirouter_arp_pending_req_remove(ctx, pending_req);
+    else
+        chirouter_arp_timer_add(ctx, timer, chirouter_timer_now_ms() + ctx->server->arp_retransmit_ms);
+}
+
+
+/* See arp.h */
+int chirouter_arp_cache_init(chirouter_ctx_t *ctx, uint32_t max_entries)
+{
+    uint32_t capacity = 1;
+
+    /* Keep the load factor at or below 1/2, so probe
+     * sequences stay short (and always end in an empty slot) */
+    while(capacity < 2 * (uint64_t) max_entries)
+        capacity <<= 1;
+
+    ctx->arpcache = calloc(capacity, sizeof(chirouter_arpcache_entry_t));
+    if(ctx->arpcache == NULL)
+        return -1;
+
+    ctx->arp_negcache = calloc(ARP_NEGCACHE_SIZE, sizeof(chirouter_arp_negcache_entry_t));
+    if(ctx->arp_negcache == NULL)
+    {
+        free(ctx->arpcache);
+        ctx->arpcache = NULL;
+        return -1;
+    }
+    ctx->arp_negcache_hits = 0;
+
+    ctx->arpcache_capacity = capacity;
+    ctx->arpcache_max_entries = max_entries;
+    ctx->arpcache_num_entries = 0;
+    ctx->arpcache_num_static = 0;
+    ctx->arpcache_clock_hand = 0;
+    ctx->arpcache_evictions = 0;
+
+    return 0;
+}
+
+
+/* See arp.h */
+void chirouter_arp_cache_destroy(chirouter_ctx_t *ctx)
+{
+    free(ctx->arpcache);
+    ctx->arpcache = NULL;
+    ctx->arpcache_capacity = 0;
+    free(ctx->arp_negcache);
+    ctx->arp_negcache = NULL;
+    ctx->arpcache_num_entries = 0;
+}
+
+
+/*
+ * chirouter_arp_cache_slot - Returns the home slot of an IP address
+ *
+ * ctx: Router context
+ *
+ * ip: IP address (in network order)
+ *
+ * Returns: Index of the first slot to probe
+ */
+static inline uint32_t chirouter_arp_cache_slot(chirouter_ctx_t *ctx, uint32_t ip)
+{
+    return hash_mix(ip) & (ctx->arpcache_capacity - 1);
+}
 
 
 /* See arp.h */
 chirouter_arpcache_entry_t* chirouter_arp_cache_lookup(chirouter_ctx_t *ctx, struct in_addr *ip)
 {
-    for(int i=0; i < ARPCACHE_SIZE; i++)
+    uint32_t mask = ctx->arpcache_capacity - 1;
+
+    for(uint32_t i = chirouter_arp_cache_slot(ctx, ip->s_addr); ctx->arpcache[i].valid; i = (i + 1) & mask)
     {
-        if(ctx->arpcache[i].valid && ctx->arpcache[i].ip.s_addr == ip->s_addr)
+        if(ctx->arpcache[i].ip.s_addr == ip->s_addr)
         {
             return &ctx->arpcache[i];
         }
@@ -130,87 +399,342 @@ chirouter_arpcache_entry_t* chirouter_arp_cache_lookup(chirouter_ctx_t *ctx, str
 }
 
 
+/*
+ * chirouter_arp_cache_write_begin - Starts modifying an ARP cache entry
+ *
+ * Makes the entry's sequence counter odd, so lock-free readers
+ * will retry any read that overlaps with the modification.
+ *
+ * Note: The lock_arp mutex must be held.
+ *
+ * entry: ARP cache entry
+ *
+ * Returns: nothing.
+ */
+static inline void chirouter_arp_cache_write_begin(chirouter_arpcache_entry_t *entry)
+{
+    unsigned seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&entry->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+
+/*
+ * chirouter_arp_cache_write_end - Finishes modifying an ARP cache entry
+ *
+ * Note: The lock_arp mutex must be held.
+ *
+ * entry: ARP cache entry
+ *
+ * Returns: nothing.
+ */
+static inline void chirouter_arp_cache_write_end(chirouter_arpcache_entry_t *entry)
+{
+    unsigned seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&entry->seq, seq + 1, memory_order_release);
+}
+
+
 /* See arp.h */
-int chirouter_arp_cache_add(chirouter_ctx_t *ctx, struct in_addr *ip, uint8_t *mac)
+bool chirouter_arp_cache_lookup_mac(chirouter_ctx_t *ctx, struct in_addr *ip, uint8_t *mac)
+{
+    uint32_t mask = ctx->arpcache_capacity - 1;
+
+    for(uint32_t i = chirouter_arp_cache_slot(ctx, ip->s_addr); ; i = (i + 1) & mask)
+    {
+        chirouter_arpcache_entry_t *entry = &ctx->arpcache[i];
+        uint8_t entry_mac[ETHER_ADDR_LEN];
+        uint32_t entry_ip;
+        bool valid;
+        unsigned seq;
+
+        /* Take a consistent snapshot of the entry */
+        do
+        {
+            seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+            valid = entry->valid;
+            entry_ip = entry->ip.s_addr;
+            memcpy(entry_mac, entry->mac, ETHER_ADDR_LEN);
+            atomic_thread_fence(memory_order_acquire);
+        } while((seq & 1) || seq != atomic_load_explicit(&entry->seq, memory_order_relaxed));
+
+        if(!valid)
+            return false;
+
+        if(entry_ip == ip->s_addr)
+        {
+            memcpy(mac, entry_mac, ETHER_ADDR_LEN);
+
+            /* Avoid writing to the entry (and bouncing its cache
+             * line between threads) if the flag is already set */
+            if(!atomic_load_explicit(&entry->referenced, memory_order_relaxed))
+                atomic_store_explicit(&entry->referenced, true, memory_order_relaxed);
+            if(!atomic_load_explicit(&entry->used, memory_order_relaxed))
+                atomic_store_explicit(&entry->used, true, memory_order_relaxed);
+
+            return true;
+        }
+    }
+}
+
+
+/*
+ * chirouter_arp_cache_remove_slot - Removes the entry in a slot of the ARP cache
+ *
+ * Uses backward-shift deletion: the entries that follow the removed
+ * entry in its probe sequence are moved back to fill the hole, so no
+ * tombstones are needed and lookups stay O(1) as entries come and go.
+ *
+ * Note: The lock_arp mutex must be held.
+ *
+ * ctx: Router context
+ *
+ * hole: Slot to remove
+ *
+ * Returns: nothing.
+ */
+static void chirouter_arp_cache_remove_slot(chirouter_ctx_t *ctx, uint32_t hole)
 {
-    for(int i=0; i < ARPCACHE_SIZE; i++)
+    uint32_t mask = ctx->arpcache_capacity - 1;
+
+    if(ctx->arpcache[hole].permanent)
+        ctx->arpcache_num_static--;
+
+    for(uint32_t i = (hole + 1) & mask; ctx->arpcache[i].valid; i = (i + 1) & mask)
     {
-        if(!ctx->arpcache[i].valid)
+        uint32_t home = chirouter_arp_cache_slot(ctx, ctx->arpcache[i].ip.s_addr);
+
+        /* The entry in slot i can only move to the hole if the hole
+         * is in its probe sequence (i.e., between its home slot and i) */
+        if(((i - home) & mask) >= ((i - hole) & mask))
         {
-            ctx->arpcache[i].valid = true;
-            memcpy(&ctx->arpcache[i].ip, ip, sizeof(struct in_addr));
-            memcpy(ctx->arpcache[i].mac, mac, ETHER_ADDR_LEN);
-            ctx->arpcache[i].time_added = time(NULL);
+            chirouter_arpcache_entry_t *dst = &ctx->arpcache[hole], *src = &ctx->arpcache[i];
+
+            /* The entry is copied field by field, since the
+             * hole keeps its own sequence counter */
+            chirouter_arp_cache_write_begin(dst);
+            memcpy(dst->mac, src->mac, ETHER_ADDR_LEN);
+            dst->ip = src->ip;
+            dst->permanent = src->permanent;
+            dst->iface = src->iface;
+            dst->expiry_timer = src->expiry_timer;
+            dst->time_added = src->time_added;
+            dst->expires = src->expires;
+            atomic_store_explicit(&dst->referenced,
+                                  atomic_load_explicit(&src->referenced, memory_order_relaxed),
+                                  memory_order_relaxed);
+            atomic_store_explicit(&dst->used,
+                                  atomic_load_explicit(&src->used, memory_order_relaxed),
+                                  memory_order_relaxed);
+            chirouter_arp_cache_write_end(dst);
 
-            return 0;
+            hole = i;
         }
     }
 
-    return 1;
+    chirouter_arp_cache_write_begin(&ctx->arpcache[hole]);
+    ctx->arpcache[hole].valid = false;
+    ctx->arpcache[hole].permanent = false;
+    chirouter_arp_cache_write_end(&ctx->arpcache[hole]);
+    ctx->arpcache_num_entries--;
 }
 
 
-/* See arp.h */
-chirouter_pending_arp_req_t* chirouter_arp_pending_req_lookup(chirouter_ctx_t *ctx, struct in_addr *ip)
+/*
+ * chirouter_arp_cache_evict - Evicts an entry from the ARP cache
+ *
+ * Uses the CLOCK algorithm: the hand advances over the slots, clearing
+ * the referenced flag of the entries it passes over, and evicts the
+ * first entry whose flag was already clear (i.e., the first entry that
+ * has not been used since the hand last passed over it). Static
+ * entries are never evicted, so the hand skips them.
+ *
+ * Note: The lock_arp mutex must be held, and the cache
+ *       must have at least one entry that is not static.
+ *
+ * ctx: Router context
+ *
+ * Returns: nothing.
+ */
+static void chirouter_arp_cache_evict(chirouter_ctx_t *ctx)
 {
-    chirouter_pending_arp_req_t *elt;
-    DL_FOREACH(ctx->pending_arp_reqs, elt)
+    uint32_t mask = ctx->arpcache_capacity - 1;
+    uint32_t hand = ctx->arpcache_clock_hand;
+
+    while(1)
     {
-        if(elt->ip.s_addr == ip->s_addr)
+        chirouter_arpcache_entry_t *entry = &ctx->arpcache[hand];
+
+        if(entry->valid && !entry->permanent)
         {
-            return elt;
+            if(!atomic_load_explicit(&entry->referenced, memory_order_relaxed))
+                break;
+
+            atomic_store_explicit(&entry->referenced, false, memory_order_relaxed);
         }
+
+        hand = (hand + 1) & mask;
     }
 
-    return NULL;
+    chilog(DEBUG, "ARP cache of router %s is full. Evicting %s", ctx->name, inet_ntoa(ctx->arpcache[hand].ip));
+
+    /* If another entry moves into the evicted slot, the hand
+     * will only reach it on its next pass */
+    chirouter_arp_cache_remove_slot(ctx, hand);
+    ctx->arpcache_clock_hand = (hand + 1) & mask;
+    ctx->arpcache_evictions++;
 }
 
 
-/* See arp.h */
-chirouter_pending_arp_req_t* chirouter_arp_pending_req_add(chirouter_ctx_t *ctx, struct in_addr *ip, chirouter_interface_t *iface)
+/*
+ * chirouter_arp_cache_insert - Adds or updates an entry in the ARP cache
+ *
+ * Note: The lock_arp mutex must be held.
+ *
+ * ctx: Router context
+ *
+ * iface, ip, mac: See chirouter_arp_cache_add
+ *
+ * permanent: Whether the entry is static
+ *
+ * expires: Time (as returned by chirouter_timer_now_ms) when the entry
+ *          expires (UINT64_MAX for static entries)
+ *
+ * Returns: The entry, or NULL if the cache is full of static entries
+ *          (or if there is a static entry for the IP address, and the
+ *          entry being added is not static).
+ */
+static chirouter_arpcache_entry_t* chirouter_arp_cache_insert(chirouter_ctx_t *ctx, chirouter_interface_t *iface,
+                                                              struct in_addr *ip, uint8_t *mac, bool permanent,
+                                                              uint64_t expires)
 {
-    chirouter_pending_arp_req_t *pending_req = calloc(1, sizeof(chirouter_pending_arp_req_t));
+    uint32_t mask = ctx->arpcache_capacity - 1;
+    uint32_t i;
 
-    memcpy(&pending_req->ip, ip, sizeof(struct in_addr));
-    pending_req->times_sent = 0;
-    pending_req->last_sent = time(NULL);
-    pending_req->out_interface = iface;
-    pending_req->withheld_frames = NULL;
+    /* Find the entry for this IP address or, if there isn't one,
+     * the empty slot at the end of its probe sequence */
+    for(i = chirouter_arp_cache_slot(ctx, ip->s_addr); ctx->arpcache[i].valid; i = (i + 1) & mask)
+    {
+        if(ctx->arpcache[i].ip.s_addr == ip->s_addr)
+            break;
+    }
 
-    DL_APPEND(ctx->pending_arp_reqs, pending_req);
+    bool new_entry = !ctx->arpcache[i].valid;
 
-    return pending_req;
+    if(new_entry)
+    {
+        if(ctx->arpcache_num_entries == ctx->arpcache_max_entries)
+        {
+            if(ctx->arpcache_num_static == ctx->arpcache_num_entries)
+                return NULL;
+
+            chirouter_arp_cache_evict(ctx);
+
+            /* Eviction may have moved entries around, so we
+             * need to find the empty slot for this IP again */
+            for(i = chirouter_arp_cache_slot(ctx, ip->s_addr); ctx->arpcache[i].valid; i = (i + 1) & mask);
+        }
+
+        ctx->arpcache_num_entries++;
+    }
+    else if(ctx->arpcache[i].permanent && !permanent)
+        return NULL;
+
+    chirouter_arpcache_entry_t *entry = &ctx->arpcache[i];
+
+    if(permanent && (new_entry || !entry->permanent))
+        ctx->arpcache_num_static++;
+
+    chirouter_arp_cache_write_begin(entry);
+    entry->valid = true;
+    entry->permanent = permanent;
+    memcpy(&entry->ip, ip, sizeof(struct in_addr));
+    memcpy(entry->mac, mac, ETHER_ADDR_LEN);
+    entry->iface = iface;
+    if(new_entry || permanent)
+        entry->expiry_timer = NULL;
+    entry->time_added = time(NULL);
+    entry->expires = expires;
+    atomic_store_explicit(&entry->referenced, true, memory_order_relaxed);
+    atomic_store_explicit(&entry->used, false, memory_order_relaxed);
+    chirouter_arp_cache_write_end(entry);
+
+    return entry;
+}
+
+
+/*
+ * chirouter_arp_cache_arm - Sets up the timer that refreshes and expires an ARP cache entry
+ *
+ * A refreshed entry keeps its timer, which will notice the new expiry
+ * time when it expires, so a timer is only set up for new entries.
+ *
+ * Note: The lock_arp mutex must be held.
+ *
+ * ctx: Router context
+ *
+ * entry: ARP cache entry (not static)
+ *
+ * Returns: nothing.
+ */
+static void chirouter_arp_cache_arm(chirouter_ctx_t *ctx, chirouter_arpcache_entry_t *entry)
+{
+    if(entry->expiry_timer != NULL)
+        return;
+
+    chirouter_arp_expiry_timer_t *expiry = malloc(sizeof(chirouter_arp_expiry_timer_t));
+    if(expiry == NULL)
+    {
+        /* The entry will stay in the cache until it is evicted */
+        chilog(ERROR, "Could not allocate expiry timer for ARP cache entry");
+        return;
+    }
+
+    chirouter_timer_init(&expiry->timer, chirouter_arp_cache_expire, ctx);
+    expiry->ip = entry->ip;
+    expiry->expires = entry->expires;
+    entry->expiry_timer = &expiry->timer;
+    chirouter_arp_timer_add(ctx, &expiry->timer, expiry->expires - ARPCACHE_REFRESH_AHEAD_MS);
 }
 
 
 /* See arp.h */
-int chirouter_arp_pending_req_add_frame(chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req, ethernet_frame_t *frame)
+int chirouter_arp_cache_add(chirouter_ctx_t *ctx, chirouter_interface_t *iface, struct in_addr *ip, uint8_t *mac)
 {
-    withheld_frame_t *withheld = calloc(1, sizeof(withheld_frame_t));
+    /* The host answered, so it is no longer unreachable */
+    chirouter_arp_negcache_remove(ctx, ip);
+
+    chirouter_arpcache_entry_t *entry = chirouter_arp_cache_lookup(ctx, ip);
+    if(entry != NULL && entry->permanent)
+        return 0;
 
-    withheld->frame = calloc(1, sizeof(ethernet_frame_t));
-    withheld->frame->raw = calloc(1, frame->length);
-    memcpy(withheld->frame->raw, frame->raw, frame->length);
-    withheld->frame->length = frame->length;
-    withheld->frame->in_interface = frame->in_interface;
+    entry = chirouter_arp_cache_insert(ctx, iface, ip, mac, false,
+                                       chirouter_timer_now_ms() + ARPCACHE_ENTRY_TIMEOUT * 1000);
+    if(entry == NULL)
+    {
+        chilog(DEBUG, "ARP cache of router %s is full of static entries. Not adding %s", ctx->name, inet_ntoa(*ip));
+        return 1;
+    }
 
-    DL_APPEND(pending_req->withheld_frames, withheld);
+    chirouter_arp_cache_arm(ctx, entry);
 
     return 0;
 }
 
 
 /* See arp.h */
-int chirouter_arp_pending_req_free_frames(chirouter_pending_arp_req_t *pending_req)
+int chirouter_arp_cache_add_static(chirouter_ctx_t *ctx, chirouter_interface_t *iface, struct in_addr *ip, uint8_t *mac)
 {
-    withheld_frame_t *elt, *tmp;
+    chirouter_arp_negcache_remove(ctx, ip);
 
-    DL_FOREACH_SAFE(pending_req->withheld_frames, elt, tmp)
+    /* If the entry was learned before, its timer will find that
+     * it no longer belongs to the entry, and will do nothing */
+    if(chirouter_arp_cache_insert(ctx, iface, ip, mac, true, UINT64_MAX) == NULL)
     {
-        free(elt->frame->raw);
-        free(elt->frame);
-        DL_DELETE(pending_req->withheld_frames, elt);
-        free(elt);
+        chilog(ERROR, "ARP cache of router %s is full of static entries. Not adding %s", ctx->name, inet_ntoa(*ip));
+        return 1;
     }
 
     return 0;
@@ -218,44 +742,812 @@ int chirouter_arp_pending_req_free_frames(chirouter_pending_arp_req_t *pending_r
 
 
 /* See arp.h */
-void* chirouter_arp_process(void *args)
+void chirouter_arp_cache_remove(chirouter_ctx_t *ctx, chirouter_arpcache_entry_t *entry)
 {
-    chirouter_ctx_t *ctx = (chirouter_ctx_t *) args;
+    chirouter_arp_cache_remove_slot(ctx, entry - ctx->arpcache);
+}
 
-    while (ctx->server->state != HELLO_WAIT) {
-        pthread_mutex_lock(&(ctx->lock_arp));
 
-        /* Purge the cache */
-        time_t curtime = time(NULL);
-        for(int i = 0; i < ARPCACHE_SIZE; i++)
-        {
-            chirouter_arpcache_entry_t *cache_entry = &ctx->arpcache[i];
-            double entry_age = difftime(curtime, cache_entry->time_added);
+/*
+ * chirouter_arp_negcache_slot - Returns the slot of an IP address in the negative ARP cache
+ */
+static inline chirouter_arp_negcache_entry_t* chirouter_arp_negcache_slot(chirouter_ctx_t *ctx, struct in_addr *ip)
+{
+    return &ctx->arp_negcache[hash_mix(ip->s_addr) & (ARP_NEGCACHE_SIZE - 1)];
+}
 
-            if ((cache_entry->valid) && (entry_age > ARPCACHE_ENTRY_TIMEOUT)) {
-                cache_entry->valid = false;
-            }
-        }
 
-        /* Process pending ARP requests */
-        if (ctx->pending_arp_reqs != NULL)
-        {
-            chirouter_pending_arp_req_t *elt, *tmp;
+/* See arp.h */
+void chirouter_arp_negcache_add(chirouter_ctx_t *ctx, struct in_addr *ip)
+{
+    if(ctx->server->arp_negcache_ms == 0)
+        return;
 
-            DL_FOREACH_SAFE(ctx->pending_arp_reqs, elt, tmp)
-            {
-                if(chirouter_arp_process_pending_req(ctx, elt) == ARP_REQ_REMOVE)
-                {
-                    chirouter_arp_pending_req_free_frames(elt);
-                    DL_DELETE(ctx->pending_arp_reqs, elt);
-                    free(elt);
-                }
-            }
-        }
+    /* If another address is in the slot, it is forgotten (which
+     * only means frames to it will be withheld again) */
+    chirouter_arp_negcache_entry_t *entry = chirouter_arp_negcache_slot(ctx, ip);
+    entry->ip = *ip;
+    entry->expires = chirouter_timer_now_ms() + ctx->server->arp_negcache_ms;
+}
+
+
+/* See arp.h */
+bool chirouter_arp_negcache_lookup(chirouter_ctx_t *ctx, struct in_addr *ip)
+{
+    chirouter_arp_negcache_entry_t *entry = chirouter_arp_negcache_slot(ctx, ip);
 
-        pthread_mutex_unlock(&(ctx->lock_arp));
-        sleep(1.0);
+    if(entry->expires == 0 || entry->ip.s_addr != ip->s_addr)
+        return false;
+
+    if(entry->expires <= chirouter_timer_now_ms())
+    {
+        entry->expires = 0;
+        return false;
     }
 
-    return NULL;
+    ctx->arp_negcache_hits++;
+    return true;
+}
+
+
+/* See arp.h */
+void chirouter_arp_negcache_remove(chirouter_ctx_t *ctx, struct in_addr *ip)
+{
+    chirouter_arp_negcache_entry_t *entry = chirouter_arp_negcache_slot(ctx, ip);
+
+    if(entry->ip.s_addr == ip->s_addr)
+        entry->expires = 0;
+}
+
+
+/* See arp.h */
+int chirouter_arp_pending_reqs_init(chirouter_ctx_t *ctx)
+{
+    ctx->pending_arp_reqs = NULL;
+    ctx->pending_arp_reqs_hash = calloc(ARP_PENDING_REQS_BUCKETS, sizeof(chirouter_pending_arp_req_t *));
+    if(ctx->pending_arp_reqs_hash == NULL)
+        return -1;
+
+    ctx->pending_arp_reqs_num_buckets = ARP_PENDING_REQS_BUCKETS;
+    ctx->num_pending_arp_reqs = 0;
+    ctx->withheld_drops = 0;
+
+    return 0;
+}
+
+
+/* See arp.h */
+void chirouter_arp_pending_reqs_destroy(chirouter_ctx_t *ctx)
+{
+    free(ctx->pending_arp_reqs_hash);
+    ctx->pending_arp_reqs_hash = NULL;
+    ctx->pending_arp_reqs_num_buckets = 0;
+}
+
+
+/*
+ * chirouter_arp_pending_req_bucket - Returns the hash table bucket of an IP address
+ *
+ * ctx: Router context
+ *
+ * ip: IP address (in network order)
+ *
+ * Returns: Pointer to the head of the bucket's chain
+ */
+static inline chirouter_pending_arp_req_t** chirouter_arp_pending_req_bucket(chirouter_ctx_t *ctx, uint32_t ip)
+{
+    return &ctx->pending_arp_reqs_hash[hash_mix(ip) & (ctx->pending_arp_reqs_num_buckets - 1)];
+}
+
+
+/*
+ * chirouter_arp_pending_reqs_grow - Doubles the number of buckets of the pending request hash table
+ *
+ * If the new table can't be allocated, the current one is kept
+ * (lookups will just walk longer chains).
+ *
+ * Note: The lock_arp mutex must be held.
+ *
+ * ctx: Router context
+ *
+ * Returns: nothing.
+ */
+static void chirouter_arp_pending_reqs_grow(chirouter_ctx_t *ctx)
+{
+    uint32_t num_buckets = ctx->pending_arp_reqs_num_buckets * 2;
+    chirouter_pending_arp_req_t **hash = calloc(num_buckets, sizeof(chirouter_pending_arp_req_t *));
+
+    if(hash == NULL)
+        return;
+
+    free(ctx->pending_arp_reqs_hash);
+    ctx->pending_arp_reqs_hash = hash;
+    ctx->pending_arp_reqs_num_buckets = num_buckets;
+
+    chirouter_pending_arp_req_t *elt;
+    DL_FOREACH(ctx->pending_arp_reqs, elt)
+    {
+        chirouter_pending_arp_req_t **bucket = chirouter_arp_pending_req_bucket(ctx, elt->ip.s_addr);
+        elt->hash_next = *bucket;
+        *bucket = elt;
+    }
+}
+
+
+/* See arp.h */
+chirouter_pending_arp_req_t* chirouter_arp_pending_req_lookup(chirouter_ctx_t *ctx, struct in_addr *ip)
+{
+    chirouter_pending_arp_req_t *elt;
+
+    for(elt = *chirouter_arp_pending_req_bucket(ctx, ip->s_addr); elt != NULL; elt = elt->hash_next)
+    {
+        if(elt->ip.s_addr == ip->s_addr)
+        {
+            return elt;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* See arp.h */
+chirouter_pending_arp_req_t* chirouter_arp_pending_req_add(chirouter_ctx_t *ctx, struct in_addr *ip, chirouter_interface_t *iface)
+{
+    uint32_t capacity = ctx->server->arp_max_withheld_per_req;
+    chirouter_pending_arp_req_t *pending_req = calloc(1, sizeof(chirouter_pending_arp_req_t) + capacity * sizeof(ethernet_frame_t *));
+
+    if(pending_req == NULL)
+        return NULL;
+
+    memcpy(&pending_req->ip, ip, sizeof(struct in_addr));
+    pending_req->times_sent = 0;
+    pending_req->out_interface = iface;
+    pending_req->withheld_capacity = capacity;
+    pending_req->withheld_head = 0;
+    pending_req->num_withheld = 0;
+
+    if(++ctx->num_pending_arp_reqs > ctx->pending_arp_reqs_num_buckets)
+        chirouter_arp_pending_reqs_grow(ctx);
+
+    /* The list keeps the requests in the order they were added,
+     * and the hash table is used to look them up by IP */
+    DL_APPEND(ctx->pending_arp_reqs, pending_req);
+
+    chirouter_pending_arp_req_t **bucket = chirouter_arp_pending_req_bucket(ctx, ip->s_addr);
+    pending_req->hash_next = *bucket;
+    *bucket = pending_req;
+
+    chirouter_timer_init(&pending_req->timer, chirouter_arp_pending_req_retransmit, ctx);
+    chirouter_arp_timer_add(ctx, &pending_req->timer, chirouter_timer_now_ms() + ctx->server->arp_retransmit_ms);
+
+    return pending_req;
+}
+
+
+/*
+ * chirouter_arp_withheld_frame_drop - Frees a withheld frame that will not be sent
+ *
+ * The frame is counted as dropped on the interface it was received on.
+ */
+static void chirouter_arp_withheld_frame_drop(chirouter_ctx_t *ctx, ethernet_frame_t *frame)
+{
+    if(frame->in_interface)
+        chirouter_iface_count(frame->in_interface, router_drops);
+    chirouter_pktbuf_frame_free(&ctx->server->pool, frame);
+}
+
+
+/*
+ * chirouter_arp_withheld_reserve - Reserves room for one more withheld frame
+ *
+ * The limit on withheld frames is shared by all the routers, whose
+ * ARP state is protected by different locks, so the count is
+ * incremented first and rolled back if it went past the limit.
+ *
+ * Returns: true if the frame fits in the limit, false otherwise.
+ */
+static bool chirouter_arp_withheld_reserve(server_ctx_t *server)
+{
+    if(atomic_fetch_add_explicit(&server->num_withheld_frames, 1, memory_order_relaxed) < server->arp_max_withheld)
+        return true;
+
+    atomic_fetch_sub_explicit(&server->num_withheld_frames, 1, memory_order_relaxed);
+    return false;
+}
+
+
+/* See arp.h */
+int chirouter_arp_pending_req_add_frame(chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req, ethernet_frame_t *frame)
+{
+    server_ctx_t *server = ctx->server;
+    bool reserved = pending_req->num_withheld < pending_req->withheld_capacity
+                    && chirouter_arp_withheld_reserve(server);
+
+    /* With the drop-oldest policy, the oldest frame of this request
+     * makes room for the new one (unless the request has no frames,
+     * because the limit was reached by other requests) */
+    if(!reserved && (!server->arp_withheld_drop_oldest || pending_req->num_withheld == 0))
+    {
+        chilog(DEBUG, "Pending ARP request for %s is full. Dropping frame.", inet_ntoa(pending_req->ip));
+        ctx->withheld_drops++;
+        if(frame->in_interface)
+            chirouter_iface_count(frame->in_interface, router_drops);
+        return 1;
+    }
+
+    /* The oldest frame is only dropped once the new one has a buffer */
+    ethernet_frame_t *withheld = chirouter_pktbuf_frame_alloc(&server->pool);
+    if(withheld == NULL)
+    {
+        chilog(DEBUG, "Could not allocate buffer for frame withheld by ARP request for %s. Dropping frame.", inet_ntoa(pending_req->ip));
+        if(reserved)
+            atomic_fetch_sub_explicit(&server->num_withheld_frames, 1, memory_order_relaxed);
+        ctx->withheld_drops++;
+        if(frame->in_interface)
+            chirouter_iface_count(frame->in_interface, router_drops);
+        return 1;
+    }
+
+    if(!reserved)
+    {
+        /* The new frame takes the oldest frame's place in the count */
+        chilog(DEBUG, "Pending ARP request for %s is full. Dropping oldest frame.", inet_ntoa(pending_req->ip));
+        ctx->withheld_drops++;
+        chirouter_arp_withheld_frame_drop(ctx, chirouter_arp_pending_req_pop_frame(pending_req));
+    }
+
+    memcpy(withheld->raw, frame->raw, frame->length);
+    withheld->length = frame->length;
+    withheld->in_interface = frame->in_interface;
+
+    uint32_t tail = (pending_req->withheld_head + pending_req->num_withheld) % pending_req->withheld_capacity;
+    pending_req->withheld[tail] = withheld;
+    pending_req->num_withheld++;
+
+    return 0;
+}
+
+
+/* See arp.h */
+ethernet_frame_t* chirouter_arp_pending_req_pop_frame(chirouter_pending_arp_req_t *pending_req)
+{
+    if(pending_req->num_withheld == 0)
+        return NULL;
+
+    ethernet_frame_t *frame = pending_req->withheld[pending_req->withheld_head];
+
+    pending_req->withheld_head = (pending_req->withheld_head + 1) % pending_req->withheld_capacity;
+    pending_req->num_withheld--;
+
+    return frame;
+}
+
+
+/* See arp.h */
+int chirouter_arp_pending_req_free_frames(chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req)
+{
+    ethernet_frame_t *frame;
+
+    atomic_fetch_sub_explicit(&ctx->server->num_withheld_frames, pending_req->num_withheld, memory_order_relaxed);
+
+    while((frame = chirouter_arp_pending_req_pop_frame(pending_req)) != NULL)
+        chirouter_arp_withheld_frame_drop(ctx, frame);
+
+    return 0;
+}
+
+
+/* See arp.h */
+void chirouter_arp_pending_req_detach(chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req)
+{
+    chirouter_timer_del(&ctx->arp_timers, &pending_req->timer);
+
+    chirouter_pending_arp_req_t **link = chirouter_arp_pending_req_bucket(ctx, pending_req->ip.s_addr);
+    while(*link != pending_req)
+        link = &(*link)->hash_next;
+    *link = pending_req->hash_next;
+    ctx->num_pending_arp_reqs--;
+
+    DL_DELETE(ctx->pending_arp_reqs, pending_req);
+
+    /* The frames still in the request no longer count
+     * against the limit on withheld frames */
+    atomic_fetch_sub_explicit(&ctx->server->num_withheld_frames, pending_req->num_withheld, memory_order_relaxed);
+}
+
+
+/* See arp.h */
+void chirouter_arp_pending_req_free(chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req)
+{
+    ethernet_frame_t *frame;
+
+    while((frame = chirouter_arp_pending_req_pop_frame(pending_req)) != NULL)
+        chirouter_arp_withheld_frame_drop(ctx, frame);
+
+    free(pending_req);
+}
+
+
+/* See arp.h */
+void chirouter_arp_pending_req_remove(chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req)
+{
+    chirouter_arp_pending_req_detach(ctx, pending_req);
+    chirouter_arp_pending_req_free(ctx, pending_req);
+}
+
+
+/* See arp.h */
+int chirouter_arp_resolve_gateways(chirouter_ctx_t *ctx)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&ctx->lock_arp);
+
+    for(int i = 0; i < ctx->num_rtable_entries; i++)
+    {
+        chirouter_rtable_entry_t *rtentry = &ctx->routing_table[i];
+
+        /* Skip direct routes, and gateways that are already
+         * resolved (or being resolved) */
+        if(rtentry->gw.s_addr == 0
+           || chirouter_arp_cache_lookup(ctx, &rtentry->gw) != NULL
+           || chirouter_arp_pending_req_lookup(ctx, &rtentry->gw) != NULL)
+            continue;
+
+        /* The request withholds no frames, and is retransmitted
+         * (and given up on) like any other pending request */
+        chirouter_pending_arp_req_t *pending_req = chirouter_arp_pending_req_add(ctx, &rtentry->gw, rtentry->interface);
+        if(pending_req == NULL)
+        {
+            chilog(ERROR, "Could not allocate pending ARP request");
+            rc = 1;
+            break;
+        }
+
+        chilog(DEBUG, "Router %s: resolving gateway %s", ctx->name, inet_ntoa(rtentry->gw));
+
+        ethernet_frame_t *request = chirouter_arp_build_request(ctx, rtentry->interface, &rtentry->gw);
+        if(request)
+        {
+            chirouter_send_frame(ctx, rtentry->interface, request->raw, request->length);
+            chirouter_pktbuf_frame_free(&ctx->server->pool, request);
+        }
+
+        pending_req->times_sent = 1;
+        }
+
+    pthread_mutex_unlock(&ctx->lock_arp);
+
+    return rc;
+}
+
+
+/* ARP cache snapshot file (see chirouter_arp_snapshot_save in arp.h).
+ * All integers are in network byte order. */
+#define ARP_SNAPSHOT_MAGIC (0x43524143u)  /* "CRAC" */
+#define ARP_SNAPSHOT_VERSION (2u)
+
+typedef struct chirouter_arp_snapshot_header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t num_routers;
+    /* Wall-clock time when the snapshot was taken */
+    uint32_t time_sec;
+    uint32_t time_msec;
+} __attribute__ ((packed)) chirouter_arp_snapshot_header_t;
+
+typedef struct chirouter_arp_snapshot_router
+{
+    char name[MAX_ROUTER_NAMELEN];
+    uint32_t num_entries;
+} __attribute__ ((packed)) chirouter_arp_snapshot_router_t;
+
+typedef struct chirouter_arp_snapshot_entry
+{
+    uint32_t ip;
+    uint8_t mac[ETHER_ADDR_LEN];
+    /* Name of the interface (empty if the entry has none) */
+    char iface[MAX_IFACE_NAMELEN];
+    /* Seconds since the entry was added */
+    uint32_t age;
+    /* Milliseconds until the entry expires */
+    uint32_t lifetime_ms;
+} __attribute__ ((packed)) chirouter_arp_snapshot_entry_t;
+
+
+/*
+ * chirouter_arp_snapshot_wallclock_ms - Returns the wall-clock time in milliseconds
+ */
+static uint64_t chirouter_arp_snapshot_wallclock_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ * chirouter_arp_snapshot_save_router - Writes the entries of a router's ARP cache to a snapshot file
+ *
+ * Static entries are not saved, since they are installed by the configuration.
+ *
+ * Note: The lock_arp mutex must be held.
+ *
+ * Returns: 0 on success, 1 on error.
+ */
+static int chirouter_arp_snapshot_save_router(chirouter_ctx_t *ctx, FILE *f)
+{
+    chirouter_arp_snapshot_router_t rhdr;
+    uint64_t now = chirouter_timer_now_ms();
+    time_t now_sec = time(NULL);
+
+    memset(&rhdr, 0, sizeof(rhdr));
+    memcpy(rhdr.name, ctx->name, strnlen(ctx->name, MAX_ROUTER_NAMELEN));
+    rhdr.num_entries = htonl(ctx->arpcache_num_entries - ctx->arpcache_num_static);
+
+    if(fwrite(&rhdr, sizeof(rhdr), 1, f) != 1)
+        return 1;
+
+    for(uint32_t i = 0; i < ctx->arpcache_capacity; i++)
+    {
+        chirouter_arpcache_entry_t *entry = &ctx->arpcache[i];
+        chirouter_arp_snapshot_entry_t sentry;
+
+        if(!entry->valid || entry->permanent)
+            continue;
+
+        memset(&sentry, 0, sizeof(sentry));
+        sentry.ip = entry->ip.s_addr;
+        memcpy(sentry.mac, entry->mac, ETHER_ADDR_LEN);
+        if(entry->iface)
+            memcpy(sentry.iface, entry->iface->name, strnlen(entry->iface->name, MAX_IFACE_NAMELEN));
+        sentry.age = htonl(now_sec > entry->time_added ? now_sec - entry->time_added : 0);
+        sentry.lifetime_ms = htonl(entry->expires > now ? entry->expires - now : 0);
+
+        if(fwrite(&sentry, sizeof(sentry), 1, f) != 1)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/* See arp.h */
+int chirouter_arp_snapshot_save(server_ctx_t *ctx, const char *path)
+{
+    chirouter_arp_snapshot_header_t hdr;
+    uint64_t now = chirouter_arp_snapshot_wallclock_ms();
+    char tmp_path[PATH_MAX];
+    int rc = 0;
+
+    /* The snapshot is written to a temporary file, which then
+     * replaces the previous snapshot (if any) */
+    if(snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path))
+    {
+        chilog(ERROR, "ARP cache snapshot path is too long: %s", path);
+        return 1;
+    }
+
+    FILE *f = fopen(tmp_path, "w");
+    if(f == NULL)
+    {
+        chilog(ERROR, "Could not create ARP cache snapshot %s", tmp_path);
+        return 1;
+    }
+
+    hdr.magic = htonl(ARP_SNAPSHOT_MAGIC);
+    hdr.version = htons(ARP_SNAPSHOT_VERSION);
+    hdr.num_routers = htons(ctx->num_routers);
+    hdr.time_sec = htonl(now / 1000);
+    hdr.time_msec = htonl(now % 1000);
+
+    if(fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+        rc = 1;
+
+    for(int i = 0; i < ctx->num_routers && rc == 0; i++)
+    {
+        chirouter_ctx_t *r = &ctx->routers[i];
+
+        pthread_mutex_lock(&r->lock_arp);
+        rc = chirouter_arp_snapshot_save_router(r, f);
+
+        pthread_mutex_unlock(&r->lock_arp);
+    }
+
+    if(fclose(f) != 0)
+        rc = 1;
+
+    if(rc == 0 && rename(tmp_path, path) != 0)
+        rc = 1;
+
+    if(rc)
+    {
+        chilog(ERROR, "Could not write ARP cache snapshot %s", path);
+        remove(tmp_path);
+        return 1;
+    }
+
+    chilog(INFO, "Saved ARP cache snapshot %s", path);
+
+    return 0;
+}
+
+
+/*
+ * chirouter_arp_snapshot_iface - Finds the interface an entry in a snapshot file was on
+ *
+ * Interfaces are matched by name, since their order may have
+ * changed since the snapshot was taken.
+ *
+ * ctx: Router context
+ *
+ * sentry: Entry in the snapshot file
+ *
+ * iface: Where the interface (NULL if the entry had none) is stored
+ *
+ * Returns: true if the interface was found (or the entry had none),
+ *          false if the router no longer has the interface.
+ */
+static bool chirouter_arp_snapshot_iface(chirouter_ctx_t *ctx, chirouter_arp_snapshot_entry_t *sentry,
+                                         chirouter_interface_t **iface)
+{
+    *iface = NULL;
+
+    if(sentry->iface[0] == '\0')
+        return true;
+
+    for(int i = 0; i < ctx->num_interfaces; i++)
+    {
+        if(strncmp(ctx->interfaces[i].name, sentry->iface, MAX_IFACE_NAMELEN) == 0)
+        {
+            *iface = &ctx->interfaces[i];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/*
+ * chirouter_arp_snapshot_load_router - Restores the entries of a router's ARP cache from a snapshot file
+ *
+ * Entries that have expired since the snapshot was taken, and entries
+ * on interfaces the router no longer has, are skipped.
+ *
+ * ctx: Router context, or NULL to skip the entries
+ *
+ * f: Snapshot file
+ *
+ * num_entries: Number of entries saved for the router
+ *
+ * elapsed_ms: Time elapsed since the snapshot was taken
+ *
+ * Returns: Number of entries restored, or -1 if the file is truncated.
+ */
+static int chirouter_arp_snapshot_load_router(chirouter_ctx_t *ctx, FILE *f, uint32_t num_entries, uint64_t elapsed_ms)
+{
+    uint64_t now = chirouter_timer_now_ms();
+    time_t now_sec = time(NULL);
+    int restored = 0;
+
+    for(uint32_t i = 0; i < num_entries; i++)
+    {
+        chirouter_arp_snapshot_entry_t sentry;
+
+        if(fread(&sentry, sizeof(sentry), 1, f) != 1)
+            return -1;
+
+        uint32_t lifetime_ms = ntohl(sentry.lifetime_ms);
+        chirouter_interface_t *iface;
+
+        if(ctx == NULL || lifetime_ms <= elapsed_ms || !chirouter_arp_snapshot_iface(ctx, &sentry, &iface))
+            continue;
+
+        struct in_addr ip = { .s_addr = sentry.ip };
+        chirouter_arpcache_entry_t *entry = chirouter_arp_cache_insert(ctx, iface, &ip, sentry.mac,
+                                                                       false, now + lifetime_ms - elapsed_ms);
+        if(entry == NULL)
+            continue;
+
+        /* The entry keeps its age, so it expires at the same time
+         * it would have if the router had not been restarted */
+        entry->time_added = now_sec - ntohl(sentry.age) - elapsed_ms / 1000;
+        chirouter_arp_cache_arm(ctx, entry);
+        restored++;
+    }
+
+    return restored;
+}
+
+
+/* See arp.h */
+int chirouter_arp_snapshot_load(server_ctx_t *ctx, const char *path)
+{
+    chirouter_arp_snapshot_header_t hdr;
+    int rc = 0;
+
+    FILE *f = fopen(path, "r");
+    if(f == NULL)
+    {
+        chilog(INFO, "No ARP cache snapshot found in %s", path);
+        return 0;
+    }
+
+    if(fread(&hdr, sizeof(hdr), 1, f) != 1
+       || ntohl(hdr.magic) != ARP_SNAPSHOT_MAGIC
+       || ntohs(hdr.version) != ARP_SNAPSHOT_VERSION)
+    {
+        chilog(ERROR, "%s is not a valid ARP cache snapshot", path);
+        fclose(f);
+        return 1;
+    }
+
+    uint64_t taken = (uint64_t) ntohl(hdr.time_sec) * 1000 + ntohl(hdr.time_msec);
+    uint64_t now = chirouter_arp_snapshot_wallclock_ms();
+    uint64_t elapsed_ms = now > taken ? now - taken : 0;
+
+    for(int i = 0; i < ntohs(hdr.num_routers); i++)
+    {
+        chirouter_arp_snapshot_router_t rhdr;
+        chirouter_ctx_t *r = NULL;
+
+        if(fread(&rhdr, sizeof(rhdr), 1, f) != 1)
+        {
+            rc = 1;
+            break;
+        }
+
+        /* Routers are matched by name, and the entries of routers
+         * that are not in the current configuration are skipped */
+        for(int j = 0; j < ctx->num_routers; j++)
+        {
+            if(strncmp(ctx->routers[j].name, rhdr.name, MAX_ROUTER_NAMELEN) == 0)
+            {
+                r = &ctx->routers[j];
+                break;
+            }
+        }
+
+        if(r)
+            pthread_mutex_lock(&r->lock_arp);
+
+        int restored = chirouter_arp_snapshot_load_router(r, f, ntohl(rhdr.num_entries), elapsed_ms);
+
+        if(r)
+        {
+            pthread_mutex_unlock(&r->lock_arp);
+            chilog(INFO, "Router %s: restored %d ARP cache entries", r->name, restored < 0 ? 0 : restored);
+        }
+
+        if(restored < 0)
+        {
+            rc = 1;
+            break;
+        }
+    }
+
+    if(rc)
+        chilog(ERROR, "ARP cache snapshot %s is truncated", path);
+
+    fclose(f);
+
+    return rc;
+}
+
+
+/* See arp.h */
+void chirouter_arp_timers_free(chirouter_ctx_t *ctx)
+{
+    chirouter_pending_arp_req_t *elt, *tmp;
+
+    /* Pending requests' timers are part of the requests themselves,
+     * so only the cache expiry timers are left after removing them */
+    DL_FOREACH_SAFE(ctx->pending_arp_reqs, elt, tmp)
+    {
+        chirouter_arp_pending_req_remove(ctx, elt);
+    }
+
+    chirouter_timer_wheel_clear(&ctx->arp_timers, chirouter_arp_expiry_timer_free);
+}
+
+
+/* See arp.h */
+void* chirouter_arp_process(void *args)
+{
+    server_ctx_t *server = (server_ctx_t *) args;
+
+    pthread_mutex_lock(&server->lock_arp_thread);
+
+    while (server->arp_running) {
+        /* Timers added while the routers are being visited lower
+         * arp_next_wakeup (the signal is lost, since the thread
+         * is not waiting yet) */
+        atomic_store_explicit(&server->arp_next_wakeup, UINT64_MAX, memory_order_relaxed);
+        pthread_mutex_unlock(&server->lock_arp_thread);
+
+        uint64_t now = chirouter_timer_now_ms();
+        uint64_t next_wakeup = UINT64_MAX;
+
+        for(int i = 0; i < server->num_routers; i++)
+        {
+            chirouter_ctx_t *ctx = &server->routers[i];
+
+            /* Only the cache entries and pending requests whose
+             * timers have expired are visited */
+            pthread_mutex_lock(&ctx->lock_arp);
+            chirouter_timer_wheel_advance(&ctx->arp_timers, now);
+            uint64_t router_next = chirouter_timer_wheel_next(&ctx->arp_timers);
+            pthread_mutex_unlock(&ctx->lock_arp);
+
+            if(router_next < next_wakeup)
+                next_wakeup = router_next;
+        }
+
+        pthread_mutex_lock(&server->lock_arp_thread);
+
+        /* Sleep until the earliest timer of any router expires, or until
+         * the thread is signaled (because an earlier timer was added,
+         * or because the thread is being stopped) */
+        uint64_t added_wakeup = atomic_load_explicit(&server->arp_next_wakeup, memory_order_relaxed);
+        if(added_wakeup < next_wakeup)
+            next_wakeup = added_wakeup;
+        atomic_store_explicit(&server->arp_next_wakeup, next_wakeup, memory_order_relaxed);
+
+        if(!server->arp_running)
+            break;
+
+        if(next_wakeup == UINT64_MAX)
+            pthread_cond_wait(&server->arp_cond, &server->lock_arp_thread);
+        else
+        {
+            struct timespec deadline = { .tv_sec = next_wakeup / 1000,
+                                         .tv_nsec = (next_wakeup % 1000) * 1000000 };
+            pthread_cond_timedwait(&server->arp_cond, &server->lock_arp_thread, &deadline);
+        }
+    }
+
+    pthread_mutex_unlock(&server->lock_arp_thread);
+
+    return NULL;
+}
+
+
+/* See arp.h */
+int chirouter_arp_thread_start(server_ctx_t *ctx)
+{
+    ctx->arp_running = true;
+    atomic_store(&ctx->arp_next_wakeup, UINT64_MAX);
+
+    if(pthread_create(&ctx->arp_thread, NULL, chirouter_arp_process, ctx) != 0)
+    {
+        ctx->arp_running = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* See arp.h */
+int chirouter_arp_thread_stop(server_ctx_t *ctx)
+{
+    pthread_mutex_lock(&ctx->lock_arp_thread);
+    if(!ctx->arp_running)
+    {
+        pthread_mutex_unlock(&ctx->lock_arp_thread);
+        return 0;
+    }
+    ctx->arp_running = false;
+    pthread_cond_signal(&ctx->arp_cond);
+    pthread_mutex_unlock(&ctx->lock_arp_thread);
+
+    if(pthread_join(ctx->arp_thread, NULL) != 0)
+        return -1;
+
+    return 0;
 }
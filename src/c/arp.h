@@ -5,13 +5,13 @@
  *  the list of pending ARP requests.
  *
  *  Most importantly, this module defines a function chirouter_arp_process
- *  that is run as a separate thread, and which will wake up every second
- *  to purge stale entries in the ARP cache (entries that are more than 15 seconds
- *  old) and to traverse the list of pending ARP requests. For each pending
- *  request in the list, it will call chirouter_arp_process_pending_req,
- *  which must either re-send the pending ARP request or cancel the
- *  request and send ICMP Host Unreachable messages in reply to all
- *  the withheld frames.
+ *  that is run as a separate thread (shared by all the routers), and which
+ *  runs the routers' ARP timers as they expire: it purges stale entries in
+ *  the ARP cache (entries that are more than 15 seconds old) and, for each
+ *  pending ARP request whose retransmission timer expires, it will call
+ *  chirouter_arp_process_pending_req, which must either re-send the pending
+ *  ARP request or cancel the request and send ICMP Host Unreachable messages
+ *  in reply to all the withheld frames.
  *
  */
 
@@ -68,6 +68,9 @@
 #include <pthread.h>
 #include "chirouter.h"
 
+/* Number of times an ARP request is sent before giving up */
+#define ARP_REQ_MAX_TIMES_SENT (5)
+
 
 /*
  * chirouter_arp_cache_lookup - Look up an IP in the ARP cache
@@ -87,20 +90,147 @@
 chirouter_arpcache_entry_t* chirouter_arp_cache_lookup(chirouter_ctx_t *ctx, struct in_addr *ip);
 
 
+/*
+ * chirouter_arp_cache_lookup_mac - Look up the MAC address of an IP in the ARP cache
+ *
+ * Unlike chirouter_arp_cache_lookup, this function can be called without
+ * holding the lock_arp mutex, and can be called concurrently from several
+ * threads. It takes no locks at all (each entry is read under its sequence
+ * counter, and read again if it changed while it was being read), so it
+ * never waits for a thread that is modifying the cache. Use this function
+ * on the forwarding path.
+ *
+ * Note: If the cache is modified during the lookup, the function may
+ *       miss an entry that is in the cache. A miss should be confirmed
+ *       with chirouter_arp_cache_lookup (holding lock_arp) before
+ *       sending an ARP request.
+ *
+ * ctx: Router context
+ *
+ * ip: IP address being looked up.
+ *
+ * mac: Buffer of ETHER_ADDR_LEN bytes where the MAC address will be copied.
+ *
+ * Returns: true if the cache contains a valid entry for the IP address
+ *          (and the MAC address has been copied to "mac"), false otherwise.
+ */
+bool chirouter_arp_cache_lookup_mac(chirouter_ctx_t *ctx, struct in_addr *ip, uint8_t *mac);
+
+
 /*
  * chirouter_arp_cache_add - Add an entry to the ARP cache
  *
  * Note: The lock_arp mutex in the router context must be locked before
  *       calling this function
  *
+ * If the cache already has an entry for the IP address, the entry
+ * is refreshed (with the new MAC address, and a new expiry time),
+ * unless it is a static entry (which is left unchanged).
+ *
  * ctx: Router context
  *
+ * iface: Interface on which the mapping was learned (requests to
+ *        refresh the entry before it expires are sent on it). Can
+ *        be NULL, in which case the entry is never refreshed.
+ *
  * ip, mac: IP address (and MAC address corresponding to that IP address)
  *          to be added to the cache.
  *
- * Returns: 0 on success, 1 on error.
+ * Returns: 0 on success, 1 on error (including when the cache is full
+ *          and all its entries are static).
+ */
+int chirouter_arp_cache_add(chirouter_ctx_t *ctx, chirouter_interface_t *iface, struct in_addr *ip, uint8_t *mac);
+
+
+/*
+ * chirouter_arp_cache_add_static - Add a static entry to the ARP cache
+ *
+ * Static entries are installed by the configuration. They never expire,
+ * are never evicted or refreshed, and are not changed by the ARP packets
+ * the router receives. If the cache already has an entry for the IP
+ * address, it is replaced by the static entry.
+ *
+ * Note: The lock_arp mutex in the router context must be locked before
+ *       calling this function
+ *
+ * ctx: Router context
+ *
+ * iface: Interface the host with that IP address is reachable on
+ *
+ * ip, mac: IP address (and MAC address corresponding to that IP address)
+ *          to be added to the cache.
+ *
+ * Returns: 0 on success, 1 on error (if the cache is full of static entries).
+ */
+int chirouter_arp_cache_add_static(chirouter_ctx_t *ctx, chirouter_interface_t *iface, struct in_addr *ip, uint8_t *mac);
+
+
+/*
+ * chirouter_arp_cache_remove - Remove an entry from the ARP cache
+ *
+ * Note: The lock_arp mutex in the router context must be locked before
+ *       calling this function. Other entries may be moved within the
+ *       cache, so any pointers to entries obtained before calling this
+ *       function must not be used afterwards.
+ *
+ * ctx: Router context
+ *
+ * entry: Entry to remove (returned by chirouter_arp_cache_lookup)
+ *
+ * Returns: nothing.
+ */
+void chirouter_arp_cache_remove(chirouter_ctx_t *ctx, chirouter_arpcache_entry_t *entry);
+
+
+/*
+ * chirouter_arp_negcache_add - Add an IP address to the negative ARP cache
+ *
+ * Marks the IP address as unreachable for the hold-down period
+ * (server->arp_negcache_ms). Called when a pending ARP request
+ * is given up on. Does nothing if the negative cache is disabled.
+ *
+ * Note: The lock_arp mutex in the router context must be locked before
+ *       calling this function
+ *
+ * ctx: Router context
+ *
+ * ip: IP address that did not answer ARP requests
+ *
+ * Returns: nothing.
+ */
+void chirouter_arp_negcache_add(chirouter_ctx_t *ctx, struct in_addr *ip);
+
+
+/*
+ * chirouter_arp_negcache_lookup - Check whether an IP address is in the negative ARP cache
+ *
+ * Note: The lock_arp mutex in the router context must be locked before
+ *       calling this function
+ *
+ * ctx: Router context
+ *
+ * ip: IP address
+ *
+ * Returns: true if the IP address did not answer ARP requests and is
+ *          still in its hold-down period (frames to it should get an
+ *          ICMP Host Unreachable instead of being withheld), false otherwise.
+ */
+bool chirouter_arp_negcache_lookup(chirouter_ctx_t *ctx, struct in_addr *ip);
+
+
+/*
+ * chirouter_arp_negcache_remove - Remove an IP address from the negative ARP cache
+ *
+ * Note: The lock_arp mutex in the router context must be locked before
+ *       calling this function
+ *
+ * ctx: Router context
+ *
+ * ip: IP address
+ *
+ * Returns: nothing.
  */
-int chirouter_arp_cache_add(chirouter_ctx_t *ctx, struct in_addr *ip, uint8_t *mac);
+void chirouter_arp_negcache_remove(chirouter_ctx_t *ctx, struct in_addr *ip);
 
 
 /*
@@ -137,7 +267,8 @@ chirouter_pending_arp_req_t* chirouter_arp_pending_req_lookup(chirouter_ctx_t *c
  * iface: Router interface on which the ARP request was sent.
  *
  * Returns: A pointer to the pending request (a chirouter_pending_arp_req_t struct)
- *          that was added to the pending ARP request list.
+ *          that was added to the pending ARP request list, or NULL if
+ *          no memory could be allocated for it.
  */
 chirouter_pending_arp_req_t* chirouter_arp_pending_req_add(chirouter_ctx_t *ctx, struct in_addr *ip, chirouter_interface_t *iface);
 
@@ -145,6 +276,16 @@ chirouter_pending_arp_req_t* chirouter_arp_pending_req_add(chirouter_ctx_t *ctx,
 /*
  * chirouter_arp_pending_req_add_frame - Add an Ethernet frame to a pending ARP request list
  *
+ * The frame is copied into a buffer from the packet buffer pool, which
+ * is added to the request's ring of withheld frames. Each request holds
+ * at most server->arp_max_withheld_per_req frames, and all the routers
+ * together at most server->arp_max_withheld frames. Past those limits,
+ * either the new frame or the oldest frame in the request is dropped
+ * (depending on server->arp_withheld_drop_oldest), and
+ * ctx->withheld_drops is incremented. The new frame is also dropped
+ * (and counted the same way) if no buffer can be allocated for it, in
+ * which case the oldest frame is kept.
+ *
  * Note: The lock_arp mutex in the router context must be locked before
  *       calling this function.
  *
@@ -155,28 +296,177 @@ chirouter_pending_arp_req_t* chirouter_arp_pending_req_add(chirouter_ctx_t *ctx,
  * frame: Frame to be added. Note: This function will make a deep copy of the frame
  *        and will add that copy to the list of withheld frames.
  *
- * Returns: 0 on success, 1 on error.
+ * Returns: 0 on success, 1 on error (including when the new
+ *          frame is dropped because of the limits above).
  */
 int chirouter_arp_pending_req_add_frame(chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req, ethernet_frame_t *frame);
 
 
+/*
+ * chirouter_arp_pending_req_withheld_frame - Returns a frame withheld in a pending ARP request
+ *
+ * Note: The lock_arp mutex in the router context must be locked before
+ *       calling this function (unless the request has been detached).
+ *
+ * pending_req: Pending request
+ *
+ * i: Index of the frame, from 0 (the oldest frame) to
+ *    pending_req->num_withheld - 1 (the newest frame)
+ *
+ * Returns: The withheld frame (which still belongs to the pending request)
+ */
+static inline ethernet_frame_t* chirouter_arp_pending_req_withheld_frame(chirouter_pending_arp_req_t *pending_req, uint32_t i)
+{
+    return pending_req->withheld[(pending_req->withheld_head + i) % pending_req->withheld_capacity];
+}
+
+
+/*
+ * chirouter_arp_pending_req_pop_frame - Takes the oldest withheld frame out of a pending ARP request
+ *
+ * Note: This function is meant to be used on detached requests (see
+ *       chirouter_arp_pending_req_detach), since it does not update
+ *       the router's count of withheld frames.
+ *
+ * pending_req: Pending request
+ *
+ * Returns: The oldest withheld frame, which no longer belongs to the pending
+ *          request (the caller must free it with chirouter_pktbuf_frame_free),
+ *          or NULL if there are no withheld frames.
+ */
+ethernet_frame_t* chirouter_arp_pending_req_pop_frame(chirouter_pending_arp_req_t *pending_req);
+
+
 /*
  * chirouter_arp_pending_req_free_frames - Frees all the frames associated with a pending ARP request
  *
  * Note: The lock_arp mutex in the router context must be locked before
  *       calling this function.
  *
+ * ctx: Router context
+ *
  * pending_req: Pending request whose frames will be freed
  *
  * Returns: 0 on success, 1 on error.
  */
-int chirouter_arp_pending_req_free_frames(chirouter_pending_arp_req_t *pending_req);
+int chirouter_arp_pending_req_free_frames(chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req);
+
+
+/*
+ * chirouter_arp_pending_req_detach - Detaches a pending ARP request from the router
+ *
+ * Removes the request from the pending ARP request list and cancels its
+ * retransmission timer, but does not free it. The caller then owns the
+ * request (and its withheld frames), so it can take the frames out with
+ * chirouter_arp_pending_req_pop_frame without holding lock_arp. The
+ * request must then be freed with chirouter_arp_pending_req_free.
+ *
+ * Note: The lock_arp mutex in the router context must be locked before
+ *       calling this function.
+ *
+ * ctx: Router context
+ *
+ * pending_req: Pending request to detach
+ *
+ * Returns: nothing.
+ */
+void chirouter_arp_pending_req_detach(chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req);
+
+
+/*
+ * chirouter_arp_pending_req_free - Frees a detached pending ARP request
+ *
+ * Frees the frames still withheld in the request, and the request itself.
+ *
+ * ctx: Router context
+ *
+ * pending_req: Pending request (detached with chirouter_arp_pending_req_detach)
+ *
+ * Returns: nothing.
+ */
+void chirouter_arp_pending_req_free(chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req);
+
+
+/*
+ * chirouter_arp_pending_req_remove - Removes a pending ARP request
+ *
+ * Removes the request from the pending ARP request list, cancels its
+ * retransmission timer, frees any frames still withheld in it,
+ * and frees the request itself.
+ *
+ * Note: The lock_arp mutex in the router context must be locked before
+ *       calling this function.
+ *
+ * ctx: Router context
+ *
+ * pending_req: Pending request to remove
+ *
+ * Returns: nothing.
+ */
+void chirouter_arp_pending_req_remove(chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req);
+
+
+/*
+ * chirouter_arp_build_request - Builds a broadcast ARP request
+ *
+ * ctx: Router context
+ *
+ * iface: Interface the request will be sent on
+ *
+ * ip: IP address being resolved
+ *
+ * Returns: Frame allocated from the packet buffer pool (which must be
+ *          freed with chirouter_pktbuf_frame_free), or NULL if no memory
+ *          could be allocated.
+ */
+ethernet_frame_t* chirouter_arp_build_request(chirouter_ctx_t *ctx, chirouter_interface_t *iface, struct in_addr *ip);
+
+
+
+/* DO NOT USE THESE FUNCTIONS */
+/* Allocate (with room for max_entries entries) and free the
+ * ARP cache. Called from chirouter_ctx_init/chirouter_ctx_destroy */
+int chirouter_arp_cache_init(chirouter_ctx_t *ctx, uint32_t max_entries);
+void chirouter_arp_cache_destroy(chirouter_ctx_t *ctx);
+
+/* Allocate and free the hash table of pending ARP requests.
+ * Called from chirouter_ctx_init/chirouter_ctx_destroy */
+int chirouter_arp_pending_reqs_init(chirouter_ctx_t *ctx);
+void chirouter_arp_pending_reqs_destroy(chirouter_ctx_t *ctx);
+
+/* Removes all pending ARP requests, and frees all the ARP timers.
+ * Called from chirouter_ctx_destroy */
+void chirouter_arp_timers_free(chirouter_ctx_t *ctx);
 
+/* Sends ARP requests for all the gateways in the routing table that
+ * are not in the ARP cache, so they are resolved before any traffic
+ * is routed through them. Called from server.c at END_CONFIG (when
+ * the -g option is given). Returns 0 on success, 1 on error. */
+int chirouter_arp_resolve_gateways(chirouter_ctx_t *ctx);
 
+/* Save and restore the ARP caches of all the routers. The snapshot file
+ * holds a header (magic number, format version, number of routers, and
+ * the wall-clock time when it was written), followed, for each router,
+ * by its name, its number of entries, and the entries themselves (IP
+ * address, MAC address, interface name, age, and remaining lifetime).
+ * Static entries are not saved. Entries are restored into the router
+ * and interface with the same names, with their remaining lifetime
+ * reduced by the time elapsed since the snapshot was written (so they
+ * still expire when they would have). Called from server.c (when the
+ * -s option is given): chirouter_arp_snapshot_save when the controller
+ * disconnects (or when chirouter is asked to shut down, see
+ * chirouter_server_shutdown), and chirouter_arp_snapshot_load at
+ * END_CONFIG. A missing snapshot file is not an error. Both return 0
+ * on success, 1 on error. */
+int chirouter_arp_snapshot_save(server_ctx_t *ctx, const char *path);
+int chirouter_arp_snapshot_load(server_ctx_t *ctx, const char *path);
 
-/* DO NOT USE THIS FUNCTION */
-/* This is the thread function that periodically purges the ARP cache
- * and processes the pending ARP requests. The thread is created in server.c */
+/* This is the thread function that expires ARP cache entries and
+ * retransmits pending ARP requests of all the routers, as their timers
+ * expire. A single thread is started (and stopped) by server.c with
+ * chirouter_arp_thread_start/chirouter_arp_thread_stop */
 void* chirouter_arp_process(void *args);
+int chirouter_arp_thread_start(server_ctx_t *ctx);
+int chirouter_arp_thread_stop(server_ctx_t *ctx);
 
 #endif
@@ -0,0 +1,268 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Capture throughput benchmark
+ *
+ *  Captures frames (with chirouter_pcap_write_frame) from one or more
+ *  threads as fast as possible, and reports how many frames per second
+ *  the capture writer writes to the capture file, and how long each
+ *  call to chirouter_pcap_write_frame takes (which is what capturing
+ *  costs the forwarding path). Frames that find the capture ring full
+ *  are retried, so that all of them are written.
+ *
+ *  pcap-bench accepts the following command-line arguments:
+ *
+ *  -n NUM: Number of frames (default: 1000000)
+ *  -t NUM: Number of threads capturing frames (default: 1)
+ *  -s BYTES: Frame size (default: 64)
+ *  -o FILE: Capture file (default: /dev/null)
+ *  -c SOURCE: Time source for capture timestamps (tsc, realtime,
+ *             or coarse; default: tsc)
+ *
+ */
+
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "../chirouter.h"
+#include "../server.h"
+#include "../pcap.h"
+#include "../log.h"
+#include "../clock.h"
+
+#define USAGE "Usage: pcap-bench [-n NUM_FRAMES] [-t NUM_THREADS] [-s FRAME_SIZE] [-o CAP_FILE] [-c TIME_SOURCE]\n"
+
+#define MAX_THREADS (64)
+
+/* A thread capturing frames */
+typedef struct bench_thread
+{
+    pthread_t thread;
+    chirouter_ctx_t *router;
+    uint64_t num_frames;
+    size_t frame_size;
+
+    /* Time spent in chirouter_pcap_write_frame (in ns), and
+     * number of calls that found the capture ring full */
+    uint64_t capture_ns;
+    uint64_t ring_full;
+} bench_thread_t;
+
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void* bench_run(void *args)
+{
+    bench_thread_t *t = (bench_thread_t *) args;
+    chirouter_interface_t *iface = &t->router->interfaces[0];
+    uint8_t frame[ETHER_FRAME_MAX_LEN];
+
+    for(size_t i = 0; i < t->frame_size; i++)
+        frame[i] = i;
+
+    uint64_t start = now_ns();
+
+    for(uint64_t i = 0; i < t->num_frames; i++)
+    {
+        while(chirouter_pcap_write_frame(t->router, iface, frame, t->frame_size, PCAP_OUTBOUND) != 0)
+        {
+            t->ring_full++;
+            sched_yield();
+        }
+    }
+
+    t->capture_ns = now_ns() - start;
+
+    return NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+    uint64_t num_frames = 1000000;
+    int num_threads = 1;
+    long frame_size = 64;
+    char *cap_file = "/dev/null";
+    chirouter_clock_source_t clock_source = CLOCK_SOURCE_TSC;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:s:o:c:h")) != -1)
+        switch (opt)
+        {
+        case 'n':
+            num_frames = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            if(num_threads < 1 || num_threads > MAX_THREADS)
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Number of threads must be between 1 and %d\n", MAX_THREADS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            frame_size = atol(optarg);
+            if(frame_size < ETHER_HDR_LEN || frame_size > ETHER_FRAME_MAX_LEN)
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Frame size must be between %d and %d\n", ETHER_HDR_LEN, ETHER_FRAME_MAX_LEN);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            cap_file = optarg;
+            break;
+        case 'c':
+            if(chirouter_clock_parse_source(optarg, &clock_source))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Time source must be tsc, realtime, or coarse\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            printf(USAGE);
+            exit(0);
+        default:
+            fprintf(stderr, USAGE);
+            return EXIT_FAILURE;
+        }
+
+    chirouter_setloglevel(ERROR);
+    chirouter_clock_init(clock_source);
+
+    /* A server with a single router, with a single interface */
+    server_ctx_t *ctx = calloc(1, sizeof(server_ctx_t));
+    chirouter_ctx_t *router = calloc(1, sizeof(chirouter_ctx_t));
+    chirouter_interface_t *iface = calloc(1, sizeof(chirouter_interface_t));
+    if(ctx == NULL || router == NULL || iface == NULL)
+    {
+        perror("ERROR: Could not allocate memory");
+        return EXIT_FAILURE;
+    }
+
+    strcpy(router->name, "r1");
+    router->server = ctx;
+    router->interfaces = iface;
+    router->num_interfaces = router->max_interfaces = 1;
+    strcpy(iface->name, "eth1");
+    ctx->routers = router;
+    ctx->num_routers = ctx->max_routers = 1;
+
+    ctx->pcap = fopen(cap_file, "w");
+    if(ctx->pcap == NULL)
+    {
+        perror("ERROR: Capture file could not be created");
+        return EXIT_FAILURE;
+    }
+
+    if(chirouter_pcap_start(ctx))
+    {
+        fprintf(stderr, "ERROR: Could not start capture\n");
+        return EXIT_FAILURE;
+    }
+
+    bench_thread_t threads[MAX_THREADS];
+    memset(threads, 0, sizeof(threads));
+
+    uint64_t start = now_ns();
+
+    for(int i = 0; i < num_threads; i++)
+    {
+        threads[i].router = router;
+        threads[i].num_frames = num_frames / num_threads + (i < (int) (num_frames % num_threads));
+        threads[i].frame_size = frame_size;
+        if(pthread_create(&threads[i].thread, NULL, bench_run, &threads[i]) != 0)
+        {
+            perror("ERROR: Could not create thread");
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint64_t capture_ns = 0, ring_full = 0;
+    for(int i = 0; i < num_threads; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        capture_ns += threads[i].capture_ns;
+        ring_full += threads[i].ring_full;
+    }
+
+    /* Wait until all the frames have been written */
+    chirouter_pcap_stop(ctx);
+    uint64_t elapsed_ns = now_ns() - start;
+    chirouter_pcap_free(ctx);
+    fclose(ctx->pcap);
+
+    double secs = elapsed_ns / 1e9;
+    printf("frames: %" PRIu64 " x %ld bytes, %d thread(s)\n", num_frames, frame_size, num_threads);
+    printf("elapsed: %.3f s\n", secs);
+    printf("throughput: %.0f frames/s (%.1f MB/s)\n", num_frames / secs, num_frames * (double) frame_size / secs / 1e6);
+    printf("capture call: %.1f ns/frame (ring full %" PRIu64 " times)\n", (double) capture_ns / num_frames, ring_full);
+
+    free(iface);
+    free(router);
+    free(ctx);
+
+    return EXIT_SUCCESS;
+}
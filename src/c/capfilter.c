@@ -0,0 +1,423 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This module implements capture filters.
+ *
+ *  See capfilter.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <arpa/inet.h>
+
+#include "capfilter.h"
+
+/* Delimiters between the tokens of a filter expression */
+#define CAPFILTER_DELIM " \t\n"
+
+
+/*
+ * chirouter_capfilter_error - Writes an error message to the error buffer
+ *
+ * errbuf: Error buffer
+ *
+ * errlen: Size of the error buffer
+ *
+ * fmt: Format string (as in printf)
+ *
+ * Returns: Always returns -1
+ *
+ */
+static int chirouter_capfilter_error(char *errbuf, size_t errlen, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(errbuf, errlen, fmt, args);
+    va_end(args);
+
+    return -1;
+}
+
+
+/*
+ * chirouter_capfilter_parse_number - Parses a number in a filter expression
+ *
+ * Numbers can be written in decimal or (with a 0x prefix) in hexadecimal.
+ *
+ * tok: Token
+ *
+ * max: Maximum value
+ *
+ * value: Out parameter. Parsed number.
+ *
+ * Returns: 0 on success, -1 if the token is not a number between 0 and max
+ *
+ */
+static int chirouter_capfilter_parse_number(const char *tok, unsigned long max, uint16_t *value)
+{
+    char *end;
+    unsigned long n;
+
+    if(tok == NULL || *tok == '-')
+        return -1;
+
+    n = strtoul(tok, &end, 0);
+    if(*end != '\0' || end == tok || n > max)
+        return -1;
+
+    *value = n;
+    return 0;
+}
+
+
+/*
+ * chirouter_capfilter_parse_net - Parses an address or a prefix in a filter expression
+ *
+ * tok: Token (ADDR or ADDR/N)
+ *
+ * term: Primitive where the address and mask will be stored
+ *
+ * Returns: 0 on success, -1 if the token is not a valid address or prefix
+ *
+ */
+static int chirouter_capfilter_parse_net(char *tok, chirouter_capfilter_term_t *term)
+{
+    struct in_addr addr;
+    uint16_t prefix_len = 32;
+    char *slash;
+
+    if(tok == NULL)
+        return -1;
+
+    slash = strchr(tok, '/');
+    if(slash)
+    {
+        *slash = '\0';
+        if(chirouter_capfilter_parse_number(slash + 1, 32, &prefix_len))
+            return -1;
+    }
+
+    if(inet_pton(AF_INET, tok, &addr) != 1)
+        return -1;
+
+    term->mask = prefix_len == 0 ? 0 : htonl(0xFFFFFFFFu << (32 - prefix_len));
+    term->addr = addr.s_addr & term->mask;
+
+    return 0;
+}
+
+
+/* See capfilter.h */
+int chirouter_capfilter_compile(const char *expr, chirouter_capfilter_t **filter, char *errbuf, size_t errlen)
+{
+    chirouter_capfilter_t *f;
+    char *copy, *saveptr, **toks;
+    size_t num_toks = 0, i = 0;
+    bool negate = false, expect_term = true;
+    uint8_t addr_dir = 0;
+    int rc = 0;
+
+    /* Split the expression into tokens (there can be at
+     * most one token for every two characters) */
+    f = calloc(1, sizeof(chirouter_capfilter_t));
+    copy = strdup(expr);
+    toks = calloc(strlen(expr) / 2 + 2, sizeof(char *));
+    if(f == NULL || copy == NULL || toks == NULL)
+    {
+        free(f);
+        free(copy);
+        free(toks);
+        return chirouter_capfilter_error(errbuf, errlen, "Could not allocate memory for capture filter");
+    }
+
+    for(char *tok = strtok_r(copy, CAPFILTER_DELIM, &saveptr); tok != NULL; tok = strtok_r(NULL, CAPFILTER_DELIM, &saveptr))
+        toks[num_toks++] = tok;
+
+    /* Returns the next token (or NULL if there are no more tokens) */
+#define NEXT_TOKEN() (i < num_toks ? toks[i++] : NULL)
+
+    while(i < num_toks && rc == 0)
+    {
+        chirouter_capfilter_term_t *term = &f->terms[f->num_terms];
+        char *tok = NEXT_TOKEN();
+
+        /* Operators */
+        if(!strcmp(tok, "and") || !strcmp(tok, "or"))
+        {
+            if(expect_term)
+                rc = chirouter_capfilter_error(errbuf, errlen, "Unexpected '%s'", tok);
+            else if(!strcmp(tok, "or"))
+                f->terms[f->num_terms - 1].last = true;
+            expect_term = true;
+            continue;
+        }
+
+        if(!strcmp(tok, "not"))
+        {
+            if(addr_dir)
+                rc = chirouter_capfilter_error(errbuf, errlen, "Expected 'host' or 'net' instead of 'not'");
+            negate = !negate;
+            continue;
+        }
+
+        if(!strcmp(tok, "src") || !strcmp(tok, "dst"))
+        {
+            if(addr_dir)
+                rc = chirouter_capfilter_error(errbuf, errlen, "Expected 'host' or 'net' instead of '%s'", tok);
+            addr_dir = !strcmp(tok, "src") ? CAPFILTER_ADDR_SRC : CAPFILTER_ADDR_DST;
+            continue;
+        }
+
+        /* Primitives */
+        if(f->num_terms == CAPFILTER_MAX_TERMS)
+        {
+            rc = chirouter_capfilter_error(errbuf, errlen, "Too many primitives (at most %u)", CAPFILTER_MAX_TERMS);
+            break;
+        }
+
+        memset(term, 0, sizeof(chirouter_capfilter_term_t));
+        term->negate = negate;
+
+        if(addr_dir && strcmp(tok, "host") && strcmp(tok, "net"))
+        {
+            rc = chirouter_capfilter_error(errbuf, errlen, "Expected 'host' or 'net' instead of '%s'", tok);
+            break;
+        }
+
+        if(!strcmp(tok, "router") || !strcmp(tok, "iface"))
+        {
+            size_t maxlen = !strcmp(tok, "router") ? MAX_ROUTER_NAMELEN : MAX_IFACE_NAMELEN;
+            char *name = NEXT_TOKEN();
+
+            term->kind = !strcmp(tok, "router") ? CAPFILTER_ROUTER : CAPFILTER_IFACE;
+            if(name == NULL || strlen(name) > maxlen)
+                rc = chirouter_capfilter_error(errbuf, errlen, "'%s' must be followed by a name of at most %zu characters", tok, maxlen);
+            else
+                strcpy(term->name, name);
+        }
+        else if(!strcmp(tok, "in") || !strcmp(tok, "out"))
+        {
+            term->kind = CAPFILTER_DIRECTION;
+            term->value = !strcmp(tok, "in") ? PCAP_INBOUND : PCAP_OUTBOUND;
+        }
+        else if(!strcmp(tok, "ether"))
+        {
+            char *proto = NEXT_TOKEN();
+            term->kind = CAPFILTER_ETHERTYPE;
+            if(proto == NULL || strcmp(proto, "proto") ||
+               chirouter_capfilter_parse_number(NEXT_TOKEN(), 0xFFFF, &term->value))
+                rc = chirouter_capfilter_error(errbuf, errlen, "'ether' must be followed by 'proto' and an Ethertype");
+        }
+        else if(!strcmp(tok, "arp"))
+        {
+            term->kind = CAPFILTER_ETHERTYPE;
+            term->value = ETHERTYPE_ARP;
+        }
+        else if(!strcmp(tok, "ip"))
+        {
+            /* "ip" can be a primitive by itself, or be followed by "proto N" */
+            if(i < num_toks && !strcmp(toks[i], "proto"))
+            {
+                i++;
+                term->kind = CAPFILTER_IPPROTO;
+                if(chirouter_capfilter_parse_number(NEXT_TOKEN(), 0xFF, &term->value))
+                    rc = chirouter_capfilter_error(errbuf, errlen, "'ip proto' must be followed by a protocol number");
+            }
+            else
+            {
+                term->kind = CAPFILTER_ETHERTYPE;
+                term->value = ETHERTYPE_IP;
+            }
+        }
+        else if(!strcmp(tok, "icmp") || !strcmp(tok, "tcp") || !strcmp(tok, "udp"))
+        {
+            term->kind = CAPFILTER_IPPROTO;
+            term->value = !strcmp(tok, "icmp") ? 1 : (!strcmp(tok, "tcp") ? 6 : 17);
+        }
+        else if(!strcmp(tok, "host") || !strcmp(tok, "net"))
+        {
+            bool host = !strcmp(tok, "host");
+            char *arg = NEXT_TOKEN();
+
+            term->kind = CAPFILTER_ADDR;
+            term->addr_dir = addr_dir ? addr_dir : CAPFILTER_ADDR_SRC | CAPFILTER_ADDR_DST;
+            if(arg == NULL || (host && strchr(arg, '/')) || chirouter_capfilter_parse_net(arg, term))
+                rc = chirouter_capfilter_error(errbuf, errlen, "'%s' must be followed by %s", tok,
+                                               host ? "an IPv4 address" : "an IPv4 prefix (ADDR/N)");
+        }
+        else
+        {
+            rc = chirouter_capfilter_error(errbuf, errlen, "Unknown primitive '%s'", tok);
+            break;
+        }
+
+        f->num_terms++;
+        negate = false;
+        addr_dir = 0;
+        expect_term = false;
+    }
+
+    if(rc == 0 && (negate || addr_dir || (expect_term && f->num_terms > 0)))
+        rc = chirouter_capfilter_error(errbuf, errlen, "Unexpected end of capture filter");
+    else if(rc == 0 && f->num_terms == 0)
+        rc = chirouter_capfilter_error(errbuf, errlen, "Empty capture filter");
+
+#undef NEXT_TOKEN
+
+    free(toks);
+    free(copy);
+
+    if(rc)
+    {
+        free(f);
+        return -1;
+    }
+
+    f->terms[f->num_terms - 1].last = true;
+    *filter = f;
+
+    return 0;
+}
+
+
+/* See capfilter.h */
+bool chirouter_capfilter_match(const chirouter_capfilter_t *filter, const chirouter_ctx_t *router,
+                               const chirouter_interface_t *iface, pcap_packet_direction_t dir,
+                               const uint8_t *frame, size_t len)
+{
+    uint16_t ethertype = 0;
+    bool has_addrs = false, has_proto = false;
+    uint32_t src = 0, dst = 0;
+    uint8_t proto = 0;
+
+    /* Extract the fields the primitives can match
+     * on (if the frame is long enough to have them) */
+    if(len >= ETHER_HDR_LEN)
+    {
+        ethertype = ntohs(((ethhdr_t *) frame)->type);
+
+        if(ethertype == ETHERTYPE_IP && len >= ETHER_HDR_LEN + sizeof(iphdr_t))
+        {
+            iphdr_t *ip = (iphdr_t *) (frame + ETHER_HDR_LEN);
+            src = ip->src;
+            dst = ip->dst;
+            proto = ip->proto;
+            has_addrs = has_proto = true;
+        }
+        else if(ethertype == ETHERTYPE_ARP && len >= ETHER_HDR_LEN + sizeof(arp_packet_t))
+        {
+            arp_packet_t *arp = (arp_packet_t *) (frame + ETHER_HDR_LEN);
+            src = arp->spa;
+            dst = arp->tpa;
+            has_addrs = true;
+        }
+    }
+
+    bool group_matches = true;
+
+    for(unsigned int i = 0; i < filter->num_terms; i++)
+    {
+        const chirouter_capfilter_term_t *term = &filter->terms[i];
+
+        /* Once a primitive in a group does not match,
+         * skip to the end of the group */
+        if(group_matches)
+        {
+            bool m;
+
+            switch(term->kind)
+            {
+            case CAPFILTER_ROUTER:
+                m = !strcmp(router->name, term->name);
+                break;
+            case CAPFILTER_IFACE:
+                m = !strcmp(iface->name, term->name);
+                break;
+            case CAPFILTER_DIRECTION:
+                m = (dir == term->value);
+                break;
+            case CAPFILTER_ETHERTYPE:
+                m = (ethertype == term->value);
+                break;
+            case CAPFILTER_IPPROTO:
+                m = has_proto && (proto == term->value);
+                break;
+            case CAPFILTER_ADDR:
+                m = has_addrs &&
+                    (((term->addr_dir & CAPFILTER_ADDR_SRC) && (src & term->mask) == term->addr) ||
+                     ((term->addr_dir & CAPFILTER_ADDR_DST) && (dst & term->mask) == term->addr));
+                break;
+            default:
+                m = false;
+                break;
+            }
+
+            group_matches = (m != term->negate);
+        }
+
+        if(term->last)
+        {
+            if(group_matches)
+                return true;
+            group_matches = true;
+        }
+    }
+
+    return false;
+}
+
+
+/* See capfilter.h */
+void chirouter_capfilter_free(chirouter_capfilter_t *filter)
+{
+    free(filter);
+}
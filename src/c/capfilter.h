@@ -0,0 +1,189 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This header file defines capture filters, which select the frames
+ *  that are written to the capture file.
+ *
+ *  A filter is compiled once (when chirouter starts) from an expression
+ *  made up of the following primitives:
+ *
+ *    router NAME           Frames sent/received by router NAME
+ *    iface NAME            Frames sent/received on an interface named NAME
+ *    in, out               Inbound or outbound frames
+ *    ether proto N         Frames with Ethertype N (e.g., 0x0806)
+ *    arp, ip               Same as "ether proto 0x0806" and "ether proto 0x0800"
+ *    ip proto N            IPv4 datagrams with protocol number N
+ *    icmp, tcp, udp        Same as "ip proto 1", "ip proto 6", and "ip proto 17"
+ *    [src|dst] host ADDR   IPv4 datagrams (or ARP messages) from/to ADDR
+ *    [src|dst] net ADDR/N  IPv4 datagrams (or ARP messages) from/to ADDR/N
+ *
+ *  Any primitive can be preceded by "not". Primitives are joined with
+ *  "and" (which can be omitted) and "or", which has lower precedence.
+ *  For example: "arp or icmp and not router r1".
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef CAPFILTER_H
+#define CAPFILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "chirouter.h"
+#include "pcap.h"
+
+/* Maximum number of primitives in a capture filter */
+#define CAPFILTER_MAX_TERMS (64u)
+
+/* Kinds of primitives */
+typedef enum
+{
+    CAPFILTER_ROUTER,
+    CAPFILTER_IFACE,
+    CAPFILTER_DIRECTION,
+    CAPFILTER_ETHERTYPE,
+    CAPFILTER_IPPROTO,
+    CAPFILTER_ADDR
+} chirouter_capfilter_kind_t;
+
+/* Addresses matched by host and net primitives */
+#define CAPFILTER_ADDR_SRC (1u)
+#define CAPFILTER_ADDR_DST (2u)
+
+/* A primitive */
+typedef struct chirouter_capfilter_term
+{
+    chirouter_capfilter_kind_t kind;
+
+    /* Is the primitive preceded by "not"? */
+    bool negate;
+
+    /* Is this the last primitive of a group of primitives
+     * joined with "and" (i.e., is it followed by "or")? */
+    bool last;
+
+    /* Router or interface name */
+    char name[MAX_IFACE_NAMELEN + 1];
+
+    /* Direction, Ethertype, or IP protocol, depending on the kind */
+    uint16_t value;
+
+    /* Address and mask (in network order), and whether they
+     * apply to the source address, the destination address, or both */
+    uint32_t addr;
+    uint32_t mask;
+    uint8_t addr_dir;
+} chirouter_capfilter_term_t;
+
+/* A compiled capture filter. A frame matches the filter if it
+ * matches all the primitives in any of the groups */
+typedef struct chirouter_capfilter
+{
+    unsigned int num_terms;
+    chirouter_capfilter_term_t terms[CAPFILTER_MAX_TERMS];
+} chirouter_capfilter_t;
+
+
+/*
+ * chirouter_capfilter_compile - Compiles a capture filter expression
+ *
+ * expr: Filter expression (see above)
+ *
+ * filter: Out parameter. Will point to the compiled filter
+ *         (which must be freed with chirouter_capfilter_free)
+ *
+ * errbuf: Buffer where an error message will be written if
+ *         the expression is not valid
+ *
+ * errlen: Size of errbuf
+ *
+ * Returns: 0 on success, -1 if the expression is not valid
+ *          (or memory could not be allocated)
+ *
+ */
+int chirouter_capfilter_compile(const char *expr, chirouter_capfilter_t **filter, char *errbuf, size_t errlen);
+
+
+/*
+ * chirouter_capfilter_match - Checks whether a frame matches a capture filter
+ *
+ * Can be called concurrently from several threads.
+ *
+ * filter: Capture filter
+ *
+ * router: Router that sent/received the frame
+ *
+ * iface: Interface the frame was sent/received on
+ *
+ * dir: Direction of the frame
+ *
+ * frame: Pointer to the frame (including the Ethernet header)
+ *
+ * len: Length in bytes of the frame
+ *
+ * Returns: true if the frame matches the filter, false otherwise.
+ *
+ */
+bool chirouter_capfilter_match(const chirouter_capfilter_t *filter, const chirouter_ctx_t *router,
+                               const chirouter_interface_t *iface, pcap_packet_direction_t dir,
+                               const uint8_t *frame, size_t len);
+
+
+/*
+ * chirouter_capfilter_free - Frees a capture filter
+ *
+ * filter: Capture filter (can be NULL)
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_capfilter_free(chirouter_capfilter_t *filter);
+
+
+#endif
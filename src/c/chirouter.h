@@ -59,22 +59,69 @@
 #include <arpa/inet.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "protocols/ethernet.h"
 #include "protocols/arp.h"
 #include "protocols/ipv4.h"
 #include "protocols/icmp.h"
 #include "log.h"
+#include "timer.h"
 
 #define MAX_ROUTER_NAMELEN (8u)
 #define MAX_IFACE_NAMELEN (32u)
 #define MAX_NUM_INTERFACES (65536u)
 #define MAX_NUM_RTABLE_ENTRIES (65536u)
-#define ARPCACHE_SIZE (100u)
+#define ARPCACHE_SIZE (100u)           /* Default maximum number of entries in the ARP cache */
+#define ARPCACHE_MAX_SIZE (1u << 24)   /* Largest configurable ARP cache */
 #define ARPCACHE_ENTRY_TIMEOUT (15u)
+#define ARPCACHE_REFRESH_AHEAD_MS (3000u)  /* Entries in use are refreshed this long before they expire */
+#define ARP_REQ_RETRANSMIT_MS (1000u)  /* Default interval between ARP request retransmissions */
+#define ARP_REQ_RETRANSMIT_MAX_MS (60000u)  /* Maximum interval between ARP request retransmissions */
+#define ARP_NEGCACHE_HOLDDOWN_MS (20000u) /* Default hold-down period for unreachable hosts */
+#define ARP_NEGCACHE_MAX_HOLDDOWN_MS (3600000u) /* Longest configurable hold-down period */
+#define ARP_NEGCACHE_SIZE (4096u)          /* Number of slots in the negative ARP cache (a power of two) */
+#define ARP_PENDING_REQS_BUCKETS (64u)     /* Initial number of buckets in the pending ARP request hash table */
+#define ARP_MAX_WITHHELD_FRAMES (4096u)    /* Default maximum number of frames withheld by all routers */
+#define ARP_MAX_WITHHELD_PER_REQ (64u)     /* Default maximum number of frames withheld by each pending ARP request */
+#define ARP_MAX_WITHHELD_LIMIT (1u << 20)  /* Largest configurable limit on withheld frames */
 
 
 typedef struct server_ctx server_ctx_t;
+typedef struct chirouter_worker chirouter_worker_t;
+typedef struct chirouter_tx_batch chirouter_tx_batch_t;
+
+
+/* Capture sampling. Either one in every "every" frames is captured, or
+ * each frame is captured with probability "prob" (if both are 0, all
+ * the frames are captured) */
+typedef struct chirouter_pcap_sampling
+{
+    uint32_t every;
+    double prob;
+} chirouter_pcap_sampling_t;
+
+
+/* Per-interface counters. They are updated from several threads (with
+ * chirouter_iface_count), and written to the capture file in Interface
+ * Statistics Blocks (see pcap.c) */
+typedef struct chirouter_interface_stats
+{
+    /* Frames received and sent on the interface */
+    _Atomic uint64_t rx_frames;
+    _Atomic uint64_t tx_frames;
+
+    /* Frames received on the interface that the router dropped */
+    _Atomic uint64_t router_drops;
+
+    /* Frames that passed the capture filter and sampling, but
+     * were dropped by the capture path (the capture ring was full) */
+    _Atomic uint64_t pcap_drops;
+} chirouter_interface_stats_t;
+
+/* Increments one of an interface's counters */
+#define chirouter_iface_count(iface, counter) \
+    atomic_fetch_add_explicit(&(iface)->stats.counter, 1, memory_order_relaxed)
 
 
 /* Represents a single Ethernet interface */
@@ -97,6 +144,14 @@ typedef struct chirouter_interface
     /* Interface ID for capture file */
     uint32_t pcap_iface_id;
 
+    /* Capture sampling on this interface, and number of frames
+     * seen by the sampler (for one-in-N sampling) */
+    chirouter_pcap_sampling_t pcap_sampling;
+    _Atomic uint64_t pcap_sample_count;
+
+    /* Counters */
+    chirouter_interface_stats_t stats;
+
 } chirouter_interface_t;
 
 
@@ -143,28 +198,54 @@ typedef struct chirouter_arpcache_entry
     /* IP address */
     struct in_addr ip;
 
+    /* Interface on which the mapping was learned */
+    chirouter_interface_t *iface;
+
+    /* Timer that refreshes and expires the entry (do not use) */
+    chirouter_timer_t *expiry_timer;
+
     /* Time when this entry was created */
     time_t time_added;
 
+    /* Time (as returned by chirouter_timer_now_ms) when this entry expires */
+    uint64_t expires;
+
     /* Is this a valid entry?
      * If an entry is not valid, this means
      * it is available and can be used to store
      * a new (valid) entry. */
     bool valid;
+
+    /* Is this a static entry (installed by the configuration)?
+     * Static entries never expire, are never evicted, and are
+     * not changed by the ARP packets the router receives. */
+    bool permanent;
+
+    /* Set when the entry is used, and cleared by the CLOCK
+     * eviction policy when it passes over the entry. Kept in
+     * the entry itself so that setting it on a cache hit does
+     * not touch any other memory. */
+    atomic_bool referenced;
+
+    /* Set when the entry is used, and cleared when it is refreshed.
+     * Only entries that are in use are refreshed before they expire. */
+    atomic_bool used;
+
+    /* Sequence counter that lets the forwarding path read the entry
+     * without taking any locks (see chirouter_arp_cache_lookup_mac).
+     * It is odd while the entry is being written. */
+    atomic_uint seq;
 } chirouter_arpcache_entry_t;
 
 
-/* Used to store withheld frames (using a linked list)
- * in a pending ARP request. */
-typedef struct withheld_frame
+/* An entry in the negative ARP cache: an IP address that did not
+ * answer any ARP requests, and when the hold-down period for that
+ * address ends (as returned by chirouter_timer_now_ms) */
+typedef struct chirouter_arp_negcache_entry
 {
-    /* Pointer to the withheld Ethernet frame */
-    ethernet_frame_t *frame;
-
-    /* List pointers */
-    struct withheld_frame *prev;
-    struct withheld_frame *next;
-} withheld_frame_t;
+    struct in_addr ip;
+    uint64_t expires;
+} chirouter_arp_negcache_entry_t;
 
 /* Represents a pending ARP request for which
  * we have not yet received an ARP reply */
@@ -176,23 +257,41 @@ typedef struct chirouter_pending_arp_req
     /* Interface on which the ARP request was sent */
     chirouter_interface_t *out_interface;
 
-    /* The number of times this ARP request has been sent,
-     * and the last time we sent the request */
+    /* The number of times this ARP request has been sent. The request
+     * is retransmitted when its timer expires, so the time it was last
+     * sent is not kept (see chirouter_arp_process_pending_req) */
     uint32_t times_sent;
-    time_t last_sent;
 
-    /* List of Ethernet frames containing IP datagrams destined
-     * to "ip", but which we cannot yet send because we do not
-     * know the MAC address corresponding to that IP address */
-    withheld_frame_t *withheld_frames;
+    /* Retransmission timer (do not use) */
+    chirouter_timer_t timer;
+
+    /* Next request in the same bucket of the
+     * pending request hash table (do not use) */
+    struct chirouter_pending_arp_req *hash_next;
 
     /* List pointers */
     struct chirouter_pending_arp_req *prev;
     struct chirouter_pending_arp_req *next;
+
+    /* Ethernet frames containing IP datagrams destined to "ip", but
+     * which we cannot yet send because we do not know the MAC address
+     * corresponding to that IP address. This is a ring of frames
+     * allocated from the packet buffer pool, with room for
+     * withheld_capacity frames. The oldest frame is
+     * withheld[withheld_head], and there are num_withheld frames. Use
+     * chirouter_arp_pending_req_withheld_frame to access the frames. */
+    uint32_t withheld_capacity;
+    uint32_t withheld_head;
+    uint32_t num_withheld;
+    ethernet_frame_t *withheld[];
 } chirouter_pending_arp_req_t;
 
 
-/* The chirouter context. Contains all the router data structures */
+/* The chirouter context. Contains all the router data structures.
+ *
+ * The interfaces and the routing table are not modified after the
+ * router has been configured, so they can be read by several threads
+ * without locking. */
 typedef struct chirouter_ctx
 {
     /* Router name */
@@ -212,23 +311,66 @@ typedef struct chirouter_ctx
      * guaranteed to be of size "num_rtable_entries" */
     chirouter_rtable_entry_t* routing_table;
 
-    /* ARP cache */
-    chirouter_arpcache_entry_t arpcache[ARPCACHE_SIZE];
+    /* ARP cache. This is an open-addressing hash table (with linear
+     * probing) keyed by IP address, with arpcache_capacity slots (a power
+     * of two). At most arpcache_max_entries slots are valid at any given
+     * time, so that the table is never more than half full. Use the
+     * chirouter_arp_cache_* functions to access it. */
+    chirouter_arpcache_entry_t *arpcache;
+    uint32_t arpcache_capacity;
+    uint32_t arpcache_max_entries;
+    uint32_t arpcache_num_entries;
+
+    /* Number of static entries in the ARP cache (which
+     * count towards arpcache_max_entries) */
+    uint32_t arpcache_num_static;
+
+    /* When the ARP cache is full, adding an entry evicts an existing
+     * one, chosen with the CLOCK algorithm: the hand sweeps the slots,
+     * giving entries that have been used since its last pass a second
+     * chance. Number of evictions so far. */
+    uint32_t arpcache_clock_hand;
+    uint64_t arpcache_evictions;
+
+    /* Negative ARP cache. A direct-mapped table (keyed by IP address)
+     * with ARP_NEGCACHE_SIZE slots, holding the IP addresses that did
+     * not answer our ARP requests. Until their hold-down period ends,
+     * frames to those addresses get an ICMP Host Unreachable right away
+     * instead of being withheld. Protected by lock_arp. */
+    chirouter_arp_negcache_entry_t *arp_negcache;
+    uint64_t arp_negcache_hits;
 
     /* List of pending ARP requests */
     chirouter_pending_arp_req_t* pending_arp_reqs;
 
+    /* Hash table (with chaining) that indexes the pending ARP requests
+     * by IP address, with pending_arp_reqs_num_buckets buckets (a power
+     * of two, doubled whenever there are more requests than buckets).
+     * Use chirouter_arp_pending_req_lookup to access it. */
+    chirouter_pending_arp_req_t **pending_arp_reqs_hash;
+    uint32_t pending_arp_reqs_num_buckets;
+    uint32_t num_pending_arp_reqs;
+
+    /* Number of frames that have been dropped because a pending
+     * request, or all the routers together, were already withholding
+     * as many frames as they could */
+    uint64_t withheld_drops;
+
 
     /* Mutex to protect both the ARP cache and the list of
      * pending ARP requests. Lock this mutex if *either* of
-     * these data structures are going to be used */
+     * these data structures are going to be used (the only exception
+     * are lookups with chirouter_arp_cache_lookup_mac, which are
+     * lock-free, so the forwarding path never waits on this mutex) */
     pthread_mutex_t lock_arp;
 
+    /* Timers for the expiry of ARP cache entries and the retransmission
+     * of pending ARP requests. Protected by lock_arp. They are run by
+     * the ARP thread (which is shared by all the routers) */
+    chirouter_timer_wheel_t arp_timers;
 
-    /*** NOTE: You should NOT use or modify the fields below ***/
 
-    /* ARP thread */
-    pthread_t arp_thread;
+    /*** NOTE: You should NOT use or modify the fields below ***/
 
     /* Used during configuration of router */
     uint16_t max_interfaces;
@@ -237,6 +379,10 @@ typedef struct chirouter_ctx
     /* Router ID for POX controller */
     uint8_t r_id;
 
+    /* Worker thread that processes this router's frames
+     * (NULL if frames are processed by the I/O thread) */
+    chirouter_worker_t *worker;
+
     /* Server context */
     server_ctx_t *server;
 } chirouter_ctx_t;
@@ -265,6 +411,28 @@ typedef struct chirouter_ctx
 int chirouter_send_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *msg, size_t len);
 
 
+/*
+ * chirouter_icmp_build - Builds an ICMP message in response to an inbound IP datagram
+ *
+ * The message is addressed to the sender of the datagram, and is meant
+ * to be sent on the interface the datagram was received on. For Echo
+ * Replies, the ICMP message of the datagram is copied back; for all
+ * other types, the IP header and first eight bytes of the datagram's
+ * payload are included in the message.
+ *
+ * ctx: Router context
+ *
+ * frame: Inbound frame containing the IP datagram
+ *
+ * type, code: ICMP type and code
+ *
+ * Returns: Frame allocated from the packet buffer pool (which must be
+ *          freed with chirouter_pktbuf_frame_free), or NULL if no memory
+ *          could be allocated.
+ */
+ethernet_frame_t* chirouter_icmp_build(chirouter_ctx_t *ctx, ethernet_frame_t *frame, uint8_t type, uint8_t code);
+
+
 /* Note: You should not call any of the functions below */
 
 int chirouter_ctx_init(chirouter_ctx_t *ctx);
@@ -274,5 +442,6 @@ void chirouter_ctx_log(chirouter_ctx_t *ctx, loglevel_t loglevel);
 int chirouter_ctx_destroy(chirouter_ctx_t *ctx);
 
 int chirouter_process_ethernet_frame(chirouter_ctx_t *ctx, ethernet_frame_t *frame);
+int chirouter_process_ethernet_frames(chirouter_ctx_t *ctx, ethernet_frame_t **frames, size_t n);
 
 #endif
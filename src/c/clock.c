@@ -0,0 +1,440 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This module implements the clock used for capture timestamps,
+ *  log messages, and processing time measurements.
+ *
+ *  See clock.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "clock.h"
+
+#define BILLION (1000000000ull)
+
+/* Fixed-point shift of the nanoseconds-per-cycle multiplier */
+#define CLOCK_MULT_SHIFT (32u)
+
+/* How long the TSC is calibrated for when the clock is initialized */
+#define CLOCK_CALIBRATION_NS (20000000ull)
+
+
+/* The TSC is converted to nanoseconds since the epoch by extrapolating from
+ * the last point where it was synchronized with CLOCK_REALTIME (base_cycles,
+ * base_ns) with a fixed-point multiplier. These are updated while other
+ * threads may be reading them, so they are protected by a sequence lock:
+ * the writer makes seq odd while it updates them, and readers retry if seq
+ * was odd or changed while they read them. */
+static struct
+{
+    _Atomic uint32_t seq;
+    _Atomic uint64_t base_cycles;
+    _Atomic uint64_t base_ns;
+    _Atomic uint64_t mult;
+
+    /* Cycles between re-synchronizations */
+    _Atomic uint64_t resync_cycles;
+
+    /* Last reading of the TSC and CLOCK_REALTIME (which is not the same
+     * as base_ns when the clock is running ahead of CLOCK_REALTIME), and
+     * the rate of the TSC measured against CLOCK_REALTIME (which is not
+     * the same as mult while the clock is slowed down). See
+     * chirouter_clock_tsc_resync. Only used by the resyncing thread. */
+    uint64_t sync_cycles;
+    uint64_t sync_ns;
+    uint64_t rate;
+
+    /* Set by the thread that is re-synchronizing the TSC */
+    atomic_flag resyncing;
+} tsc = { .resyncing = ATOMIC_FLAG_INIT };
+
+/* Last value returned by chirouter_clock_tsc_now_ns on each thread */
+static __thread uint64_t tsc_last_ns;
+
+static _Atomic chirouter_clock_source_t clock_source = CLOCK_SOURCE_REALTIME;
+
+/* See clock.h */
+bool chirouter_clock_use_tsc = false;
+
+
+/*
+ * chirouter_clock_read - Reads a clock in nanoseconds
+ *
+ * clock_id: Clock (CLOCK_REALTIME, etc.)
+ *
+ * Returns: Nanoseconds
+ *
+ */
+static inline uint64_t chirouter_clock_read(clockid_t clock_id)
+{
+    struct timespec spec;
+
+    clock_gettime(clock_id, &spec);
+
+    return (uint64_t) spec.tv_sec * BILLION + (uint64_t) spec.tv_nsec;
+}
+
+
+#if defined(__x86_64__)
+
+/*
+ * chirouter_clock_tsc_usable - Checks whether the TSC can be used as a clock
+ *
+ * Returns: true if the processor has an invariant TSC (one that ticks
+ *          at a constant rate, regardless of frequency scaling and
+ *          sleep states), false otherwise.
+ *
+ */
+static bool chirouter_clock_tsc_usable()
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if(__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 || eax < 0x80000007)
+        return false;
+
+    if(__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0)
+        return false;
+
+    return (edx & (1u << 8)) != 0;
+}
+
+
+/*
+ * chirouter_clock_sync_point - Reads the TSC and CLOCK_REALTIME at the same time
+ *
+ * The TSC is read before and after CLOCK_REALTIME, and the reading
+ * with the shortest gap (out of a few) is used, so that a preemption
+ * in the middle does not throw the calibration off.
+ *
+ * cycles: Out parameter. TSC
+ *
+ * ns: Out parameter. CLOCK_REALTIME, in nanoseconds since the epoch
+ *
+ * Returns: nothing.
+ *
+ */
+static void chirouter_clock_sync_point(uint64_t *cycles, uint64_t *ns)
+{
+    uint64_t best_gap = UINT64_MAX;
+
+    for(int i = 0; i < 5; i++)
+    {
+        uint64_t before = __rdtsc();
+        uint64_t now = chirouter_clock_read(CLOCK_REALTIME);
+        uint64_t after = __rdtsc();
+
+        if(after - before < best_gap)
+        {
+            best_gap = after - before;
+            *cycles = before + (after - before) / 2;
+            *ns = now;
+        }
+    }
+}
+
+
+/*
+ * chirouter_clock_tsc_update - Updates the TSC synchronization point
+ *
+ * Only one thread can call this function at a time.
+ *
+ * cycles, ns: Synchronization point
+ *
+ * mult: Nanoseconds per cycle (shifted CLOCK_MULT_SHIFT bits)
+ *
+ * Returns: nothing.
+ *
+ */
+static void chirouter_clock_tsc_update(uint64_t cycles, uint64_t ns, uint64_t mult)
+{
+    uint32_t seq = atomic_load_explicit(&tsc.seq, memory_order_relaxed);
+
+    atomic_store_explicit(&tsc.seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&tsc.base_cycles, cycles, memory_order_relaxed);
+    atomic_store_explicit(&tsc.base_ns, ns, memory_order_relaxed);
+    atomic_store_explicit(&tsc.mult, mult, memory_order_relaxed);
+
+    atomic_store_explicit(&tsc.seq, seq + 2, memory_order_release);
+}
+
+
+/*
+ * chirouter_clock_tsc_resync - Re-synchronizes the TSC with CLOCK_REALTIME
+ *
+ * The multiplier is recomputed from the interval since the last
+ * synchronization point (which is much longer, and thus more precise,
+ * than the initial calibration), so it also tracks any adjustments
+ * made to CLOCK_REALTIME (e.g., by NTP).
+ *
+ * The clock never goes back: if it is ahead of CLOCK_REALTIME (because
+ * CLOCK_REALTIME was adjusted back, or the TSC ran slightly fast), it
+ * carries on from where it is, but runs slower, so that it catches up
+ * with CLOCK_REALTIME by the next re-synchronization (running at no
+ * less than half speed, so it may take longer if it is far ahead).
+ *
+ * Returns: nothing.
+ *
+ */
+static void chirouter_clock_tsc_resync()
+{
+    uint64_t cycles, ns, now_ns;
+    uint64_t base_cycles = atomic_load_explicit(&tsc.base_cycles, memory_order_relaxed);
+    uint64_t base_ns = atomic_load_explicit(&tsc.base_ns, memory_order_relaxed);
+    uint64_t mult = atomic_load_explicit(&tsc.mult, memory_order_relaxed);
+    uint64_t rate;
+
+    chirouter_clock_sync_point(&cycles, &ns);
+
+    /* Rates that are more than 0.1% off are not caused by the TSC
+     * (or by NTP adjustments), but by CLOCK_REALTIME being set */
+    if(cycles > tsc.sync_cycles && ns > tsc.sync_ns)
+    {
+        rate = (uint64_t) (((unsigned __int128) (ns - tsc.sync_ns) << CLOCK_MULT_SHIFT) / (cycles - tsc.sync_cycles));
+        if(rate > tsc.rate - tsc.rate / 1000 && rate < tsc.rate + tsc.rate / 1000)
+            tsc.rate = rate;
+    }
+    tsc.sync_cycles = cycles;
+    tsc.sync_ns = ns;
+    rate = tsc.rate;
+
+    /* Time given by the current synchronization point */
+    now_ns = base_ns;
+    if(cycles > base_cycles)
+        now_ns += (uint64_t) (((unsigned __int128) (cycles - base_cycles) * mult) >> CLOCK_MULT_SHIFT);
+
+    if(now_ns <= ns)
+    {
+        chirouter_clock_tsc_update(cycles, ns, rate);
+        return;
+    }
+
+    uint64_t resync_ns = (uint64_t) CLOCK_RESYNC_MS * 1000000;
+    uint64_t ahead_ns = now_ns - ns;
+
+    if(ahead_ns < resync_ns / 2)
+        rate = (uint64_t) ((unsigned __int128) rate * (resync_ns - ahead_ns) / resync_ns);
+    else
+        rate /= 2;
+
+    chirouter_clock_tsc_update(cycles, now_ns, rate);
+}
+
+
+/*
+ * chirouter_clock_tsc_now_ns - Converts the TSC into nanoseconds since the epoch
+ *
+ * Returns: Nanoseconds since the epoch
+ *
+ */
+static inline uint64_t chirouter_clock_tsc_now_ns()
+{
+    uint64_t cycles, base_cycles, base_ns, mult;
+    uint32_t seq;
+
+    while(1)
+    {
+        seq = atomic_load_explicit(&tsc.seq, memory_order_acquire);
+        base_cycles = atomic_load_explicit(&tsc.base_cycles, memory_order_relaxed);
+        base_ns = atomic_load_explicit(&tsc.base_ns, memory_order_relaxed);
+        mult = atomic_load_explicit(&tsc.mult, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+
+        if(!(seq & 1) && seq == atomic_load_explicit(&tsc.seq, memory_order_relaxed))
+            break;
+    }
+
+    cycles = __rdtsc();
+
+    /* Whichever thread first notices that the synchronization
+     * point is too old takes care of re-synchronizing */
+    if(cycles - base_cycles > atomic_load_explicit(&tsc.resync_cycles, memory_order_relaxed) &&
+       !atomic_flag_test_and_set(&tsc.resyncing))
+    {
+        chirouter_clock_tsc_resync();
+        atomic_flag_clear(&tsc.resyncing);
+    }
+
+    uint64_t ns = base_ns;
+    if(cycles > base_cycles)
+        ns += (uint64_t) (((unsigned __int128) (cycles - base_cycles) * mult) >> CLOCK_MULT_SHIFT);
+
+    /* The TSC of different cores may be a few cycles apart (and a thread
+     * may be moved to another core), and a thread can read the new
+     * synchronization point right after reading the old one */
+    if(ns < tsc_last_ns)
+        return tsc_last_ns;
+
+    tsc_last_ns = ns;
+
+    return ns;
+}
+
+#endif
+
+
+/* See clock.h */
+int chirouter_clock_init(chirouter_clock_source_t source)
+{
+    int rc = 0;
+
+#if defined(__x86_64__)
+    if(chirouter_clock_tsc_usable())
+    {
+        uint64_t cycles0, ns0, cycles1, ns1;
+        struct timespec delay = { 0, CLOCK_CALIBRATION_NS };
+
+        chirouter_clock_sync_point(&cycles0, &ns0);
+        nanosleep(&delay, NULL);
+        chirouter_clock_sync_point(&cycles1, &ns1);
+
+        uint64_t mult = (uint64_t) (((unsigned __int128) (ns1 - ns0) << CLOCK_MULT_SHIFT) / (cycles1 - cycles0));
+        atomic_store(&tsc.resync_cycles, (uint64_t) (((unsigned __int128) CLOCK_RESYNC_MS * 1000000 << CLOCK_MULT_SHIFT) / mult));
+        tsc.sync_cycles = cycles1;
+        tsc.sync_ns = ns1;
+        tsc.rate = mult;
+        chirouter_clock_tsc_update(cycles1, ns1, mult);
+        chirouter_clock_use_tsc = true;
+    }
+    else if(source == CLOCK_SOURCE_TSC)
+    {
+        source = CLOCK_SOURCE_REALTIME;
+        rc = 1;
+    }
+#else
+    if(source == CLOCK_SOURCE_TSC)
+    {
+        source = CLOCK_SOURCE_REALTIME;
+        rc = 1;
+    }
+#endif
+
+    atomic_store(&clock_source, source);
+
+    return rc;
+}
+
+
+/* See clock.h */
+chirouter_clock_source_t chirouter_clock_source()
+{
+    return atomic_load_explicit(&clock_source, memory_order_relaxed);
+}
+
+
+/* See clock.h */
+const char* chirouter_clock_source_name(chirouter_clock_source_t source)
+{
+    switch(source)
+    {
+    case CLOCK_SOURCE_TSC:
+        return "tsc";
+    case CLOCK_SOURCE_COARSE:
+        return "coarse";
+    case CLOCK_SOURCE_REALTIME:
+    default:
+        return "realtime";
+    }
+}
+
+
+/* See clock.h */
+int chirouter_clock_parse_source(const char *name, chirouter_clock_source_t *source)
+{
+    if(!strcmp(name, "realtime"))
+        *source = CLOCK_SOURCE_REALTIME;
+    else if(!strcmp(name, "tsc"))
+        *source = CLOCK_SOURCE_TSC;
+    else if(!strcmp(name, "coarse"))
+        *source = CLOCK_SOURCE_COARSE;
+    else
+        return -1;
+
+    return 0;
+}
+
+
+/* See clock.h */
+uint64_t chirouter_clock_now_ns()
+{
+    switch(atomic_load_explicit(&clock_source, memory_order_relaxed))
+    {
+#if defined(__x86_64__)
+    case CLOCK_SOURCE_TSC:
+        return chirouter_clock_tsc_now_ns();
+#endif
+    case CLOCK_SOURCE_COARSE:
+        return chirouter_clock_read(CLOCK_REALTIME_COARSE);
+    case CLOCK_SOURCE_REALTIME:
+    default:
+        return chirouter_clock_read(CLOCK_REALTIME);
+    }
+}
+
+
+/* See clock.h */
+double chirouter_clock_cycles_to_ns(uint64_t cycles)
+{
+#if defined(__x86_64__)
+    if(chirouter_clock_use_tsc)
+        return (double) cycles * atomic_load_explicit(&tsc.mult, memory_order_relaxed) / (1ull << CLOCK_MULT_SHIFT);
+#endif
+
+    /* The cycle counter is CLOCK_MONOTONIC, in nanoseconds */
+    return (double) cycles;
+}
@@ -0,0 +1,194 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This header file defines the clock used to timestamp captured frames
+ *  and log messages, and to measure how long processing takes.
+ *
+ *  The clock can read the time from one of several sources:
+ *
+ *  - CLOCK_REALTIME (precise, but each reading costs a clock_gettime call)
+ *  - The TSC, calibrated against CLOCK_REALTIME when the clock is
+ *    initialized and re-synchronized with it every CLOCK_RESYNC_MS
+ *    milliseconds (precise, and a reading costs a few nanoseconds).
+ *    Only available on x86-64 processors with an invariant TSC.
+ *  - CLOCK_REALTIME_COARSE (cheap, but only updated every few milliseconds)
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+/* How often the TSC is re-synchronized with CLOCK_REALTIME */
+#define CLOCK_RESYNC_MS (1000u)
+
+/* Time sources */
+typedef enum
+{
+    CLOCK_SOURCE_REALTIME = 0,
+    CLOCK_SOURCE_TSC = 1,
+    CLOCK_SOURCE_COARSE = 2
+} chirouter_clock_source_t;
+
+
+/*
+ * chirouter_clock_init - Initializes the clock
+ *
+ * If the TSC is chosen, it is calibrated against CLOCK_REALTIME (which
+ * takes a few milliseconds). If the TSC cannot be used, the clock falls
+ * back to CLOCK_REALTIME. Until this function is called, the clock
+ * reads CLOCK_REALTIME.
+ *
+ * source: Time source
+ *
+ * Returns: 0 on success, 1 if the clock fell back to CLOCK_REALTIME.
+ *
+ */
+int chirouter_clock_init(chirouter_clock_source_t source);
+
+
+/*
+ * chirouter_clock_source - Returns the time source in use
+ *
+ * Returns: Time source
+ *
+ */
+chirouter_clock_source_t chirouter_clock_source();
+
+
+/*
+ * chirouter_clock_source_name - Returns the name of a time source
+ *
+ * source: Time source
+ *
+ * Returns: Name of the time source ("realtime", "tsc", or "coarse")
+ *
+ */
+const char* chirouter_clock_source_name(chirouter_clock_source_t source);
+
+
+/*
+ * chirouter_clock_parse_source - Parses the name of a time source
+ *
+ * name: Name of the time source ("realtime", "tsc", or "coarse")
+ *
+ * source: Out parameter. Time source.
+ *
+ * Returns: 0 on success, -1 if the name is not a valid time source.
+ *
+ */
+int chirouter_clock_parse_source(const char *name, chirouter_clock_source_t *source);
+
+
+/*
+ * chirouter_clock_now_ns - Returns the current time
+ *
+ * Can be called concurrently from several threads. With the TSC time
+ * source, the time returned to a thread never goes back (even if
+ * CLOCK_REALTIME is adjusted back, in which case the clock slows down
+ * until CLOCK_REALTIME catches up). The other time sources follow
+ * CLOCK_REALTIME.
+ *
+ * Returns: Nanoseconds since the epoch
+ *
+ */
+uint64_t chirouter_clock_now_ns();
+
+
+/* True if chirouter_clock_cycles reads the TSC, which is only the case
+ * on x86-64 processors with an invariant TSC, once chirouter_clock_init
+ * has calibrated it. Otherwise, it reads CLOCK_MONOTONIC (in nanoseconds). */
+extern bool chirouter_clock_use_tsc;
+
+
+/*
+ * chirouter_clock_cycles - Reads the cycle counter
+ *
+ * This is the TSC if it has been calibrated (see chirouter_clock_use_tsc)
+ * and, otherwise, a monotonic clock in nanoseconds. Use this (and not
+ * chirouter_clock_now_ns) to measure short intervals, and convert them
+ * with chirouter_clock_cycles_to_ns.
+ *
+ * Returns: Cycle count
+ *
+ */
+static inline uint64_t chirouter_clock_cycles()
+{
+#if defined(__x86_64__)
+    if(chirouter_clock_use_tsc)
+        return __rdtsc();
+#endif
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/*
+ * chirouter_clock_cycles_to_ns - Converts a number of cycles into nanoseconds
+ *
+ * The TSC is calibrated when the clock is initialized, whatever the
+ * time source (if it is not used, cycles are nanoseconds).
+ *
+ * cycles: Number of cycles (as a difference of chirouter_clock_cycles values)
+ *
+ * Returns: Nanoseconds
+ *
+ */
+double chirouter_clock_cycles_to_ns(uint64_t cycles);
+
+
+#endif
@@ -54,23 +54,34 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include "utlist.h"
 #include "chirouter.h"
 #include "log.h"
 #include "arp.h"
+#include "server.h"
 
 /*
  * chirouter_ctx_init - Initializes a router context
  *
- * ctx: Router context
+ * ctx: Router context (its "server" field must already be set)
  *
  * Returns: 0 on success, -1 if an error happens.
  */
 int chirouter_ctx_init(chirouter_ctx_t *ctx)
 {
+    if(chirouter_arp_cache_init(ctx, ctx->server->arpcache_size))
+        return -1;
+
+    if(chirouter_arp_pending_reqs_init(ctx))
+    {
+        chirouter_arp_cache_destroy(ctx);
+        return -1;
+    }
+
     pthread_mutex_init(&ctx->lock_arp, NULL);
 
-    ctx->pending_arp_reqs = NULL;
+    chirouter_timer_wheel_init(&ctx->arp_timers, chirouter_timer_now_ms());
 
     return 0;
 }
@@ -135,6 +146,10 @@ void chirouter_ctx_log(chirouter_ctx_t *ctx, loglevel_t loglevel)
             free(mask);
         }
     }
+
+    chilog(loglevel, "");
+    chilog(loglevel, "ARP cache: up to %u entries (%u slots), %u static", ctx->arpcache_max_entries,
+                     ctx->arpcache_capacity, ctx->arpcache_num_static);
 }
 
 
@@ -148,19 +163,23 @@ void chirouter_ctx_log(chirouter_ctx_t *ctx, loglevel_t loglevel)
  */
 int chirouter_ctx_destroy(chirouter_ctx_t *ctx)
 {
-    pthread_mutex_lock(&ctx->lock_arp);
-    pthread_join(ctx->arp_thread, NULL);
+    chirouter_arp_timers_free(ctx);
+    chirouter_arp_pending_reqs_destroy(ctx);
 
     pthread_mutex_destroy(&ctx->lock_arp);
 
-    chirouter_pending_arp_req_t *elt, *tmp;
-
-    DL_FOREACH_SAFE(ctx->pending_arp_reqs, elt, tmp)
-    {
-        chirouter_arp_pending_req_free_frames(elt);
-        DL_DELETE(ctx->pending_arp_reqs, elt);
-        free(elt);
-    }
+    chilog(INFO, "Router %s: %u entries in ARP cache, %" PRIu64 " evictions, %" PRIu64 " withheld frames dropped, "
+                 "%" PRIu64 " negative ARP cache hits", ctx->name, ctx->arpcache_num_entries,
+                 ctx->arpcache_evictions, ctx->withheld_drops, ctx->arp_negcache_hits);
+    chirouter_arp_cache_destroy(ctx);
+
+    /* Allocated by the server when the router was configured */
+    free(ctx->interfaces);
+    ctx->interfaces = NULL;
+    ctx->num_interfaces = 0;
+    free(ctx->routing_table);
+    ctx->routing_table = NULL;
+    ctx->num_rtable_entries = 0;
 
     return 0;
 }
@@ -0,0 +1,214 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This module implements the engine that runs the packet processing
+ *  graph. The nodes themselves are defined in router.c.
+ *
+ *  See graph.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "graph.h"
+#include "clock.h"
+#include "log.h"
+
+
+/* Graph instance used by the current thread */
+static __thread chirouter_graph_t *thread_graph = NULL;
+
+
+/* See graph.h */
+const char* chirouter_graph_node_name(chirouter_graph_node_t node)
+{
+    switch(node)
+    {
+    case NODE_L2_FILTER:
+        return "l2-filter";
+    case NODE_ETHERTYPE_DISPATCH:
+        return "ethertype-dispatch";
+    case NODE_ARP_INPUT:
+        return "arp-input";
+    case NODE_IP4_INPUT:
+        return "ip4-input";
+    case NODE_IP4_LOCAL:
+        return "ip4-local";
+    case NODE_IP4_LOOKUP:
+        return "ip4-lookup";
+    case NODE_IP4_REWRITE:
+        return "ip4-rewrite";
+    case NODE_TX:
+        return "tx";
+    case NODE_DROP:
+        return "drop";
+    default:
+        return "unknown";
+    }
+}
+
+
+/* See graph.h */
+void chirouter_graph_init(chirouter_graph_t *g, chirouter_tx_batch_t *tx_batch)
+{
+    memset(g, 0, sizeof(chirouter_graph_t));
+    g->tx_batch = tx_batch;
+}
+
+
+/* See graph.h */
+void chirouter_graph_thread_set(chirouter_graph_t *g)
+{
+    thread_graph = g;
+}
+
+
+/* See graph.h */
+chirouter_graph_t* chirouter_graph_thread_get()
+{
+    return thread_graph;
+}
+
+
+/*
+ * chirouter_graph_run_node - Runs a single node on its input vector
+ *
+ * g: Graph
+ *
+ * node: Node
+ *
+ * Returns: nothing (errors are recorded in g->error)
+ *
+ */
+static void chirouter_graph_run_node(chirouter_graph_t *g, chirouter_graph_node_t node)
+{
+    chirouter_graph_vector_t *v = &g->vectors[node];
+    chirouter_graph_node_stats_t *stats = &g->stats[node];
+    uint64_t start = chirouter_clock_cycles();
+
+    /* Nodes only pass frames on to nodes with a higher ID, so
+     * nothing will be added to this vector while we process it */
+    if(chirouter_graph_node_fns[node](g, g->ctx, v) == -1)
+        g->error = -1;
+
+    stats->calls++;
+    stats->frames += v->n;
+    stats->cycles += chirouter_clock_cycles() - start;
+    v->n = 0;
+}
+
+
+/* See graph.h */
+void chirouter_graph_enqueue(chirouter_graph_t *g, chirouter_graph_node_t node, chirouter_graph_elt_t *elt)
+{
+    chirouter_graph_vector_t *v = &g->vectors[node];
+
+    if(v->n == GRAPH_VECTOR_SIZE)
+        chirouter_graph_run_node(g, node);
+
+    v->elts[v->n++] = *elt;
+}
+
+
+/* See graph.h */
+int chirouter_graph_run(chirouter_graph_t *g, chirouter_ctx_t *ctx, ethernet_frame_t **frames, size_t n)
+{
+    g->ctx = ctx;
+    g->error = 0;
+
+    for(size_t i = 0; i < n; i += GRAPH_VECTOR_SIZE)
+    {
+        size_t batch = (n - i < GRAPH_VECTOR_SIZE) ? n - i : GRAPH_VECTOR_SIZE;
+        chirouter_graph_vector_t *v = &g->vectors[NODE_L2_FILTER];
+
+        for(size_t j = 0; j < batch; j++)
+        {
+            v->elts[j].frame = frames[i + j];
+            v->elts[j].out_interface = NULL;
+            v->elts[j].next_hop.s_addr = 0;
+            v->elts[j].owned = false;
+        }
+        v->n = batch;
+
+        for(int node = 0; node < NUM_GRAPH_NODES; node++)
+        {
+            if(g->vectors[node].n > 0)
+                chirouter_graph_run_node(g, node);
+        }
+    }
+
+    g->ctx = NULL;
+
+    return g->error;
+}
+
+
+/* See graph.h */
+void chirouter_graph_log_stats(chirouter_graph_t *g, const char *name, loglevel_t loglevel)
+{
+    chilog(loglevel, "Graph statistics (%s):", name);
+    chilog(loglevel, "  %-20s%12s%12s%12s%14s%10s", "Node", "Calls", "Frames", "Frames/call", "Cycles/frame", "ns/frame");
+
+    for(int node = 0; node < NUM_GRAPH_NODES; node++)
+    {
+        chirouter_graph_node_stats_t *stats = &g->stats[node];
+
+        if(stats->calls == 0)
+            continue;
+
+        chilog(loglevel, "  %-20s%12" PRIu64 "%12" PRIu64 "%12.1f%14.1f%10.1f", chirouter_graph_node_name(node),
+                         stats->calls, stats->frames,
+                         (double) stats->frames / stats->calls,
+                         stats->frames ? (double) stats->cycles / stats->frames : 0.0,
+                         stats->frames ? chirouter_clock_cycles_to_ns(stats->cycles) / stats->frames : 0.0);
+    }
+
+    memset(g->stats, 0, sizeof(g->stats));
+}
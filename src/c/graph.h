@@ -0,0 +1,269 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This header file defines the packet processing graph.
+ *
+ *  Inbound frames are processed by a graph of nodes (L2 filter, ethertype
+ *  dispatch, ARP input, IPv4 input, local delivery, route lookup, rewrite,
+ *  and transmit). Instead of taking each frame through the whole graph
+ *  before moving on to the next one, each node processes a vector of up to
+ *  GRAPH_VECTOR_SIZE frames before passing them on to the next node(s).
+ *  This keeps each node's code and data warm in the cache, and allows
+ *  nodes to prefetch the frames they are about to process.
+ *
+ *  The graph engine (in graph.c) is independent of the nodes themselves,
+ *  which are defined in router.c.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "chirouter.h"
+#include "log.h"
+
+/* Maximum number of frames in a vector */
+#define GRAPH_VECTOR_SIZE (64u)
+
+
+/* Graph nodes. Nodes can only pass frames on to nodes with a
+ * higher ID, so running the nodes in order of increasing ID
+ * processes every frame. */
+typedef enum
+{
+    NODE_L2_FILTER = 0,
+    NODE_ETHERTYPE_DISPATCH,
+    NODE_ARP_INPUT,
+    NODE_IP4_INPUT,
+    NODE_IP4_LOCAL,
+    NODE_IP4_LOOKUP,
+    NODE_IP4_REWRITE,
+    NODE_TX,
+    NODE_DROP,
+    NUM_GRAPH_NODES
+} chirouter_graph_node_t;
+
+
+/* A frame in a vector, with the metadata that is passed between nodes */
+typedef struct chirouter_graph_elt
+{
+    /* The frame */
+    ethernet_frame_t *frame;
+
+    /* Interface the frame must be sent on (set by NODE_IP4_LOOKUP,
+     * or by any node that sends a frame to NODE_TX directly) */
+    chirouter_interface_t *out_interface;
+
+    /* IP address of the next hop (set by NODE_IP4_LOOKUP) */
+    struct in_addr next_hop;
+
+    /* If true, the frame was allocated from the packet buffer pool
+     * by the graph, and must be freed once it is sent or dropped.
+     * Otherwise, it is owned by the caller of chirouter_graph_run. */
+    bool owned;
+} chirouter_graph_elt_t;
+
+
+/* A vector of frames */
+typedef struct chirouter_graph_vector
+{
+    uint16_t n;
+    chirouter_graph_elt_t elts[GRAPH_VECTOR_SIZE];
+} chirouter_graph_vector_t;
+
+
+/* Per-node statistics */
+typedef struct chirouter_graph_node_stats
+{
+    /* Number of times the node was run */
+    uint64_t calls;
+
+    /* Number of frames processed by the node */
+    uint64_t frames;
+
+    /* Cycles spent in the node (including any nodes it
+     * had to flush because their vector was full) */
+    uint64_t cycles;
+} chirouter_graph_node_stats_t;
+
+
+/* A graph instance. Each thread that processes frames has its own
+ * instance, so the vectors and counters are never shared. */
+typedef struct chirouter_graph
+{
+    /* Input vector of each node */
+    chirouter_graph_vector_t vectors[NUM_GRAPH_NODES];
+
+    /* Statistics of each node */
+    chirouter_graph_node_stats_t stats[NUM_GRAPH_NODES];
+
+    /* Router whose frames are being processed */
+    chirouter_ctx_t *ctx;
+
+    /* Outbound frames are gathered in this batch of messages, which
+     * is flushed once a batch of inbound frames has been processed.
+     * If NULL, outbound frames are sent right away. */
+    chirouter_tx_batch_t *tx_batch;
+
+    /* Set to -1 if a node encounters a critical error */
+    int error;
+} chirouter_graph_t;
+
+
+/* A node function processes all the frames in vector "v", passing each of
+ * them on to another node with chirouter_graph_enqueue. It returns 0 on
+ * success, and -1 if a critical error happens. */
+typedef int (*chirouter_graph_node_fn_t)(chirouter_graph_t *g, chirouter_ctx_t *ctx, chirouter_graph_vector_t *v);
+
+
+/* The node functions, indexed by chirouter_graph_node_t (see router.c) */
+extern const chirouter_graph_node_fn_t chirouter_graph_node_fns[NUM_GRAPH_NODES];
+
+
+/*
+ * chirouter_graph_init - Initializes a graph instance
+ *
+ * g: Graph
+ *
+ * tx_batch: Batch of messages used to gather outbound frames (can be NULL)
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_graph_init(chirouter_graph_t *g, chirouter_tx_batch_t *tx_batch);
+
+
+/*
+ * chirouter_graph_thread_set - Sets the graph instance used by the calling thread
+ *
+ * g: Graph
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_graph_thread_set(chirouter_graph_t *g);
+
+
+/*
+ * chirouter_graph_thread_get - Returns the graph instance used by the calling thread
+ *
+ * Every thread that processes frames (the I/O thread, the worker threads,
+ * and the replay loop) owns a graph instance, and must set it up with
+ * chirouter_graph_thread_set first.
+ *
+ * Returns: Graph instance, or NULL if the thread has not set one.
+ *
+ */
+chirouter_graph_t* chirouter_graph_thread_get();
+
+
+/*
+ * chirouter_graph_run - Processes a batch of inbound frames
+ *
+ * g: Graph
+ *
+ * ctx: Router that received the frames
+ *
+ * frames: Array of frames. These are owned by the caller, and can
+ *         be freed once this function returns.
+ *
+ * n: Number of frames. If larger than GRAPH_VECTOR_SIZE, the frames are
+ *    processed in vectors of GRAPH_VECTOR_SIZE frames.
+ *
+ * Returns: 0 on success, -1 if a critical error happens.
+ *
+ */
+int chirouter_graph_run(chirouter_graph_t *g, chirouter_ctx_t *ctx, ethernet_frame_t **frames, size_t n);
+
+
+/*
+ * chirouter_graph_enqueue - Passes a frame on to a node
+ *
+ * If the node's vector is full, the node is run first.
+ *
+ * g: Graph
+ *
+ * node: Node
+ *
+ * elt: Frame and metadata (copied into the node's vector)
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_graph_enqueue(chirouter_graph_t *g, chirouter_graph_node_t node, chirouter_graph_elt_t *elt);
+
+
+/*
+ * chirouter_graph_node_name - Returns the name of a node
+ *
+ * node: Node
+ *
+ * Returns: Constant string
+ *
+ */
+const char* chirouter_graph_node_name(chirouter_graph_node_t node);
+
+
+/*
+ * chirouter_graph_log_stats - Logs (and resets) the statistics of a graph instance
+ *
+ * g: Graph
+ *
+ * name: Name of the graph instance (e.g., the thread that uses it)
+ *
+ * loglevel: Log level
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_graph_log_stats(chirouter_graph_t *g, const char *name, loglevel_t loglevel);
+
+#endif
@@ -51,6 +51,7 @@
 #include "protocols/ipv4.h"
 #include "protocols/icmp.h"
 #include "log.h"
+#include "clock.h"
 
 
 /* Logging level. Set by default to print just errors */
@@ -74,7 +75,7 @@ void chilog(loglevel_t level, char *fmt, ...)
     if(level > loglevel)
         return;
 
-    t = time(NULL);
+    t = chirouter_clock_now_ns() / 1000000000;
     strftime(buf,80,"%Y-%m-%d %H:%M:%S",localtime(&t));
 
     switch(level)
@@ -3,12 +3,72 @@
  *
  *  main() function for the router
  *
- *  The chirouter executable accepts three command-line arguments:
+ *  The chirouter executable accepts the following command-line arguments:
  *
  *  -p PORT: Port on which chirouter will listen (default: 23320)
  *  -c FILE: If specified, will produce a pcapng capture file with all
  *           the Ethernet frames received/sent by the routers.
+ *  -C MB: Rotate the capture file when it reaches MB megabytes. The
+ *         capture files are numbered (e.g., -c cap.pcapng produces
+ *         cap-000000.pcapng, cap-000001.pcapng, etc.). Requires -c.
+ *  -G SECS: Rotate the capture file every SECS seconds. Requires -c.
+ *  -W NUM: When rotating the capture file, keep only the last NUM
+ *          files (default: keep all the files). Requires -C or -G.
+ *  -F FILTER: Only capture the frames that match FILTER (see capfilter.h
+ *             for the syntax, e.g., -F "arp or icmp"). Requires -c.
+ *  -S BYTES: Only capture the first BYTES bytes of each frame (e.g.,
+ *            -S 64 to capture just the headers). Requires -c.
+ *  -m [ROUTER-IFACE:]RATE: Sampled capture. RATE is either 1/N (capture
+ *            one in every N frames) or P (capture each frame with
+ *            probability P). Applies to every interface, or only to
+ *            interface IFACE of router ROUTER. Can be repeated. Requires -c.
+ *  -t SOURCE: Time source for capture timestamps, log messages, and
+ *             processing time measurements: "tsc" (the processor's
+ *             timestamp counter, calibrated against the system clock),
+ *             "realtime" (the system clock), or "coarse" (a cheaper, but
+ *             less precise, system clock). Default: tsc (or realtime,
+ *             if the processor does not have an invariant TSC).
+ *  -H: Back packet memory (frame buffers and receive buffers) with
+ *      2 MB huge pages, if available.
+ *  -w NUM: Process frames in NUM worker threads (default: 0, meaning
+ *          frames are processed in the thread that receives them).
+ *          Each router is assigned to a single worker.
+ *  -f: Flow-affine processing. Instead of assigning each router to a
+ *      single worker, spread the frames of every router across all the
+ *      workers by hashing their IPv4 5-tuple. Requires -w.
+ *  -a NUM: Maximum number of entries in each router's ARP cache
+ *          (default: 100)
+ *  -r MS: Retransmit unanswered ARP requests every MS milliseconds
+ *         (default: 1000)
+ *  -n MS: Hold-down period of the negative ARP cache. For MS milliseconds
+ *         after a host does not answer ARP requests, frames to it get an
+ *         ICMP Host Unreachable right away (default: 20000; 0 disables it)
+ *  -q NUM: Maximum number of frames withheld by each pending ARP request
+ *          (default: 64)
+ *  -Q NUM: Maximum number of frames withheld by all the routers
+ *          together while waiting for ARP replies (default: 4096)
+ *  -o: When a pending ARP request (or all the routers together) is
+ *      withholding as many frames as it can, drop the request's oldest
+ *      frame instead of the new frame.
+ *  -g: Resolve the gateways in the routing tables as soon as the
+ *      configuration is received, instead of when the first frame
+ *      is routed through them.
+ *  -s FILE: Save the routers' ARP caches to FILE when the controller
+ *           disconnects (or when chirouter is interrupted), and restore
+ *           them from FILE when the configuration is received.
  *  -v: Be verbose. Can be repeated up to three times for extra verbosity.
+ *  --replay FILE: Instead of waiting for a controller, configure the
+ *                 routers from a topology file, replay the inbound frames
+ *                 in capture FILE (e.g., one produced with -c), and report
+ *                 the throughput and the latency of each frame. The frames
+ *                 the routers send are only counted (or, with -c, captured).
+ *                 Requires --topology. Cannot be used with -w.
+ *  --topology FILE: Topology file (as used by the controller; see the
+ *                   topologies directory) to configure the routers from
+ *                   when replaying a capture.
+ *  --replay-timing: Replay the frames at their original timing, instead
+ *                   of as fast as possible.
+ *  --replay-loops NUM: Replay the capture NUM times (default: 1).
  *
  *  The main() function takes care of processing these command-line
  *  arguments and launching the router processing code.
@@ -65,6 +125,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
 #include <arpa/inet.h>
 
 #include <getopt.h>
@@ -74,26 +135,69 @@
 #include "arp.h"
 #include "log.h"
 #include "pcap.h"
+#include "capfilter.h"
+#include "clock.h"
+#include "replay.h"
 
-#define USAGE "Usage: chirouter [-p PORT] [-c CAP_FILE] [(-v|-vv|-vvv)]\n"
+#define USAGE "Usage: chirouter [-p PORT] [-c CAP_FILE [-C ROTATE_MB] [-G ROTATE_SECS] [-W ROTATE_FILES] [-F CAP_FILTER] [-S SNAPLEN] [-m [ROUTER-IFACE:]SAMPLING_RATE ...]] [-t TIME_SOURCE] [-H] [-w NUM_WORKERS [-f]] [-a ARP_CACHE_SIZE] [-r ARP_RETRANSMIT_MS] [-n ARP_HOLDDOWN_MS] [-q MAX_WITHHELD_PER_REQ] [-Q MAX_WITHHELD] [-o] [-g] [-s ARP_SNAPSHOT_FILE] [(-v|-vv|-vvv)] [--replay REPLAY_FILE --topology TOPOLOGY_FILE [--replay-timing] [--replay-loops NUM]]\n"
+
+/* Options that only have a long form */
+enum
+{
+    OPT_REPLAY = 256,
+    OPT_TOPOLOGY,
+    OPT_REPLAY_TIMING,
+    OPT_REPLAY_LOOPS
+};
+
+static const struct option long_options[] =
+{
+    {"replay", required_argument, NULL, OPT_REPLAY},
+    {"topology", required_argument, NULL, OPT_TOPOLOGY},
+    {"replay-timing", no_argument, NULL, OPT_REPLAY_TIMING},
+    {"replay-loops", required_argument, NULL, OPT_REPLAY_LOOPS},
+    {NULL, 0, NULL, 0}
+};
 
 
 /* Unfortunately required by signal handler */
 static server_ctx_t *ctx;
 
-/* Signal handler. Ensures capture file is
- * flushed on SIGINT */
+/* Signal handler. Only asks the server to shut down; the capture
+ * file is flushed (and the ARP caches are saved) by the main thread
+ * once chirouter_server_run (or chirouter_replay_run) returns */
 void sig_handler(int signo)
 {
   if (signo == SIGINT)
-  {
-      fprintf(stderr, "Exiting chirouter...\n");
-      if(ctx->pcap)
-      {
-          fclose(ctx->pcap);
-      }
-      exit(0);
-  }
+      chirouter_server_shutdown(ctx);
+}
+
+
+/*
+ * parse_long_arg - Parses a numeric command-line argument
+ *
+ * arg: Argument (a decimal integer)
+ *
+ * min, max: Range of valid values
+ *
+ * value: Set to the value of the argument
+ *
+ * Returns: 0 on success, -1 if the argument is not a decimal integer
+ *          (or has trailing characters), or is out of range.
+ *
+ */
+static int parse_long_arg(const char *arg, long min, long max, long *value)
+{
+    char *end;
+    long v;
+
+    errno = 0;
+    v = strtol(arg, &end, 10);
+    if(errno != 0 || end == arg || *end != '\0' || v < min || v > max)
+        return -1;
+
+    *value = v;
+    return 0;
 }
 
 
@@ -102,10 +206,35 @@ int main(int argc, char *argv[])
     int rc;
 
     sigset_t new;
+    struct sigaction sa;
     int opt;
     char *port = "23320";
     char *cap_file = NULL;
+    long cap_rotate_mb = 0;
+    long cap_rotate_secs = 0;
+    long cap_rotate_keep = 0;
+    chirouter_capfilter_t *cap_filter = NULL;
+    long cap_snaplen = 0;
+    char *cap_sampling[argc];
+    int num_cap_sampling = 0;
+    chirouter_clock_source_t clock_source = CLOCK_SOURCE_TSC;
+    char errbuf[256];
     int verbosity = 0;
+    bool hugepages = false;
+    long num_workers = 0;
+    bool flow_affine = false;
+    long arpcache_size = ARPCACHE_SIZE;
+    long arp_retransmit_ms = ARP_REQ_RETRANSMIT_MS;
+    long arp_negcache_ms = ARP_NEGCACHE_HOLDDOWN_MS;
+    long max_withheld_per_req = ARP_MAX_WITHHELD_PER_REQ;
+    long max_withheld = ARP_MAX_WITHHELD_FRAMES;
+    bool withheld_drop_oldest = false;
+    bool resolve_gateways = false;
+    char *arp_snapshot_file = NULL;
+    char *replay_file = NULL;
+    char *topology_file = NULL;
+    bool replay_timing = false;
+    long replay_loops = 1;
 
     /* Stop SIGPIPE from messing with our sockets */
     sigemptyset(&new);
@@ -116,15 +245,8 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
-    /* Add a SIGINT handler to properly close the pcap file on exit */
-    if (signal(SIGINT, sig_handler) == SIG_ERR)
-    {
-        perror("Unable to register SIGINT handler");
-        exit(-1);
-    }
-
     /* Process command-line arguments */
-    while ((opt = getopt(argc, argv, "p:c:vdh")) != -1)
+    while ((opt = getopt_long(argc, argv, "p:c:C:G:W:F:S:m:t:Hw:fa:r:n:q:Q:ogs:vdh", long_options, NULL)) != -1)
         switch (opt)
         {
         case 'p':
@@ -133,9 +255,142 @@ int main(int argc, char *argv[])
         case 'c':
             cap_file = strdup(optarg);
             break;
+        case 'C':
+            if(parse_long_arg(optarg, 1, PCAP_ROTATE_MAX_MB, &cap_rotate_mb))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Capture file size must be between 1 and %u MB\n", PCAP_ROTATE_MAX_MB);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'G':
+            if(parse_long_arg(optarg, 1, PCAP_ROTATE_MAX_SECS, &cap_rotate_secs))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Capture rotation interval must be between 1 and %u seconds\n", PCAP_ROTATE_MAX_SECS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'W':
+            if(parse_long_arg(optarg, 1, PCAP_ROTATE_MAX_FILES, &cap_rotate_keep))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Number of capture files must be between 1 and %u\n", PCAP_ROTATE_MAX_FILES);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'F':
+            chirouter_capfilter_free(cap_filter);
+            if(chirouter_capfilter_compile(optarg, &cap_filter, errbuf, sizeof(errbuf)))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Invalid capture filter: %s\n", errbuf);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'S':
+            if(parse_long_arg(optarg, ETHER_HDR_LEN, UINT16_MAX, &cap_snaplen))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Snapshot length must be between %u and %u bytes\n", ETHER_HDR_LEN, UINT16_MAX);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'm':
+            cap_sampling[num_cap_sampling++] = optarg;
+            break;
+        case 't':
+            if(chirouter_clock_parse_source(optarg, &clock_source))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Time source must be tsc, realtime, or coarse\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'H':
+            hugepages = true;
+            break;
+        case 'w':
+            if(parse_long_arg(optarg, 0, MAX_NUM_WORKERS, &num_workers))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Number of workers must be between 0 and %u\n", MAX_NUM_WORKERS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            flow_affine = true;
+            break;
+        case 'a':
+            if(parse_long_arg(optarg, 1, ARPCACHE_MAX_SIZE, &arpcache_size))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: ARP cache size must be between 1 and %u\n", ARPCACHE_MAX_SIZE);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            if(parse_long_arg(optarg, TIMER_TICK_MS, ARP_REQ_RETRANSMIT_MAX_MS, &arp_retransmit_ms))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: ARP retransmission interval must be between %u and %u ms\n",
+                                TIMER_TICK_MS, ARP_REQ_RETRANSMIT_MAX_MS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            if(parse_long_arg(optarg, 0, ARP_NEGCACHE_MAX_HOLDDOWN_MS, &arp_negcache_ms))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: ARP hold-down period must be between 0 and %u ms\n", ARP_NEGCACHE_MAX_HOLDDOWN_MS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'q':
+        case 'Q':
+        {
+            long max;
+            if(parse_long_arg(optarg, 1, ARP_MAX_WITHHELD_LIMIT, &max))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Maximum number of withheld frames must be between 1 and %u\n", ARP_MAX_WITHHELD_LIMIT);
+                return EXIT_FAILURE;
+            }
+            if(opt == 'q')
+                max_withheld_per_req = max;
+            else
+                max_withheld = max;
+            break;
+        }
+        case 'o':
+            withheld_drop_oldest = true;
+            break;
+        case 'g':
+            resolve_gateways = true;
+            break;
+        case 's':
+            arp_snapshot_file = strdup(optarg);
+            break;
         case 'v':
             verbosity++;
             break;
+        case OPT_REPLAY:
+            replay_file = optarg;
+            break;
+        case OPT_TOPOLOGY:
+            topology_file = optarg;
+            break;
+        case OPT_REPLAY_TIMING:
+            replay_timing = true;
+            break;
+        case OPT_REPLAY_LOOPS:
+            if(parse_long_arg(optarg, 1, REPLAY_MAX_LOOPS, &replay_loops))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Number of replay loops must be between 1 and %u\n", REPLAY_MAX_LOOPS);
+                return EXIT_FAILURE;
+            }
+            break;
         case 'h':
             printf(USAGE);
             exit(0);
@@ -145,6 +400,48 @@ int main(int argc, char *argv[])
             return EXIT_FAILURE;
         }
 
+    if(flow_affine && num_workers == 0)
+    {
+        fprintf(stderr, USAGE);
+        fprintf(stderr, "ERROR: -f requires -w\n");
+        return EXIT_FAILURE;
+    }
+
+    if((cap_rotate_mb || cap_rotate_secs || cap_filter || cap_snaplen || num_cap_sampling) && cap_file == NULL)
+    {
+        fprintf(stderr, USAGE);
+        fprintf(stderr, "ERROR: -C, -G, -F, -S, and -m require -c\n");
+        return EXIT_FAILURE;
+    }
+
+    if(cap_rotate_keep && !cap_rotate_mb && !cap_rotate_secs)
+    {
+        fprintf(stderr, USAGE);
+        fprintf(stderr, "ERROR: -W requires -C or -G\n");
+        return EXIT_FAILURE;
+    }
+
+    if((replay_file == NULL) != (topology_file == NULL))
+    {
+        fprintf(stderr, USAGE);
+        fprintf(stderr, "ERROR: --replay and --topology must be used together\n");
+        return EXIT_FAILURE;
+    }
+
+    if((replay_timing || replay_loops > 1) && replay_file == NULL)
+    {
+        fprintf(stderr, USAGE);
+        fprintf(stderr, "ERROR: --replay-timing and --replay-loops require --replay\n");
+        return EXIT_FAILURE;
+    }
+
+    if(replay_file && num_workers > 0)
+    {
+        fprintf(stderr, USAGE);
+        fprintf(stderr, "ERROR: --replay cannot be used with -w\n");
+        return EXIT_FAILURE;
+    }
+
     /* Set logging level based on verbosity */
     switch(verbosity)
     {
@@ -165,6 +462,12 @@ int main(int argc, char *argv[])
         break;
     }
 
+    if(chirouter_clock_init(clock_source))
+        chilog(WARNING, "The TSC cannot be used as a time source. Using %s instead.",
+                        chirouter_clock_source_name(chirouter_clock_source()));
+    else
+        chilog(INFO, "Time source: %s", chirouter_clock_source_name(chirouter_clock_source()));
+
     /* Initialize server context */
     rc = chirouter_server_ctx_init(&ctx);
     if(rc)
@@ -173,12 +476,48 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    /* Add a SIGINT handler to properly close the pcap file on exit */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) == -1)
+    {
+        perror("Unable to register SIGINT handler");
+        exit(-1);
+    }
+
+    ctx->hugepages = hugepages;
+    ctx->num_workers = num_workers;
+    ctx->flow_affine = flow_affine;
+    ctx->arpcache_size = arpcache_size;
+    ctx->arp_retransmit_ms = arp_retransmit_ms;
+    ctx->arp_negcache_ms = arp_negcache_ms;
+    ctx->arp_max_withheld_per_req = max_withheld_per_req;
+    ctx->arp_max_withheld = max_withheld;
+    ctx->arp_withheld_drop_oldest = withheld_drop_oldest;
+    ctx->arp_resolve_gateways = resolve_gateways;
+    ctx->arp_snapshot_file = arp_snapshot_file;
+
     /* Create capture file */
     if(cap_file)
     {
-        ctx->pcap = fopen(cap_file,"w");
+        ctx->pcap_file = cap_file;
+        ctx->pcap_rotate_bytes = (uint64_t) cap_rotate_mb * 1024 * 1024;
+        ctx->pcap_rotate_secs = cap_rotate_secs;
+        ctx->pcap_rotate_keep = cap_rotate_keep;
+        ctx->pcap_filter = cap_filter;
+        ctx->pcap_snaplen = cap_snaplen;
+
+        for(int i = 0; i < num_cap_sampling; i++)
+            if(chirouter_pcap_add_sampling(ctx, cap_sampling[i]))
+            {
+                fprintf(stderr, USAGE);
+                fprintf(stderr, "ERROR: Invalid capture sampling rate: %s\n", cap_sampling[i]);
+                return EXIT_FAILURE;
+            }
 
-        if(!ctx->pcap)
+        if(chirouter_pcap_open(ctx))
         {
             fprintf(stderr, USAGE);
             perror("ERROR: Capture file could not be created.");
@@ -186,6 +525,17 @@ int main(int argc, char *argv[])
         }
     }
 
+    if(replay_file)
+    {
+        rc = chirouter_replay_run(ctx, replay_file, topology_file, replay_timing, replay_loops);
+
+        chirouter_server_ctx_destroy(ctx);
+        if(ctx->pcap)
+            fclose(ctx->pcap);
+
+        return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
     rc = chirouter_server_setup(ctx, port);
     if(rc)
     {
@@ -194,10 +544,14 @@ int main(int argc, char *argv[])
     }
 
     rc = chirouter_server_run(ctx);
+    if(rc == 0)
+        fprintf(stderr, "Exiting chirouter...\n");
 
     chirouter_server_ctx_destroy(ctx);
+    if(ctx->pcap)
+        fclose(ctx->pcap);
 
-    return EXIT_SUCCESS;
+    return rc ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 
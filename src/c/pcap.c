@@ -4,16 +4,27 @@
 #include <stdint.h>
 #include <time.h>
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include "server.h"
 #include "chirouter.h"
 #include "pcap.h"
+#include "capfilter.h"
+#include "clock.h"
 
-#define PADDED_LEN(x) (x%4==0 ? x : ((x/4)+1)*4)
-#define PAD_LEN(x) (PADDED_LEN(x) - x)
+#define PADDED_LEN(x) ((x)%4==0 ? (x) : (((x)/4)+1)*4)
+#define PAD_LEN(x) (PADDED_LEN(x) - (x))
 
 #define BLOCK_TYPE_SHB 0x0A0D0D0A
 #define BLOCK_TYPE_IDB 0x00000001
 #define BLOCK_TYPE_EPB 0x00000006
+#define BLOCK_TYPE_ISB 0x00000005
 
 #define BYTEORDER_MAGIC 0x1A2B3C4D
 #define PCAPNG_VERSION_MAJOR 1
@@ -24,13 +35,42 @@
 #define OPTION_HDR_LEN 4
 
 #define OPCODE_END 0
+#define OPCODE_COMMENT 1
 #define OPCODE_IF_NAME 2
 #define OPCODE_IF_MACADDR 6
 #define OPCODE_IF_TSRESOL 9
 #define OPCODE_EPB_FLAGS 2
+#define OPCODE_ISB_STARTTIME 2
+#define OPCODE_ISB_ENDTIME 3
+#define OPCODE_ISB_IFRECV 4
+#define OPCODE_ISB_IFDROP 5
+#define OPCODE_ISB_FILTERACCEPT 6
+#define OPCODE_ISB_OSDROP 7
+#define OPCODE_ISB_USRDELIV 8
 
 #define min(a,b) ( (a) < (b) ? (a) : (b) )
 
+/* Longest sampling comment ("sampling=1/N" or "sampling=P") */
+#define SAMPLING_COMMENT_MAX_LEN (32)
+
+/* Largest Interface Description Block (header, name, MAC address,
+ * timestamp resolution, sampling, end of options, and trailing length) */
+#define IDB_MAX_LEN (sizeof(struct pcapng_idb) + OPTION_HDR_LEN + PADDED_LEN(MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 1) \
+                     + OPTION_HDR_LEN + PADDED_LEN(ETHER_ADDR_LEN) + OPTION_HDR_LEN + 4 \
+                     + OPTION_HDR_LEN + SAMPLING_COMMENT_MAX_LEN + OPTION_HDR_LEN + 4)
+
+/* Largest Enhanced Packet Block (header, frame, flags,
+ * end of options, and trailing length) */
+#define EPB_MAX_LEN (sizeof(struct pcapng_epb) + PADDED_LEN(ETHER_FRAME_MAX_LEN) + OPTION_HDR_LEN + 4 + OPTION_HDR_LEN + 4)
+
+/* Longest sent frames comment ("ifsent=N") */
+#define SENT_COMMENT_MAX_LEN (28)
+
+/* Largest Interface Statistics Block (header, start and end time,
+ * five counters, sent frames, end of options, and trailing length) */
+#define ISB_MAX_LEN (sizeof(struct pcapng_isb) + 7 * (OPTION_HDR_LEN + 8) \
+                     + OPTION_HDR_LEN + SENT_COMMENT_MAX_LEN + OPTION_HDR_LEN + 4)
+
 /* pcapng Section Header Block */
 struct pcapng_shb {
     uint32_t block_type;
@@ -70,8 +110,57 @@ struct pcapng_epb {
 } __attribute__((packed));
 
 
-/* See pcap.h */
-int chirouter_pcap_write_section_header(server_ctx_t *ctx)
+/* pcapng Interface Statistics Block */
+struct pcapng_isb {
+    uint32_t block_type;
+    uint32_t block_total_length;
+    uint32_t interface_id;
+    uint32_t timestamp_high;
+    uint32_t timestamp_low;
+} __attribute__((packed));
+
+
+/*
+ * chirouter_pcap_put_option - Serializes a pcapng option
+ *
+ * buf: Buffer, with room for OPTION_HDR_LEN + PADDED_LEN(option_length) bytes
+ *
+ * option_code: Option code
+ *
+ * option_length: Option length
+ *
+ * option_value: Raw binary value of the option
+ *
+ * Returns: Number of bytes written to the buffer (including the padding).
+ *
+ */
+static size_t chirouter_pcap_put_option(uint8_t *buf, uint16_t option_code, uint16_t option_length, const void *option_value)
+{
+    struct pcapng_option opt;
+
+    opt.option_code = option_code;
+    opt.option_length = option_length;
+    memcpy(buf, &opt, sizeof(opt));
+
+    if(option_length > 0)
+    {
+        memcpy(buf + OPTION_HDR_LEN, option_value, option_length);
+        memset(buf + OPTION_HDR_LEN + option_length, 0, PAD_LEN(option_length));
+    }
+
+    return OPTION_HDR_LEN + PADDED_LEN(option_length);
+}
+
+
+/*
+ * chirouter_pcap_build_shb - Serializes a Section Header Block
+ *
+ * buf: Buffer, with room for sizeof(struct pcapng_shb) bytes
+ *
+ * Returns: Length of the block.
+ *
+ */
+static size_t chirouter_pcap_build_shb(uint8_t *buf)
 {
     struct pcapng_shb hdr;
 
@@ -82,67 +171,84 @@ int chirouter_pcap_write_section_header(server_ctx_t *ctx)
     hdr.minor_version = PCAPNG_VERSION_MINOR;
     hdr.section_length = -1;
     hdr.block_total_length_trail = sizeof(hdr);
+    memcpy(buf, &hdr, sizeof(hdr));
 
-    if (fwrite((char *)&hdr, sizeof(hdr), 1, ctx->pcap) != 1)
-        return EXIT_FAILURE;
-    else
-        return EXIT_SUCCESS;
+    return sizeof(hdr);
 }
 
 
 /*
- * chirouter_pcap_write_option - Writes a pcapng option
- *
- * ctx: Server context
+ * chirouter_pcap_build_idb - Serializes an Interface Description Block
  *
- * option_code: Option code
+ * buf: Buffer, with room for IDB_MAX_LEN bytes
  *
- * option_length: Option length
+ * r: Router
  *
- * option_value: Raw binary value of the option
+ * iface: Interface
  *
- * Returns: 0 on success, -1 if an error happens.
+ * Returns: Length of the block.
  *
  */
-int chirouter_pcap_write_option(server_ctx_t *ctx, uint16_t option_code, uint16_t option_length, uint8_t *option_value)
+static size_t chirouter_pcap_build_idb(uint8_t *buf, chirouter_ctx_t *r, chirouter_interface_t *iface)
 {
-    struct pcapng_option opt;
-    uint16_t pad_length;
-    uint32_t pad = 0;
+    struct pcapng_idb hdr;
+    char iface_name[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2];
+    uint8_t tsresol = 9;
+    uint32_t snaplen = r->server->pcap_snaplen ? r->server->pcap_snaplen : 65535;
+    size_t len;
 
-    opt.option_code = option_code;
-    opt.option_length = option_length;
+    snprintf(iface_name, MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2, "%s-%s", r->name, iface->name);
 
-    /* Write option code and length */
-    if (fwrite((char *)&opt, sizeof(opt), 1, ctx->pcap) != 1)
-        return EXIT_FAILURE;
+    len = sizeof(hdr);
+    len += chirouter_pcap_put_option(buf + len, OPCODE_IF_NAME, strlen(iface_name), iface_name);
+    len += chirouter_pcap_put_option(buf + len, OPCODE_IF_MACADDR, ETHER_ADDR_LEN, iface->mac);
+    len += chirouter_pcap_put_option(buf + len, OPCODE_IF_TSRESOL, 1, &tsresol);
 
-    if(option_length > 0)
+    /* Analysis tools need the sampling rate to scale frame counts back up */
+    if(iface->pcap_sampling.every > 1 || iface->pcap_sampling.prob > 0)
     {
-        pad_length = PAD_LEN(option_length);
+        char comment[SAMPLING_COMMENT_MAX_LEN];
+        int n;
 
-        assert(pad_length >= 0 && pad_length <= 3);
+        if(iface->pcap_sampling.every > 1)
+            n = snprintf(comment, sizeof(comment), "sampling=1/%" PRIu32, iface->pcap_sampling.every);
+        else
+            n = snprintf(comment, sizeof(comment), "sampling=%.9g", iface->pcap_sampling.prob);
+        len += chirouter_pcap_put_option(buf + len, OPCODE_COMMENT, min(n, SAMPLING_COMMENT_MAX_LEN - 1), comment);
+    }
 
-        /* Write option value */
-        if (fwrite(option_value, 1, option_length, ctx->pcap) != option_length)
-            return EXIT_FAILURE;
+    len += chirouter_pcap_put_option(buf + len, OPCODE_END, 0, NULL);
+    len += 4; /* Trailing length */
 
-        if(pad_length > 0)
-        {
-            /* Write padding */
-            if (fwrite((char *)&pad, 1, pad_length, ctx->pcap) != pad_length)
-                return EXIT_FAILURE;
-        }
-    }
+    hdr.block_type = BLOCK_TYPE_IDB;
+    hdr.block_total_length = len;
+    hdr.link_type = LINKTYPE_ETHERNET;
+    hdr.reserved = 0;
+    hdr.snaplen = snaplen;
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + len - 4, &hdr.block_total_length, 4);
 
-    return EXIT_SUCCESS;
+    return len;
+}
+
+
+/* See pcap.h */
+int chirouter_pcap_write_section_header(server_ctx_t *ctx)
+{
+    uint8_t buf[sizeof(struct pcapng_shb)];
+    size_t len = chirouter_pcap_build_shb(buf);
+
+    if (fwrite(buf, len, 1, ctx->pcap) != 1)
+        return EXIT_FAILURE;
+    else
+        return EXIT_SUCCESS;
 }
 
 
 /* See pcap.h */
 int chirouter_pcap_write_interfaces(server_ctx_t *ctx)
 {
-    uint32_t interface_id = 0;
+    uint8_t buf[IDB_MAX_LEN];
 
     for(int i=0; i < ctx->num_routers; i++)
     {
@@ -151,121 +257,1154 @@ int chirouter_pcap_write_interfaces(server_ctx_t *ctx)
         for(int i=0; i < r->num_interfaces; i++)
         {
             chirouter_interface_t *iface = &r->interfaces[i];
-            struct pcapng_idb hdr;
-            char iface_name[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2];
+            size_t len = chirouter_pcap_build_idb(buf, r, iface);
+            if (fwrite(buf, len, 1, ctx->pcap) != 1)
+                return EXIT_FAILURE;
+        }
+    }
 
-            snprintf(iface_name, MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2, "%s-%s", r->name, iface->name);
+    return EXIT_SUCCESS;
+}
 
-            iface->pcap_iface_id = interface_id++;
 
-            hdr.block_type = BLOCK_TYPE_IDB;
-            hdr.link_type = LINKTYPE_ETHERNET;
-            hdr.reserved = 0;
-            hdr.snaplen = 65535;
+#define BILLION 1000000000L
 
-            hdr.block_total_length = sizeof(hdr);
-            hdr.block_total_length += OPTION_HDR_LEN + PADDED_LEN(strlen(iface_name));
-            hdr.block_total_length += OPTION_HDR_LEN + PADDED_LEN(ETHER_ADDR_LEN);
-            hdr.block_total_length += OPTION_HDR_LEN + PADDED_LEN(1);
-            hdr.block_total_length += OPTION_HDR_LEN; /* End of options */
-            hdr.block_total_length += 4; /* Trailing length */
 
-            if (fwrite((char *)&hdr, sizeof(hdr), 1, ctx->pcap) != 1)
-                return EXIT_FAILURE;
+/* A frame waiting to be written to the capture file. The ring is a
+ * bounded multi-producer/single-consumer queue: each slot has a sequence
+ * number that tells producers when the slot is free (seq == position)
+ * and the writer when the frame in it is ready (seq == position + 1) */
+typedef struct chirouter_pcap_record
+{
+    _Atomic uint64_t seq;
 
-            if(chirouter_pcap_write_option(ctx, OPCODE_IF_NAME, strlen(iface_name), (uint8_t *) iface_name))
-                return EXIT_FAILURE;
+    /* Nanoseconds since the epoch */
+    uint64_t timestamp;
 
-            if(chirouter_pcap_write_option(ctx, OPCODE_IF_MACADDR, ETHER_ADDR_LEN, iface->mac))
-                return EXIT_FAILURE;
+    uint32_t pcap_iface_id;
 
-            uint8_t tsresol = 9;
-            if(chirouter_pcap_write_option(ctx, OPCODE_IF_TSRESOL, 1, &tsresol))
-                return EXIT_FAILURE;
+    /* Captured length (at most the snaplen), and original length */
+    uint16_t len;
+    uint16_t orig_len;
+    uint8_t dir;
+    uint8_t frame[ETHER_FRAME_MAX_LEN];
+} chirouter_pcap_record_t;
 
-            if(chirouter_pcap_write_option(ctx, OPCODE_END, 0, NULL))
-                return EXIT_FAILURE;
 
-            if (fwrite((char *)&hdr.block_total_length, sizeof(hdr.block_total_length), 1, ctx->pcap) != 1)
-                return EXIT_FAILURE;
-        }
-    }
+/* Capture writer */
+struct chirouter_pcap_writer
+{
+    /* Next position to be claimed by a producer */
+    _Atomic uint64_t enqueue_pos __attribute__((aligned(64)));
 
-    return EXIT_SUCCESS;
-}
+    /* Next position to be written (used only by the writer thread) */
+    uint64_t dequeue_pos __attribute__((aligned(64)));
 
-#define BILLION 1000000000L
+    /* Ring of PCAP_RING_SIZE records */
+    chirouter_pcap_record_t *ring;
 
-int chirouter_pcap_write_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *msg, size_t len, pcap_packet_direction_t dir)
-{
-    struct pcapng_epb hdr;
+    /* The writer thread writes all the frames that are ready, and
+     * then sleeps on this semaphore (setting the sleeping flag first)
+     * until a producer (or chirouter_pcap_stop) posts to it */
+    sem_t pending;
+    atomic_bool sleeping;
+
+    /* Set to request that the writer exit */
+    atomic_bool stop;
+
+    /* Writer thread */
+    pthread_t thread;
+
+    /* Frames dropped because the ring was full */
+    _Atomic uint64_t drops;
+
+    /* Frames written (written only by the writer thread) */
+    uint64_t written;
+
+    /* Buffer of PCAP_WRITE_BUFFER_SIZE bytes where the writer thread
+     * serializes blocks, so that many blocks are written at once */
+    uint8_t *out;
+    size_t out_len;
+
+    /* Bytes written to the current capture file, and time (in
+     * CLOCK_MONOTONIC milliseconds) when it has to be rotated */
+    uint64_t file_bytes;
+    uint64_t file_deadline_ms;
 
-    /* Get nanoseconds since epoch */
-    uint64_t ns;
+    /* When the capture started (in nanoseconds since the epoch), and when
+     * the next Interface Statistics Blocks are due (in CLOCK_MONOTONIC
+     * milliseconds) */
+    uint64_t start_ns;
+    uint64_t stats_deadline_ms;
+
+    /* Bytes that must be left in a capture file for
+     * its final Interface Statistics Blocks */
+    uint64_t stats_reserve;
+
+    /* Frames written from each interface (indexed by capture interface
+     * ID). Counted by the writer thread, so producers don't have to */
+    uint64_t *iface_written;
+};
+
+
+/* Milliseconds since an arbitrary point in time (CLOCK_MONOTONIC) */
+static uint64_t chirouter_pcap_now_ms()
+{
     struct timespec spec;
 
-    clock_gettime(CLOCK_REALTIME, &spec);
-    ns = (uint64_t) spec.tv_sec * BILLION + (uint64_t) spec.tv_nsec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
 
-    hdr.block_type = BLOCK_TYPE_EPB;
-    hdr.interface_id = iface->pcap_iface_id;
-    hdr.timestamp_high = ns >> 32;
-    hdr.timestamp_low = ns & 0x00000000FFFFFFFF;
-    hdr.captured_plen = len;
-    hdr.original_plen = len;
+    return (uint64_t) spec.tv_sec * 1000 + spec.tv_nsec / 1000000;
+}
 
-    hdr.block_total_length = sizeof(hdr);
-    hdr.block_total_length += len;
-    hdr.block_total_length += OPTION_HDR_LEN + PADDED_LEN(4); /* Flags */
-    hdr.block_total_length += OPTION_HDR_LEN; /* End of options */
-    hdr.block_total_length += 4; /* Trailing length */
 
-    if (fwrite((char *)&hdr, sizeof(hdr), 1, ctx->server->pcap) != 1)
-        return EXIT_FAILURE;
+/*
+ * chirouter_pcap_file_name - Produces the name of a capture file
+ *
+ * When the capture is rotated, the files are numbered by inserting
+ * the file number before the extension of the capture file name
+ * (e.g., "capture.pcapng" becomes "capture-000002.pcapng")
+ *
+ * ctx: Server context
+ *
+ * seq: File number
+ *
+ * buf: Buffer where the name will be written
+ *
+ * size: Size of the buffer
+ *
+ * Returns: 0 on success, -1 if the name does not fit in the buffer.
+ *
+ */
+static int chirouter_pcap_file_name(server_ctx_t *ctx, uint32_t seq, char *buf, size_t size)
+{
+    const char *base = ctx->pcap_file;
+    int n;
+
+    if(ctx->pcap_rotate_bytes == 0 && ctx->pcap_rotate_secs == 0)
+        n = snprintf(buf, size, "%s", base);
+    else
+    {
+        const char *slash = strrchr(base, '/');
+        const char *dot = strrchr(base, '.');
 
-    uint32_t pad_length;
-    uint32_t pad = 0;
+        if(dot == NULL || dot == base || (slash && dot < slash + 2))
+            dot = base + strlen(base);
+
+        n = snprintf(buf, size, "%.*s-%06" PRIu32 "%s", (int) (dot - base), base, seq, dot);
+    }
 
-    pad_length = PAD_LEN(len);
+    return (n < 0 || (size_t) n >= size) ? -1 : 0;
+}
 
-    assert(pad_length >= 0 && pad_length <= 3);
 
-    if (fwrite(msg, 1, len, ctx->server->pcap) != len)
-        return EXIT_FAILURE;
+/* See pcap.h */
+int chirouter_pcap_open(server_ctx_t *ctx)
+{
+    char path[PATH_MAX];
 
-    /* Write padding */
-    if(pad_length > 0)
+    ctx->pcap_file_seq = 0;
+
+    if(chirouter_pcap_file_name(ctx, ctx->pcap_file_seq, path, sizeof(path)))
     {
-        if (fwrite((char *)&pad, 1, pad_length, ctx->server->pcap) != pad_length)
-            return EXIT_FAILURE;
+        errno = ENAMETOOLONG;
+        return -1;
     }
 
-    /* Compute flags */
+    ctx->pcap = fopen(path, "w");
+
+    return ctx->pcap ? 0 : -1;
+}
+
+
+/*
+ * chirouter_pcap_build_epb - Serializes an Enhanced Packet Block
+ *
+ * buf: Buffer, with room for EPB_MAX_LEN bytes
+ *
+ * rec: Captured frame
+ *
+ * Returns: Length of the block.
+ *
+ */
+static size_t chirouter_pcap_build_epb(uint8_t *buf, chirouter_pcap_record_t *rec)
+{
+    struct pcapng_epb hdr;
+    uint64_t ns = rec->timestamp;
     uint32_t flags;
+    size_t len;
 
-    switch(dir)
+    switch(rec->dir)
     {
-    case PCAP_UNSPECIFIED:
-        flags = 0;
-        break;
     case PCAP_INBOUND:
         flags = 1;
         break;
     case PCAP_OUTBOUND:
         flags = 2;
         break;
+    default:
+        flags = 0;
+        break;
     }
 
-    if(chirouter_pcap_write_option(ctx->server, OPCODE_EPB_FLAGS, 4, (uint8_t*) &flags))
-        return EXIT_FAILURE;
+    len = sizeof(hdr);
+    memcpy(buf + len, rec->frame, rec->len);
+    memset(buf + len + rec->len, 0, PAD_LEN(rec->len));
+    len += PADDED_LEN(rec->len);
+    len += chirouter_pcap_put_option(buf + len, OPCODE_EPB_FLAGS, 4, &flags);
+    len += chirouter_pcap_put_option(buf + len, OPCODE_END, 0, NULL);
+    len += 4; /* Trailing length */
 
-    if(chirouter_pcap_write_option(ctx->server, OPCODE_END, 0, NULL))
-        return EXIT_FAILURE;
+    hdr.block_type = BLOCK_TYPE_EPB;
+    hdr.block_total_length = len;
+    hdr.interface_id = rec->pcap_iface_id;
+    hdr.timestamp_high = ns >> 32;
+    hdr.timestamp_low = ns & 0x00000000FFFFFFFF;
+    hdr.captured_plen = rec->len;
+    hdr.original_plen = rec->orig_len;
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + len - 4, &hdr.block_total_length, 4);
 
-    if (fwrite((char *)&hdr.block_total_length, sizeof(hdr.block_total_length), 1, ctx->server->pcap) != 1)
-        return EXIT_FAILURE;
+    return len;
+}
 
-    return EXIT_SUCCESS;
+
+/*
+ * chirouter_pcap_writer_flush - Writes the blocks in the writer's buffer to the capture file
+ *
+ * ctx: Server context
+ *
+ * writer: Capture writer
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+static int chirouter_pcap_writer_flush(server_ctx_t *ctx, struct chirouter_pcap_writer *writer)
+{
+    int fd = fileno(ctx->pcap);
+    size_t off = 0;
+    int rc = 0;
+
+    while(off < writer->out_len)
+    {
+        ssize_t n = write(fd, writer->out + off, writer->out_len - off);
+
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            chilog(ERROR, "Could not write to capture file: %s", strerror(errno));
+            rc = -1;
+            break;
+        }
+
+        off += n;
+    }
+
+    writer->file_bytes += off;
+    writer->out_len = 0;
+
+    return rc;
+}
+
+
+/*
+ * chirouter_pcap_build_isb - Serializes an Interface Statistics Block
+ *
+ * The counters map to the ISB options as follows: isb_ifrecv is the
+ * number of frames received on the interface, isb_ifdrop the number of
+ * those that the router dropped, isb_usrdeliv the number of frames
+ * (received or sent) written to the capture file, isb_osdrop the number
+ * of frames that passed the capture filter and sampling but were dropped
+ * by the capture path, and isb_filteraccept the sum of the last two.
+ * There is no option for sent frames, so they are recorded in a comment.
+ *
+ * buf: Buffer, with room for ISB_MAX_LEN bytes
+ *
+ * iface: Interface
+ *
+ * written: Frames from this interface written to the capture file
+ *
+ * start_ns: Start of the capture (nanoseconds since the epoch)
+ *
+ * now_ns: Current time (nanoseconds since the epoch)
+ *
+ * Returns: Length of the block.
+ *
+ */
+static size_t chirouter_pcap_build_isb(uint8_t *buf, chirouter_interface_t *iface, uint64_t written,
+                                       uint64_t start_ns, uint64_t now_ns)
+{
+    struct pcapng_isb hdr;
+    chirouter_interface_stats_t *stats = &iface->stats;
+    uint64_t rx = atomic_load_explicit(&stats->rx_frames, memory_order_relaxed);
+    uint64_t tx = atomic_load_explicit(&stats->tx_frames, memory_order_relaxed);
+    uint64_t router_drops = atomic_load_explicit(&stats->router_drops, memory_order_relaxed);
+    uint64_t pcap_drops = atomic_load_explicit(&stats->pcap_drops, memory_order_relaxed);
+    uint64_t accepted = written + pcap_drops;
+    uint32_t start[2] = { start_ns >> 32, start_ns & 0x00000000FFFFFFFF };
+    uint32_t end[2] = { now_ns >> 32, now_ns & 0x00000000FFFFFFFF };
+    char comment[SENT_COMMENT_MAX_LEN];
+    int n;
+    size_t len;
+
+    n = snprintf(comment, sizeof(comment), "ifsent=%" PRIu64, tx);
+
+    len = sizeof(hdr);
+    len += chirouter_pcap_put_option(buf + len, OPCODE_ISB_STARTTIME, 8, start);
+    len += chirouter_pcap_put_option(buf + len, OPCODE_ISB_ENDTIME, 8, end);
+    len += chirouter_pcap_put_option(buf + len, OPCODE_ISB_IFRECV, 8, &rx);
+    len += chirouter_pcap_put_option(buf + len, OPCODE_ISB_IFDROP, 8, &router_drops);
+    len += chirouter_pcap_put_option(buf + len, OPCODE_ISB_FILTERACCEPT, 8, &accepted);
+    len += chirouter_pcap_put_option(buf + len, OPCODE_ISB_OSDROP, 8, &pcap_drops);
+    len += chirouter_pcap_put_option(buf + len, OPCODE_ISB_USRDELIV, 8, &written);
+    len += chirouter_pcap_put_option(buf + len, OPCODE_COMMENT, min(n, SENT_COMMENT_MAX_LEN - 1), comment);
+    len += chirouter_pcap_put_option(buf + len, OPCODE_END, 0, NULL);
+    len += 4; /* Trailing length */
+
+    hdr.block_type = BLOCK_TYPE_ISB;
+    hdr.block_total_length = len;
+    hdr.interface_id = iface->pcap_iface_id;
+    hdr.timestamp_high = end[0];
+    hdr.timestamp_low = end[1];
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + len - 4, &hdr.block_total_length, 4);
+
+    return len;
+}
+
+
+/*
+ * chirouter_pcap_writer_stats - Writes Interface Statistics Blocks for all the interfaces
+ *
+ * Note: The writer's buffer must have been flushed.
+ *
+ * ctx: Server context
+ *
+ * writer: Capture writer
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+static int chirouter_pcap_writer_stats(server_ctx_t *ctx, struct chirouter_pcap_writer *writer)
+{
+    uint64_t now_ns = chirouter_clock_now_ns();
+
+    for(int i=0; i < ctx->num_routers; i++)
+    {
+        chirouter_ctx_t *r = &ctx->routers[i];
+
+        for(int j=0; j < r->num_interfaces; j++)
+        {
+            if(writer->out_len + ISB_MAX_LEN > PCAP_WRITE_BUFFER_SIZE)
+                chirouter_pcap_writer_flush(ctx, writer);
+            chirouter_interface_t *iface = &r->interfaces[j];
+
+            writer->out_len += chirouter_pcap_build_isb(writer->out + writer->out_len, iface,
+                                                        writer->iface_written[iface->pcap_iface_id],
+                                                        writer->start_ns, now_ns);
+        }
+    }
+
+    writer->stats_deadline_ms = chirouter_pcap_now_ms() + PCAP_STATS_INTERVAL_MS;
+
+    return chirouter_pcap_writer_flush(ctx, writer);
+}
+
+
+/*
+ * chirouter_pcap_rotate - Rotates the capture file if it has reached its limits
+ *
+ * The next capture file is opened (with its own section header and
+ * interface description blocks) before closing the current one (which
+ * gets final interface statistics blocks), and files older than the last
+ * pcap_rotate_keep files are removed. If the next file cannot be opened,
+ * capture continues in the current file.
+ *
+ * Note: The writer's buffer must have been flushed.
+ *
+ * ctx: Server context
+ *
+ * writer: Capture writer
+ *
+ * Returns: 0 on success (or if no rotation was needed), -1 if an error happens.
+ *
+ */
+static int chirouter_pcap_rotate(server_ctx_t *ctx, struct chirouter_pcap_writer *writer)
+{
+    char path[PATH_MAX];
+    uint64_t now = 0;
+
+    if(ctx->pcap_rotate_bytes == 0 && ctx->pcap_rotate_secs == 0)
+        return 0;
+
+    if(ctx->pcap_rotate_secs)
+        now = chirouter_pcap_now_ms();
+
+    if(!(ctx->pcap_rotate_bytes && writer->file_bytes + EPB_MAX_LEN + writer->stats_reserve > ctx->pcap_rotate_bytes) &&
+       !(ctx->pcap_rotate_secs && now >= writer->file_deadline_ms))
+        return 0;
+
+    /* Whether or not the rotation succeeds, the limits start
+     * over, so that a failure is not retried on every write */
+    writer->file_bytes = 0;
+    writer->file_deadline_ms = now + (uint64_t) ctx->pcap_rotate_secs * 1000;
+
+    uint32_t seq = ctx->pcap_file_seq + 1;
+    FILE *f;
+
+    if(chirouter_pcap_file_name(ctx, seq, path, sizeof(path)) || (f = fopen(path, "w")) == NULL)
+    {
+        chilog(ERROR, "Could not open capture file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    chirouter_pcap_writer_stats(ctx, writer);
+    fclose(ctx->pcap);
+    ctx->pcap = f;
+    ctx->pcap_file_seq = seq;
+
+    if(chirouter_pcap_write_section_header(ctx) || chirouter_pcap_write_interfaces(ctx) || fflush(ctx->pcap))
+        chilog(ERROR, "Could not write capture file headers to %s", path);
+    writer->file_bytes = ftell(ctx->pcap);
+
+    chilog(DEBUG, "Rotated capture file to %s", path);
+
+    if(ctx->pcap_rotate_keep && seq >= ctx->pcap_rotate_keep)
+    {
+        if(chirouter_pcap_file_name(ctx, seq - ctx->pcap_rotate_keep, path, sizeof(path)) == 0 &&
+           unlink(path) != 0 && errno != ENOENT)
+            chilog(WARNING, "Could not remove old capture file %s: %s", path, strerror(errno));
+    }
+
+    return 0;
 }
 
 
+/*
+ * chirouter_pcap_writer_tick - Writes interface statistics and rotates the capture file, if due
+ *
+ * Note: The writer's buffer must have been flushed.
+ *
+ * ctx: Server context
+ *
+ * writer: Capture writer
+ *
+ * Returns: nothing.
+ *
+ */
+static void chirouter_pcap_writer_tick(server_ctx_t *ctx, struct chirouter_pcap_writer *writer)
+{
+    if(chirouter_pcap_now_ms() >= writer->stats_deadline_ms)
+        chirouter_pcap_writer_stats(ctx, writer);
+
+    chirouter_pcap_rotate(ctx, writer);
+}
+
+
+/*
+ * chirouter_pcap_writer_sleep - Waits until the writer is woken up
+ *
+ * The writer is also woken up when the next interface statistics
+ * blocks are due, and (if the capture is rotated by time) when the
+ * current capture file has to be rotated.
+ *
+ * ctx: Server context
+ *
+ * writer: Capture writer
+ *
+ * Returns: nothing.
+ *
+ */
+static void chirouter_pcap_writer_sleep(server_ctx_t *ctx, struct chirouter_pcap_writer *writer)
+{
+    uint64_t now = chirouter_pcap_now_ms();
+    uint64_t wake = writer->stats_deadline_ms;
+    struct timespec deadline;
+
+    if(ctx->pcap_rotate_secs && writer->file_deadline_ms < wake)
+        wake = writer->file_deadline_ms;
+
+    uint64_t wait_ms = wake > now ? wake - now : 0;
+
+    /* sem_timedwait takes a CLOCK_REALTIME deadline */
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wait_ms / 1000;
+    deadline.tv_nsec += (wait_ms % 1000) * 1000000;
+    if(deadline.tv_nsec >= BILLION)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= BILLION;
+    }
+
+    while(sem_timedwait(&writer->pending, &deadline) != 0 && errno == EINTR);
+}
+
+
+/*
+ * chirouter_pcap_sample - Decides whether a frame is picked by an interface's sampling
+ *
+ * iface: Interface the frame was sent/received on
+ *
+ * Returns: true if the frame must be captured, false otherwise.
+ *
+ */
+static bool chirouter_pcap_sample(chirouter_interface_t *iface)
+{
+    /* Each thread has its own random number generator (xorshift64*),
+     * seeded the first time the thread samples a frame */
+    static _Thread_local uint64_t state = 0;
+    chirouter_pcap_sampling_t *sampling = &iface->pcap_sampling;
+
+    if(sampling->every > 1)
+        return atomic_fetch_add_explicit(&iface->pcap_sample_count, 1, memory_order_relaxed) % sampling->every == 0;
+
+    if(sampling->prob > 0)
+    {
+        if(state == 0)
+        {
+            struct timespec spec;
+            clock_gettime(CLOCK_MONOTONIC, &spec);
+            state = ((uint64_t) spec.tv_nsec << 32) ^ (uint64_t) spec.tv_sec ^ (uintptr_t) &state;
+            state = state ? state : 1;
+        }
+
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+
+        /* Uniform double in [0, 1) from the top 53 bits */
+        return ((state * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53 < sampling->prob;
+    }
+
+    return true;
+}
+
+
+/* See pcap.h */
+int chirouter_pcap_add_sampling(server_ctx_t *ctx, const char *spec)
+{
+    chirouter_pcap_sampling_t sampling = {0, 0};
+    const char *rate = spec, *colon = strrchr(spec, ':');
+    char *end;
+
+    if(colon)
+    {
+        if(colon == spec || (size_t) (colon - spec) >= sizeof(((chirouter_pcap_sampling_rule_t *) 0)->name))
+            return -1;
+        rate = colon + 1;
+    }
+
+    if(!strncmp(rate, "1/", 2))
+    {
+        unsigned long every;
+
+        if(rate[2] == '-')
+            return -1;
+        errno = 0;
+        every = strtoul(rate + 2, &end, 10);
+        if(errno || *end != '\0' || end == rate + 2 || every < 1 || every > UINT32_MAX)
+            return -1;
+        sampling.every = every;
+    }
+    else
+    {
+        sampling.prob = strtod(rate, &end);
+        if(*end != '\0' || end == rate || !(sampling.prob > 0 && sampling.prob <= 1))
+            return -1;
+
+        /* Sampling with probability 1 is just capturing everything */
+        if(sampling.prob == 1)
+            sampling.prob = 0;
+    }
+
+    if(colon == NULL)
+    {
+        ctx->pcap_sampling = sampling;
+        return 0;
+    }
+
+    chirouter_pcap_sampling_rule_t *rules = realloc(ctx->pcap_sampling_rules,
+                                                    (ctx->num_pcap_sampling_rules + 1) * sizeof(chirouter_pcap_sampling_rule_t));
+    if(rules == NULL)
+        return -1;
+
+    chirouter_pcap_sampling_rule_t *rule = &rules[ctx->num_pcap_sampling_rules];
+    memset(rule, 0, sizeof(chirouter_pcap_sampling_rule_t));
+    memcpy(rule->name, spec, colon - spec);
+    rule->sampling = sampling;
+
+    ctx->pcap_sampling_rules = rules;
+    ctx->num_pcap_sampling_rules++;
+
+    return 0;
+}
+
+
+/* See pcap.h */
+int chirouter_pcap_write_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *msg, size_t len, pcap_packet_direction_t dir)
+{
+    struct chirouter_pcap_writer *writer = ctx->server->pcap_writer;
+    uint64_t timestamp;
+    size_t caplen = len;
+
+    if(writer == NULL)
+        return 0;
+
+    if(ctx->server->pcap_filter && !chirouter_capfilter_match(ctx->server->pcap_filter, ctx, iface, dir, msg, len))
+        return 0;
+
+    if(!chirouter_pcap_sample(iface))
+        return 0;
+
+
+    if(caplen > ETHER_FRAME_MAX_LEN)
+        caplen = ETHER_FRAME_MAX_LEN;
+    if(ctx->server->pcap_snaplen && caplen > ctx->server->pcap_snaplen)
+        caplen = ctx->server->pcap_snaplen;
+
+    timestamp = chirouter_clock_now_ns();
+
+    /* Claim a slot. Frames can be captured from several threads (the
+     * I/O thread, the worker threads, and the ARP thread) */
+    uint64_t pos = atomic_load_explicit(&writer->enqueue_pos, memory_order_relaxed);
+    chirouter_pcap_record_t *rec;
+
+    while(1)
+    {
+        rec = &writer->ring[pos & (PCAP_RING_SIZE - 1)];
+        uint64_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+
+        if(seq == pos)
+        {
+            if(atomic_compare_exchange_weak_explicit(&writer->enqueue_pos, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if(seq < pos)
+        {
+            /* The writer has not written the frame in this slot yet,
+             * so the ring is full */
+            atomic_fetch_add_explicit(&writer->drops, 1, memory_order_relaxed);
+            chirouter_iface_count(iface, pcap_drops);
+            return -1;
+        }
+        else
+            pos = atomic_load_explicit(&writer->enqueue_pos, memory_order_relaxed);
+    }
+
+    rec->timestamp = timestamp;
+    rec->pcap_iface_id = iface->pcap_iface_id;
+    rec->len = caplen;
+    rec->orig_len = len > UINT16_MAX ? UINT16_MAX : len;
+    rec->dir = dir;
+    memcpy(rec->frame, msg, caplen);
+    atomic_store(&rec->seq, pos + 1);
+
+    /* Waking up the writer is only needed (and only costs
+     * a system call) when the writer is sleeping */
+    if(atomic_load(&writer->sleeping) && atomic_exchange(&writer->sleeping, false))
+        sem_post(&writer->pending);
+
+    return 0;
+}
+
+
+/*
+ * chirouter_pcap_writer_run - Capture writer thread function
+ *
+ * Writes the frames in the ring to the capture file until it is
+ * asked to stop (and the ring has been drained).
+ *
+ * args: Server context
+ *
+ * Returns: NULL
+ *
+ */
+static void* chirouter_pcap_writer_run(void *args)
+{
+    server_ctx_t *ctx = (server_ctx_t *) args;
+    struct chirouter_pcap_writer *writer = ctx->pcap_writer;
+
+    while(1)
+    {
+        uint64_t pos = writer->dequeue_pos;
+        chirouter_pcap_record_t *rec = &writer->ring[pos & (PCAP_RING_SIZE - 1)];
+
+        if(atomic_load_explicit(&rec->seq, memory_order_acquire) == pos + 1)
+        {
+            writer->out_len += chirouter_pcap_build_epb(writer->out + writer->out_len, rec);
+            writer->iface_written[rec->pcap_iface_id]++;
+            writer->written++;
+
+            atomic_store_explicit(&rec->seq, pos + PCAP_RING_SIZE, memory_order_release);
+            writer->dequeue_pos = pos + 1;
+
+            /* Write the buffer when it is full, or when the next block
+             * might not fit in the current capture file */
+            if(writer->out_len + EPB_MAX_LEN > PCAP_WRITE_BUFFER_SIZE ||
+               (ctx->pcap_rotate_bytes &&
+                writer->file_bytes + writer->out_len + EPB_MAX_LEN + writer->stats_reserve > ctx->pcap_rotate_bytes))
+            {
+                chirouter_pcap_writer_flush(ctx, writer);
+                chirouter_pcap_writer_tick(ctx, writer);
+            }
+            continue;
+        }
+
+        /* The ring is drained (or the next frame is still being
+         * copied), so this is a good time to write the buffer, and
+         * the file is up to date while there is no traffic */
+        chirouter_pcap_writer_flush(ctx, writer);
+        chirouter_pcap_writer_tick(ctx, writer);
+
+        /* Every capture file ends with the final statistics */
+        if(atomic_load(&writer->stop) && pos == atomic_load(&writer->enqueue_pos))
+        {
+            chirouter_pcap_writer_stats(ctx, writer);
+            break;
+        }
+
+        /* Producers only post to the semaphore when we're sleeping, so we
+         * must check the slot again after announcing that we will sleep */
+        atomic_store(&writer->sleeping, true);
+        if(atomic_load(&rec->seq) == pos + 1 || atomic_load(&writer->stop))
+        {
+            atomic_store(&writer->sleeping, false);
+            continue;
+        }
+
+        chirouter_pcap_writer_sleep(ctx, writer);
+        atomic_store(&writer->sleeping, false);
+    }
+
+    return NULL;
+}
+
+
+/* See pcap.h */
+int chirouter_pcap_start(server_ctx_t *ctx)
+{
+    struct chirouter_pcap_writer *writer = calloc(1, sizeof(struct chirouter_pcap_writer));
+    if(writer == NULL)
+        return -1;
+
+    writer->ring = calloc(PCAP_RING_SIZE, sizeof(chirouter_pcap_record_t));
+    if(writer->ring == NULL)
+    {
+        free(writer);
+        return -1;
+    }
+
+    /* The buffer is page-aligned, so large writes
+     * can be copied to the page cache efficiently */
+    if(posix_memalign((void **) &writer->out, 4096, PCAP_WRITE_BUFFER_SIZE) != 0)
+    {
+        free(writer->ring);
+        free(writer);
+        return -1;
+    }
+    writer->out_len = 0;
+
+    for(uint64_t i = 0; i < PCAP_RING_SIZE; i++)
+        atomic_init(&writer->ring[i].seq, i);
+    atomic_init(&writer->enqueue_pos, 0);
+    writer->dequeue_pos = 0;
+    atomic_init(&writer->stop, false);
+    atomic_init(&writer->sleeping, false);
+    atomic_init(&writer->drops, 0);
+    sem_init(&writer->pending, 0, 0);
+
+    /* Assign capture interface IDs, and set up the sampling on each
+     * interface (if an interface matches several sampling rules,
+     * the last one wins, as with any other repeated option) */
+    uint32_t interface_id = 0;
+    bool rule_used[ctx->num_pcap_sampling_rules + 1];
+    memset(rule_used, 0, sizeof(rule_used));
+
+    for(int i=0; i < ctx->num_routers; i++)
+    {
+        chirouter_ctx_t *r = &ctx->routers[i];
+
+        for(int j=0; j < r->num_interfaces; j++)
+        {
+            chirouter_interface_t *iface = &r->interfaces[j];
+            char name[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2];
+
+            iface->pcap_iface_id = interface_id++;
+            iface->pcap_sampling = ctx->pcap_sampling;
+            atomic_store(&iface->pcap_sample_count, 0);
+
+            snprintf(name, sizeof(name), "%s-%s", r->name, iface->name);
+            for(unsigned int k = 0; k < ctx->num_pcap_sampling_rules; k++)
+                if(!strcmp(ctx->pcap_sampling_rules[k].name, name))
+                {
+                    iface->pcap_sampling = ctx->pcap_sampling_rules[k].sampling;
+                    rule_used[k] = true;
+                }
+        }
+    }
+
+    for(unsigned int k = 0; k < ctx->num_pcap_sampling_rules; k++)
+        if(!rule_used[k])
+            chilog(WARNING, "Capture sampling: there is no interface named %s", ctx->pcap_sampling_rules[k].name);
+
+    /* The headers are written through ctx->pcap, but the writer
+     * thread writes directly to the file, so they must be flushed */
+    if(chirouter_pcap_write_section_header(ctx) || chirouter_pcap_write_interfaces(ctx) || fflush(ctx->pcap))
+        chilog(ERROR, "Could not write capture file headers");
+    writer->file_bytes = ftell(ctx->pcap);
+    writer->file_deadline_ms = chirouter_pcap_now_ms() + (uint64_t) ctx->pcap_rotate_secs * 1000;
+    writer->start_ns = chirouter_clock_now_ns();
+    writer->stats_deadline_ms = chirouter_pcap_now_ms() + PCAP_STATS_INTERVAL_MS;
+    writer->stats_reserve = (uint64_t) interface_id * ISB_MAX_LEN;
+
+    writer->iface_written = calloc(interface_id ? interface_id : 1, sizeof(uint64_t));
+    if(writer->iface_written == NULL)
+    {
+        sem_destroy(&writer->pending);
+        free(writer->out);
+        free(writer->ring);
+        free(writer);
+        return -1;
+    }
+
+    ctx->pcap_writer = writer;
+
+    if(pthread_create(&writer->thread, NULL, chirouter_pcap_writer_run, ctx) != 0)
+    {
+        ctx->pcap_writer = NULL;
+        sem_destroy(&writer->pending);
+        free(writer->iface_written);
+        free(writer->out);
+        free(writer->ring);
+        free(writer);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* See pcap.h */
+int chirouter_pcap_stop(server_ctx_t *ctx)
+{
+    struct chirouter_pcap_writer *writer = ctx->pcap_writer;
+
+    if(writer == NULL || atomic_exchange(&writer->stop, true))
+        return 0;
+
+    sem_post(&writer->pending);
+
+    if(pthread_join(writer->thread, NULL) != 0)
+        return -1;
+
+    return 0;
+}
+
+
+/* See pcap.h */
+void chirouter_pcap_free(server_ctx_t *ctx)
+{
+    struct chirouter_pcap_writer *writer = ctx->pcap_writer;
+
+    if(writer == NULL)
+        return;
+
+    ctx->pcap_writer = NULL;
+
+    chilog(INFO, "Capture: %" PRIu64 " frames written, %" PRIu64 " frames dropped (capture ring full)",
+                 writer->written, atomic_load(&writer->drops));
+
+    sem_destroy(&writer->pending);
+    free(writer->iface_written);
+    free(writer->out);
+    free(writer->ring);
+    free(writer);
+}
+
+
+/*
+ * chirouter_pcap_next_option - Parses a pcapng option
+ *
+ * opt: Option (updated to point to the next option)
+ *
+ * end: End of the block's options
+ *
+ * code, len: Out parameters. Option code and length.
+ *
+ * Returns: Pointer to the option's value, or NULL if there
+ *          are no more options (or the option is not valid).
+ *
+ */
+static const uint8_t* chirouter_pcap_next_option(const uint8_t **opt, const uint8_t *end, uint16_t *code, uint16_t *len)
+{
+    struct pcapng_option hdr;
+    const uint8_t *value;
+
+    if(end - *opt < OPTION_HDR_LEN)
+        return NULL;
+
+    memcpy(&hdr, *opt, sizeof(hdr));
+    value = *opt + OPTION_HDR_LEN;
+
+    if(hdr.option_code == OPCODE_END || end - value < PADDED_LEN(hdr.option_length))
+        return NULL;
+
+    *code = hdr.option_code;
+    *len = hdr.option_length;
+    *opt = value + PADDED_LEN(hdr.option_length);
+
+    return value;
+}
+
+
+/*
+ * chirouter_pcap_ts_to_ns - Converts a pcapng timestamp into nanoseconds
+ *
+ * ts: Timestamp
+ *
+ * tsresol: Resolution of the timestamp (if_tsresol)
+ *
+ * Returns: Nanoseconds.
+ *
+ */
+static uint64_t chirouter_pcap_ts_to_ns(uint64_t ts, uint8_t tsresol)
+{
+    /* Negative powers of two */
+    if(tsresol & 0x80)
+        return (uint64_t) (((unsigned __int128) ts * 1000000000u) >> (tsresol & 0x7f));
+
+    /* Negative powers of ten */
+    for(int i = tsresol; i < 9; i++)
+        ts *= 10;
+    for(int i = 9; i < tsresol; i++)
+        ts /= 10;
+
+    return ts;
+}
+
+
+/*
+ * chirouter_pcap_read_idb - Parses an Interface Description Block
+ *
+ * file: Capture file
+ *
+ * body: Block body (after the block type and length)
+ *
+ * body_len: Length of the body (without the trailing length)
+ *
+ * Returns: 0 on success, -1 if the block is not valid or not supported.
+ *
+ */
+static int chirouter_pcap_read_idb(chirouter_pcap_file_t *file, const uint8_t *body, size_t body_len)
+{
+    const uint8_t *opt, *end = body + body_len, *value;
+    uint16_t link_type, code, len;
+    chirouter_pcap_file_iface_t *ifaces, *iface;
+
+    if(body_len < sizeof(struct pcapng_idb) - 8)
+        return -1;
+
+    memcpy(&link_type, body, sizeof(link_type));
+    if(link_type != LINKTYPE_ETHERNET)
+        return -1;
+
+    ifaces = realloc(file->ifaces, (file->num_ifaces + 1) * sizeof(chirouter_pcap_file_iface_t));
+    if(ifaces == NULL)
+        return -1;
+    file->ifaces = ifaces;
+
+    iface = &file->ifaces[file->num_ifaces++];
+    memset(iface, 0, sizeof(*iface));
+    iface->tsresol = 6;
+
+    opt = body + sizeof(struct pcapng_idb) - 8;
+    while((value = chirouter_pcap_next_option(&opt, end, &code, &len)) != NULL)
+    {
+        if(code == OPCODE_IF_NAME)
+        {
+            len = min(len, sizeof(iface->name) - 1);
+            memcpy(iface->name, value, len);
+            iface->name[len] = '\0';
+        }
+        else if(code == OPCODE_IF_MACADDR && len == ETHER_ADDR_LEN)
+        {
+            memcpy(iface->mac, value, ETHER_ADDR_LEN);
+            iface->has_mac = true;
+        }
+        else if(code == OPCODE_IF_TSRESOL && len == 1)
+        {
+            iface->tsresol = value[0];
+            if((iface->tsresol & 0x80) && (iface->tsresol & 0x7f) > 64)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * chirouter_pcap_read_epb - Parses an Enhanced Packet Block
+ *
+ * file: Capture file
+ *
+ * body: Block body (after the block type and length)
+ *
+ * body_len: Length of the body (without the trailing length)
+ *
+ * section_iface: Index of the first interface of the block's section
+ *
+ * max_frames: Number of frames allocated in file->frames (updated
+ *             if the array is enlarged)
+ *
+ * Returns: 0 on success, -1 if the block is not valid.
+ *
+ */
+static int chirouter_pcap_read_epb(chirouter_pcap_file_t *file, uint8_t *body, size_t body_len,
+                                   uint32_t section_iface, uint64_t *max_frames)
+{
+    struct pcapng_epb hdr;
+    const uint8_t *opt, *end = body + body_len, *value;
+    uint16_t code, len;
+    chirouter_pcap_file_frame_t *frame;
+
+    if(body_len < sizeof(hdr) - 8)
+        return -1;
+
+    memcpy((uint8_t *) &hdr + 8, body, sizeof(hdr) - 8);
+
+    if(hdr.interface_id >= file->num_ifaces - section_iface || hdr.captured_plen > body_len - (sizeof(hdr) - 8))
+        return -1;
+
+    if(file->num_frames == *max_frames)
+    {
+        uint64_t n = *max_frames ? *max_frames * 2 : 1024;
+        chirouter_pcap_file_frame_t *frames = realloc(file->frames, n * sizeof(chirouter_pcap_file_frame_t));
+
+        if(frames == NULL)
+            return -1;
+
+        file->frames = frames;
+        *max_frames = n;
+    }
+
+    frame = &file->frames[file->num_frames++];
+    frame->iface = section_iface + hdr.interface_id;
+    frame->dir = PCAP_UNSPECIFIED;
+    frame->ts_ns = chirouter_pcap_ts_to_ns(((uint64_t) hdr.timestamp_high << 32) | hdr.timestamp_low,
+                                           file->ifaces[frame->iface].tsresol);
+    frame->data = body + sizeof(hdr) - 8;
+    frame->caplen = hdr.captured_plen;
+    frame->origlen = hdr.original_plen;
+
+    opt = frame->data + PADDED_LEN(hdr.captured_plen);
+    while((value = chirouter_pcap_next_option(&opt, end, &code, &len)) != NULL)
+    {
+        if(code == OPCODE_EPB_FLAGS && len == 4)
+        {
+            uint32_t flags;
+            memcpy(&flags, value, sizeof(flags));
+            frame->dir = flags & 0x3;
+        }
+    }
+
+    return 0;
+}
+
+
+/* See pcap.h */
+int chirouter_pcap_read(const char *filename, chirouter_pcap_file_t *file, char *errbuf, size_t errlen)
+{
+    FILE *f;
+    long size;
+    size_t off = 0;
+    uint32_t section_iface = 0;
+    uint64_t max_frames = 0;
+
+    memset(file, 0, sizeof(*file));
+
+    f = fopen(filename, "rb");
+    if(f == NULL || fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET))
+    {
+        snprintf(errbuf, errlen, "%s: %s", filename, strerror(errno));
+        if(f)
+            fclose(f);
+        return -1;
+    }
+
+    file->size = size;
+    file->buf = malloc(size ? size : 1);
+    if(file->buf == NULL || (size > 0 && fread(file->buf, size, 1, f) != 1))
+    {
+        snprintf(errbuf, errlen, "%s: Could not read the file", filename);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    if(file->size < sizeof(struct pcapng_shb) || *(uint32_t *) file->buf != BLOCK_TYPE_SHB)
+    {
+        snprintf(errbuf, errlen, "%s: Not a pcapng file", filename);
+        return -1;
+    }
+
+    while(off < file->size)
+    {
+        uint8_t *block = file->buf + off;
+        uint32_t block_type, block_len, magic;
+
+        if(file->size - off < 12)
+        {
+            snprintf(errbuf, errlen, "%s: Truncated block at offset %zu", filename, off);
+            return -1;
+        }
+
+        memcpy(&block_type, block, 4);
+        memcpy(&block_len, block + 4, 4);
+
+        if(block_type == BLOCK_TYPE_SHB)
+        {
+            memcpy(&magic, block + 8, 4);
+            if(magic != BYTEORDER_MAGIC)
+            {
+                snprintf(errbuf, errlen, "%s: The section at offset %zu is not in this host's byte order", filename, off);
+                return -1;
+            }
+            section_iface = file->num_ifaces;
+        }
+
+        if(block_len < 12 || block_len % 4 != 0 || block_len > file->size - off)
+        {
+            snprintf(errbuf, errlen, "%s: Invalid block length at offset %zu", filename, off);
+            return -1;
+        }
+
+        if(block_type == BLOCK_TYPE_IDB && chirouter_pcap_read_idb(file, block + 8, block_len - 12))
+        {
+            snprintf(errbuf, errlen, "%s: Invalid or unsupported (non-Ethernet) interface at offset %zu", filename, off);
+            return -1;
+        }
+
+        if(block_type == BLOCK_TYPE_EPB && chirouter_pcap_read_epb(file, block + 8, block_len - 12, section_iface, &max_frames))
+        {
+            snprintf(errbuf, errlen, "%s: Invalid frame at offset %zu", filename, off);
+            return -1;
+        }
+
+        off += block_len;
+    }
+
+    return 0;
+}
+
+
+/* See pcap.h */
+void chirouter_pcap_file_free(chirouter_pcap_file_t *file)
+{
+    free(file->buf);
+    free(file->ifaces);
+    free(file->frames);
+    memset(file, 0, sizeof(*file));
+}
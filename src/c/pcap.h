@@ -57,6 +57,32 @@
 #include "server.h"
 #include "chirouter.h"
 
+/* Number of frames that can be waiting to be written
+ * to the capture file (must be a power of two) */
+#define PCAP_RING_SIZE (4096u)
+
+/* Size of the buffer where the capture writer thread serializes
+ * blocks before writing them to the capture file */
+#define PCAP_WRITE_BUFFER_SIZE (256u * 1024)
+
+/* How often Interface Statistics Blocks are written to the capture
+ * file (they are also written when a capture file is closed) */
+#define PCAP_STATS_INTERVAL_MS (10000u)
+
+/* Limits on the rotation of capture files (-C, -G, and -W options) */
+#define PCAP_ROTATE_MAX_MB (1024u * 1024)
+#define PCAP_ROTATE_MAX_SECS (7u * 24 * 3600)
+#define PCAP_ROTATE_MAX_FILES (100000u)
+
+/* Capture sampling on a specific interface */
+typedef struct chirouter_pcap_sampling_rule
+{
+    /* Router and interface name (ROUTER-IFACE, as in the capture file) */
+    char name[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2];
+
+    chirouter_pcap_sampling_t sampling;
+} chirouter_pcap_sampling_rule_t;
+
 /* Packet direction */
 typedef enum
 {
@@ -66,6 +92,42 @@ typedef enum
 } pcap_packet_direction_t;
 
 
+/*
+ * chirouter_pcap_open - Creates the capture file
+ *
+ * Creates the file named ctx->pcap_file (or, if the capture is
+ * rotated, the first of the numbered capture files) and stores it
+ * in ctx->pcap.
+ *
+ * ctx: Server context
+ *
+ * Returns: 0 on success, -1 if the file could not be created (with errno set).
+ *
+ */
+int chirouter_pcap_open(server_ctx_t *ctx);
+
+
+/*
+ * chirouter_pcap_add_sampling - Adds a capture sampling specification
+ *
+ * The specification has the form [ROUTER-IFACE:]RATE, where RATE is
+ * either 1/N (capture one in every N frames) or a probability P between
+ * 0 and 1 (capture each frame with probability P). Without ROUTER-IFACE,
+ * the sampling applies to all the interfaces (except those with their own
+ * specification). Sampling is applied independently on each interface,
+ * after the capture filter, and the rate is recorded as a comment
+ * ("sampling=1/N" or "sampling=P") in the interface's description block.
+ *
+ * ctx: Server context
+ *
+ * spec: Sampling specification
+ *
+ * Returns: 0 on success, -1 if the specification is not valid.
+ *
+ */
+int chirouter_pcap_add_sampling(server_ctx_t *ctx, const char *spec);
+
+
 /*
  * chirouter_pcap_write_section_header - Writes a pcapng section header
  *
@@ -92,7 +154,15 @@ int chirouter_pcap_write_interfaces(server_ctx_t *ctx);
 
 
 /*
- * chirouter_pcap_write_frame - Writes an Ethernet frame to the capture file
+ * chirouter_pcap_write_frame - Captures an Ethernet frame
+ *
+ * The frame is copied (along with a timestamp) into the capture ring,
+ * and written to the capture file by the capture writer thread. If the
+ * ring is full, the frame is not captured (and is counted as dropped).
+ * Frames that do not match the capture filter (if any), or that are not
+ * picked by the interface's sampling, are skipped, and only the first
+ * pcap_snaplen bytes (if set) of the frame are copied.
+ * Can be called concurrently from several threads.
  *
  * ctx: Server context
  *
@@ -104,10 +174,148 @@ int chirouter_pcap_write_interfaces(server_ctx_t *ctx);
  *
  * dir: Direction of the frame (inbound or outbound)
  *
- * Returns: 0 on success, -1 if an error happens.
+ * Returns: 0 on success, -1 if the frame could not be captured.
  *
  */
 int chirouter_pcap_write_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *msg, size_t len, pcap_packet_direction_t dir);
 
 
+
+/*
+ * chirouter_pcap_start - Starts capturing frames
+ *
+ * Writes the section header and the interface description blocks to
+ * the capture file, and starts the capture writer thread. Called at
+ * END_CONFIG, once all the routers have been configured.
+ *
+ * The writer thread also writes Interface Statistics Blocks with the
+ * interfaces' counters every PCAP_STATS_INTERVAL_MS milliseconds, and
+ * when the capture stops.
+ *
+ * If ctx->pcap_rotate_bytes or ctx->pcap_rotate_secs are set, the writer
+ * thread moves on to a new capture file (with its own section header and
+ * interface description blocks) whenever the current one reaches either
+ * limit, and keeps only the last ctx->pcap_rotate_keep files.
+ *
+ * ctx: Server context
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_pcap_start(server_ctx_t *ctx);
+
+
+/*
+ * chirouter_pcap_stop - Stops the capture writer thread
+ *
+ * Waits until the writer thread has written all the frames in the
+ * capture ring, and flushes the capture file. Frames captured after
+ * this function is called are dropped. Can be called more than once.
+ *
+ * ctx: Server context
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_pcap_stop(server_ctx_t *ctx);
+
+
+/*
+ * chirouter_pcap_free - Frees the capture ring
+ *
+ * Note: The writer thread must have been stopped with chirouter_pcap_stop,
+ *       and no other threads can be capturing frames.
+ *
+ * ctx: Server context
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_pcap_free(server_ctx_t *ctx);
+
+
+/* An interface in a capture file (from an Interface Description Block) */
+typedef struct chirouter_pcap_file_iface
+{
+    /* Interface name (ROUTER-IFACE, in the files written by chirouter) */
+    char name[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2];
+
+    /* MAC address, if the block has one */
+    uint8_t mac[ETHER_ADDR_LEN];
+    bool has_mac;
+
+    /* Resolution of the interface's timestamps (if_tsresol) */
+    uint8_t tsresol;
+} chirouter_pcap_file_iface_t;
+
+/* A frame in a capture file (from an Enhanced Packet Block) */
+typedef struct chirouter_pcap_file_frame
+{
+    /* Interface (index into the file's interfaces) */
+    uint32_t iface;
+
+    /* Direction (PCAP_UNSPECIFIED if the block has no flags) */
+    pcap_packet_direction_t dir;
+
+    /* Timestamp, in nanoseconds since the epoch */
+    uint64_t ts_ns;
+
+    /* Captured bytes, and length of the frame (larger than caplen
+     * if the frame was truncated to the snapshot length) */
+    uint8_t *data;
+    uint32_t caplen;
+    uint32_t origlen;
+} chirouter_pcap_file_frame_t;
+
+/* A capture file, read into memory */
+typedef struct chirouter_pcap_file
+{
+    /* Contents of the file (the frames point into it) */
+    uint8_t *buf;
+    size_t size;
+
+    chirouter_pcap_file_iface_t *ifaces;
+    uint32_t num_ifaces;
+
+    chirouter_pcap_file_frame_t *frames;
+    uint64_t num_frames;
+} chirouter_pcap_file_t;
+
+
+/*
+ * chirouter_pcap_read - Reads a capture file
+ *
+ * Reads a pcapng file (such as the ones written by chirouter) into
+ * memory, and indexes its interfaces and frames. Only Ethernet interfaces
+ * and files in the host's byte order are supported. Blocks other than
+ * Interface Description Blocks and Enhanced Packet Blocks are skipped.
+ * The interfaces of all the sections in the file are numbered
+ * consecutively.
+ *
+ * filename: Name of the capture file
+ *
+ * file: Out parameter. The capture file (which must be freed
+ *       with chirouter_pcap_file_free, even if an error happens)
+ *
+ * errbuf: Buffer for an error message
+ *
+ * errlen: Size of errbuf
+ *
+ * Returns: 0 on success, -1 if the file could not be read or is not valid.
+ *
+ */
+int chirouter_pcap_read(const char *filename, chirouter_pcap_file_t *file, char *errbuf, size_t errlen);
+
+
+/*
+ * chirouter_pcap_file_free - Frees a capture file read with chirouter_pcap_read
+ *
+ * file: Capture file
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_pcap_file_free(chirouter_pcap_file_t *file);
+
+
 #endif
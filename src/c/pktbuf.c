@@ -0,0 +1,260 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This module implements the packet buffer pool and the allocation
+ *  of (optionally huge page-backed) packet memory.
+ *
+ *  See pktbuf.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+
+#include "pktbuf.h"
+#include "log.h"
+
+#define ROUND_UP(x, align) ((((x) + (align) - 1) / (align)) * (align))
+
+
+/* See pktbuf.h */
+int chirouter_pktmem_alloc(chirouter_pktmem_t *mem, size_t size, bool hugepages)
+{
+    size_t base_page_size = sysconf(_SC_PAGESIZE);
+    void *addr;
+
+    memset(mem, 0, sizeof(chirouter_pktmem_t));
+
+    if(hugepages)
+    {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_2MB
+        flags |= MAP_HUGE_2MB;
+#endif
+        mem->size = ROUND_UP(size, PKTMEM_HUGEPAGE_SIZE);
+        addr = mmap(NULL, mem->size, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+        if(addr != MAP_FAILED)
+        {
+            mem->addr = addr;
+            mem->page_size = PKTMEM_HUGEPAGE_SIZE;
+            mem->backing = PKTMEM_BACKING_HUGETLB;
+            return 0;
+        }
+
+        chilog(DEBUG, "Could not map %zu bytes of huge pages (%s). Falling back to transparent huge pages.",
+                      mem->size, strerror(errno));
+
+        addr = mmap(NULL, mem->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(addr == MAP_FAILED)
+            return -1;
+
+        mem->addr = addr;
+#ifdef MADV_HUGEPAGE
+        if(madvise(addr, mem->size, MADV_HUGEPAGE) == 0)
+        {
+            mem->page_size = PKTMEM_HUGEPAGE_SIZE;
+            mem->backing = PKTMEM_BACKING_THP;
+            return 0;
+        }
+#endif
+        chilog(DEBUG, "Transparent huge pages are not available. Using regular pages.");
+        mem->page_size = base_page_size;
+        mem->backing = PKTMEM_BACKING_DEFAULT;
+        return 0;
+    }
+
+    mem->size = ROUND_UP(size, base_page_size);
+    addr = mmap(NULL, mem->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(addr == MAP_FAILED)
+        return -1;
+
+    mem->addr = addr;
+    mem->page_size = base_page_size;
+    mem->backing = PKTMEM_BACKING_DEFAULT;
+
+    return 0;
+}
+
+
+/* See pktbuf.h */
+void chirouter_pktmem_free(chirouter_pktmem_t *mem)
+{
+    if(mem->addr)
+        munmap(mem->addr, mem->size);
+
+    mem->addr = NULL;
+    mem->size = 0;
+}
+
+
+/* See pktbuf.h */
+const char* chirouter_pktmem_backing_str(pktmem_backing_t backing)
+{
+    switch(backing)
+    {
+    case PKTMEM_BACKING_HUGETLB:
+        return "huge pages";
+    case PKTMEM_BACKING_THP:
+        return "transparent huge pages";
+    default:
+        return "regular pages";
+    }
+}
+
+
+/* See pktbuf.h */
+int chirouter_pktbuf_pool_init(chirouter_pktbuf_pool_t *pool, uint32_t num_bufs, bool hugepages)
+{
+    if(chirouter_pktmem_alloc(&pool->mem, (size_t) num_bufs * PKTBUF_SLOT_SIZE, hugepages))
+        return -1;
+
+    /* The region may have been rounded up to a page boundary, so
+     * we might as well make all of it available to the pool */
+    pool->num_bufs = pool->mem.size / PKTBUF_SLOT_SIZE;
+    pool->free_stack = calloc(pool->num_bufs, sizeof(uint32_t));
+    if(pool->free_stack == NULL)
+    {
+        chirouter_pktmem_free(&pool->mem);
+        return -1;
+    }
+
+    /* Hand out lower addresses first */
+    for(uint32_t i = 0; i < pool->num_bufs; i++)
+        pool->free_stack[i] = pool->num_bufs - 1 - i;
+    pool->num_free = pool->num_bufs;
+    pool->num_fallback = 0;
+
+    pthread_mutex_init(&pool->lock, NULL);
+
+    return 0;
+}
+
+
+/* See pktbuf.h */
+int chirouter_pktbuf_pool_destroy(chirouter_pktbuf_pool_t *pool)
+{
+    if(pool->num_free != pool->num_bufs)
+        chilog(WARNING, "Destroying packet buffer pool with %u buffers still in use", pool->num_bufs - pool->num_free);
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->free_stack);
+    pool->free_stack = NULL;
+    chirouter_pktmem_free(&pool->mem);
+
+    return 0;
+}
+
+
+/* See pktbuf.h */
+ethernet_frame_t* chirouter_pktbuf_frame_alloc(chirouter_pktbuf_pool_t *pool)
+{
+    uint8_t *buf = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->num_free > 0)
+    {
+        uint32_t idx = pool->free_stack[--pool->num_free];
+        buf = pool->mem.addr + (size_t) idx * PKTBUF_SLOT_SIZE;
+    }
+    else
+    {
+        pool->num_fallback++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if(buf == NULL)
+    {
+        buf = calloc(1, PKTBUF_SLOT_SIZE);
+        if(buf == NULL)
+            return NULL;
+    }
+
+    ethernet_frame_t *frame = (ethernet_frame_t *) buf;
+    frame->raw = buf + PKTBUF_DATA_OFFSET;
+    frame->length = 0;
+    frame->in_interface = NULL;
+
+    return frame;
+}
+
+
+/* See pktbuf.h */
+void chirouter_pktbuf_frame_free(chirouter_pktbuf_pool_t *pool, ethernet_frame_t *frame)
+{
+    uint8_t *buf = (uint8_t *) frame;
+
+    if(buf < pool->mem.addr || buf >= pool->mem.addr + (size_t) pool->num_bufs * PKTBUF_SLOT_SIZE)
+    {
+        /* Not from the pool */
+        free(buf);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->free_stack[pool->num_free++] = (buf - pool->mem.addr) / PKTBUF_SLOT_SIZE;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/* See pktbuf.h */
+void chirouter_pktbuf_pool_log(chirouter_pktbuf_pool_t *pool, loglevel_t loglevel)
+{
+    pthread_mutex_lock(&pool->lock);
+    chilog(loglevel, "Packet buffer pool: %u buffers (%zu KB) backed by %s (page size: %zu KB)",
+                     pool->num_bufs, pool->mem.size / 1024,
+                     chirouter_pktmem_backing_str(pool->mem.backing), pool->mem.page_size / 1024);
+    chilog(loglevel, "Packet buffer pool: %u buffers in use, %" PRIu64 " allocations outside the pool",
+                     pool->num_bufs - pool->num_free, pool->num_fallback);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,237 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This header file defines the packet memory used by chirouter: a
+ *  pool of fixed-size buffers that hold Ethernet frames, and the
+ *  functions used to allocate the memory backing that pool (and other
+ *  packet-related structures, such as the receive buffers). If
+ *  requested, this memory is backed by 2 MB huge pages.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef PKTBUF_H
+#define PKTBUF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "chirouter.h"
+
+/* Size of a single buffer in the pool. A buffer holds the ethernet_frame_t
+ * struct followed by the raw frame (starting at PKTBUF_DATA_OFFSET) */
+#define PKTBUF_SLOT_SIZE (2048u)
+#define PKTBUF_DATA_OFFSET (64u)
+
+/* Default number of buffers in the pool */
+#define PKTBUF_POOL_DEFAULT_SIZE (4096u)
+
+/* Size of the huge pages we request */
+#define PKTMEM_HUGEPAGE_SIZE (2u * 1024u * 1024u)
+
+
+/* How a region of packet memory is backed */
+typedef enum
+{
+    PKTMEM_BACKING_DEFAULT = 0,  // Regular pages
+    PKTMEM_BACKING_HUGETLB = 1,  // Explicit huge pages (MAP_HUGETLB)
+    PKTMEM_BACKING_THP = 2       // Transparent huge pages (madvise)
+} pktmem_backing_t;
+
+
+/* A region of packet memory */
+typedef struct chirouter_pktmem
+{
+    /* Start of the region */
+    uint8_t *addr;
+
+    /* Size of the region (rounded up to a multiple of the page size) */
+    size_t size;
+
+    /* Size of the pages backing the region */
+    size_t page_size;
+
+    /* How the region is backed */
+    pktmem_backing_t backing;
+} chirouter_pktmem_t;
+
+
+/* A pool of packet buffers */
+typedef struct chirouter_pktbuf_pool
+{
+    /* Memory region containing all the buffers */
+    chirouter_pktmem_t mem;
+
+    /* Number of buffers in the pool */
+    uint32_t num_bufs;
+
+    /* Stack of indices of free buffers. Only the first
+     * "num_free" entries are valid. */
+    uint32_t *free_stack;
+    uint32_t num_free;
+
+    /* Number of allocations that could not be served by the pool
+     * (because it was exhausted) and were allocated with calloc */
+    uint64_t num_fallback;
+
+    /* Protects free_stack, num_free, and num_fallback */
+    pthread_mutex_t lock;
+} chirouter_pktbuf_pool_t;
+
+
+/*
+ * chirouter_pktmem_alloc - Allocates a region of packet memory
+ *
+ * If huge pages are requested, this function will first try to map
+ * explicit huge pages (MAP_HUGETLB). If none are available, it will
+ * fall back to regular pages with a transparent huge page hint and,
+ * if that is not supported either, to plain regular pages. None of
+ * these fallbacks are considered an error.
+ *
+ * mem: Region to initialize
+ *
+ * size: Size of the region in bytes. The region is zero-filled.
+ *
+ * hugepages: Whether to try to back the region with huge pages
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_pktmem_alloc(chirouter_pktmem_t *mem, size_t size, bool hugepages);
+
+
+/*
+ * chirouter_pktmem_free - Frees a region of packet memory
+ *
+ * mem: Region allocated with chirouter_pktmem_alloc
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_pktmem_free(chirouter_pktmem_t *mem);
+
+
+/*
+ * chirouter_pktmem_backing_str - Returns a printable description of a backing
+ *
+ * backing: Memory backing
+ *
+ * Returns: Constant string
+ *
+ */
+const char* chirouter_pktmem_backing_str(pktmem_backing_t backing);
+
+
+/*
+ * chirouter_pktbuf_pool_init - Initializes a pool of packet buffers
+ *
+ * pool: Pool to initialize
+ *
+ * num_bufs: Number of buffers in the pool
+ *
+ * hugepages: Whether to back the pool with huge pages (see chirouter_pktmem_alloc)
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_pktbuf_pool_init(chirouter_pktbuf_pool_t *pool, uint32_t num_bufs, bool hugepages);
+
+
+/*
+ * chirouter_pktbuf_pool_destroy - Frees a pool of packet buffers
+ *
+ * pool: Pool to free. All buffers must have been returned to the pool.
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_pktbuf_pool_destroy(chirouter_pktbuf_pool_t *pool);
+
+
+/*
+ * chirouter_pktbuf_frame_alloc - Allocates an Ethernet frame from the pool
+ *
+ * The returned frame's "raw" pointer points to a buffer (inside the same
+ * pool buffer) that can hold up to ETHER_FRAME_MAX_LEN bytes. If the pool
+ * is exhausted, the frame is allocated with calloc instead.
+ *
+ * pool: Pool to allocate from
+ *
+ * Returns: Pointer to the frame, or NULL if no memory could be allocated.
+ *
+ */
+ethernet_frame_t* chirouter_pktbuf_frame_alloc(chirouter_pktbuf_pool_t *pool);
+
+
+/*
+ * chirouter_pktbuf_frame_free - Returns an Ethernet frame to the pool
+ *
+ * pool: Pool the frame was allocated from
+ *
+ * frame: Frame allocated with chirouter_pktbuf_frame_alloc
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_pktbuf_frame_free(chirouter_pktbuf_pool_t *pool, ethernet_frame_t *frame);
+
+
+/*
+ * chirouter_pktbuf_pool_log - Logs the pool's memory statistics
+ *
+ * pool: Pool
+ *
+ * loglevel: Log level
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_pktbuf_pool_log(chirouter_pktbuf_pool_t *pool, loglevel_t loglevel);
+
+#endif
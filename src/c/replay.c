@@ -0,0 +1,470 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This module implements the replay mode.
+ *
+ *  See replay.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "replay.h"
+#include "chirouter.h"
+#include "server.h"
+#include "pcap.h"
+#include "topology.h"
+#include "graph.h"
+#include "clock.h"
+#include "log.h"
+
+/* Latency percentiles that are reported */
+static const double replay_percentiles[] = {50, 90, 99, 99.9};
+#define NUM_REPLAY_PERCENTILES (sizeof(replay_percentiles) / sizeof(replay_percentiles[0]))
+
+
+/* A frame to replay */
+typedef struct chirouter_replay_frame
+{
+    /* Router and interface that receive the frame */
+    chirouter_ctx_t *router;
+    chirouter_interface_t *iface;
+
+    /* Capture timestamp (nanoseconds) */
+    uint64_t ts_ns;
+
+    uint8_t *data;
+    uint32_t len;
+} chirouter_replay_frame_t;
+
+/* Frames sent by the routers (counted by the tx sink) */
+typedef struct chirouter_replay_sink
+{
+    uint64_t frames;
+    uint64_t bytes;
+} chirouter_replay_sink_t;
+
+/* The sink has to outlive the replay, since the ARP thread
+ * can send frames until the routers are freed */
+static chirouter_replay_sink_t replay_sink;
+
+
+/*
+ * chirouter_replay_sink - Counts the frames in a batch of messages for the controller
+ *
+ * (See tx_sink in server.h)
+ *
+ * arg: Sink
+ *
+ * buf: Serialized messages
+ *
+ * len: Number of bytes
+ *
+ * Returns: Always returns 0
+ *
+ */
+static int chirouter_replay_sink(void *arg, uint8_t *buf, size_t len)
+{
+    chirouter_replay_sink_t *sink = arg;
+    size_t off = 0;
+
+    while(off + 4 <= len)
+    {
+        chirouter_msg_t *msg = (chirouter_msg_t *) (buf + off);
+        uint16_t payload_len = ntohs(msg->payload_length);
+
+        if(msg->type == MSG_TYPE_ETHERNET_FRAME)
+        {
+            sink->frames++;
+            sink->bytes += payload_len - 4;
+        }
+
+        off += 4 + payload_len;
+    }
+
+    return 0;
+}
+
+
+/*
+ * chirouter_replay_set_macs - Sets the MAC addresses missing from a topology
+ *
+ * The MAC address of each interface that does not have one is taken
+ * from the interface with the same name (ROUTER-IFACE) in the capture.
+ *
+ * topo: Topology
+ *
+ * cap: Capture file
+ *
+ * Returns: nothing.
+ *
+ */
+static void chirouter_replay_set_macs(chirouter_topology_t *topo, chirouter_pcap_file_t *cap)
+{
+    char name[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2];
+
+    for(uint8_t r = 0; r < topo->num_routers; r++)
+    {
+        chirouter_topology_router_t *router = &topo->routers[r];
+
+        for(uint8_t i = 0; i < router->num_ifaces; i++)
+        {
+            chirouter_topology_iface_t *iface = &router->ifaces[i];
+
+            snprintf(name, sizeof(name), "%s-%s", router->name, iface->name);
+
+            for(uint32_t j = 0; j < cap->num_ifaces && !iface->has_mac; j++)
+                if(cap->ifaces[j].has_mac && !strcmp(cap->ifaces[j].name, name))
+                {
+                    memcpy(iface->mac, cap->ifaces[j].mac, ETHER_ADDR_LEN);
+                    iface->has_mac = true;
+                }
+
+            if(!iface->has_mac)
+                chilog(WARNING, "Interface %s has no MAC address (it is not in the capture file, and "
+                                "the topology does not specify one)", name);
+        }
+    }
+}
+
+
+/*
+ * chirouter_replay_frames - Picks the frames to replay from a capture
+ *
+ * Only inbound frames (that were not truncated) received on one of the
+ * routers' interfaces are replayed. Warns about any other frames.
+ *
+ * ctx: Server context (with the routers configured)
+ *
+ * cap: Capture file
+ *
+ * num_frames: Out parameter. Number of frames to replay.
+ *
+ * Returns: Array of frames to replay (NULL if no memory could be allocated).
+ *
+ */
+static chirouter_replay_frame_t* chirouter_replay_frames(server_ctx_t *ctx, chirouter_pcap_file_t *cap, uint64_t *num_frames)
+{
+    char name[MAX_ROUTER_NAMELEN + MAX_IFACE_NAMELEN + 2];
+    chirouter_ctx_t **routers = calloc(cap->num_ifaces + 1, sizeof(chirouter_ctx_t *));
+    chirouter_interface_t **ifaces = calloc(cap->num_ifaces + 1, sizeof(chirouter_interface_t *));
+    chirouter_replay_frame_t *frames = calloc(cap->num_frames + 1, sizeof(chirouter_replay_frame_t));
+    uint64_t not_inbound = 0, truncated = 0, unknown = 0, n = 0;
+
+    if(routers == NULL || ifaces == NULL || frames == NULL)
+    {
+        free(routers);
+        free(ifaces);
+        free(frames);
+        return NULL;
+    }
+
+    /* Map the capture's interfaces to the routers' interfaces */
+    for(uint32_t j = 0; j < cap->num_ifaces; j++)
+        for(int r = 0; r < ctx->num_routers; r++)
+            for(int i = 0; i < ctx->routers[r].num_interfaces; i++)
+            {
+                snprintf(name, sizeof(name), "%s-%s", ctx->routers[r].name, ctx->routers[r].interfaces[i].name);
+                if(!strcmp(cap->ifaces[j].name, name))
+                {
+                    routers[j] = &ctx->routers[r];
+                    ifaces[j] = &ctx->routers[r].interfaces[i];
+                }
+            }
+
+    for(uint64_t k = 0; k < cap->num_frames; k++)
+    {
+        chirouter_pcap_file_frame_t *f = &cap->frames[k];
+
+        if(f->dir != PCAP_INBOUND)
+            not_inbound++;
+        else if(f->caplen < f->origlen || f->caplen < ETHER_HDR_LEN || f->caplen > ETHER_FRAME_MAX_LEN)
+            truncated++;
+        else if(ifaces[f->iface] == NULL)
+            unknown++;
+        else
+        {
+            frames[n].router = routers[f->iface];
+            frames[n].iface = ifaces[f->iface];
+            frames[n].ts_ns = f->ts_ns;
+            frames[n].data = f->data;
+            frames[n].len = f->caplen;
+            n++;
+        }
+    }
+
+    if(truncated)
+        chilog(WARNING, "Skipping %" PRIu64 " truncated (or invalid) frames", truncated);
+    if(unknown)
+        chilog(WARNING, "Skipping %" PRIu64 " frames received on interfaces that are not in the topology", unknown);
+    chilog(INFO, "Replaying %" PRIu64 " of the %" PRIu64 " frames in the capture (%" PRIu64 " are not inbound)",
+                 n, cap->num_frames, not_inbound);
+
+    free(routers);
+    free(ifaces);
+
+    *num_frames = n;
+    return frames;
+}
+
+
+/*
+ * chirouter_replay_wait - Waits until a given time, or until
+ *                         chirouter is asked to shut down
+ *
+ * ctx: Server context
+ *
+ * deadline_ns: Time to wait until (as returned by chirouter_clock_now_ns)
+ *
+ * Returns: nothing.
+ *
+ */
+static void chirouter_replay_wait(server_ctx_t *ctx, uint64_t deadline_ns)
+{
+    uint64_t now;
+
+    while((now = chirouter_clock_now_ns()) < deadline_ns && !ctx->shutdown)
+    {
+        if(deadline_ns - now > REPLAY_SPIN_NS)
+        {
+            uint64_t sleep_ns = deadline_ns - now - REPLAY_SPIN_NS;
+            struct timespec ts = { .tv_sec = sleep_ns / 1000000000ull, .tv_nsec = sleep_ns % 1000000000ull };
+
+            nanosleep(&ts, NULL);
+        }
+    }
+}
+
+
+/*
+ * chirouter_replay_frame - Feeds a frame to its router
+ *
+ * As when the frame is received from the controller, the frame is
+ * counted and captured before it is processed.
+ *
+ * ctx: Server context
+ *
+ * rf: Frame
+ *
+ * Returns: Same as chirouter_process_ethernet_frame
+ *
+ */
+static int chirouter_replay_frame(server_ctx_t *ctx, chirouter_replay_frame_t *rf)
+{
+    ethernet_frame_t *frame = chirouter_pktbuf_frame_alloc(&ctx->pool);
+    int rc;
+
+    if(frame == NULL)
+    {
+        chilog(CRITICAL, "Could not allocate memory for Ethernet frame");
+        return -1;
+    }
+
+    memcpy(frame->raw, rf->data, rf->len);
+    frame->length = rf->len;
+    frame->in_interface = rf->iface;
+    chirouter_iface_count(rf->iface, rx_frames);
+
+    if(ctx->pcap_writer)
+        chirouter_pcap_write_frame(rf->router, rf->iface, rf->data, rf->len, PCAP_INBOUND);
+
+    rc = chirouter_process_ethernet_frame(rf->router, frame);
+
+    chirouter_pktbuf_frame_free(&ctx->pool, frame);
+
+    return rc;
+}
+
+
+/*
+ * chirouter_replay_cmp - Compares two latencies (for qsort)
+ */
+static int chirouter_replay_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * chirouter_replay_report - Prints the results of a replay
+ *
+ * num_frames: Number of frames replayed
+ *
+ * latencies: Latency of each frame (in cycles, see chirouter_clock_cycles).
+ *            Sorted by this function.
+ *
+ * elapsed_ns: Duration of the replay
+ *
+ * sink: Frames sent by the routers
+ *
+ * Returns: nothing.
+ *
+ */
+static void chirouter_replay_report(uint64_t num_frames, uint64_t *latencies, uint64_t elapsed_ns,
+                                    chirouter_replay_sink_t *sink)
+{
+    double secs = elapsed_ns / 1e9;
+
+    qsort(latencies, num_frames, sizeof(uint64_t), chirouter_replay_cmp);
+
+    printf("frames: %" PRIu64 " replayed, %" PRIu64 " sent (%.1f MB)\n", num_frames, sink->frames, sink->bytes / 1e6);
+    printf("elapsed: %.3f s\n", secs);
+    printf("throughput: %.0f frames/s\n", secs > 0 ? num_frames / secs : 0);
+
+    if(num_frames == 0)
+        return;
+
+    printf("latency (%s):", chirouter_clock_use_tsc ? "tsc" : "monotonic");
+    for(size_t i = 0; i < NUM_REPLAY_PERCENTILES; i++)
+    {
+        /* Nearest rank */
+        double rank = replay_percentiles[i] / 100 * num_frames;
+        uint64_t k = (uint64_t) rank + (rank > (uint64_t) rank);
+
+        printf(" p%g %.0f ns,", replay_percentiles[i], chirouter_clock_cycles_to_ns(latencies[k > 0 ? k - 1 : 0]));
+    }
+    printf(" max %.0f ns\n", chirouter_clock_cycles_to_ns(latencies[num_frames - 1]));
+}
+
+
+/* See replay.h */
+int chirouter_replay_run(server_ctx_t *ctx, const char *capture_file, const char *topology_file,
+                         bool original_timing, uint32_t loops)
+{
+    chirouter_topology_t topo;
+    chirouter_pcap_file_t cap;
+    chirouter_replay_frame_t *frames = NULL;
+    uint64_t *latencies = NULL;
+    uint64_t num_frames = 0, done = 0, start_ns;
+    char errbuf[256];
+    int rc = -1;
+
+    if(chirouter_topology_load(topology_file, &topo, errbuf, sizeof(errbuf)))
+    {
+        chilog(CRITICAL, "Could not load topology: %s", errbuf);
+        chirouter_topology_free(&topo);
+        return -1;
+    }
+
+    if(chirouter_pcap_read(capture_file, &cap, errbuf, sizeof(errbuf)))
+    {
+        chilog(CRITICAL, "Could not read capture: %s", errbuf);
+        goto out;
+    }
+
+    chirouter_replay_set_macs(&topo, &cap);
+
+    if(chirouter_server_setup_memory(ctx))
+        goto out;
+
+    ctx->tx_sink = chirouter_replay_sink;
+    ctx->tx_sink_arg = &replay_sink;
+
+    chirouter_graph_init(&ctx->graph, &ctx->tx_batch);
+    chirouter_graph_thread_set(&ctx->graph);
+
+    if(chirouter_topology_configure(ctx, &topo))
+    {
+        chilog(CRITICAL, "Could not configure the routers");
+        goto out;
+    }
+
+    frames = chirouter_replay_frames(ctx, &cap, &num_frames);
+    latencies = calloc(num_frames * loops + 1, sizeof(uint64_t));
+    if(frames == NULL || latencies == NULL)
+    {
+        chilog(CRITICAL, "Could not allocate memory for the frames to replay");
+        goto out;
+    }
+
+    start_ns = chirouter_clock_now_ns();
+
+    /* Stop early (and report the frames replayed so far)
+     * if chirouter is asked to shut down */
+    for(uint32_t loop = 0; loop < loops && !ctx->shutdown; loop++)
+    {
+        uint64_t loop_start_ns = chirouter_clock_now_ns();
+
+        for(uint64_t k = 0; k < num_frames && !ctx->shutdown; k++)
+        {
+            if(original_timing && frames[k].ts_ns > frames[0].ts_ns)
+                chirouter_replay_wait(ctx, loop_start_ns + (frames[k].ts_ns - frames[0].ts_ns));
+
+            uint64_t t0 = chirouter_clock_cycles();
+
+            if(chirouter_replay_frame(ctx, &frames[k]) == -1)
+            {
+                chilog(CRITICAL, "Critical error while processing Ethernet frames");
+                goto out;
+            }
+
+            latencies[done++] = chirouter_clock_cycles() - t0;
+        }
+    }
+
+    /* The ARP thread may still be sending frames to the sink */
+    pthread_mutex_lock(&ctx->lock_send);
+    chirouter_replay_report(done, latencies, chirouter_clock_now_ns() - start_ns, &replay_sink);
+    pthread_mutex_unlock(&ctx->lock_send);
+
+    rc = 0;
+
+out:
+    free(latencies);
+    free(frames);
+    chirouter_pcap_file_free(&cap);
+    chirouter_topology_free(&topo);
+
+    return rc;
+}
@@ -0,0 +1,109 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This header file defines the replay mode, which benchmarks the
+ *  routers without Mininet or a controller.
+ *
+ *  The routers are configured from a topology file, and the inbound
+ *  frames of a capture file (such as one written with -c) are fed
+ *  to chirouter_process_ethernet_frame, either as fast as possible or
+ *  at the original timing. The frames the routers send are counted
+ *  (and captured, if there is a capture file) instead of being sent
+ *  to a controller. Once all the frames have been replayed, the
+ *  throughput and the latency (how long each frame took to process,
+ *  including sending the frames it produced) are reported. Latencies
+ *  are measured with the TSC if it has been calibrated and, otherwise,
+ *  with CLOCK_MONOTONIC (see chirouter_clock_cycles).
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "server.h"
+
+/* Maximum number of times a capture can be replayed */
+#define REPLAY_MAX_LOOPS (1000000u)
+
+/* When replaying at the original timing, gaps between frames are
+ * slept through, except for their last REPLAY_SPIN_NS nanoseconds
+ * (which are busy-waited, since sleeping is not that precise) */
+#define REPLAY_SPIN_NS (100000u)
+
+
+/*
+ * chirouter_replay_run - Replays a capture file
+ *
+ * The capture file must have been written by chirouter (or use the same
+ * interface names, ROUTER-IFACE). Only the inbound frames are replayed.
+ * Interfaces without a MAC address in the topology file get the one
+ * recorded in the capture file.
+ *
+ * ctx: Server context (initialized, but without a server socket)
+ *
+ * capture_file: Capture file
+ *
+ * topology_file: Topology file
+ *
+ * original_timing: If true, the frames are replayed at the times they
+ *                  were captured (relative to the first frame); otherwise,
+ *                  they are replayed as fast as possible
+ *
+ * loops: Number of times the capture is replayed
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_replay_run(server_ctx_t *ctx, const char *capture_file, const char *topology_file,
+                         bool original_timing, uint32_t loops);
+
+
+#endif
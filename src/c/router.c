@@ -5,6 +5,11 @@
  *  When a router receives an Ethernet frame, it is handled by
  *  the chirouter_process_ethernet_frame() function.
  *
+ *  Frames are processed by a graph of nodes (see graph.h), each of
+ *  which processes a vector of frames at a time. This module defines
+ *  the nodes of that graph, and chirouter_process_ethernet_frame()
+ *  simply runs a single frame through the graph.
+ *
  */
 
 /*
@@ -60,9 +65,723 @@
 
 #include "chirouter.h"
 #include "arp.h"
+#include "graph.h"
+#include "pktbuf.h"
+#include "server.h"
 #include "utils.h"
 #include "utlist.h"
 
+/* TTL of the IP datagrams originated by the router */
+#define ROUTER_IP_TTL (64)
+
+/* Prefetch the frames this many positions ahead in a vector */
+#define PREFETCH_AHEAD (4)
+
+#define PREFETCH_FRAME(v, i) \
+    do { \
+        if((i) + PREFETCH_AHEAD < (v)->n) \
+            __builtin_prefetch((v)->elts[(i) + PREFETCH_AHEAD].frame->raw); \
+    } while(0)
+
+
+/*
+ * chirouter_graph_drop - Passes a frame on to the drop node
+ *
+ * The frame is counted as dropped on the interface it was received on.
+ */
+static inline void chirouter_graph_drop(chirouter_graph_t *g, chirouter_graph_elt_t *elt)
+{
+    if(elt->frame->in_interface)
+        chirouter_iface_count(elt->frame->in_interface, router_drops);
+    chirouter_graph_enqueue(g, NODE_DROP, elt);
+}
+
+
+/*
+ * chirouter_graph_consume - Passes a frame that the router is done with on to the drop node
+ *
+ * Unlike chirouter_graph_drop, this is for frames that were delivered
+ * to the router (or withheld), so they are not counted as dropped.
+ */
+static inline void chirouter_graph_consume(chirouter_graph_t *g, chirouter_graph_elt_t *elt)
+{
+    chirouter_graph_enqueue(g, NODE_DROP, elt);
+}
+
+
+/*
+ * chirouter_graph_tx_new - Passes a frame created by the router on to the TX node
+ *
+ * g: Graph
+ *
+ * frame: Frame allocated from the packet buffer pool (the graph will free it)
+ *
+ * iface: Interface to send the frame on
+ *
+ */
+static inline void chirouter_graph_tx_new(chirouter_graph_t *g, ethernet_frame_t *frame, chirouter_interface_t *iface)
+{
+    chirouter_graph_elt_t elt = { .frame = frame, .out_interface = iface, .owned = true };
+    chirouter_graph_enqueue(g, NODE_TX, &elt);
+}
+
+
+/*
+ * chirouter_iface_by_ip - Returns the router interface with a given IP address
+ *
+ * ctx: Router context
+ *
+ * ip: IP address (in network order)
+ *
+ * Returns: Interface, or NULL if no interface has that IP address.
+ *
+ */
+static chirouter_interface_t* chirouter_iface_by_ip(chirouter_ctx_t *ctx, uint32_t ip)
+{
+    for(int i=0; i < ctx->num_interfaces; i++)
+    {
+        if(ctx->interfaces[i].ip.s_addr == ip)
+            return &ctx->interfaces[i];
+    }
+
+    return NULL;
+}
+
+
+/* See chirouter.h */
+ethernet_frame_t* chirouter_icmp_build(chirouter_ctx_t *ctx, ethernet_frame_t *frame, uint8_t type, uint8_t code)
+{
+    ethhdr_t *in_eth = (ethhdr_t *) frame->raw;
+    iphdr_t *in_ip = (iphdr_t *) ETHER_PAYLOAD_START(frame->raw);
+    uint16_t in_ip_len = ntohs(in_ip->len);
+    uint16_t in_ihl = in_ip->ihl * 4;
+    chirouter_interface_t *iface = frame->in_interface;
+    size_t icmp_len;
+
+    ethernet_frame_t *reply = chirouter_pktbuf_frame_alloc(&ctx->server->pool);
+    if(reply == NULL)
+        return NULL;
+
+    ethhdr_t *eth = (ethhdr_t *) reply->raw;
+    iphdr_t *ip = (iphdr_t *) ETHER_PAYLOAD_START(reply->raw);
+    icmp_packet_t *icmp = (icmp_packet_t *) ((uint8_t *) ip + sizeof(iphdr_t));
+
+    if(type == ICMPTYPE_ECHO_REPLY)
+    {
+        /* Echo the entire ICMP message back */
+        icmp_len = in_ip_len - in_ihl;
+        memcpy(icmp, (uint8_t *) in_ip + in_ihl, icmp_len);
+    }
+    else
+    {
+        /* Include the IP header and the first 8 bytes of the
+         * original datagram's payload */
+        size_t payload_len = in_ip_len < in_ihl + 8 ? in_ip_len : in_ihl + 8;
+
+        icmp_len = ICMP_HDR_SIZE + payload_len;
+        memset(icmp, 0, ICMP_HDR_SIZE);
+        memcpy((uint8_t *) icmp + ICMP_HDR_SIZE, in_ip, payload_len);
+    }
+
+    icmp->type = type;
+    icmp->code = code;
+    icmp->chksum = 0;
+    icmp->chksum = cksum(icmp, icmp_len);
+
+    memset(ip, 0, sizeof(iphdr_t));
+    ip->version = 4;
+    ip->ihl = sizeof(iphdr_t) / 4;
+    ip->len = htons(sizeof(iphdr_t) + icmp_len);
+    ip->ttl = ROUTER_IP_TTL;
+    ip->proto = IPPROTO_ICMP;
+    ip->src = iface->ip.s_addr;
+    ip->dst = in_ip->src;
+    ip->cksum = cksum(ip, sizeof(iphdr_t));
+
+    /* Replies are sent back to the host (or router) we received
+     * the original datagram from */
+    memcpy(eth->dst, in_eth->src, ETHER_ADDR_LEN);
+    memcpy(eth->src, iface->mac, ETHER_ADDR_LEN);
+    eth->type = htons(ETHERTYPE_IP);
+
+    reply->length = sizeof(ethhdr_t) + sizeof(iphdr_t) + icmp_len;
+    reply->in_interface = iface;
+
+    return reply;
+}
+
+
+/*
+ * chirouter_node_l2_filter - Drops frames that are not addressed to the router
+ *
+ * Frames must be at least as long as an Ethernet header, and must be
+ * addressed to the receiving interface (or be broadcast frames).
+ */
+static int chirouter_node_l2_filter(chirouter_graph_t *g, chirouter_ctx_t *ctx, chirouter_graph_vector_t *v)
+{
+    static const uint8_t broadcast[ETHER_ADDR_LEN] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+    (void) ctx;
+
+    for(int i = 0; i < v->n; i++)
+    {
+        chirouter_graph_elt_t *elt = &v->elts[i];
+        ethernet_frame_t *frame = elt->frame;
+        ethhdr_t *hdr = (ethhdr_t *) frame->raw;
+
+        PREFETCH_FRAME(v, i);
+
+        if(frame->length < ETHER_HDR_LEN || frame->length > ETHER_FRAME_MAX_LEN
+           || (!ethernet_addr_is_equal(hdr->dst, frame->in_interface->mac)
+               && !ethernet_addr_is_equal(hdr->dst, (uint8_t *) broadcast)))
+            chirouter_graph_drop(g, elt);
+        else
+            chirouter_graph_enqueue(g, NODE_ETHERTYPE_DISPATCH, elt);
+    }
+
+    return 0;
+}
+
+
+/*
+ * chirouter_node_ethertype_dispatch - Sends each frame to its protocol's input node
+ */
+static int chirouter_node_ethertype_dispatch(chirouter_graph_t *g, chirouter_ctx_t *ctx, chirouter_graph_vector_t *v)
+{
+    (void) ctx;
+
+    for(int i = 0; i < v->n; i++)
+    {
+        chirouter_graph_elt_t *elt = &v->elts[i];
+        ethhdr_t *hdr = (ethhdr_t *) elt->frame->raw;
+
+        switch(ntohs(hdr->type))
+        {
+        case ETHERTYPE_ARP:
+            chirouter_graph_enqueue(g, NODE_ARP_INPUT, elt);
+            break;
+        case ETHERTYPE_IP:
+            chirouter_graph_enqueue(g, NODE_IP4_INPUT, elt);
+            break;
+        default:
+            chilog(DEBUG, "Dropping frame with unsupported ethertype %04X", ntohs(hdr->type));
+            chirouter_graph_drop(g, elt);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * chirouter_arp_build_reply - Builds an ARP reply to an ARP request
+ *
+ * ctx: Router context
+ *
+ * frame: Frame containing the ARP request
+ *
+ * Returns: Frame allocated from the packet buffer pool, or NULL
+ *          if no memory could be allocated.
+ */
+static ethernet_frame_t* chirouter_arp_build_reply(chirouter_ctx_t *ctx, ethernet_frame_t *frame)
+{
+    chirouter_interface_t *iface = frame->in_interface;
+    arp_packet_t *req = (arp_packet_t *) ETHER_PAYLOAD_START(frame->raw);
+
+    ethernet_frame_t *reply = chirouter_pktbuf_frame_alloc(&ctx->server->pool);
+    if(reply == NULL)
+        return NULL;
+
+    ethhdr_t *eth = (ethhdr_t *) reply->raw;
+    arp_packet_t *arp = (arp_packet_t *) ETHER_PAYLOAD_START(reply->raw);
+
+    memcpy(eth->dst, req->sha, ETHER_ADDR_LEN);
+    memcpy(eth->src, iface->mac, ETHER_ADDR_LEN);
+    eth->type = htons(ETHERTYPE_ARP);
+
+    arp->hrd = htons(ARP_HRD_ETHERNET);
+    arp->pro = htons(ETHERTYPE_IP);
+    arp->hln = ETHER_ADDR_LEN;
+    arp->pln = IPV4_ADDR_LEN;
+    arp->op = htons(ARP_OP_REPLY);
+    memcpy(arp->sha, iface->mac, ETHER_ADDR_LEN);
+    arp->spa = iface->ip.s_addr;
+    memcpy(arp->tha, req->sha, ETHER_ADDR_LEN);
+    arp->tpa = req->spa;
+
+    reply->length = sizeof(ethhdr_t) + sizeof(arp_packet_t);
+    reply->in_interface = iface;
+
+    return reply;
+}
+
+
+/*
+ * chirouter_arp_flush_withheld - Passes on the frames withheld in a resolved ARP request
+ *
+ * The frames are passed on to the rewrite node (which will now find
+ * the MAC address in the cache), and the request is freed. In
+ * flow-affine mode, the frames whose flow is assigned to a different
+ * worker are handed off to that worker instead (see
+ * chirouter_worker_handoff), unless its handoff queue is full.
+ *
+ * Note: The request must have been detached (with chirouter_arp_pending_req_detach),
+ *       and lock_arp must not be held, since the rewrite node may need to take it
+ *       (and the TX node, which the frames are passed on to, may block).
+ */
+static void chirouter_arp_flush_withheld(chirouter_graph_t *g, chirouter_ctx_t *ctx, chirouter_pending_arp_req_t *pending_req)
+{
+    ethernet_frame_t *withheld;
+
+    while((withheld = chirouter_arp_pending_req_pop_frame(pending_req)) != NULL)
+    {
+        if(ctx->server->workers && ctx->server->flow_affine)
+        {
+            chirouter_worker_t *worker = chirouter_worker_for_frame(ctx->server, ctx, withheld);
+
+            /* The worker takes ownership of the withheld frame */
+            if(&worker->graph != g && chirouter_worker_handoff(worker, ctx, withheld) == 0)
+                continue;
+        }
+
+        /* The graph takes ownership of the withheld frame */
+        chirouter_graph_elt_t elt = { .frame = withheld,
+                                      .out_interface = pending_req->out_interface,
+                                      .next_hop = pending_req->ip,
+                                      .owned = true };
+
+        chirouter_graph_enqueue(g, NODE_IP4_REWRITE, &elt);
+    }
+
+    chirouter_arp_pending_req_free(ctx, pending_req);
+}
+
+
+/*
+ * chirouter_node_arp_input - Processes ARP packets
+ *
+ * Following RFC 826, the sender's mapping is learned from any ARP packet
+ * (request or reply) addressed to one of the router's IP addresses, and
+ * merged into the ARP cache if the sender is already in it (or is being
+ * resolved), even if the packet is addressed to someone else (as with
+ * gratuitous ARPs). Requests addressed to the receiving interface are
+ * answered in the same pass.
+ *
+ * lock_arp is taken once for the whole vector. The ARP replies, and
+ * the frames withheld in the pending requests resolved by any of the
+ * packets, are passed on together once it has been released (if the
+ * TX node's vector is full, it is run right away, and sending may
+ * block on the controller socket).
+ */
+static int chirouter_node_arp_input(chirouter_graph_t *g, chirouter_ctx_t *ctx, chirouter_graph_vector_t *v)
+{
+    chirouter_pending_arp_req_t *resolved[GRAPH_VECTOR_SIZE];
+    ethernet_frame_t *replies[GRAPH_VECTOR_SIZE];
+    int num_resolved = 0, num_replies = 0;
+
+    pthread_mutex_lock(&ctx->lock_arp);
+
+    for(int i = 0; i < v->n; i++)
+    {
+        chirouter_graph_elt_t *elt = &v->elts[i];
+        ethernet_frame_t *frame = elt->frame;
+        arp_packet_t *arp = (arp_packet_t *) ETHER_PAYLOAD_START(frame->raw);
+
+        if(frame->length < sizeof(ethhdr_t) + sizeof(arp_packet_t)
+           || ntohs(arp->hrd) != ARP_HRD_ETHERNET || ntohs(arp->pro) != ETHERTYPE_IP
+           || arp->hln != ETHER_ADDR_LEN || arp->pln != IPV4_ADDR_LEN)
+        {
+            chirouter_graph_drop(g, elt);
+            continue;
+        }
+
+        struct in_addr sender = { .s_addr = arp->spa };
+        bool for_iface = arp->tpa == frame->in_interface->ip.s_addr;
+        bool for_us = for_iface || chirouter_iface_by_ip(ctx, arp->tpa) != NULL;
+
+        /* ARP probes (with no sender IP address) are not learned from */
+        if(sender.s_addr != 0)
+        {
+            chirouter_pending_arp_req_t *pending_req = chirouter_arp_pending_req_lookup(ctx, &sender);
+
+            if(for_us || pending_req != NULL || chirouter_arp_cache_lookup(ctx, &sender) != NULL)
+                chirouter_arp_cache_add(ctx, frame->in_interface, &sender, arp->sha);
+
+            if(pending_req != NULL)
+            {
+                chirouter_arp_pending_req_detach(ctx, pending_req);
+                resolved[num_resolved++] = pending_req;
+            }
+        }
+
+        if(for_iface && ntohs(arp->op) == ARP_OP_REQUEST)
+        {
+            ethernet_frame_t *reply = chirouter_arp_build_reply(ctx, frame);
+            if(reply)
+                replies[num_replies++] = reply;
+        }
+
+        /* The ARP message itself has been consumed */
+        chirouter_graph_consume(g, elt);
+    }
+
+    pthread_mutex_unlock(&ctx->lock_arp);
+
+    for(int i = 0; i < num_replies; i++)
+        chirouter_graph_tx_new(g, replies[i], replies[i]->in_interface);
+
+    for(int i = 0; i < num_resolved; i++)
+        chirouter_arp_flush_withheld(g, ctx, resolved[i]);
+
+    return 0;
+}
+
+
+/*
+ * chirouter_node_ip4_input - Validates IPv4 datagrams
+ *
+ * Drops malformed datagrams (bad version, header length, total length,
+ * or checksum), and sends the rest to the local delivery node (if they
+ * are addressed to one of the router's IP addresses) or to the lookup node.
+ */
+static int chirouter_node_ip4_input(chirouter_graph_t *g, chirouter_ctx_t *ctx, chirouter_graph_vector_t *v)
+{
+    for(int i = 0; i < v->n; i++)
+    {
+        chirouter_graph_elt_t *elt = &v->elts[i];
+        ethernet_frame_t *frame = elt->frame;
+        iphdr_t *ip = (iphdr_t *) ETHER_PAYLOAD_START(frame->raw);
+        size_t payload_len = frame->length - sizeof(ethhdr_t);
+
+        PREFETCH_FRAME(v, i);
+
+        if(payload_len < sizeof(iphdr_t) || ip->version != 4 || ip->ihl * 4 < sizeof(iphdr_t)
+           || ntohs(ip->len) < ip->ihl * 4 || ntohs(ip->len) > payload_len
+           || cksum(ip, ip->ihl * 4) != 0xffff)
+        {
+            chilog(DEBUG, "Dropping malformed IPv4 datagram");
+            chirouter_graph_drop(g, elt);
+            continue;
+        }
+
+        if(chirouter_iface_by_ip(ctx, ip->dst))
+            chirouter_graph_enqueue(g, NODE_IP4_LOCAL, elt);
+        else
+            chirouter_graph_enqueue(g, NODE_IP4_LOOKUP, elt);
+    }
+
+    return 0;
+}
+
+
+/*
+ * chirouter_node_ip4_local - Processes datagrams addressed to the router
+ *
+ * - Datagrams addressed to an interface other than the receiving
+ *   interface get an ICMP Host Unreachable.
+ * - TCP and UDP segments get an ICMP Port Unreachable.
+ * - Datagrams with a TTL of 1 get an ICMP Time Exceeded.
+ * - ICMP Echo Requests get an ICMP Echo Reply.
+ * - Anything else is dropped.
+ */
+static int chirouter_node_ip4_local(chirouter_graph_t *g, chirouter_ctx_t *ctx, chirouter_graph_vector_t *v)
+{
+    for(int i = 0; i < v->n; i++)
+    {
+        chirouter_graph_elt_t *elt = &v->elts[i];
+        ethernet_frame_t *frame = elt->frame;
+        iphdr_t *ip = (iphdr_t *) ETHER_PAYLOAD_START(frame->raw);
+        ethernet_frame_t *reply = NULL;
+        bool answered = false;
+
+        if(ip->dst != frame->in_interface->ip.s_addr)
+        {
+            reply = chirouter_icmp_build(ctx, frame, ICMPTYPE_DEST_UNREACHABLE, ICMPCODE_DEST_HOST_UNREACHABLE);
+        }
+        else if(ip->proto == IPPROTO_TCP || ip->proto == IPPROTO_UDP)
+        {
+            reply = chirouter_icmp_build(ctx, frame, ICMPTYPE_DEST_UNREACHABLE, ICMPCODE_DEST_PORT_UNREACHABLE);
+        }
+        else if(ip->ttl == 1)
+        {
+            reply = chirouter_icmp_build(ctx, frame, ICMPTYPE_TIME_EXCEEDED, 0);
+        }
+        else if(ip->proto == IPPROTO_ICMP)
+        {
+            icmp_packet_t *icmp = (icmp_packet_t *) ((uint8_t *) ip + ip->ihl * 4);
+
+            if(ntohs(ip->len) >= ip->ihl * 4 + ICMP_HDR_SIZE && icmp->type == ICMPTYPE_ECHO_REQUEST)
+            {
+                reply = chirouter_icmp_build(ctx, frame, ICMPTYPE_ECHO_REPLY, 0);
+                answered = true;
+            }
+        }
+
+        if(reply)
+            chirouter_graph_tx_new(g, reply, frame->in_interface);
+
+        /* Only Echo Requests are actually delivered to the router */
+        if(answered)
+            chirouter_graph_consume(g, elt);
+        else
+            chirouter_graph_drop(g, elt);
+    }
+
+    return 0;
+}
+
+
+/*
+ * chirouter_route_lookup - Finds the routing table entry for an IP address
+ *
+ * Uses longest prefix match. If several entries have the same prefix
+ * length, the one with the lowest metric is used.
+ *
+ * ctx: Router context
+ *
+ * dst: Destination IP address (in network order)
+ *
+ * Returns: Routing table entry, or NULL if there is no route.
+ */
+static chirouter_rtable_entry_t* chirouter_route_lookup(chirouter_ctx_t *ctx, uint32_t dst)
+{
+    chirouter_rtable_entry_t *best = NULL;
+
+    for(int i=0; i < ctx->num_rtable_entries; i++)
+    {
+        chirouter_rtable_entry_t *entry = &ctx->routing_table[i];
+
+        if((dst & entry->mask.s_addr) != entry->dest.s_addr)
+            continue;
+
+        if(best == NULL
+           || ntohl(entry->mask.s_addr) > ntohl(best->mask.s_addr)
+           || (entry->mask.s_addr == best->mask.s_addr && entry->metric < best->metric))
+            best = entry;
+    }
+
+    return best;
+}
+
+
+/*
+ * chirouter_node_ip4_lookup - Finds the outgoing interface and next hop of a datagram
+ *
+ * Datagrams with no matching route get an ICMP Network Unreachable,
+ * and datagrams whose TTL would reach zero get an ICMP Time Exceeded.
+ */
+static int chirouter_node_ip4_lookup(chirouter_graph_t *g, chirouter_ctx_t *ctx, chirouter_graph_vector_t *v)
+{
+    for(int i = 0; i < v->n; i++)
+    {
+        chirouter_graph_elt_t *elt = &v->elts[i];
+        ethernet_frame_t *frame = elt->frame;
+        iphdr_t *ip = (iphdr_t *) ETHER_PAYLOAD_START(frame->raw);
+        ethernet_frame_t *reply = NULL;
+
+        chirouter_rtable_entry_t *route = chirouter_route_lookup(ctx, ip->dst);
+
+        if(route == NULL)
+        {
+            reply = chirouter_icmp_build(ctx, frame, ICMPTYPE_DEST_UNREACHABLE, ICMPCODE_DEST_NET_UNREACHABLE);
+        }
+        else if(ip->ttl <= 1)
+        {
+            reply = chirouter_icmp_build(ctx, frame, ICMPTYPE_TIME_EXCEEDED, 0);
+        }
+        else
+        {
+            elt->out_interface = route->interface;
+            elt->next_hop.s_addr = route->gw.s_addr ? route->gw.s_addr : ip->dst;
+            chirouter_graph_enqueue(g, NODE_IP4_REWRITE, elt);
+            continue;
+        }
+
+        if(reply)
+            chirouter_graph_tx_new(g, reply, frame->in_interface);
+
+        chirouter_graph_drop(g, elt);
+    }
+
+    return 0;
+}
+
+
+/*
+ * chirouter_arp_withhold - Withholds a frame until its next hop is resolved
+ *
+ * Adds the frame to the pending ARP request for the next hop, creating
+ * the request (and sending the first ARP request) if necessary. If the
+ * next hop is in the negative ARP cache, an ICMP Host Unreachable is
+ * sent instead.
+ *
+ * The lock-free lookup on the forwarding path can miss an entry that
+ * is being moved in the cache (or that was added right after it), so
+ * the cache is checked again holding lock_arp first. If the next hop
+ * is in the cache, its MAC address is copied to "mac" instead.
+ *
+ * The first ARP request is only passed on to the TX node once lock_arp
+ * has been released (sending may block on the controller socket).
+ *
+ * Returns: true if the frame was withheld (or dropped, if it could not
+ *          be withheld or the next hop is unreachable), false if the
+ *          next hop was found in the cache.
+ */
+static bool chirouter_arp_withhold(chirouter_graph_t *g, chirouter_ctx_t *ctx, chirouter_graph_elt_t *elt, uint8_t *mac)
+{
+    ethernet_frame_t *request = NULL;
+
+    pthread_mutex_lock(&ctx->lock_arp);
+
+    chirouter_arpcache_entry_t *entry = chirouter_arp_cache_lookup(ctx, &elt->next_hop);
+    if(entry != NULL)
+    {
+        memcpy(mac, entry->mac, ETHER_ADDR_LEN);
+        pthread_mutex_unlock(&ctx->lock_arp);
+        return false;
+    }
+
+    /* Hosts that recently did not answer our ARP requests get
+     * an ICMP Host Unreachable right away */
+    if(chirouter_arp_negcache_lookup(ctx, &elt->next_hop))
+    {
+        pthread_mutex_unlock(&ctx->lock_arp);
+
+        ethernet_frame_t *reply = chirouter_icmp_build(ctx, elt->frame,
+                                                       ICMPTYPE_DEST_UNREACHABLE,
+                                                       ICMPCODE_DEST_HOST_UNREACHABLE);
+        if(reply)
+            chirouter_graph_tx_new(g, reply, reply->in_interface);
+
+        return true;
+    }
+
+    chirouter_pending_arp_req_t *pending_req = chirouter_arp_pending_req_lookup(ctx, &elt->next_hop);
+    if(pending_req == NULL)
+    {
+        pending_req = chirouter_arp_pending_req_add(ctx, &elt->next_hop, elt->out_interface);
+        if(pending_req == NULL)
+        {
+            chilog(ERROR, "Could not allocate pending ARP request");
+            pthread_mutex_unlock(&ctx->lock_arp);
+            return true;
+        }
+
+        request = chirouter_arp_build_request(ctx, elt->out_interface, &elt->next_hop);
+
+        pending_req->times_sent = 1;
+    }
+
+    chirouter_arp_pending_req_add_frame(ctx, pending_req, elt->frame);
+
+    pthread_mutex_unlock(&ctx->lock_arp);
+
+    if(request)
+        chirouter_graph_tx_new(g, request, elt->out_interface);
+
+    return true;
+}
+
+
+/*
+ * chirouter_node_ip4_rewrite - Rewrites the Ethernet and IP headers of a forwarded datagram
+ *
+ * If the MAC address of the next hop is not in the ARP cache, the
+ * frame is withheld in a pending ARP request instead.
+ */
+static int chirouter_node_ip4_rewrite(chirouter_graph_t *g, chirouter_ctx_t *ctx, chirouter_graph_vector_t *v)
+{
+    for(int i = 0; i < v->n; i++)
+    {
+        chirouter_graph_elt_t *elt = &v->elts[i];
+        ethernet_frame_t *frame = elt->frame;
+        ethhdr_t *eth = (ethhdr_t *) frame->raw;
+        iphdr_t *ip = (iphdr_t *) ETHER_PAYLOAD_START(frame->raw);
+
+        if(!chirouter_arp_cache_lookup_mac(ctx, &elt->next_hop, eth->dst)
+           && chirouter_arp_withhold(g, ctx, elt, eth->dst))
+        {
+            /* The pending request keeps a copy of the frame (if
+             * it could not, the pending request counted the drop) */
+            chirouter_graph_consume(g, elt);
+            continue;
+        }
+
+        memcpy(eth->src, elt->out_interface->mac, ETHER_ADDR_LEN);
+
+        ip->ttl--;
+        ip->cksum = 0;
+        ip->cksum = cksum(ip, ip->ihl * 4);
+
+        chirouter_graph_enqueue(g, NODE_TX, elt);
+    }
+
+    return 0;
+}
+
+
+/*
+ * chirouter_node_tx - Sends frames
+ *
+ * If the graph has a batch of messages, the frames are only added to
+ * the batch, which is flushed by chirouter_process_ethernet_frames.
+ */
+static int chirouter_node_tx(chirouter_graph_t *g, chirouter_ctx_t *ctx, chirouter_graph_vector_t *v)
+{
+    int rc = 0, rc_send;
+
+    for(int i = 0; i < v->n; i++)
+    {
+        chirouter_graph_elt_t *elt = &v->elts[i];
+
+        if(g->tx_batch)
+            rc_send = chirouter_server_tx_batch_add(ctx, g->tx_batch, elt->out_interface, elt->frame->raw, elt->frame->length);
+        else
+            rc_send = chirouter_send_frame(ctx, elt->out_interface, elt->frame->raw, elt->frame->length);
+
+        if(rc_send == -1)
+            rc = -1;
+
+        if(elt->owned)
+            chirouter_pktbuf_frame_free(&ctx->server->pool, elt->frame);
+    }
+
+    return rc;
+}
+
+
+/*
+ * chirouter_node_drop - Drops frames
+ */
+static int chirouter_node_drop(chirouter_graph_t *g, chirouter_ctx_t *ctx, chirouter_graph_vector_t *v)
+{
+    (void) g;
+
+    for(int i = 0; i < v->n; i++)
+    {
+        if(v->elts[i].owned)
+            chirouter_pktbuf_frame_free(&ctx->server->pool, v->elts[i].frame);
+    }
+
+    return 0;
+}
+
+
+/* See graph.h */
+const chirouter_graph_node_fn_t chirouter_graph_node_fns[NUM_GRAPH_NODES] =
+{
+    [NODE_L2_FILTER] = chirouter_node_l2_filter,
+    [NODE_ETHERTYPE_DISPATCH] = chirouter_node_ethertype_dispatch,
+    [NODE_ARP_INPUT] = chirouter_node_arp_input,
+    [NODE_IP4_INPUT] = chirouter_node_ip4_input,
+    [NODE_IP4_LOCAL] = chirouter_node_ip4_local,
+    [NODE_IP4_LOOKUP] = chirouter_node_ip4_lookup,
+    [NODE_IP4_REWRITE] = chirouter_node_ip4_rewrite,
+    [NODE_TX] = chirouter_node_tx,
+    [NODE_DROP] = chirouter_node_drop,
+};
+
 
 /*
  * chirouter_process_ethernet_frame - Process a single inbound Ethernet frame
@@ -76,13 +795,26 @@
  * adding it to a list of withheld frames in the pending ARP request list)
  * you must make a deep copy of the frame.
  *
- * chirouter can manage multiple routers at once, but does so in a single
- * thread. i.e., it is guaranteed that this function is always called
+ * chirouter can manage multiple routers at once. By default, it does so in a
+ * single thread. i.e., it is guaranteed that this function is always called
  * sequentially, and that there will not be concurrent calls to this
  * function. If two routers receive Ethernet frames "at the same time",
  * they will be ordered arbitrarily and processed sequentially, not
  * concurrently (and with each call receiving a different router context)
  *
+ * If chirouter is run with worker threads (-w), each router is assigned
+ * to a single worker. Calls for the same router context are still
+ * sequential (and in the order the frames were received), but calls for
+ * different routers may happen concurrently. Any state shared between
+ * routers must therefore be protected.
+ *
+ * In flow-affine mode (-w with -f), calls for the same router context
+ * may also happen concurrently, but frames belonging to the same flow
+ * (same IPv4 5-tuple) are still processed sequentially and in order.
+ * The ARP cache must be looked up with chirouter_arp_cache_lookup_mac,
+ * and the lock_arp mutex must be held when using the list of pending
+ * ARP requests or adding entries to the ARP cache.
+ *
  * ctx: Router context
  *
  * frame: Inbound Ethernet frame
@@ -101,9 +833,50 @@
  */
 int chirouter_process_ethernet_frame(chirouter_ctx_t *ctx, ethernet_frame_t *frame)
 {
-    /* Your code goes here */
-
-    return 0;
+    return chirouter_process_ethernet_frames(ctx, &frame, 1);
 }
 
 
+/*
+ * chirouter_process_ethernet_frames - Process a batch of Ethernet frames
+ *
+ * Batch counterpart of chirouter_process_ethernet_frame. All the frames
+ * must have been received by the same router, and are processed in
+ * order. Any frames sent while processing the batch are gathered and
+ * sent to the controller once all the frames have been processed.
+ *
+ * The same concurrency rules as chirouter_process_ethernet_frame apply.
+ *
+ * ctx: Router context
+ *
+ * frames: Inbound Ethernet frames (owned by the caller, which can free
+ *         them once this function returns)
+ *
+ * n: Number of frames
+ *
+ * Returns:
+ *   0 on success,
+ *
+ *   1 if a non-critical error happens
+ *
+ *   -1 if a critical error happens
+ *
+ */
+int chirouter_process_ethernet_frames(chirouter_ctx_t *ctx, ethernet_frame_t **frames, size_t n)
+{
+    chirouter_graph_t *g = chirouter_graph_thread_get();
+    int rc;
+
+    if(g == NULL)
+    {
+        chilog(CRITICAL, "No packet processing graph set up for this thread");
+        return -1;
+    }
+
+    rc = chirouter_graph_run(g, ctx, frames, n);
+
+    if(g->tx_batch && chirouter_server_tx_batch_flush(ctx->server, g->tx_batch) == -1)
+        rc = -1;
+
+    return rc;
+}
@@ -59,6 +59,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
@@ -69,13 +72,15 @@
 #include "log.h"
 #include "utils.h"
 #include "pcap.h"
+#include "capfilter.h"
 #include "arp.h"
 
 
 /* Forward declarations */
 int chirouter_server_process_messages(server_ctx_t *ctx);
-int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *msg);
 int chirouter_server_process_ethernet_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *msg, size_t len);
+int chirouter_server_rx_batch_flush(server_ctx_t *ctx);
+void chirouter_server_rx_batch_discard(server_ctx_t *ctx);
 int chirouter_server_ctx_free_routers(server_ctx_t *ctx);
 
 
@@ -94,12 +99,44 @@ int chirouter_server_ctx_init(server_ctx_t **ctx)
     if(*ctx == NULL)
         return -1;
 
+    pthread_mutex_init(&(*ctx)->lock_send, NULL);
+
+    /* The ARP thread waits on arp_cond with CLOCK_MONOTONIC
+     * deadlines (the clock used by the timer wheels) */
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&(*ctx)->lock_arp_thread, NULL);
+    pthread_cond_init(&(*ctx)->arp_cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+
+    (*ctx)->arpcache_size = ARPCACHE_SIZE;
+    (*ctx)->arp_retransmit_ms = ARP_REQ_RETRANSMIT_MS;
+    (*ctx)->arp_negcache_ms = ARP_NEGCACHE_HOLDDOWN_MS;
+    (*ctx)->arp_max_withheld_per_req = ARP_MAX_WITHHELD_PER_REQ;
+    (*ctx)->arp_max_withheld = ARP_MAX_WITHHELD_FRAMES;
+    (*ctx)->arp_withheld_drop_oldest = false;
+    (*ctx)->arp_resolve_gateways = false;
+
+    /* The write end of the shutdown pipe is non-blocking, so that
+     * chirouter_server_shutdown never blocks (one byte is enough
+     * to wake up the server) */
+    if(pipe((*ctx)->shutdown_pipe) == -1)
+    {
+        free(*ctx);
+        *ctx = NULL;
+        return -1;
+    }
+    for(int i = 0; i < 2; i++)
+        fcntl((*ctx)->shutdown_pipe[i], F_SETFD, FD_CLOEXEC);
+    fcntl((*ctx)->shutdown_pipe[1], F_SETFL, O_NONBLOCK);
+
     return 0;
 }
 
 
 /*
- * chirouter_server_setup - Sets up the chirouter server socket
+ * chirouter_server_setup - Sets up the chirouter server socket and packet memory
  *
  * ctx: Server context
  *
@@ -164,39 +201,159 @@ int chirouter_server_setup(server_ctx_t *ctx, char *port)
         return -1;
     }
 
+    return chirouter_server_setup_memory(ctx);
+}
+
+
+/*
+ * chirouter_server_setup_memory - Allocates the packet buffer pool and the receive buffers
+ *
+ * ctx: Server context
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_server_setup_memory(server_ctx_t *ctx)
+{
+    if (chirouter_pktbuf_pool_init(&ctx->pool, PKTBUF_POOL_DEFAULT_SIZE, ctx->hugepages))
+    {
+        chilog(CRITICAL, "Could not allocate packet buffer pool");
+        return -1;
+    }
+
+    if (chirouter_pktmem_alloc(&ctx->rx_mem, SERVER_RECV_BUFFER_SIZE + SERVER_MSG_BUFFER_SIZE, ctx->hugepages))
+    {
+        chilog(CRITICAL, "Could not allocate receive buffers");
+        return -1;
+    }
+
+    chirouter_pktbuf_pool_log(&ctx->pool, INFO);
+    chilog(INFO, "Receive buffers: %zu KB backed by %s (page size: %zu KB)", ctx->rx_mem.size / 1024,
+                 chirouter_pktmem_backing_str(ctx->rx_mem.backing), ctx->rx_mem.page_size / 1024);
+
     return 0;
 }
 
 
 /*
- * chirouter_server_send_msg - Sends a message to the controller
+ * chirouter_server_send_bytes - Sends one or more serialized messages to the controller
+ *
+ * If the server has a tx sink, the messages are handed to it instead.
  *
  * ctx: Server context
  *
- * msg: Message to send
+ * buf: Serialized messages
+ *
+ * totallen: Number of bytes to send
  *
  * Returns: 0 on success, -1 if an error happens.
  *
  */
-int chirouter_server_send_msg(server_ctx_t *ctx, chirouter_msg_t *msg)
+static int chirouter_server_send_bytes(server_ctx_t *ctx, uint8_t *buf, size_t totallen)
 {
-    int sent = 0;
-    int totallen = 4 + ntohs(msg->payload_length);
-    char *buf = (char *) msg;
+    size_t sent = 0;
 
+    pthread_mutex_lock(&ctx->lock_send);
+    if (ctx->tx_sink)
+    {
+        int rc = ctx->tx_sink(ctx->tx_sink_arg, buf, totallen);
+        pthread_mutex_unlock(&ctx->lock_send);
+        return rc;
+    }
     while (sent < totallen) {
-        int cur = send(ctx->client_socket, buf+sent, totallen-sent, 0);
-        sent = sent + cur;
+        ssize_t cur = send(ctx->client_socket, buf+sent, totallen-sent, 0);
         if (cur == -1) {
+            pthread_mutex_unlock(&ctx->lock_send);
             chilog(CRITICAL, "Could not send message to controller");
             return -1;
         }
+        sent = sent + cur;
     }
+    pthread_mutex_unlock(&ctx->lock_send);
 
     return 0;
 }
 
 
+/*
+ * chirouter_server_send_msg - Sends a message to the controller
+ *
+ * ctx: Server context
+ *
+ * msg: Message to send
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_server_send_msg(server_ctx_t *ctx, chirouter_msg_t *msg)
+{
+    return chirouter_server_send_bytes(ctx, (uint8_t *) msg, 4 + ntohs(msg->payload_length));
+}
+
+
+/*
+ * chirouter_server_shutdown - Asks the chirouter server to shut down
+ *
+ * Only sets a flag and writes to a pipe, so it is async-signal-safe
+ * (it is meant to be called from the SIGINT handler). The server
+ * notices the request while it waits for a connection or for a
+ * message, and chirouter_server_run returns.
+ *
+ * ctx: Server context
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_server_shutdown(server_ctx_t *ctx)
+{
+    int saved_errno = errno;
+
+    ctx->shutdown = 1;
+    if(write(ctx->shutdown_pipe[1], "", 1) == -1)
+    {
+        /* The pipe is full, so the server has already been woken up */
+    }
+
+    errno = saved_errno;
+}
+
+
+/*
+ * chirouter_server_wait - Waits until a socket can be read from
+ *
+ * ctx: Server context
+ *
+ * fd: Socket
+ *
+ * Returns:
+ *  0 if the socket can be read from
+ *  1 if chirouter was asked to shut down (see chirouter_server_shutdown)
+ *  -1 if an error occurred
+ *
+ */
+static int chirouter_server_wait(server_ctx_t *ctx, int fd)
+{
+    struct pollfd fds[2] =
+    {
+        { .fd = fd, .events = POLLIN },
+        { .fd = ctx->shutdown_pipe[0], .events = POLLIN }
+    };
+
+    while(!ctx->shutdown)
+    {
+        int rc = poll(fds, 2, -1);
+
+        if(rc == -1 && errno != EINTR)
+            return -1;
+
+        if(rc > 0 && fds[0].revents && !ctx->shutdown)
+            return 0;
+    }
+
+    return 1;
+}
+
+
 /*
  * chirouter_server_run - Run the chirouter server
  *
@@ -205,7 +362,8 @@ int chirouter_server_send_msg(server_ctx_t *ctx, chirouter_msg_t *msg)
  *
  * ctx: Server context
  *
- * Returns: 0 on success, -1 if an error happens.
+ * Returns: 0 when chirouter is asked to shut down (after the router
+ *          resources have been freed), -1 if an error happens.
  *
  */
 int chirouter_server_run(server_ctx_t *ctx)
@@ -216,11 +374,17 @@ int chirouter_server_run(server_ctx_t *ctx)
     char port[NI_MAXSERV];
     socklen_t sa_size = sizeof(struct sockaddr_storage);
 
+    chirouter_graph_init(&ctx->graph, &ctx->tx_batch);
+    chirouter_graph_thread_set(&ctx->graph);
+
     client_addr = calloc(1, sa_size);
     while (1)
     {
         chilog(INFO, "Waiting for connection from controller...");
-        if ((client_socket = accept(ctx->server_socket, (struct sockaddr *) client_addr, &sa_size)) == -1)
+        rc = chirouter_server_wait(ctx, ctx->server_socket);
+        if (rc == 1)
+            break;
+        if (rc == -1 || (client_socket = accept(ctx->server_socket, (struct sockaddr *) client_addr, &sa_size)) == -1)
         {
             free(client_addr);
             chilog(CRITICAL, "Could not accept() connection");
@@ -241,25 +405,30 @@ int chirouter_server_run(server_ctx_t *ctx)
 
         rc = chirouter_server_process_messages(ctx);
 
-        if(rc <= 0)
+        if (rc < 0)
         {
-            if (rc < 0)
-            {
-                chilog(CRITICAL, "Error while processing messages");
-            }
-            else
-            {
-                chilog(INFO, "Controller has disconnected.");
-            }
+            chilog(CRITICAL, "Error while processing messages");
+        }
+        else if (rc == 0)
+        {
+            chilog(INFO, "Controller has disconnected.");
+        }
 
-            ctx->state = HELLO_WAIT;
-            rc = chirouter_server_ctx_free_routers(ctx);
-            if(rc == -1)
-            {
-                chilog(CRITICAL, "Error while freeing router resources");
-                return -1;
-            }
+        /* The ARP caches are saved both when the controller disconnects
+         * and when chirouter is asked to shut down (rc == 1) */
+        if(ctx->state == RUNNING && ctx->arp_snapshot_file)
+            chirouter_arp_snapshot_save(ctx, ctx->arp_snapshot_file);
+
+        ctx->state = HELLO_WAIT;
+        if(chirouter_server_ctx_free_routers(ctx) == -1)
+        {
+            free(client_addr);
+            chilog(CRITICAL, "Error while freeing router resources");
+            return -1;
         }
+
+        if (rc == 1)
+            break;
     }
     free(client_addr);
     return 0;
@@ -273,21 +442,32 @@ int chirouter_server_run(server_ctx_t *ctx)
  *
  * Returns:
  *  0 if the client closed the connection normally
+ *  1 if chirouter was asked to shut down (see chirouter_server_shutdown)
  *  -1 if an error occurred
  *
  */
 int chirouter_server_process_messages(server_ctx_t *ctx)
 {
-    char recv_buffer[4096], msg_buffer[4096];
+    char *recv_buffer = (char *) ctx->rx_mem.addr;
+    char *msg_buffer = recv_buffer + SERVER_RECV_BUFFER_SIZE;
     chirouter_msg_t *msg;
     int nbytes, rc;
     bool reading_header = true;
-    size_t len;
+    size_t len = 0;
     int i, bufpos = 0;
 
     while(1)
     {
-        nbytes = recv(ctx->client_socket, recv_buffer, sizeof(recv_buffer), 0);
+        rc = chirouter_server_wait(ctx, ctx->client_socket);
+        if (rc != 0)
+        {
+            if (rc == -1)
+                chilog(CRITICAL, "poll() on controller socket failed");
+            close(ctx->client_socket);
+            return rc;
+        }
+
+        nbytes = recv(ctx->client_socket, recv_buffer, SERVER_RECV_BUFFER_SIZE, 0);
         if (nbytes == 0)
         {
             chilog(DEBUG, "Controller closed connection");
@@ -301,11 +481,24 @@ int chirouter_server_process_messages(server_ctx_t *ctx)
             return -1;
         }
 
+        if(atomic_load(&ctx->worker_error))
+        {
+            chilog(CRITICAL, "A worker thread encountered a critical error");
+            close(ctx->client_socket);
+            return -1;
+        }
+
         chilog(TRACE, "recv() from controller (%i bytes)", nbytes);
         chilog_hex(TRACE, recv_buffer, nbytes);
 
+        /* Ethernet frames are not processed as soon as their message
+         * is parsed. Instead, all the frames received in this recv()
+         * are processed as a batch once we reach the end of the buffer
+         * (or before processing any other type of message) */
+
+        /* Note: a message may span several recv() calls, so
+         * bufpos and len carry over from the previous call */
         i = 0;
-        len = 0;
         while(i < nbytes)
         {
             msg_buffer[bufpos++] = recv_buffer[i++];
@@ -316,15 +509,30 @@ int chirouter_server_process_messages(server_ctx_t *ctx)
                 msg = (chirouter_msg_t *) msg_buffer;
                 len = ntohs(msg->payload_length);
                 reading_header = false;
+
+                if(4 + len > SERVER_MSG_BUFFER_SIZE)
+                {
+                    chilog(CRITICAL, "Received a message that is too large (%zu bytes)", 4 + len);
+                    close(ctx->client_socket);
+                    return -1;
+                }
             }
 
             if(!reading_header && bufpos == (4+len))
             {
                 /* We have a complete message */
+                if(msg->type != MSG_TYPE_ETHERNET_FRAME && chirouter_server_rx_batch_flush(ctx) == -1)
+                {
+                    chilog(CRITICAL, "Error while processing Ethernet frames.");
+                    close(ctx->client_socket);
+                    return -1;
+                }
+
                 rc = chirouter_server_process_single_message(ctx, msg);
                 if(rc)
                 {
                     chilog(CRITICAL, "Error while processing message.");
+                    chirouter_server_rx_batch_discard(ctx);
                     close(ctx->client_socket);
                     return -1;
                 }
@@ -334,7 +542,91 @@ int chirouter_server_process_messages(server_ctx_t *ctx)
             }
         }
 
+        if(chirouter_server_rx_batch_flush(ctx) == -1)
+        {
+            chilog(CRITICAL, "Error while processing Ethernet frames.");
+            close(ctx->client_socket);
+            return -1;
+        }
+    }
+}
+
+
+/*
+ * chirouter_server_rx_batch_flush - Processes the frames received in the current recv()
+ *
+ * The frames are grouped by router (preserving the order in which
+ * each router received them), and each group is processed with a
+ * single call to chirouter_process_ethernet_frames. The frames are
+ * grouped in a single pass over the batch with a counting sort by
+ * router (into the scratch array).
+ *
+ * ctx: Server context
+ *
+ * Returns: 0 on success, -1 if a critical error happens.
+ *
+ */
+int chirouter_server_rx_batch_flush(server_ctx_t *ctx)
+{
+    size_t end[ctx->num_routers + 1];
+    int rc = 0;
+
+    if(ctx->rx_batch_len == 0)
+        return 0;
+
+    /* Count the frames of each router, so that, once the counts are
+     * added up, end[r] is where the frames of router r start */
+    memset(end, 0, sizeof(end));
+    for(size_t i = 0; i < ctx->rx_batch_len; i++)
+        end[ctx->rx_batch_routers[i] - ctx->routers + 1]++;
+
+    for(int r = 0; r < ctx->num_routers; r++)
+        end[r + 1] += end[r];
+
+    /* Place each frame after the frames of the same router that were
+     * received before it. Afterwards, end[r] is where they end. */
+    for(size_t i = 0; i < ctx->rx_batch_len; i++)
+        ctx->rx_batch_scratch[end[ctx->rx_batch_routers[i] - ctx->routers]++] = ctx->rx_batch[i];
+
+    for(int r = 0; r < ctx->num_routers; r++)
+    {
+        size_t start = (r == 0) ? 0 : end[r - 1];
+        size_t n = end[r] - start;
+
+        if(n == 0)
+            continue;
+
+        if(chirouter_process_ethernet_frames(&ctx->routers[r], &ctx->rx_batch_scratch[start], n) == -1)
+        {
+            chilog(CRITICAL, "Critical error while processing Ethernet frames");
+            rc = -1;
+        }
+
+        for(size_t i = start; i < end[r]; i++)
+            chirouter_pktbuf_frame_free(&ctx->pool, ctx->rx_batch_scratch[i]);
     }
+
+    ctx->rx_batch_len = 0;
+
+    return rc;
+}
+
+
+/*
+ * chirouter_server_rx_batch_discard - Frees the frames received in the current recv()
+ *                                     without processing them
+ *
+ * ctx: Server context
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_server_rx_batch_discard(server_ctx_t *ctx)
+{
+    for(size_t i = 0; i < ctx->rx_batch_len; i++)
+        chirouter_pktbuf_frame_free(&ctx->pool, ctx->rx_batch[i]);
+
+    ctx->rx_batch_len = 0;
 }
 
 
@@ -393,8 +685,12 @@ int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *
 
         for(int i=0; i < nrouters; i++)
         {
-            chirouter_ctx_init(&ctx->routers[i]);
             ctx->routers[i].server = ctx;
+            if(chirouter_ctx_init(&ctx->routers[i]))
+            {
+                chilog(CRITICAL, "Could not allocate memory for router %i", i);
+                return -1;
+            }
         }
 
         break;
@@ -515,6 +811,44 @@ int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *
         r->num_rtable_entries++;
         break;
     }
+    case MSG_TYPE_ARP_ENTRY:
+    {
+        if(ctx->state != CONFIG)
+        {
+            chilog(CRITICAL, "Received an ARP ENTRY message but not in the CONFIG state");
+            return -1;
+        }
+
+        if(msg->arp_entry.r_id >= ctx->num_routers)
+        {
+            chilog(CRITICAL, "Received invalid Router ID: %d", msg->arp_entry.r_id);
+            return -1;
+        }
+
+        chirouter_ctx_t *r = &ctx->routers[msg->arp_entry.r_id];
+
+        if(msg->arp_entry.iface_id >= r->num_interfaces)
+        {
+            chilog(CRITICAL, "Received invalid Interface ID: %d", msg->arp_entry.iface_id);
+            return -1;
+        }
+
+        chilog(TRACE, "Processing ARP Entry in Router ID %d (with Interface ID %d)", msg->arp_entry.r_id, msg->arp_entry.iface_id);
+
+        chirouter_interface_t *iface = &r->interfaces[msg->arp_entry.iface_id];
+        struct in_addr ip = { .s_addr = msg->arp_entry.ipaddr };
+
+        pthread_mutex_lock(&r->lock_arp);
+        rc = chirouter_arp_cache_add_static(r, iface, &ip, msg->arp_entry.hwaddr);
+        pthread_mutex_unlock(&r->lock_arp);
+
+        if(rc)
+        {
+            chilog(CRITICAL, "Router %s: Could not add static ARP entry for %s", r->name, inet_ntoa(ip));
+            return -1;
+        }
+        break;
+    }
     case MSG_TYPE_END_CONFIG:
     {
         if(ctx->num_routers != ctx->max_routers)
@@ -537,17 +871,37 @@ int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *
             }
 
             chirouter_ctx_log(&ctx->routers[i], INFO);
-            pthread_create(&r->arp_thread, NULL, chirouter_arp_process, r);
             chilog(INFO, "--------------------------------------------------------------------------------");
         }
 
-        if(ctx->pcap)
+        if(ctx->pcap && chirouter_pcap_start(ctx))
+        {
+            chilog(CRITICAL, "Could not start capture writer thread");
+            return -1;
+        }
+
+        if(ctx->arp_snapshot_file)
+            chirouter_arp_snapshot_load(ctx, ctx->arp_snapshot_file);
+
+        if(chirouter_arp_thread_start(ctx))
         {
-            chirouter_pcap_write_section_header(ctx);
-            chirouter_pcap_write_interfaces(ctx);
+            chilog(CRITICAL, "Could not start ARP thread");
+            return -1;
+        }
+
+        if(ctx->num_workers > 0 && chirouter_workers_start(ctx))
+        {
+            chilog(CRITICAL, "Could not start worker threads");
+            return -1;
         }
 
         ctx->state = RUNNING;
+
+        if(ctx->arp_resolve_gateways)
+        {
+            for(int i=0; i < ctx->num_routers; i++)
+                chirouter_arp_resolve_gateways(&ctx->routers[i]);
+        }
         break;
     }
     case MSG_TYPE_ETHERNET_FRAME:
@@ -608,8 +962,6 @@ int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *
  */
 int chirouter_server_process_ethernet_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *msg, size_t len)
 {
-    int rc;
-
     if(len < ETHER_HDR_LEN)
     {
         chilog(ERROR, "Received an Ethernet frame on interface %s that is %i bytes long (shorter than an Ethernet header)", iface->name, len);
@@ -667,33 +1019,77 @@ int chirouter_server_process_ethernet_frame(chirouter_ctx_t *ctx, chirouter_inte
     }
 
     /* Create Ethernet frame struct */
-    ethernet_frame_t *frame = calloc(1, sizeof(ethernet_frame_t));
+    ethernet_frame_t *frame = chirouter_pktbuf_frame_alloc(&ctx->server->pool);
+    if(frame == NULL)
+    {
+        chilog(CRITICAL, "Could not allocate memory for Ethernet frame");
+        return -1;
+    }
 
-    frame->raw = calloc(len, 1);
     memcpy(frame->raw, msg, len);
     frame->length = len;
     frame->in_interface = iface;
+    chirouter_iface_count(iface, rx_frames);
 
-    if(ctx->server->pcap)
+    if(ctx->server->pcap_writer)
         chirouter_pcap_write_frame(ctx, iface, msg, len, PCAP_INBOUND);
 
-    rc = chirouter_process_ethernet_frame(ctx, frame);
+    if(ctx->server->workers)
+    {
+        chirouter_worker_t *worker = chirouter_worker_for_frame(ctx->server, ctx, frame);
+
+        /* The worker will free the frame */
+        if(chirouter_worker_enqueue(worker, ctx, frame))
+        {
+            chilog(DEBUG, "Queue for worker %u is full. Dropping frame.", worker->id);
+            chirouter_iface_count(iface, router_drops);
+            chirouter_pktbuf_frame_free(&ctx->server->pool, frame);
+            return 1;
+        }
 
-    free(frame->raw);
-    free(frame);
+        return 0;
+    }
 
-    if (rc == -1)
+    /* The frame will be processed (and freed) when the
+     * server reaches the end of the current recv() */
+    if(ctx->server->rx_batch_len == SERVER_RX_BATCH_SIZE && chirouter_server_rx_batch_flush(ctx->server) == -1)
     {
-        chilog(CRITICAL, "Critical error while processing Ethernet frame");
+        chirouter_pktbuf_frame_free(&ctx->server->pool, frame);
         return -1;
     }
 
+    ctx->server->rx_batch[ctx->server->rx_batch_len] = frame;
+    ctx->server->rx_batch_routers[ctx->server->rx_batch_len] = ctx;
+    ctx->server->rx_batch_len++;
+
     return 0;
 }
 
 
-/* See chirouter.h */
-int chirouter_send_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *frame, size_t frame_len)
+/*
+ * chirouter_server_frame_msg - Creates the ETHERNET FRAME message for an outbound frame
+ *
+ * Also logs the frame and writes it to the PCAP file (if any).
+ *
+ * ctx: Router context
+ *
+ * iface: Interface to send the frame on.
+ *
+ * frame: Pointer to the frame (including the Ethernet header and payload)
+ *
+ * frame_len: Length in bytes of the frame.
+ *
+ * msg: Message to fill in. Only the first 8 + frame_len bytes are written,
+ *      so this can point into a buffer of serialized messages.
+ *
+ * Returns:
+ *
+ *   0 on success,
+ *
+ *   1 if the frame cannot be sent
+ *
+ */
+static int chirouter_server_frame_msg(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *frame, size_t frame_len, chirouter_msg_t *msg)
 {
     if(frame_len < ETHER_HDR_LEN)
     {
@@ -718,23 +1114,100 @@ int chirouter_send_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uin
         return 1;
     }
 
-    if(ctx->server->pcap)
+    chirouter_iface_count(iface, tx_frames);
+
+    if(ctx->server->pcap_writer)
         chirouter_pcap_write_frame(ctx, iface, frame, frame_len, PCAP_OUTBOUND);
 
+    msg->type = MSG_TYPE_ETHERNET_FRAME;
+    msg->subtype = FROM_ROUTER;
+    msg->payload_length = htons(4+frame_len);
+    msg->ethernet.r_id = ctx->r_id;
+    msg->ethernet.iface_id = iface->pox_iface_id;
+    msg->ethernet.frame_len = htons(frame_len);
+    memcpy(msg->ethernet.frame, frame, frame_len);
+
+    return 0;
+}
+
+
+/* See chirouter.h */
+int chirouter_send_frame(chirouter_ctx_t *ctx, chirouter_interface_t *iface, uint8_t *frame, size_t frame_len)
+{
     chirouter_msg_t msg;
 
-    msg.type = MSG_TYPE_ETHERNET_FRAME;
-    msg.subtype = FROM_ROUTER;
-    msg.payload_length = htons(4+frame_len);
-    msg.ethernet.r_id = ctx->r_id;
-    msg.ethernet.iface_id = iface->pox_iface_id;
-    msg.ethernet.frame_len = htons(frame_len);
-    memcpy(msg.ethernet.frame, frame, frame_len);
+    int rc = chirouter_server_frame_msg(ctx, iface, frame, frame_len, &msg);
+    if(rc)
+        return rc;
 
     return chirouter_server_send_msg(ctx->server, &msg);
 }
 
 
+/*
+ * chirouter_server_tx_batch_add - Adds an outbound frame to a batch of messages
+ *
+ * This is equivalent to chirouter_send_frame, except the message is
+ * only sent when the batch is flushed (or when the batch is full).
+ *
+ * ctx: Router context
+ *
+ * batch: Batch of messages
+ *
+ * iface: Interface to send the frame on.
+ *
+ * frame: Pointer to the frame (including the Ethernet header and payload)
+ *
+ * frame_len: Length in bytes of the frame.
+ *
+ * Returns:
+ *
+ *   0 on success,
+ *
+ *   1 if a non-critical error happens
+ *
+ *   -1 if a critical error happens
+ *
+ */
+int chirouter_server_tx_batch_add(chirouter_ctx_t *ctx, chirouter_tx_batch_t *batch, chirouter_interface_t *iface, uint8_t *frame, size_t frame_len)
+{
+    if(batch->len + 8 + frame_len > SERVER_TX_BATCH_SIZE && chirouter_server_tx_batch_flush(ctx->server, batch) == -1)
+        return -1;
+
+    chirouter_msg_t *msg = (chirouter_msg_t *) (batch->buf + batch->len);
+
+    int rc = chirouter_server_frame_msg(ctx, iface, frame, frame_len, msg);
+    if(rc)
+        return rc;
+
+    batch->len += 8 + frame_len;
+
+    return 0;
+}
+
+
+/*
+ * chirouter_server_tx_batch_flush - Sends all the messages in a batch
+ *
+ * ctx: Server context
+ *
+ * batch: Batch of messages
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_server_tx_batch_flush(server_ctx_t *ctx, chirouter_tx_batch_t *batch)
+{
+    if(batch->len == 0)
+        return 0;
+
+    int rc = chirouter_server_send_bytes(ctx, batch->buf, batch->len);
+    batch->len = 0;
+
+    return rc;
+}
+
+
 /*
  * chirouter_server_ctx_free_routers - Frees router resources
  *
@@ -747,6 +1220,30 @@ int chirouter_server_ctx_free_routers(server_ctx_t *ctx)
 {
     int rc;
 
+    rc = chirouter_workers_stop(ctx);
+    if(rc)
+    {
+        chilog(CRITICAL, "Could not stop worker threads");
+        return -1;
+    }
+
+    rc = chirouter_arp_thread_stop(ctx);
+    if(rc)
+    {
+        chilog(CRITICAL, "Could not stop ARP thread");
+        return -1;
+    }
+
+    rc = chirouter_pcap_stop(ctx);
+    if(rc)
+    {
+        chilog(CRITICAL, "Could not stop capture writer thread");
+        return -1;
+    }
+    chirouter_pcap_free(ctx);
+
+    chirouter_graph_log_stats(&ctx->graph, "I/O thread", DEBUG);
+
     for(int i=0; i < ctx->num_routers; i++)
     {
         rc = chirouter_ctx_destroy(&ctx->routers[i]);
@@ -786,6 +1283,21 @@ int chirouter_server_ctx_destroy(server_ctx_t *ctx)
         return -1;
     }
 
+    chirouter_pktbuf_pool_log(&ctx->pool, INFO);
+    chirouter_pktbuf_pool_destroy(&ctx->pool);
+    chirouter_pktmem_free(&ctx->rx_mem);
+
+    pthread_mutex_destroy(&ctx->lock_arp_thread);
+    pthread_cond_destroy(&ctx->arp_cond);
+
+    close(ctx->shutdown_pipe[0]);
+    close(ctx->shutdown_pipe[1]);
+
+    free(ctx->arp_snapshot_file);
+    free(ctx->pcap_file);
+    chirouter_capfilter_free(ctx->pcap_filter);
+    free(ctx->pcap_sampling_rules);
+
     return 0;
 }
 
@@ -67,8 +67,28 @@
 #define SERVER_H_
 
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <signal.h>
 
 #include "chirouter.h"
+#include "graph.h"
+#include "pktbuf.h"
+#include "worker.h"
+
+/* Size of the buffer used to recv() data from the controller */
+#define SERVER_RECV_BUFFER_SIZE (65536u)
+
+/* Size of the buffer used to reassemble a single message */
+#define SERVER_MSG_BUFFER_SIZE (4096u)
+
+/* Maximum number of ETHERNET FRAME messages that can be received
+ * in a single recv() (each message has an 8-byte header followed
+ * by, at least, an Ethernet header) */
+#define SERVER_RX_BATCH_SIZE (SERVER_RECV_BUFFER_SIZE / (8 + ETHER_HDR_LEN) + 1)
+
+/* Size of the buffer used to gather the messages sent while
+ * processing a batch of frames */
+#define SERVER_TX_BATCH_SIZE (65536u)
 
 
 /* The POX controller and chirouter communicate using a simple message-based
@@ -207,6 +227,27 @@
  *  (of the specified router)
  *
  *
+ *  ARP ENTRY (Type = 8)
+ *  ====================
+ *
+ *  Subtype: Always 0 (None)
+ *
+ *  Payload:
+ *
+ *   ----------------------------------------------------------------------
+ *  |   Router ID  |  Interface ID  |  Hardware Address  |  IPv4 Address  |
+ *  |   (1 byte)   |    (1 byte)    |      (6 bytes)     |    (4 bytes)   |
+ *   ----------------------------------------------------------------------
+ *
+ *  Payload Length: 12
+ *
+ *  This message installs a static entry in the ARP cache of the given router,
+ *  mapping the IPv4 address to the hardware address of a host reachable
+ *  through the given interface. Static entries never expire. This message
+ *  is optional, and can be sent any number of times for a router, once its
+ *  INTERFACE messages have been sent.
+ *
+ *
  *  Protocol Description
  *  ====================
  *
@@ -219,7 +260,8 @@
  *  The next message from the POX controller must be a ROUTERS message specifying the
  *  number N of routers that chirouter will manage. This must be followed by N router
  *  specifications using the following messages: one ROUTER, one or more INTERFACE
- *  messages, and one or more ROUTING TABLE ENTRY messages.
+ *  messages, one or more ROUTING TABLE ENTRY messages, and zero or more
+ *  ARP ENTRY messages.
  *
  *  The router ID numbers must start from zero and be numbered consecutively. For
  *  a given router, the interface ID numbers must start from zero and be numbered
@@ -278,6 +320,13 @@ struct chirouter_msg {
           uint32_t gw;
       } rtable_entry;
       struct
+      {
+          uint8_t r_id;
+          uint8_t iface_id;
+          uint8_t hwaddr[ETHER_ADDR_LEN];
+          uint32_t ipaddr;
+      } arp_entry;
+      struct
       {
           uint8_t r_id;
           uint8_t iface_id;
@@ -289,6 +338,19 @@ struct chirouter_msg {
 typedef struct chirouter_msg chirouter_msg_t;
 
 
+/* Messages waiting to be sent to the controller. Outbound frames
+ * produced while processing a batch of inbound frames are gathered
+ * here, and sent with a single send() once the batch is processed */
+struct chirouter_tx_batch
+{
+    /* Number of bytes in the buffer */
+    size_t len;
+
+    /* Serialized messages */
+    uint8_t buf[SERVER_TX_BATCH_SIZE];
+};
+
+
 /* Message types */
 typedef enum
 {
@@ -298,7 +360,8 @@ typedef enum
     MSG_TYPE_INTERFACE = 4,
     MSG_TYPE_RTABLE_ENTRY = 5,
     MSG_TYPE_END_CONFIG = 6,
-    MSG_TYPE_ETHERNET_FRAME = 7
+    MSG_TYPE_ETHERNET_FRAME = 7,
+    MSG_TYPE_ARP_ENTRY = 8
 } chirouter_msg_type_t;
 
 
@@ -330,9 +393,23 @@ typedef struct server_ctx
     /* Client (active) socket */
     int client_socket;
 
+    /* Mutex to serialize messages sent on the client socket */
+    pthread_mutex_t lock_send;
+
+    /* If set, the messages for the controller are handed to this
+     * function (along with tx_sink_arg) instead of being sent on the
+     * client socket. Used when replaying a capture (see replay.c) */
+    int (*tx_sink)(void *arg, uint8_t *buf, size_t len);
+    void *tx_sink_arg;
+
     /* Server state */
     server_state_t state;
 
+    /* Set (and a byte written to the pipe, to wake up the server)
+     * when chirouter is asked to shut down. See chirouter_server_shutdown */
+    volatile sig_atomic_t shutdown;
+    int shutdown_pipe[2];
+
     /* Number of routers */
     uint16_t max_routers;
     uint16_t num_routers;
@@ -343,12 +420,132 @@ typedef struct server_ctx
 
     /* PCAP file to dump to */
     FILE *pcap;
+
+    /* Name of the capture file. If the capture is rotated, this is
+     * the base name, and the files are numbered (see pcap.c) */
+    char *pcap_file;
+
+    /* Rotate the capture file after it reaches this many bytes,
+     * or after this many seconds (0 means no limit) */
+    uint64_t pcap_rotate_bytes;
+    uint32_t pcap_rotate_secs;
+
+    /* Number of capture files to keep when rotating (0 means all) */
+    uint32_t pcap_rotate_keep;
+
+    /* Number of the capture file being written */
+    uint32_t pcap_file_seq;
+
+    /* Only frames matching this filter are captured (if not NULL) */
+    struct chirouter_capfilter *pcap_filter;
+
+    /* Maximum number of bytes of each frame that are
+     * captured (0 means the whole frame is captured) */
+    uint32_t pcap_snaplen;
+
+    /* Capture sampling on all the interfaces, and on specific
+     * interfaces (overriding the former). See pcap.h */
+    chirouter_pcap_sampling_t pcap_sampling;
+    struct chirouter_pcap_sampling_rule *pcap_sampling_rules;
+    unsigned int num_pcap_sampling_rules;
+
+    /* Capture writer. Frames are queued in its ring by the threads that
+     * send and receive them, and written to the PCAP file by its thread
+     * (see pcap.c). Only running in the RUNNING state. */
+    struct chirouter_pcap_writer *pcap_writer;
+
+    /* Should packet memory be backed by huge pages? */
+    bool hugepages;
+
+    /* Pool of buffers for Ethernet frames */
+    chirouter_pktbuf_pool_t pool;
+
+    /* Receive buffers (SERVER_RECV_BUFFER_SIZE bytes for recv(),
+     * followed by SERVER_MSG_BUFFER_SIZE bytes to reassemble messages) */
+    chirouter_pktmem_t rx_mem;
+
+    /* Maximum number of entries in each router's ARP cache */
+    uint32_t arpcache_size;
+
+    /* Interval between ARP request retransmissions (in milliseconds) */
+    uint32_t arp_retransmit_ms;
+
+    /* How long an IP address that did not answer ARP requests is
+     * considered unreachable (in milliseconds; zero disables the
+     * negative ARP cache) */
+    uint32_t arp_negcache_ms;
+
+    /* Maximum number of frames withheld by each pending ARP request,
+     * and by all the routers together, while waiting for ARP replies.
+     * If true, the oldest frame of a full pending request is dropped to
+     * make room for a new one; otherwise, the new frame is dropped. */
+    uint32_t arp_max_withheld_per_req;
+    uint32_t arp_max_withheld;
+    bool arp_withheld_drop_oldest;
+
+    /* Number of frames withheld in the pending ARP requests of all the
+     * routers (at most arp_max_withheld). Updated by the workers of
+     * different routers, so it is not protected by any lock_arp. */
+    _Atomic uint32_t num_withheld_frames;
+
+    /* Should the gateways in the routing tables be resolved
+     * as soon as the configuration is received? */
+    bool arp_resolve_gateways;
+
+    /* File the ARP caches are saved to when the controller
+     * disconnects, and restored from at END_CONFIG (NULL if
+     * ARP cache snapshots are disabled) */
+    char *arp_snapshot_file;
+
+    /* ARP thread, which runs the ARP timers of all the routers. Only
+     * running in the RUNNING state. It waits on arp_cond (protected by
+     * lock_arp_thread) until arp_next_wakeup, or until a timer is added
+     * that expires earlier than that, or until arp_running is cleared */
+    pthread_t arp_thread;
+    pthread_mutex_t lock_arp_thread;
+    pthread_cond_t arp_cond;
+    _Atomic uint64_t arp_next_wakeup;
+    bool arp_running;
+
+    /* Number of worker threads (zero if frames are processed
+     * by the I/O thread) */
+    uint16_t num_workers;
+
+    /* If true, the frames of each router are spread across all workers
+     * by flow, instead of assigning each router to a single worker */
+    bool flow_affine;
+
+    /* Array of workers (of size "num_workers"), and the memory
+     * holding their queues. Only allocated in the RUNNING state. */
+    chirouter_worker_t *workers;
+    chirouter_pktmem_t worker_mem;
+
+    /* Set by a worker when a critical error happens */
+    atomic_bool worker_error;
+
+    /* Packet processing graph used by the I/O thread (when there
+     * are no worker threads), and the messages it has yet to send */
+    chirouter_graph_t graph;
+    chirouter_tx_batch_t tx_batch;
+
+    /* Frames received in the current recv() (and the router that
+     * received each of them) that have yet to be processed. The
+     * scratch array is used to group them by router. */
+    ethernet_frame_t *rx_batch[SERVER_RX_BATCH_SIZE];
+    chirouter_ctx_t *rx_batch_routers[SERVER_RX_BATCH_SIZE];
+    ethernet_frame_t *rx_batch_scratch[SERVER_RX_BATCH_SIZE];
+    size_t rx_batch_len;
 } server_ctx_t;
 
 /* See server.c for documentation */
 int chirouter_server_ctx_init(server_ctx_t **ctx);
 int chirouter_server_setup(server_ctx_t *ctx, char *port);
+int chirouter_server_setup_memory(server_ctx_t *ctx);
 int chirouter_server_run(server_ctx_t *ctx);
+void chirouter_server_shutdown(server_ctx_t *ctx);
+int chirouter_server_process_single_message(server_ctx_t *ctx, chirouter_msg_t *msg);
+int chirouter_server_tx_batch_add(chirouter_ctx_t *ctx, chirouter_tx_batch_t *batch, chirouter_interface_t *iface, uint8_t *frame, size_t frame_len);
+int chirouter_server_tx_batch_flush(server_ctx_t *ctx, chirouter_tx_batch_t *batch);
 int chirouter_server_ctx_destroy(server_ctx_t *ctx);
 
 #endif /* SERVER_H_ */
@@ -0,0 +1,834 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  ARP cache tests
+ *
+ *  Checks the ARP cache (an open-addressing hash table with linear
+ *  probing): that every entry can be found from its home slot, that
+ *  removing an entry shifts back the entries after it so that their
+ *  probe sequences are not broken, and that the CLOCK policy evicts
+ *  entries that have not been used when the cache is full. Also checks
+ *  that static entries (including those listed in a topology file) are
+ *  never evicted or changed by the ARP packets the router receives.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "../chirouter.h"
+#include "../server.h"
+#include "../arp.h"
+#include "../graph.h"
+#include "../pktbuf.h"
+#include "../topology.h"
+#include "../log.h"
+#include "../utils.h"
+#include "test.h"
+
+/* A router that is not connected to anything, with
+ * an ARP cache of up to "size" entries */
+static chirouter_ctx_t* arp_test_router(uint32_t size)
+{
+    server_ctx_t *server;
+    chirouter_ctx_t *router = calloc(1, sizeof(chirouter_ctx_t));
+
+    CHECK(router != NULL);
+    CHECK(chirouter_server_ctx_init(&server) == 0);
+
+    server->arpcache_size = size;
+    strcpy(router->name, "r1");
+    router->server = server;
+    CHECK(chirouter_ctx_init(router) == 0);
+
+    return router;
+}
+
+
+static void arp_test_router_free(chirouter_ctx_t *router)
+{
+    server_ctx_t *server = router->server;
+
+    chirouter_ctx_destroy(router);
+    free(router);
+    server->num_routers = 0;
+    chirouter_server_ctx_destroy(server);
+    free(server);
+}
+
+
+static struct in_addr arp_test_ip(uint32_t n)
+{
+    struct in_addr ip = { .s_addr = htonl(0x0A000000 | n) };
+
+    return ip;
+}
+
+
+/* MAC address derived from an IP address, so lookups can be checked */
+static void arp_test_mac(struct in_addr ip, uint8_t *mac)
+{
+    mac[0] = 0x02;
+    mac[1] = 0x00;
+    memcpy(&mac[2], &ip.s_addr, sizeof(ip.s_addr));
+}
+
+
+static int arp_test_add(chirouter_ctx_t *router, struct in_addr ip)
+{
+    uint8_t mac[ETHER_ADDR_LEN];
+
+    arp_test_mac(ip, mac);
+
+    return chirouter_arp_cache_add(router, NULL, &ip, mac);
+}
+
+
+static uint32_t arp_test_home(chirouter_ctx_t *router, struct in_addr ip)
+{
+    return hash_mix(ip.s_addr) & (router->arpcache_capacity - 1);
+}
+
+
+/* Finds n addresses (starting at 10.0.0.start) whose home slot is "home" */
+static void arp_test_find_ips(chirouter_ctx_t *router, uint32_t home, uint32_t start, struct in_addr *ips, int n)
+{
+    for(uint32_t i = start; n > 0; i++)
+    {
+        struct in_addr ip = arp_test_ip(i);
+        if(arp_test_home(router, ip) == home)
+        {
+            *ips++ = ip;
+            n--;
+        }
+    }
+}
+
+
+/* Returns the slot an address is in, or -1 if it is not in the cache */
+static int64_t arp_test_slot(chirouter_ctx_t *router, struct in_addr ip)
+{
+    chirouter_arpcache_entry_t *entry = chirouter_arp_cache_lookup(router, &ip);
+
+    return entry ? entry - router->arpcache : -1;
+}
+
+
+/* Checks that there are as many valid slots as entries in the cache,
+ * and that the slots between the home slot of each entry and the slot
+ * it is in are all valid (so a lookup will find it) */
+static bool arp_test_consistent(chirouter_ctx_t *router)
+{
+    uint32_t mask = router->arpcache_capacity - 1;
+    uint32_t num_valid = 0;
+
+    for(uint32_t i = 0; i < router->arpcache_capacity; i++)
+    {
+        if(!router->arpcache[i].valid)
+            continue;
+
+        num_valid++;
+        for(uint32_t j = arp_test_home(router, router->arpcache[i].ip); j != i; j = (j + 1) & mask)
+            if(!router->arpcache[j].valid)
+                return false;
+    }
+
+    return num_valid == router->arpcache_num_entries;
+}
+
+
+/* Entries that collide are placed in consecutive slots, and removing
+ * the first one moves the others back */
+static void test_arp_backward_shift()
+{
+    chirouter_ctx_t *router = arp_test_router(4);
+    struct in_addr home0[3], home1[1];
+
+    pthread_mutex_lock(&router->lock_arp);
+
+    CHECK(router->arpcache_capacity == 8);
+    arp_test_find_ips(router, 0, 1, home0, 3);
+    arp_test_find_ips(router, 1, 1, home1, 1);
+
+    for(int i = 0; i < 3; i++)
+        CHECK(arp_test_add(router, home0[i]) == 0);
+    CHECK(arp_test_add(router, home1[0]) == 0);
+
+    CHECK(arp_test_slot(router, home0[0]) == 0);
+    CHECK(arp_test_slot(router, home0[1]) == 1);
+    CHECK(arp_test_slot(router, home0[2]) == 2);
+    CHECK(arp_test_slot(router, home1[0]) == 3);
+
+    chirouter_arp_cache_remove(router, chirouter_arp_cache_lookup(router, &home0[0]));
+
+    CHECK(arp_test_slot(router, home0[0]) == -1);
+    CHECK(arp_test_slot(router, home0[1]) == 0);
+    CHECK(arp_test_slot(router, home0[2]) == 1);
+    CHECK(arp_test_slot(router, home1[0]) == 2);
+    CHECK(!router->arpcache[3].valid);
+    CHECK(router->arpcache_num_entries == 3);
+    CHECK(arp_test_consistent(router));
+
+    pthread_mutex_unlock(&router->lock_arp);
+    arp_test_router_free(router);
+}
+
+
+/* An entry is not moved back past its home slot */
+static void test_arp_backward_shift_stops_at_home()
+{
+    chirouter_ctx_t *router = arp_test_router(4);
+    struct in_addr home0[2], home2[1];
+
+    pthread_mutex_lock(&router->lock_arp);
+
+    arp_test_find_ips(router, 0, 1, home0, 2);
+    arp_test_find_ips(router, 2, 1, home2, 1);
+
+    CHECK(arp_test_add(router, home0[0]) == 0);
+    CHECK(arp_test_add(router, home0[1]) == 0);
+    CHECK(arp_test_add(router, home2[0]) == 0);
+
+    chirouter_arp_cache_remove(router, chirouter_arp_cache_lookup(router, &home0[0]));
+
+    CHECK(arp_test_slot(router, home0[1]) == 0);
+    CHECK(!router->arpcache[1].valid);
+    CHECK(arp_test_slot(router, home2[0]) == 2);
+    CHECK(arp_test_consistent(router));
+
+    pthread_mutex_unlock(&router->lock_arp);
+    arp_test_router_free(router);
+}
+
+
+/* Probe sequences wrap around the end of the table */
+static void test_arp_backward_shift_wraps()
+{
+    chirouter_ctx_t *router = arp_test_router(4);
+    struct in_addr home7[3];
+
+    pthread_mutex_lock(&router->lock_arp);
+
+    arp_test_find_ips(router, 7, 1, home7, 3);
+
+    for(int i = 0; i < 3; i++)
+        CHECK(arp_test_add(router, home7[i]) == 0);
+
+    CHECK(arp_test_slot(router, home7[0]) == 7);
+    CHECK(arp_test_slot(router, home7[1]) == 0);
+    CHECK(arp_test_slot(router, home7[2]) == 1);
+
+    chirouter_arp_cache_remove(router, chirouter_arp_cache_lookup(router, &home7[1]));
+
+    CHECK(arp_test_slot(router, home7[0]) == 7);
+    CHECK(arp_test_slot(router, home7[1]) == -1);
+    CHECK(arp_test_slot(router, home7[2]) == 0);
+    CHECK(!router->arpcache[1].valid);
+    CHECK(arp_test_consistent(router));
+
+    pthread_mutex_unlock(&router->lock_arp);
+    arp_test_router_free(router);
+}
+
+
+/* Random additions, refreshes and removals, checked against
+ * the set of addresses that should be in the cache */
+static void test_arp_random()
+{
+    const uint32_t max_entries = 64, num_ips = 200;
+    chirouter_ctx_t *router = arp_test_router(max_entries);
+    bool present[num_ips];
+    uint32_t num_present = 0, inconsistent = 0, wrong = 0;
+
+    memset(present, 0, sizeof(present));
+    srand(1);
+
+    pthread_mutex_lock(&router->lock_arp);
+
+    for(int op = 0; op < 20000; op++)
+    {
+        uint32_t n = rand() % num_ips;
+        struct in_addr ip = arp_test_ip(n);
+
+        if(present[n] && rand() % 2)
+        {
+            chirouter_arp_cache_remove(router, chirouter_arp_cache_lookup(router, &ip));
+            present[n] = false;
+            num_present--;
+        }
+        else if(present[n] || num_present < max_entries)
+        {
+            /* Stay below the size of the cache, so nothing is evicted */
+            CHECK(arp_test_add(router, ip) == 0);
+            num_present += !present[n];
+            present[n] = true;
+        }
+
+        if(!arp_test_consistent(router))
+            inconsistent++;
+    }
+
+    CHECK(inconsistent == 0);
+    CHECK(router->arpcache_num_entries == num_present);
+    CHECK(router->arpcache_evictions == 0);
+
+    for(uint32_t n = 0; n < num_ips; n++)
+    {
+        struct in_addr ip = arp_test_ip(n);
+        uint8_t mac[ETHER_ADDR_LEN], expected[ETHER_ADDR_LEN];
+
+        arp_test_mac(ip, expected);
+        bool found = chirouter_arp_cache_lookup_mac(router, &ip, mac);
+        if(found != present[n] || (found && memcmp(mac, expected, ETHER_ADDR_LEN) != 0))
+            wrong++;
+        if((chirouter_arp_cache_lookup(router, &ip) != NULL) != present[n])
+            wrong++;
+    }
+    CHECK(wrong == 0);
+
+    pthread_mutex_unlock(&router->lock_arp);
+    arp_test_router_free(router);
+}
+
+
+/* Counts how many of the given addresses are in the cache */
+static int arp_test_count(chirouter_ctx_t *router, struct in_addr *ips, int n)
+{
+    int count = 0;
+
+    for(int i = 0; i < n; i++)
+        count += chirouter_arp_cache_lookup(router, &ips[i]) != NULL;
+
+    return count;
+}
+
+
+/* When the cache is full, adding an entry evicts one that has not been
+ * used since the CLOCK hand last passed over it */
+static void test_arp_clock_eviction()
+{
+    chirouter_ctx_t *router = arp_test_router(4);
+    struct in_addr ips[6];
+    uint8_t mac[ETHER_ADDR_LEN];
+
+    for(int i = 0; i < 6; i++)
+        ips[i] = arp_test_ip(i + 1);
+
+    pthread_mutex_lock(&router->lock_arp);
+
+    for(int i = 0; i < 4; i++)
+        CHECK(arp_test_add(router, ips[i]) == 0);
+    CHECK(router->arpcache_evictions == 0);
+
+    /* Every entry has been referenced, so the hand clears all the
+     * flags on its first pass, and evicts the entry in the first
+     * slot on the second one */
+    int64_t first_slot = router->arpcache_capacity;
+    int victim = -1;
+    for(int i = 0; i < 4; i++)
+    {
+        int64_t slot = arp_test_slot(router, ips[i]);
+        if(slot < first_slot)
+        {
+            first_slot = slot;
+            victim = i;
+        }
+    }
+
+    CHECK(arp_test_add(router, ips[4]) == 0);
+    CHECK(router->arpcache_evictions == 1);
+    CHECK(router->arpcache_num_entries == 4);
+    CHECK(chirouter_arp_cache_lookup(router, &ips[victim]) == NULL);
+    CHECK(chirouter_arp_cache_lookup(router, &ips[4]) != NULL);
+
+    /* Use the entry the hand will reach next, which gets a second chance */
+    int used = -1;
+    for(uint32_t i = 0; used == -1 && i < router->arpcache_capacity; i++)
+    {
+        chirouter_arpcache_entry_t *entry = &router->arpcache[(router->arpcache_clock_hand + i) & (router->arpcache_capacity - 1)];
+        for(int j = 0; entry->valid && j < 4; j++)
+            if(entry->ip.s_addr == ips[j].s_addr)
+                used = j;
+    }
+    CHECK(used != -1 && used != victim);
+    CHECK(chirouter_arp_cache_lookup_mac(router, &ips[used], mac));
+
+    /* One of the two entries that have not been used is evicted, and
+     * neither the entry that was used nor the newest entry are */
+    CHECK(arp_test_add(router, ips[5]) == 0);
+    CHECK(router->arpcache_evictions == 2);
+    CHECK(router->arpcache_num_entries == 4);
+    CHECK(chirouter_arp_cache_lookup(router, &ips[used]) != NULL);
+    CHECK(chirouter_arp_cache_lookup(router, &ips[4]) != NULL);
+    CHECK(chirouter_arp_cache_lookup(router, &ips[5]) != NULL);
+    CHECK(arp_test_count(router, ips, 4) == 2);
+    CHECK(arp_test_consistent(router));
+
+    pthread_mutex_unlock(&router->lock_arp);
+    arp_test_router_free(router);
+}
+
+
+/* Refreshing an entry that is already in the cache does not evict anything */
+static void test_arp_clock_refresh_no_eviction()
+{
+    chirouter_ctx_t *router = arp_test_router(4);
+
+    pthread_mutex_lock(&router->lock_arp);
+
+    for(int i = 0; i < 4; i++)
+        CHECK(arp_test_add(router, arp_test_ip(i + 1)) == 0);
+    for(int i = 0; i < 4; i++)
+        CHECK(arp_test_add(router, arp_test_ip(i + 1)) == 0);
+
+    CHECK(router->arpcache_evictions == 0);
+    CHECK(router->arpcache_num_entries == 4);
+
+    pthread_mutex_unlock(&router->lock_arp);
+    arp_test_router_free(router);
+}
+
+
+/* A static entry replaces a learned one, and is not changed
+ * when the mapping is learned again */
+static void test_arp_static_entry()
+{
+    chirouter_ctx_t *router = arp_test_router(4);
+    struct in_addr ip = arp_test_ip(1);
+    uint8_t learned_mac[ETHER_ADDR_LEN] = {0x02, 0, 0, 0, 0, 0x01};
+    uint8_t static_mac[ETHER_ADDR_LEN] = {0x02, 0, 0, 0, 0, 0x02};
+    uint8_t mac[ETHER_ADDR_LEN];
+
+    pthread_mutex_lock(&router->lock_arp);
+
+    CHECK(chirouter_arp_cache_add(router, NULL, &ip, learned_mac) == 0);
+    CHECK(chirouter_arp_cache_add_static(router, NULL, &ip, static_mac) == 0);
+
+    chirouter_arpcache_entry_t *entry = chirouter_arp_cache_lookup(router, &ip);
+    CHECK(entry != NULL && entry->permanent);
+    CHECK(entry != NULL && entry->expires == UINT64_MAX);
+    CHECK(router->arpcache_num_entries == 1);
+    CHECK(router->arpcache_num_static == 1);
+
+    CHECK(chirouter_arp_cache_add(router, NULL, &ip, learned_mac) == 0);
+    CHECK(chirouter_arp_cache_lookup_mac(router, &ip, mac));
+    CHECK(memcmp(mac, static_mac, ETHER_ADDR_LEN) == 0);
+    CHECK(router->arpcache_num_static == 1);
+
+    chirouter_arp_cache_remove(router, chirouter_arp_cache_lookup(router, &ip));
+    CHECK(router->arpcache_num_entries == 0);
+    CHECK(router->arpcache_num_static == 0);
+
+    pthread_mutex_unlock(&router->lock_arp);
+    arp_test_router_free(router);
+}
+
+
+/* Static entries are never evicted, and a cache full of
+ * static entries does not take any more entries */
+static void test_arp_static_not_evicted()
+{
+    chirouter_ctx_t *router = arp_test_router(4);
+    struct in_addr statics[4];
+    uint8_t mac[ETHER_ADDR_LEN];
+
+    pthread_mutex_lock(&router->lock_arp);
+
+    for(int i = 0; i < 3; i++)
+    {
+        statics[i] = arp_test_ip(100 + i);
+        arp_test_mac(statics[i], mac);
+        CHECK(chirouter_arp_cache_add_static(router, NULL, &statics[i], mac) == 0);
+    }
+
+    /* Only one slot is left for learned entries, so each
+     * new entry evicts the one learned before it */
+    for(int i = 1; i <= 10; i++)
+    {
+        struct in_addr ip = arp_test_ip(i);
+        CHECK(arp_test_add(router, ip) == 0);
+        CHECK(chirouter_arp_cache_lookup(router, &ip) != NULL);
+    }
+    CHECK(router->arpcache_evictions == 9);
+    CHECK(arp_test_count(router, statics, 3) == 3);
+
+    /* A static entry can take the slot of a learned one */
+    statics[3] = arp_test_ip(103);
+    arp_test_mac(statics[3], mac);
+    CHECK(chirouter_arp_cache_add_static(router, NULL, &statics[3], mac) == 0);
+    CHECK(arp_test_count(router, statics, 4) == 4);
+    CHECK(router->arpcache_num_static == 4);
+
+    /* But once the cache is full of static entries, nothing else fits */
+    struct in_addr ip = arp_test_ip(200);
+    arp_test_mac(ip, mac);
+    CHECK(arp_test_add(router, ip) == 1);
+    CHECK(chirouter_arp_cache_add_static(router, NULL, &ip, mac) == 1);
+    CHECK(chirouter_arp_cache_lookup(router, &ip) == NULL);
+    CHECK(router->arpcache_num_entries == 4);
+    CHECK(arp_test_consistent(router));
+
+    pthread_mutex_unlock(&router->lock_arp);
+    arp_test_router_free(router);
+}
+
+
+/* A static entry moved back by a removal is still static */
+static void test_arp_static_backward_shift()
+{
+    chirouter_ctx_t *router = arp_test_router(4);
+    struct in_addr home0[2];
+    uint8_t mac[ETHER_ADDR_LEN];
+
+    pthread_mutex_lock(&router->lock_arp);
+
+    arp_test_find_ips(router, 0, 1, home0, 2);
+    CHECK(arp_test_add(router, home0[0]) == 0);
+    arp_test_mac(home0[1], mac);
+    CHECK(chirouter_arp_cache_add_static(router, NULL, &home0[1], mac) == 0);
+    CHECK(arp_test_slot(router, home0[1]) == 1);
+
+    chirouter_arp_cache_remove(router, chirouter_arp_cache_lookup(router, &home0[0]));
+
+    CHECK(arp_test_slot(router, home0[1]) == 0);
+    CHECK(router->arpcache[0].permanent);
+    CHECK(!router->arpcache[1].permanent);
+    CHECK(router->arpcache_num_static == 1);
+
+    pthread_mutex_unlock(&router->lock_arp);
+    arp_test_router_free(router);
+}
+
+
+/* Counts the frames in a batch of messages for the controller (see tx_sink in server.h) */
+static int arp_test_sink(void *arg, uint8_t *buf, size_t len)
+{
+    uint64_t *frames = arg;
+    size_t off = 0;
+
+    while(off + 4 <= len)
+    {
+        chirouter_msg_t *msg = (chirouter_msg_t *) (buf + off);
+
+        if(msg->type == MSG_TYPE_ETHERNET_FRAME)
+            (*frames)++;
+
+        off += 4 + ntohs(msg->payload_length);
+    }
+
+    return 0;
+}
+
+
+/* Processes an ARP request for the router's interface from ip/mac */
+static int arp_test_request(server_ctx_t *server, chirouter_ctx_t *router, chirouter_interface_t *iface,
+                            const char *ip, uint8_t *mac)
+{
+    ethernet_frame_t *frame = chirouter_pktbuf_frame_alloc(&server->pool);
+    ethhdr_t *eth = (ethhdr_t *) frame->raw;
+    arp_packet_t *arp = (arp_packet_t *) ETHER_PAYLOAD_START(frame->raw);
+
+    memset(eth->dst, 0xFF, ETHER_ADDR_LEN);
+    memcpy(eth->src, mac, ETHER_ADDR_LEN);
+    eth->type = htons(ETHERTYPE_ARP);
+    arp->hrd = htons(ARP_HRD_ETHERNET);
+    arp->pro = htons(ETHERTYPE_IP);
+    arp->hln = ETHER_ADDR_LEN;
+    arp->pln = 4;
+    arp->op = htons(ARP_OP_REQUEST);
+    memcpy(arp->sha, mac, ETHER_ADDR_LEN);
+    arp->spa = inet_addr(ip);
+    memset(arp->tha, 0, ETHER_ADDR_LEN);
+    arp->tpa = iface->ip.s_addr;
+
+    frame->length = sizeof(ethhdr_t) + sizeof(arp_packet_t);
+    frame->in_interface = iface;
+
+    int rc = chirouter_process_ethernet_frame(router, frame);
+    chirouter_pktbuf_frame_free(&server->pool, frame);
+
+    return rc;
+}
+
+
+/* Creates a server with the routers in a topology (as JSON), which
+ * sends frames to arp_test_sink (counting them in *frames). Returns
+ * NULL if the topology could not be loaded or configured. */
+static server_ctx_t* arp_test_topology(const char *json, uint64_t *frames)
+{
+    char path[] = "/tmp/chirouter-test-XXXXXX", errbuf[256];
+    chirouter_topology_t topo;
+    server_ctx_t *server;
+
+    int fd = mkstemp(path);
+    CHECK(fd != -1);
+    CHECK(write(fd, json, strlen(json)) == (ssize_t) strlen(json));
+    close(fd);
+
+    int rc = chirouter_topology_load(path, &topo, errbuf, sizeof(errbuf));
+    if(rc != 0)
+        fprintf(stderr, "%s\n", errbuf);
+    CHECK(rc == 0);
+    unlink(path);
+    if(rc != 0)
+        return NULL;
+
+    CHECK(chirouter_server_ctx_init(&server) == 0);
+    CHECK(chirouter_server_setup_memory(server) == 0);
+    server->tx_sink = arp_test_sink;
+    server->tx_sink_arg = frames;
+    chirouter_graph_init(&server->graph, &server->tx_batch);
+    chirouter_graph_thread_set(&server->graph);
+
+    rc = chirouter_topology_configure(server, &topo);
+    CHECK(rc == 0);
+    chirouter_topology_free(&topo);
+
+    return server;
+}
+
+
+/* Static entries listed in a topology are installed when the router
+ * is configured, and ARP packets from the host do not change them */
+static void test_arp_static_topology()
+{
+    const char *json =
+        "{\"switches\": [{\"id\": 1, \"type\": \"router\","
+        "  \"interfaces\": [{\"name\": \"eth1\", \"ip\": \"10.0.0.1\", \"mask\": \"255.0.0.0\","
+        "                    \"hwaddr\": \"02:00:00:00:01:01\"}],"
+        "  \"rtable\": [{\"destination\": \"10.0.0.0\", \"gateway\": \"0.0.0.0\", \"mask\": \"255.0.0.0\","
+        "              \"metric\": 100, \"iface\": \"eth1\"}],"
+        "  \"arp\": [{\"ip\": \"10.0.0.2\", \"hwaddr\": \"02:00:00:00:00:02\", \"iface\": \"eth1\"}]}]}";
+    uint8_t static_mac[ETHER_ADDR_LEN] = {0x02, 0, 0, 0, 0, 0x02};
+    uint8_t other_mac[ETHER_ADDR_LEN] = {0x02, 0, 0, 0, 0, 0x22};
+    uint8_t mac[ETHER_ADDR_LEN];
+    uint64_t frames = 0;
+
+    server_ctx_t *server = arp_test_topology(json, &frames);
+    if(server == NULL)
+        return;
+
+    if(server->num_routers == 1)
+    {
+        chirouter_ctx_t *router = &server->routers[0];
+        chirouter_interface_t *iface = &router->interfaces[0];
+        struct in_addr ip = { .s_addr = inet_addr("10.0.0.2") };
+        struct in_addr other_ip = { .s_addr = inet_addr("10.0.0.3") };
+
+        CHECK(router->arpcache_num_static == 1);
+        CHECK(chirouter_arp_cache_lookup_mac(router, &ip, mac));
+        CHECK(memcmp(mac, static_mac, ETHER_ADDR_LEN) == 0);
+
+        /* The requests are answered, but only the host
+         * without a static entry is learned from */
+        CHECK(arp_test_request(server, router, iface, "10.0.0.2", other_mac) == 0);
+        CHECK(arp_test_request(server, router, iface, "10.0.0.3", other_mac) == 0);
+        CHECK(frames == 2);
+
+        pthread_mutex_lock(&router->lock_arp);
+        chirouter_arpcache_entry_t *entry = chirouter_arp_cache_lookup(router, &ip);
+        CHECK(entry != NULL && entry->permanent && memcmp(entry->mac, static_mac, ETHER_ADDR_LEN) == 0);
+        entry = chirouter_arp_cache_lookup(router, &other_ip);
+        CHECK(entry != NULL && !entry->permanent && memcmp(entry->mac, other_mac, ETHER_ADDR_LEN) == 0);
+        pthread_mutex_unlock(&router->lock_arp);
+    }
+    else
+        CHECK(server->num_routers == 1);
+
+    chirouter_server_ctx_destroy(server);
+    free(server);
+}
+
+
+/* Sets the age and remaining lifetime of an entry in a router's ARP cache */
+static chirouter_arpcache_entry_t* arp_test_snapshot_entry(chirouter_ctx_t *router, const char *iface_name,
+                                                           const char *ip, time_t age, uint64_t lifetime_ms)
+{
+    chirouter_interface_t *iface = NULL;
+    struct in_addr addr = { .s_addr = inet_addr(ip) };
+    uint8_t mac[ETHER_ADDR_LEN];
+
+    for(int i = 0; i < router->num_interfaces; i++)
+        if(strcmp(router->interfaces[i].name, iface_name) == 0)
+            iface = &router->interfaces[i];
+
+    arp_test_mac(addr, mac);
+    CHECK(iface != NULL && chirouter_arp_cache_add(router, iface, &addr, mac) == 0);
+
+    chirouter_arpcache_entry_t *entry = chirouter_arp_cache_lookup(router, &addr);
+    CHECK(entry != NULL);
+    if(entry == NULL)
+        return NULL;
+
+    entry->time_added = time(NULL) - age;
+    entry->expires = chirouter_timer_now_ms() + lifetime_ms;
+
+    return entry;
+}
+
+
+/* Checks that an entry restored from a snapshot is on the right
+ * interface, and kept its age and remaining lifetime */
+static void arp_test_snapshot_check(chirouter_ctx_t *router, const char *iface_name,
+                                    const char *ip, time_t age, uint64_t lifetime_ms)
+{
+    struct in_addr addr = { .s_addr = inet_addr(ip) };
+    uint8_t mac[ETHER_ADDR_LEN];
+
+    arp_test_mac(addr, mac);
+
+    chirouter_arpcache_entry_t *entry = chirouter_arp_cache_lookup(router, &addr);
+    CHECK(entry != NULL);
+    if(entry == NULL)
+        return;
+
+    time_t now_sec = time(NULL);
+    uint64_t now = chirouter_timer_now_ms();
+
+    CHECK(!entry->permanent && memcmp(entry->mac, mac, ETHER_ADDR_LEN) == 0);
+    CHECK(entry->iface != NULL && strcmp(entry->iface->name, iface_name) == 0);
+    /* Allow for the time the test takes (and for rounding to seconds) */
+    CHECK(now_sec - entry->time_added >= age && now_sec - entry->time_added <= age + 2);
+    CHECK(entry->expires <= now + lifetime_ms && entry->expires + 2000 >= now + lifetime_ms);
+}
+
+
+/* The ARP caches saved in a snapshot are restored into the routers and
+ * interfaces with the same names (even if the interfaces are in a
+ * different order), keeping their ages and remaining lifetimes, and
+ * skipping expired entries and entries on interfaces that are gone */
+static void test_arp_snapshot_roundtrip()
+{
+    const char *saved_json =
+        "{\"switches\": [{\"id\": 1, \"type\": \"router\","
+        "  \"interfaces\": [{\"name\": \"eth1\", \"ip\": \"10.0.0.1\", \"mask\": \"255.255.255.0\"},"
+        "                   {\"name\": \"eth2\", \"ip\": \"10.0.1.1\", \"mask\": \"255.255.255.0\"},"
+        "                   {\"name\": \"eth3\", \"ip\": \"10.0.2.1\", \"mask\": \"255.255.255.0\"}],"
+        "  \"rtable\": []}]}";
+    const char *loaded_json =
+        "{\"switches\": [{\"id\": 1, \"type\": \"router\","
+        "  \"interfaces\": [{\"name\": \"eth2\", \"ip\": \"10.0.1.1\", \"mask\": \"255.255.255.0\"},"
+        "                   {\"name\": \"eth1\", \"ip\": \"10.0.0.1\", \"mask\": \"255.255.255.0\"}],"
+        "  \"rtable\": []}]}";
+    char path[] = "/tmp/chirouter-test-XXXXXX";
+    uint64_t frames = 0;
+
+    int fd = mkstemp(path);
+    CHECK(fd != -1);
+    close(fd);
+
+    server_ctx_t *saved = arp_test_topology(saved_json, &frames);
+    server_ctx_t *loaded = arp_test_topology(loaded_json, &frames);
+
+    if(saved != NULL && loaded != NULL && saved->num_routers == 1 && loaded->num_routers == 1)
+    {
+        chirouter_ctx_t *router = &saved->routers[0];
+
+        pthread_mutex_lock(&router->lock_arp);
+        arp_test_snapshot_entry(router, "eth1", "10.0.0.2", 100, 60000);
+        arp_test_snapshot_entry(router, "eth2", "10.0.1.2", 5, 30000);
+        arp_test_snapshot_entry(router, "eth1", "10.0.0.3", 200, 0);
+        arp_test_snapshot_entry(router, "eth3", "10.0.2.2", 10, 60000);
+        pthread_mutex_unlock(&router->lock_arp);
+
+        CHECK(chirouter_arp_snapshot_save(saved, path) == 0);
+        CHECK(chirouter_arp_snapshot_load(loaded, path) == 0);
+
+        router = &loaded->routers[0];
+        struct in_addr expired = { .s_addr = inet_addr("10.0.0.3") };
+        struct in_addr gone = { .s_addr = inet_addr("10.0.2.2") };
+
+        pthread_mutex_lock(&router->lock_arp);
+        CHECK(router->arpcache_num_entries == 2);
+        arp_test_snapshot_check(router, "eth1", "10.0.0.2", 100, 60000);
+        arp_test_snapshot_check(router, "eth2", "10.0.1.2", 5, 30000);
+        CHECK(chirouter_arp_cache_lookup(router, &expired) == NULL);
+        CHECK(chirouter_arp_cache_lookup(router, &gone) == NULL);
+        pthread_mutex_unlock(&router->lock_arp);
+    }
+    else
+        CHECK(saved != NULL && loaded != NULL && saved->num_routers == 1 && loaded->num_routers == 1);
+
+    unlink(path);
+
+    if(saved)
+    {
+        chirouter_server_ctx_destroy(saved);
+        free(saved);
+    }
+    if(loaded)
+    {
+        chirouter_server_ctx_destroy(loaded);
+        free(loaded);
+    }
+}
+
+
+int main()
+{
+    /* Adding an entry to a cache full of static entries logs an error */
+    chirouter_setloglevel(CRITICAL);
+
+    RUN_TEST(test_arp_backward_shift);
+    RUN_TEST(test_arp_backward_shift_stops_at_home);
+    RUN_TEST(test_arp_backward_shift_wraps);
+    RUN_TEST(test_arp_random);
+    RUN_TEST(test_arp_clock_eviction);
+    RUN_TEST(test_arp_clock_refresh_no_eviction);
+    RUN_TEST(test_arp_static_entry);
+    RUN_TEST(test_arp_static_not_evicted);
+    RUN_TEST(test_arp_static_backward_shift);
+    RUN_TEST(test_arp_static_topology);
+    RUN_TEST(test_arp_snapshot_roundtrip);
+
+    return TEST_EXIT_STATUS;
+}
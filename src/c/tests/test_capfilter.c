@@ -0,0 +1,334 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Capture filter tests
+ *
+ *  Checks that filter expressions are compiled into the expected
+ *  primitives (and that invalid expressions are rejected), and that
+ *  compiled filters match the frames they should.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "../chirouter.h"
+#include "../capfilter.h"
+#include "../protocols/ipv4.h"
+#include "../protocols/arp.h"
+#include "test.h"
+
+static chirouter_capfilter_t* capfilter_test_compile(const char *expr)
+{
+    chirouter_capfilter_t *filter = NULL;
+    char errbuf[256];
+
+    if(chirouter_capfilter_compile(expr, &filter, errbuf, sizeof(errbuf)))
+    {
+        fprintf(stderr, "'%s': %s\n", expr, errbuf);
+        return NULL;
+    }
+
+    return filter;
+}
+
+
+/* Operators, precedence, and primitives that are shorthands for others */
+static void test_capfilter_compile()
+{
+    chirouter_capfilter_t *f = capfilter_test_compile("arp or icmp and not router r1");
+
+    CHECK(f != NULL);
+    if(f)
+    {
+        CHECK(f->num_terms == 3);
+        CHECK(f->terms[0].kind == CAPFILTER_ETHERTYPE && f->terms[0].value == ETHERTYPE_ARP);
+        CHECK(!f->terms[0].negate && f->terms[0].last);
+        CHECK(f->terms[1].kind == CAPFILTER_IPPROTO && f->terms[1].value == 1);
+        CHECK(!f->terms[1].negate && !f->terms[1].last);
+        CHECK(f->terms[2].kind == CAPFILTER_ROUTER && strcmp(f->terms[2].name, "r1") == 0);
+        CHECK(f->terms[2].negate && f->terms[2].last);
+        chirouter_capfilter_free(f);
+    }
+
+    /* "and" can be omitted, and "not not" cancels out */
+    f = capfilter_test_compile("  not not ip\tudp\n iface eth1 out");
+    CHECK(f != NULL);
+    if(f)
+    {
+        CHECK(f->num_terms == 4);
+        CHECK(f->terms[0].kind == CAPFILTER_ETHERTYPE && f->terms[0].value == ETHERTYPE_IP && !f->terms[0].negate);
+        CHECK(f->terms[1].kind == CAPFILTER_IPPROTO && f->terms[1].value == 17);
+        CHECK(f->terms[2].kind == CAPFILTER_IFACE && strcmp(f->terms[2].name, "eth1") == 0);
+        CHECK(f->terms[3].kind == CAPFILTER_DIRECTION && f->terms[3].value == PCAP_OUTBOUND);
+        for(int i = 0; i < 3; i++)
+            CHECK(!f->terms[i].last);
+        CHECK(f->terms[3].last);
+        chirouter_capfilter_free(f);
+    }
+
+    /* Numbers in decimal and hexadecimal */
+    f = capfilter_test_compile("ether proto 0x86DD or ip proto 89 or ether proto 2048");
+    CHECK(f != NULL);
+    if(f)
+    {
+        CHECK(f->num_terms == 3);
+        CHECK(f->terms[0].kind == CAPFILTER_ETHERTYPE && f->terms[0].value == 0x86DD);
+        CHECK(f->terms[1].kind == CAPFILTER_IPPROTO && f->terms[1].value == 89);
+        CHECK(f->terms[2].kind == CAPFILTER_ETHERTYPE && f->terms[2].value == 0x0800);
+        chirouter_capfilter_free(f);
+    }
+}
+
+
+/* Addresses and prefixes (which are stored masked) */
+static void test_capfilter_compile_addrs()
+{
+    chirouter_capfilter_t *f = capfilter_test_compile("src net 10.1.2.3/16 dst host 192.168.1.1 net 0.0.0.0/0 not host 1.2.3.4");
+
+    CHECK(f != NULL);
+    if(f)
+    {
+        CHECK(f->num_terms == 4);
+        for(unsigned int i = 0; i < f->num_terms; i++)
+            CHECK(f->terms[i].kind == CAPFILTER_ADDR);
+
+        CHECK(f->terms[0].addr_dir == CAPFILTER_ADDR_SRC);
+        CHECK(f->terms[0].addr == inet_addr("10.1.0.0"));
+        CHECK(f->terms[0].mask == inet_addr("255.255.0.0"));
+
+        CHECK(f->terms[1].addr_dir == CAPFILTER_ADDR_DST);
+        CHECK(f->terms[1].addr == inet_addr("192.168.1.1"));
+        CHECK(f->terms[1].mask == 0xFFFFFFFF);
+
+        CHECK(f->terms[2].addr_dir == (CAPFILTER_ADDR_SRC | CAPFILTER_ADDR_DST));
+        CHECK(f->terms[2].addr == 0 && f->terms[2].mask == 0);
+
+        CHECK(f->terms[3].negate);
+        CHECK(f->terms[3].addr == inet_addr("1.2.3.4"));
+        chirouter_capfilter_free(f);
+    }
+}
+
+
+/* Invalid expressions are rejected with an error message */
+static void test_capfilter_compile_errors()
+{
+    const char *exprs[] = {
+        "", "   ", "and arp", "arp or", "arp and", "arp or or ip", "not", "arp not",
+        "src", "src arp", "src not host 1.2.3.4", "dst src host 1.2.3.4",
+        "host", "host 1.2.3.4/24", "host 1.2.3", "host 1.2.3.400", "net 1.2.3.0/33", "net 1.2.3.0/", "net 1.2.3.0/-1",
+        "ether", "ether type 1", "ether proto", "ether proto 0x10000", "ether proto 12x",
+        "ip proto", "ip proto 256", "ip proto -1", "ip proto tcp",
+        "router", "router r123456789", "iface", "bogus", "arp bogus", "ARP"
+    };
+    int accepted = 0, no_message = 0;
+
+    for(size_t i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++)
+    {
+        chirouter_capfilter_t *f = NULL;
+        char errbuf[256] = "";
+
+        if(chirouter_capfilter_compile(exprs[i], &f, errbuf, sizeof(errbuf)) != -1 || f != NULL)
+        {
+            fprintf(stderr, "'%s' was accepted\n", exprs[i]);
+            chirouter_capfilter_free(f);
+            accepted++;
+        }
+        else if(errbuf[0] == '\0')
+            no_message++;
+    }
+
+    CHECK(accepted == 0);
+    CHECK(no_message == 0);
+
+    /* At most CAPFILTER_MAX_TERMS primitives */
+    char expr[8 * (CAPFILTER_MAX_TERMS + 1)] = "";
+    for(unsigned int i = 0; i < CAPFILTER_MAX_TERMS; i++)
+        strcat(expr, i ? " or arp" : "arp");
+
+    chirouter_capfilter_t *f = capfilter_test_compile(expr);
+    CHECK(f != NULL && f->num_terms == CAPFILTER_MAX_TERMS);
+    chirouter_capfilter_free(f);
+
+    strcat(expr, " or ip");
+    f = NULL;
+    char errbuf[256];
+    CHECK(chirouter_capfilter_compile(expr, &f, errbuf, sizeof(errbuf)) == -1 && f == NULL);
+}
+
+
+/* Frames to match filters against */
+typedef enum
+{
+    FRAME_ARP,     /* ARP request from 10.0.0.2 for 10.0.0.1 */
+    FRAME_ICMP,    /* ICMP from 192.168.1.2 to 10.0.0.5 */
+    FRAME_UDP,     /* UDP from 10.0.0.5 to 172.16.0.9 */
+    FRAME_IPV6,    /* An IPv6 frame */
+    FRAME_SHORT,   /* An IPv4 frame too short to have an IP header */
+    NUM_FRAMES
+} capfilter_test_frame_t;
+
+
+static size_t capfilter_test_frame(capfilter_test_frame_t which, uint8_t *frame)
+{
+    ethhdr_t *eth = (ethhdr_t *) frame;
+    iphdr_t *ip = (iphdr_t *) ETHER_PAYLOAD_START(frame);
+    arp_packet_t *arp = (arp_packet_t *) ETHER_PAYLOAD_START(frame);
+
+    memset(frame, 0, ETHER_FRAME_MAX_LEN);
+
+    switch(which)
+    {
+    case FRAME_ARP:
+        eth->type = htons(ETHERTYPE_ARP);
+        arp->spa = inet_addr("10.0.0.2");
+        arp->tpa = inet_addr("10.0.0.1");
+        return sizeof(ethhdr_t) + sizeof(arp_packet_t);
+    case FRAME_ICMP:
+    case FRAME_UDP:
+        eth->type = htons(ETHERTYPE_IP);
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->proto = which == FRAME_ICMP ? 1 : 17;
+        ip->src = inet_addr(which == FRAME_ICMP ? "192.168.1.2" : "10.0.0.5");
+        ip->dst = inet_addr(which == FRAME_ICMP ? "10.0.0.5" : "172.16.0.9");
+        return sizeof(ethhdr_t) + sizeof(iphdr_t) + 8;
+    case FRAME_IPV6:
+        eth->type = htons(ETHERTYPE_IPV6);
+        return sizeof(ethhdr_t) + 40;
+    case FRAME_SHORT:
+        eth->type = htons(ETHERTYPE_IP);
+        return sizeof(ethhdr_t) + 10;
+    default:
+        return 0;
+    }
+}
+
+
+/* Which frames (as a bitmask of capfilter_test_frame_t) match each filter,
+ * when they are received by router r1 on eth1 */
+static void test_capfilter_match()
+{
+    struct
+    {
+        const char *expr;
+        unsigned int matches;
+    } cases[] = {
+        {"arp", 1 << FRAME_ARP},
+        {"ip", 1 << FRAME_ICMP | 1 << FRAME_UDP | 1 << FRAME_SHORT},
+        {"not ip", 1 << FRAME_ARP | 1 << FRAME_IPV6},
+        {"ether proto 0x86dd", 1 << FRAME_IPV6},
+        {"icmp", 1 << FRAME_ICMP},
+        {"ip proto 17", 1 << FRAME_UDP},
+        {"not udp", 1 << FRAME_ARP | 1 << FRAME_ICMP | 1 << FRAME_IPV6 | 1 << FRAME_SHORT},
+        {"host 10.0.0.5", 1 << FRAME_ICMP | 1 << FRAME_UDP},
+        {"src host 10.0.0.5", 1 << FRAME_UDP},
+        {"dst host 10.0.0.5", 1 << FRAME_ICMP},
+        {"src host 10.0.0.2", 1 << FRAME_ARP},
+        {"dst net 10.0.0.0/8", 1 << FRAME_ARP | 1 << FRAME_ICMP},
+        {"net 172.16.0.0/12", 1 << FRAME_UDP},
+        {"net 0.0.0.0/0", 1 << FRAME_ARP | 1 << FRAME_ICMP | 1 << FRAME_UDP},
+        {"arp or icmp", 1 << FRAME_ARP | 1 << FRAME_ICMP},
+        {"ip and not icmp", 1 << FRAME_UDP | 1 << FRAME_SHORT},
+        {"arp or udp and dst net 172.16.0.0/12", 1 << FRAME_ARP | 1 << FRAME_UDP},
+        {"arp or udp and src net 172.16.0.0/12", 1 << FRAME_ARP},
+        {"router r1 arp", 1 << FRAME_ARP},
+        {"router r2 or icmp", 1 << FRAME_ICMP},
+        {"iface eth1 in udp", 1 << FRAME_UDP},
+        {"iface eth2 or out", 0},
+        {"not router r1 or not in", 0},
+    };
+    chirouter_ctx_t router;
+    chirouter_interface_t iface;
+    uint8_t frame[ETHER_FRAME_MAX_LEN];
+    int wrong = 0;
+
+    memset(&router, 0, sizeof(router));
+    memset(&iface, 0, sizeof(iface));
+    strcpy(router.name, "r1");
+    strcpy(iface.name, "eth1");
+
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        chirouter_capfilter_t *f = capfilter_test_compile(cases[i].expr);
+        CHECK(f != NULL);
+        if(f == NULL)
+            continue;
+
+        for(int which = 0; which < NUM_FRAMES; which++)
+        {
+            size_t len = capfilter_test_frame(which, frame);
+            bool expected = (cases[i].matches >> which) & 1;
+
+            if(chirouter_capfilter_match(f, &router, &iface, PCAP_INBOUND, frame, len) != expected)
+            {
+                fprintf(stderr, "'%s' %s frame %d\n", cases[i].expr, expected ? "does not match" : "matches", which);
+                wrong++;
+            }
+        }
+
+        chirouter_capfilter_free(f);
+    }
+
+    CHECK(wrong == 0);
+}
+
+
+int main()
+{
+    RUN_TEST(test_capfilter_compile);
+    RUN_TEST(test_capfilter_compile_addrs);
+    RUN_TEST(test_capfilter_compile_errors);
+    RUN_TEST(test_capfilter_match);
+
+    return TEST_EXIT_STATUS;
+}
@@ -0,0 +1,531 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Capture file tests
+ *
+ *  Captures frames with chirouter_pcap_write_frame, and reads the capture
+ *  file back with chirouter_pcap_read, checking that the blocks built by
+ *  the capture writer (and coalesced into large writes) contain the
+ *  frames that were captured, in the order they were captured.
+ *
+ *  Also reads pcapng files built by hand, to check that the reader
+ *  follows the format (and not just the files chirouter writes), and
+ *  that it rejects files that are not valid.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "../chirouter.h"
+#include "../server.h"
+#include "../pcap.h"
+#include "../log.h"
+#include "../clock.h"
+#include "test.h"
+
+#define NUM_IFACES (2)
+
+/* A server with a single router with two interfaces, capturing to a temporary file */
+typedef struct pcap_test
+{
+    server_ctx_t ctx;
+    chirouter_ctx_t router;
+    chirouter_interface_t ifaces[NUM_IFACES];
+    char path[64];
+} pcap_test_t;
+
+
+static void pcap_test_start(pcap_test_t *t)
+{
+    memset(t, 0, sizeof(pcap_test_t));
+
+    strcpy(t->router.name, "r1");
+    t->router.server = &t->ctx;
+    t->router.interfaces = t->ifaces;
+    t->router.num_interfaces = t->router.max_interfaces = NUM_IFACES;
+    for(int i = 0; i < NUM_IFACES; i++)
+    {
+        snprintf(t->ifaces[i].name, sizeof(t->ifaces[i].name), "eth%d", i + 1);
+        uint8_t mac[ETHER_ADDR_LEN] = {0x02, 0, 0, 0, 0, i + 1};
+        memcpy(t->ifaces[i].mac, mac, ETHER_ADDR_LEN);
+    }
+    t->ctx.routers = &t->router;
+    t->ctx.num_routers = t->ctx.max_routers = 1;
+
+    strcpy(t->path, "/tmp/chirouter-test-XXXXXX");
+    int fd = mkstemp(t->path);
+    CHECK(fd != -1);
+    t->ctx.pcap = fdopen(fd, "w");
+    CHECK(t->ctx.pcap != NULL);
+
+    CHECK(chirouter_pcap_start(&t->ctx) == 0);
+}
+
+
+static void pcap_test_stop(pcap_test_t *t, chirouter_pcap_file_t *cap)
+{
+    char errbuf[256];
+
+    CHECK(chirouter_pcap_stop(&t->ctx) == 0);
+    chirouter_pcap_free(&t->ctx);
+    fclose(t->ctx.pcap);
+
+    int rc = chirouter_pcap_read(t->path, cap, errbuf, sizeof(errbuf));
+    if(rc != 0)
+        fprintf(stderr, "%s\n", errbuf);
+    CHECK(rc == 0);
+
+    unlink(t->path);
+}
+
+
+/* Captures a frame, retrying while the capture ring is full */
+static void pcap_test_capture(pcap_test_t *t, int iface, uint8_t *frame, size_t len, pcap_packet_direction_t dir)
+{
+    while(chirouter_pcap_write_frame(&t->router, &t->ifaces[iface], frame, len, dir) != 0)
+        sched_yield();
+}
+
+
+/* Frames of different lengths (which need different amounts of padding)
+ * on both interfaces, in both directions */
+static void test_pcap_roundtrip()
+{
+    pcap_test_t t;
+    chirouter_pcap_file_t cap;
+    size_t lens[] = {ETHER_HDR_LEN, 61, 62, 63, 64, ETHER_FRAME_MAX_LEN};
+    size_t num_frames = sizeof(lens) / sizeof(lens[0]);
+    uint8_t frame[ETHER_FRAME_MAX_LEN];
+
+    pcap_test_start(&t);
+    for(size_t i = 0; i < num_frames; i++)
+    {
+        memset(frame, i + 1, lens[i]);
+        pcap_test_capture(&t, i % NUM_IFACES, frame, lens[i], i % 2 ? PCAP_OUTBOUND : PCAP_INBOUND);
+    }
+    pcap_test_stop(&t, &cap);
+
+    CHECK(cap.num_ifaces == NUM_IFACES);
+    for(uint32_t i = 0; i < cap.num_ifaces && i < NUM_IFACES; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "r1-eth%u", i + 1);
+        CHECK(strcmp(cap.ifaces[i].name, name) == 0);
+        CHECK(cap.ifaces[i].has_mac);
+        CHECK(memcmp(cap.ifaces[i].mac, t.ifaces[i].mac, ETHER_ADDR_LEN) == 0);
+    }
+
+    CHECK(cap.num_frames == num_frames);
+    for(uint64_t i = 0; i < cap.num_frames && i < num_frames; i++)
+    {
+        chirouter_pcap_file_frame_t *f = &cap.frames[i];
+
+        memset(frame, i + 1, lens[i]);
+        CHECK(f->iface == i % NUM_IFACES);
+        CHECK(f->dir == (i % 2 ? PCAP_OUTBOUND : PCAP_INBOUND));
+        CHECK(f->caplen == lens[i]);
+        CHECK(f->origlen == lens[i]);
+        CHECK(memcmp(f->data, frame, lens[i]) == 0);
+        CHECK(f->ts_ns > 0);
+        if(i > 0)
+            CHECK(f->ts_ns >= cap.frames[i - 1].ts_ns);
+    }
+
+    chirouter_pcap_file_free(&cap);
+}
+
+
+/* More frames than fit in the capture ring or in the write buffer,
+ * so they are written in several coalesced writes */
+static void test_pcap_coalesced_writes()
+{
+    pcap_test_t t;
+    chirouter_pcap_file_t cap;
+    uint32_t num_frames = 4 * PCAP_RING_SIZE;
+    uint8_t frame[ETHER_FRAME_MAX_LEN];
+
+    memset(frame, 0xAB, sizeof(frame));
+
+    pcap_test_start(&t);
+    for(uint32_t i = 0; i < num_frames; i++)
+    {
+        /* Each frame carries its sequence number, and has a different length */
+        memcpy(frame, &i, sizeof(i));
+        pcap_test_capture(&t, 0, frame, ETHER_HDR_LEN + i % (ETHER_FRAME_MAX_LEN - ETHER_HDR_LEN), PCAP_OUTBOUND);
+    }
+    pcap_test_stop(&t, &cap);
+
+    CHECK(cap.num_frames == num_frames);
+
+    uint64_t out_of_order = 0;
+    for(uint64_t i = 0; i < cap.num_frames; i++)
+    {
+        uint32_t seq;
+        memcpy(&seq, cap.frames[i].data, sizeof(seq));
+        if(seq != i || cap.frames[i].caplen != ETHER_HDR_LEN + i % (ETHER_FRAME_MAX_LEN - ETHER_HDR_LEN))
+            out_of_order++;
+    }
+    CHECK(out_of_order == 0);
+
+    chirouter_pcap_file_free(&cap);
+}
+
+
+/* A pcapng file built by hand, block by block (independently
+ * of the capture writer), to be read with chirouter_pcap_read */
+typedef struct pcapng_test_file
+{
+    uint8_t data[4096];
+    size_t len;
+
+    /* Offset of the block being built */
+    size_t block;
+} pcapng_test_file_t;
+
+
+static void pcapng_test_put(pcapng_test_file_t *f, const void *data, size_t len)
+{
+    memcpy(f->data + f->len, data, len);
+    f->len += len;
+}
+
+
+static void pcapng_test_put32(pcapng_test_file_t *f, uint32_t value)
+{
+    pcapng_test_put(f, &value, sizeof(value));
+}
+
+
+static void pcapng_test_pad(pcapng_test_file_t *f)
+{
+    while(f->len % 4)
+        f->data[f->len++] = 0;
+}
+
+
+static void pcapng_test_block_begin(pcapng_test_file_t *f, uint32_t type)
+{
+    f->block = f->len;
+    pcapng_test_put32(f, type);
+    pcapng_test_put32(f, 0);
+}
+
+
+/* Fills in the block length, at the start and at the end of the block */
+static void pcapng_test_block_end(pcapng_test_file_t *f)
+{
+    pcapng_test_pad(f);
+
+    uint32_t len = f->len - f->block + 4;
+    memcpy(f->data + f->block + 4, &len, sizeof(len));
+    pcapng_test_put32(f, len);
+}
+
+
+static void pcapng_test_option(pcapng_test_file_t *f, uint16_t code, const void *value, uint16_t len)
+{
+    pcapng_test_put(f, &code, sizeof(code));
+    pcapng_test_put(f, &len, sizeof(len));
+    if(len)
+        pcapng_test_put(f, value, len);
+    pcapng_test_pad(f);
+}
+
+
+static void pcapng_test_shb(pcapng_test_file_t *f, uint32_t magic)
+{
+    uint16_t version[2] = {1, 0};
+    int64_t section_len = -1;
+
+    pcapng_test_block_begin(f, 0x0A0D0D0A);
+    pcapng_test_put32(f, magic);
+    pcapng_test_put(f, version, sizeof(version));
+    pcapng_test_put(f, &section_len, sizeof(section_len));
+    pcapng_test_block_end(f);
+}
+
+
+/* Interface Description Block, with an if_name option, and an if_MACaddr
+ * and if_tsresol option if mac is not NULL and tsresol is not zero */
+static void pcapng_test_idb(pcapng_test_file_t *f, uint16_t link_type, const char *name, const uint8_t *mac, uint8_t tsresol)
+{
+    uint16_t reserved = 0;
+
+    pcapng_test_block_begin(f, 1);
+    pcapng_test_put(f, &link_type, sizeof(link_type));
+    pcapng_test_put(f, &reserved, sizeof(reserved));
+    pcapng_test_put32(f, 0);
+    pcapng_test_option(f, 2, name, strlen(name));
+    if(mac)
+        pcapng_test_option(f, 6, mac, ETHER_ADDR_LEN);
+    if(tsresol)
+        pcapng_test_option(f, 9, &tsresol, 1);
+    pcapng_test_option(f, 0, NULL, 0);
+    pcapng_test_block_end(f);
+}
+
+
+/* Enhanced Packet Block, with an epb_flags option if dir is not PCAP_UNSPECIFIED */
+static void pcapng_test_epb(pcapng_test_file_t *f, uint32_t iface, uint64_t ts, const uint8_t *data,
+                            uint32_t caplen, uint32_t origlen, pcap_packet_direction_t dir)
+{
+    pcapng_test_block_begin(f, 6);
+    pcapng_test_put32(f, iface);
+    pcapng_test_put32(f, ts >> 32);
+    pcapng_test_put32(f, ts & 0xFFFFFFFF);
+    pcapng_test_put32(f, caplen);
+    pcapng_test_put32(f, origlen);
+    pcapng_test_put(f, data, caplen);
+    pcapng_test_pad(f);
+    if(dir != PCAP_UNSPECIFIED)
+    {
+        uint32_t flags = dir;
+        pcapng_test_option(f, 2, &flags, sizeof(flags));
+        pcapng_test_option(f, 0, NULL, 0);
+    }
+    pcapng_test_block_end(f);
+}
+
+
+/* A block of a type the reader does not know about */
+static void pcapng_test_other(pcapng_test_file_t *f, uint32_t type)
+{
+    pcapng_test_block_begin(f, type);
+    pcapng_test_put32(f, 0xDEADBEEF);
+    pcapng_test_block_end(f);
+}
+
+
+/* Writes a file to disk and reads it with chirouter_pcap_read */
+static int pcapng_test_read(pcapng_test_file_t *f, chirouter_pcap_file_t *cap, char *errbuf, size_t errlen)
+{
+    char path[] = "/tmp/chirouter-test-XXXXXX";
+    int fd = mkstemp(path);
+
+    CHECK(fd != -1);
+    CHECK(write(fd, f->data, f->len) == (ssize_t) f->len);
+    close(fd);
+
+    errbuf[0] = '\0';
+    int rc = chirouter_pcap_read(path, cap, errbuf, errlen);
+    unlink(path);
+
+    return rc;
+}
+
+
+/* Two sections, with interfaces with different timestamp resolutions,
+ * blocks the reader skips, and truncated and padded frames */
+static void test_pcap_read()
+{
+    pcapng_test_file_t f = { .len = 0 };
+    chirouter_pcap_file_t cap;
+    char errbuf[256];
+    uint8_t mac[ETHER_ADDR_LEN] = {0x02, 0, 0, 0, 0, 0x42};
+    uint8_t data[100];
+
+    for(size_t i = 0; i < sizeof(data); i++)
+        data[i] = i;
+
+    pcapng_test_shb(&f, 0x1A2B3C4D);
+    pcapng_test_idb(&f, 1, "r1-eth1", NULL, 9);
+    pcapng_test_idb(&f, 1, "r1-eth2", mac, 0);
+    pcapng_test_epb(&f, 1, 1500000000123456ull, data, 61, 61, PCAP_UNSPECIFIED);
+    pcapng_test_other(&f, 5);
+    pcapng_test_epb(&f, 0, 1500000000123456789ull, data, 5, 100, PCAP_INBOUND);
+    pcapng_test_other(&f, 0x40000BAD);
+    pcapng_test_shb(&f, 0x1A2B3C4D);
+    pcapng_test_idb(&f, 1, "r2-eth1", NULL, 0x80 | 20);
+    pcapng_test_epb(&f, 0, 3ull << 20, data, 100, 100, PCAP_OUTBOUND);
+
+    int rc = pcapng_test_read(&f, &cap, errbuf, sizeof(errbuf));
+    if(rc != 0)
+        fprintf(stderr, "%s\n", errbuf);
+    CHECK(rc == 0);
+
+    CHECK(cap.num_ifaces == 3);
+    if(cap.num_ifaces == 3)
+    {
+        CHECK(strcmp(cap.ifaces[0].name, "r1-eth1") == 0);
+        CHECK(cap.ifaces[0].tsresol == 9 && !cap.ifaces[0].has_mac);
+        CHECK(strcmp(cap.ifaces[1].name, "r1-eth2") == 0);
+        CHECK(cap.ifaces[1].tsresol == 6 && cap.ifaces[1].has_mac);
+        CHECK(memcmp(cap.ifaces[1].mac, mac, ETHER_ADDR_LEN) == 0);
+        CHECK(strcmp(cap.ifaces[2].name, "r2-eth1") == 0);
+    }
+
+    CHECK(cap.num_frames == 3);
+    if(cap.num_frames == 3)
+    {
+        CHECK(cap.frames[0].iface == 1 && cap.frames[0].dir == PCAP_UNSPECIFIED);
+        CHECK(cap.frames[0].ts_ns == 1500000000123456000ull);
+        CHECK(cap.frames[0].caplen == 61 && cap.frames[0].origlen == 61);
+        CHECK(memcmp(cap.frames[0].data, data, 61) == 0);
+
+        CHECK(cap.frames[1].iface == 0 && cap.frames[1].dir == PCAP_INBOUND);
+        CHECK(cap.frames[1].ts_ns == 1500000000123456789ull);
+        CHECK(cap.frames[1].caplen == 5 && cap.frames[1].origlen == 100);
+        CHECK(memcmp(cap.frames[1].data, data, 5) == 0);
+
+        /* Interfaces are numbered from the start of their section */
+        CHECK(cap.frames[2].iface == 2 && cap.frames[2].dir == PCAP_OUTBOUND);
+        CHECK(cap.frames[2].ts_ns == 3000000000ull);
+        CHECK(memcmp(cap.frames[2].data, data, 100) == 0);
+    }
+
+    chirouter_pcap_file_free(&cap);
+}
+
+
+/* Files that are not valid are rejected with an error message */
+static void test_pcap_read_errors()
+{
+    struct
+    {
+        const char *error;
+        pcapng_test_file_t f;
+    } *cases = calloc(10, sizeof(*cases));
+    uint8_t data[64] = {0};
+    int n = 0;
+
+    CHECK(cases != NULL);
+    if(cases == NULL)
+        return;
+
+    /* An empty file */
+    cases[n++].error = "Not a pcapng file";
+
+    /* A file that does not start with a section header */
+    cases[n].error = "Not a pcapng file";
+    pcapng_test_idb(&cases[n].f, 1, "r1-eth1", NULL, 0);
+    pcapng_test_shb(&cases[n++].f, 0x1A2B3C4D);
+
+    /* A section in the other byte order */
+    cases[n].error = "not in this host's byte order";
+    pcapng_test_shb(&cases[n++].f, 0x4D3C2B1A);
+
+    /* A few bytes after the last block */
+    cases[n].error = "Truncated block at offset 28";
+    pcapng_test_shb(&cases[n].f, 0x1A2B3C4D);
+    pcapng_test_put32(&cases[n++].f, 1);
+
+    /* A block that extends past the end of the file */
+    cases[n].error = "Invalid block length at offset 28";
+    pcapng_test_shb(&cases[n].f, 0x1A2B3C4D);
+    pcapng_test_idb(&cases[n].f, 1, "r1-eth1", NULL, 0);
+    cases[n++].f.len -= 4;
+
+    /* A block length that is not a multiple of four */
+    cases[n].error = "Invalid block length at offset 28";
+    pcapng_test_shb(&cases[n].f, 0x1A2B3C4D);
+    pcapng_test_other(&cases[n].f, 0x40000BAD);
+    cases[n++].f.data[28 + 4] = 15;
+
+    /* A non-Ethernet interface */
+    cases[n].error = "Invalid or unsupported (non-Ethernet) interface at offset 28";
+    pcapng_test_shb(&cases[n].f, 0x1A2B3C4D);
+    pcapng_test_idb(&cases[n++].f, 101, "r1-eth1", NULL, 0);
+
+    /* A frame on an interface that is not in its section */
+    cases[n].error = "Invalid frame at offset";
+    pcapng_test_shb(&cases[n].f, 0x1A2B3C4D);
+    pcapng_test_idb(&cases[n].f, 1, "r1-eth1", NULL, 0);
+    pcapng_test_shb(&cases[n].f, 0x1A2B3C4D);
+    pcapng_test_epb(&cases[n++].f, 0, 0, data, sizeof(data), sizeof(data), PCAP_OUTBOUND);
+
+    /* A frame longer than its block */
+    cases[n].error = "Invalid frame at offset";
+    pcapng_test_shb(&cases[n].f, 0x1A2B3C4D);
+    pcapng_test_idb(&cases[n].f, 1, "r1-eth1", NULL, 0);
+    pcapng_test_epb(&cases[n].f, 0, 0, data, sizeof(data), sizeof(data), PCAP_UNSPECIFIED);
+    uint32_t caplen = sizeof(data) + 4;
+    memcpy(&cases[n].f.data[cases[n].f.block + 8 + 12], &caplen, sizeof(caplen));
+    n++;
+
+    for(int i = 0; i < n; i++)
+    {
+        chirouter_pcap_file_t cap;
+        char errbuf[256];
+
+        int rc = pcapng_test_read(&cases[i].f, &cap, errbuf, sizeof(errbuf));
+        if(rc != -1 || strstr(errbuf, cases[i].error) == NULL)
+        {
+            fprintf(stderr, "case %d: expected '%s', got %d ('%s')\n", i, cases[i].error, rc, errbuf);
+            test_failures++;
+        }
+        chirouter_pcap_file_free(&cap);
+    }
+
+    /* A file that does not exist */
+    chirouter_pcap_file_t cap;
+    char errbuf[256];
+    CHECK(chirouter_pcap_read("/nonexistent/capture.pcapng", &cap, errbuf, sizeof(errbuf)) == -1);
+    CHECK(strstr(errbuf, "No such file or directory") != NULL);
+    chirouter_pcap_file_free(&cap);
+
+    free(cases);
+}
+
+
+int main()
+{
+    chirouter_setloglevel(ERROR);
+    chirouter_clock_init(CLOCK_SOURCE_REALTIME);
+
+    RUN_TEST(test_pcap_roundtrip);
+    RUN_TEST(test_pcap_coalesced_writes);
+    RUN_TEST(test_pcap_read);
+    RUN_TEST(test_pcap_read_errors);
+
+    return TEST_EXIT_STATUS;
+}
@@ -0,0 +1,261 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  Timer wheel tests
+ *
+ *  Adds timers that land on every level of a timer wheel (and beyond
+ *  its range), advances the wheel, and checks that each timer runs
+ *  exactly once, on the tick it expires on, after being cascaded down
+ *  through the levels.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "../timer.h"
+#include "test.h"
+
+/* Ticks covered by each level of the wheel */
+#define LEVEL_TICKS(level) (1ull << (TIMER_WHEEL_BITS * (level)))
+
+/* A timer that records when it ran */
+typedef struct test_timer
+{
+    chirouter_timer_t timer;
+    chirouter_timer_wheel_t *wheel;
+
+    /* Tick the timer must run on */
+    uint64_t expected;
+
+    /* Tick it last ran on, and number of times it ran */
+    uint64_t ran_at;
+    uint32_t runs;
+
+    /* If not zero, the timer adds itself again this many ticks later */
+    uint64_t period;
+} test_timer_t;
+
+
+static void test_timer_fn(chirouter_timer_t *timer, void *arg)
+{
+    test_timer_t *t = arg;
+
+    t->ran_at = t->wheel->now;
+    t->runs++;
+
+    if(t->period)
+    {
+        t->expected = t->wheel->now + t->period;
+        chirouter_timer_add(t->wheel, timer, t->expected * TIMER_TICK_MS);
+    }
+}
+
+
+static void test_timer_add(chirouter_timer_wheel_t *wheel, test_timer_t *t, uint64_t ticks)
+{
+    memset(t, 0, sizeof(test_timer_t));
+    chirouter_timer_init(&t->timer, test_timer_fn, t);
+    t->wheel = wheel;
+    t->expected = wheel->now + ticks;
+    chirouter_timer_add(wheel, &t->timer, t->expected * TIMER_TICK_MS);
+}
+
+
+/* Timers on every level, and one beyond the range of the wheel,
+ * each run on their expiry tick after being cascaded down */
+static void test_timer_cascade()
+{
+    chirouter_timer_wheel_t wheel;
+    uint64_t deltas[] = {1, LEVEL_TICKS(1) - 1, LEVEL_TICKS(1), LEVEL_TICKS(1) + 1,
+                         LEVEL_TICKS(2) - 1, LEVEL_TICKS(2), LEVEL_TICKS(2) + 37,
+                         LEVEL_TICKS(3) + 5, 2 * LEVEL_TICKS(3) - 1, LEVEL_TICKS(4) + 100};
+    uint8_t levels[] = {0, 0, 1, 1, 1, 2, 2, 3, 3, 3};
+    const int n = sizeof(deltas) / sizeof(deltas[0]);
+    test_timer_t timers[n];
+
+    /* Start in the middle of a rotation of every level */
+    chirouter_timer_wheel_init(&wheel, (LEVEL_TICKS(3) + LEVEL_TICKS(2) + 3 * LEVEL_TICKS(1) + 17) * TIMER_TICK_MS);
+
+    for(int i = 0; i < n; i++)
+    {
+        test_timer_add(&wheel, &timers[i], deltas[i]);
+        CHECK(timers[i].timer.pending);
+        CHECK(timers[i].timer.level == levels[i]);
+    }
+    CHECK(wheel.num_timers == (uint64_t) n);
+
+    uint64_t num_run = chirouter_timer_wheel_advance(&wheel, timers[n - 1].expected * TIMER_TICK_MS);
+
+    CHECK(num_run == (uint64_t) n);
+    CHECK(wheel.num_timers == 0);
+    for(int i = 0; i < n; i++)
+    {
+        CHECK(!timers[i].timer.pending);
+        CHECK(timers[i].runs == 1);
+        CHECK(timers[i].ran_at == timers[i].expected);
+    }
+}
+
+
+/* Advancing the wheel a little at a time runs
+ * the timers on the same ticks as advancing it at once */
+static void test_timer_random()
+{
+    chirouter_timer_wheel_t wheel;
+    const int n = 2000;
+    test_timer_t *timers = calloc(n, sizeof(test_timer_t));
+    uint64_t last = 0, num_run = 0;
+    int wrong = 0;
+
+    CHECK(timers != NULL);
+    srand(1);
+
+    chirouter_timer_wheel_init(&wheel, 123456789 * TIMER_TICK_MS);
+
+    for(int i = 0; i < n; i++)
+    {
+        test_timer_add(&wheel, &timers[i], 1 + rand() % (3 * LEVEL_TICKS(3)));
+        if(timers[i].expected > last)
+            last = timers[i].expected;
+    }
+
+    /* Half of the timers are rescheduled, and some are deleted */
+    for(int i = 0; i < n; i += 2)
+    {
+        timers[i].expected = wheel.now + 1 + rand() % (3 * LEVEL_TICKS(2));
+        chirouter_timer_add(&wheel, &timers[i].timer, timers[i].expected * TIMER_TICK_MS);
+    }
+    for(int i = 1; i < n; i += 10)
+        chirouter_timer_del(&wheel, &timers[i].timer);
+
+    while(wheel.now < last)
+    {
+        uint64_t next = chirouter_timer_wheel_next(&wheel);
+
+        /* The wheel never asks to be advanced later than its next timer */
+        for(int i = 0; i < n; i++)
+            if(timers[i].timer.pending && next > timers[i].expected * TIMER_TICK_MS)
+                wrong++;
+
+        num_run += chirouter_timer_wheel_advance(&wheel, (wheel.now + 1 + rand() % 5000) * TIMER_TICK_MS);
+    }
+
+    for(int i = 0; i < n; i++)
+    {
+        uint32_t runs = i % 10 == 1 ? 0 : 1;
+        if(timers[i].runs != runs || (runs && timers[i].ran_at != timers[i].expected))
+            wrong++;
+    }
+
+    CHECK(wrong == 0);
+    CHECK(num_run == (uint64_t) (n - n / 10));
+    CHECK(wheel.num_timers == 0);
+
+    free(timers);
+}
+
+
+/* A timer can add itself again from its function */
+static void test_timer_periodic()
+{
+    chirouter_timer_wheel_t wheel;
+    test_timer_t t;
+
+    chirouter_timer_wheel_init(&wheel, 0);
+
+    test_timer_add(&wheel, &t, 100);
+    t.period = 100;
+
+    uint64_t num_run = chirouter_timer_wheel_advance(&wheel, 1000 * TIMER_TICK_MS);
+
+    CHECK(num_run == 10);
+    CHECK(t.runs == 10);
+    CHECK(t.ran_at == 1000);
+    CHECK(t.timer.pending);
+    CHECK(wheel.num_timers == 1);
+
+    chirouter_timer_del(&wheel, &t.timer);
+    CHECK(!t.timer.pending);
+    CHECK(wheel.num_timers == 0);
+    CHECK(chirouter_timer_wheel_next(&wheel) == UINT64_MAX);
+}
+
+
+/* Timers that have already expired run on the next tick */
+static void test_timer_past()
+{
+    chirouter_timer_wheel_t wheel;
+    test_timer_t t;
+
+    chirouter_timer_wheel_init(&wheel, 5000 * TIMER_TICK_MS);
+
+    memset(&t, 0, sizeof(t));
+    chirouter_timer_init(&t.timer, test_timer_fn, &t);
+    t.wheel = &wheel;
+    chirouter_timer_add(&wheel, &t.timer, 10 * TIMER_TICK_MS);
+
+    CHECK(chirouter_timer_wheel_next(&wheel) == 5001 * TIMER_TICK_MS);
+    CHECK(chirouter_timer_wheel_advance(&wheel, 5001 * TIMER_TICK_MS) == 1);
+    CHECK(t.runs == 1);
+    CHECK(t.ran_at == 5001);
+}
+
+
+int main()
+{
+    RUN_TEST(test_timer_cascade);
+    RUN_TEST(test_timer_random);
+    RUN_TEST(test_timer_periodic);
+    RUN_TEST(test_timer_past);
+
+    return TEST_EXIT_STATUS;
+}
@@ -0,0 +1,277 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This module implements a hierarchical timer wheel (see timer.h)
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "timer.h"
+#include "utlist.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/* Largest number of ticks a timer can be placed in the future */
+#define TIMER_WHEEL_MAX_DELTA ((1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+
+/* See timer.h */
+uint64_t chirouter_timer_now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* See timer.h */
+void chirouter_timer_wheel_init(chirouter_timer_wheel_t *wheel, uint64_t now_ms)
+{
+    memset(wheel, 0, sizeof(chirouter_timer_wheel_t));
+    wheel->now = now_ms / TIMER_TICK_MS;
+}
+
+
+/* See timer.h */
+void chirouter_timer_init(chirouter_timer_t *timer, chirouter_timer_fn_t fn, void *arg)
+{
+    memset(timer, 0, sizeof(chirouter_timer_t));
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+
+/*
+ * chirouter_timer_place - Places a timer in the slot corresponding to its expiry tick
+ *
+ * wheel: Timer wheel
+ *
+ * timer: Timer (not in the wheel, and with expires > wheel->now)
+ *
+ * Returns: nothing.
+ *
+ */
+static void chirouter_timer_place(chirouter_timer_wheel_t *wheel, chirouter_timer_t *timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+    uint64_t expires = timer->expires;
+    uint8_t level = 0;
+
+    /* Timers too far in the future are placed as far as possible,
+     * and placed again when they reach level 0 */
+    if(delta > TIMER_WHEEL_MAX_DELTA)
+    {
+        delta = TIMER_WHEEL_MAX_DELTA;
+        expires = wheel->now + delta;
+    }
+
+    while((delta >> (TIMER_WHEEL_BITS * (level + 1))) != 0)
+        level++;
+
+    timer->level = level;
+    timer->slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    timer->pending = true;
+
+    DL_APPEND(wheel->slots[timer->level][timer->slot], timer);
+}
+
+
+/* See timer.h */
+void chirouter_timer_add(chirouter_timer_wheel_t *wheel, chirouter_timer_t *timer, uint64_t expires_ms)
+{
+    uint64_t expires = (expires_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    if(timer->pending)
+        chirouter_timer_del(wheel, timer);
+
+    timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+    chirouter_timer_place(wheel, timer);
+    wheel->num_timers++;
+}
+
+
+/* See timer.h */
+void chirouter_timer_del(chirouter_timer_wheel_t *wheel, chirouter_timer_t *timer)
+{
+    if(!timer->pending)
+        return;
+
+    DL_DELETE(wheel->slots[timer->level][timer->slot], timer);
+    timer->pending = false;
+    wheel->num_timers--;
+}
+
+
+/*
+ * chirouter_timer_cascade - Moves the timers in a slot to lower levels
+ *
+ * wheel: Timer wheel
+ *
+ * level: Level (must be > 0)
+ *
+ * Returns: Index of the slot that was cascaded
+ *
+ */
+static uint32_t chirouter_timer_cascade(chirouter_timer_wheel_t *wheel, uint8_t level)
+{
+    uint32_t slot = (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    chirouter_timer_t *timers = wheel->slots[level][slot], *timer, *tmp;
+
+    wheel->slots[level][slot] = NULL;
+
+    DL_FOREACH_SAFE(timers, timer, tmp)
+    {
+        DL_DELETE(timers, timer);
+        chirouter_timer_place(wheel, timer);
+    }
+
+    return slot;
+}
+
+
+/* See timer.h */
+uint64_t chirouter_timer_wheel_advance(chirouter_timer_wheel_t *wheel, uint64_t now_ms)
+{
+    uint64_t target = now_ms / TIMER_TICK_MS;
+    uint64_t num_run = 0;
+
+    while(wheel->now < target)
+    {
+        if(wheel->num_timers == 0)
+        {
+            wheel->now = target;
+            break;
+        }
+
+        wheel->now++;
+
+        /* When a level completes a rotation, the next slot
+         * of the level above it is cascaded down */
+        if((wheel->now & TIMER_WHEEL_MASK) == 0)
+        {
+            for(uint8_t level = 1; level < TIMER_WHEEL_LEVELS; level++)
+            {
+                if(chirouter_timer_cascade(wheel, level) != 0)
+                    break;
+            }
+        }
+
+        uint32_t slot = wheel->now & TIMER_WHEEL_MASK;
+        chirouter_timer_t *timers = wheel->slots[0][slot], *timer, *tmp;
+
+        wheel->slots[0][slot] = NULL;
+
+        DL_FOREACH_SAFE(timers, timer, tmp)
+        {
+            DL_DELETE(timers, timer);
+
+            if(timer->expires > wheel->now)
+            {
+                /* Timer was too far in the future when it was added */
+                chirouter_timer_place(wheel, timer);
+                continue;
+            }
+
+            timer->pending = false;
+            wheel->num_timers--;
+            num_run++;
+
+            timer->fn(timer, timer->arg);
+        }
+    }
+
+    return num_run;
+}
+
+
+/* See timer.h */
+uint64_t chirouter_timer_wheel_next(chirouter_timer_wheel_t *wheel)
+{
+    if(wheel->num_timers == 0)
+        return UINT64_MAX;
+
+    uint64_t end = wheel->now | TIMER_WHEEL_MASK;
+
+    for(uint64_t tick = wheel->now + 1; tick <= end; tick++)
+    {
+        if(wheel->slots[0][tick & TIMER_WHEEL_MASK] != NULL)
+            return tick * TIMER_TICK_MS;
+    }
+
+    return (end + 1) * TIMER_TICK_MS;
+}
+
+
+/* See timer.h */
+void chirouter_timer_wheel_clear(chirouter_timer_wheel_t *wheel, void (*free_fn)(chirouter_timer_t *timer))
+{
+    for(uint8_t level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        for(uint32_t slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+        {
+            chirouter_timer_t *timers = wheel->slots[level][slot], *timer, *tmp;
+
+            wheel->slots[level][slot] = NULL;
+
+            DL_FOREACH_SAFE(timers, timer, tmp)
+            {
+                DL_DELETE(timers, timer);
+                timer->pending = false;
+                if(free_fn)
+                    free_fn(timer);
+            }
+        }
+    }
+
+    wheel->num_timers = 0;
+}
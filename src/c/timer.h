@@ -0,0 +1,243 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This header file defines a hierarchical timer wheel.
+ *
+ *  Timers are kept in TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots
+ *  each. A slot in level 0 covers a single tick (TIMER_TICK_MS milliseconds),
+ *  and a slot in level n covers all the ticks of a full rotation of level n-1.
+ *  Timers that expire soon are placed in level 0, and timers that expire
+ *  further in the future are placed in higher levels and cascaded down as
+ *  the wheel turns. Adding and removing a timer is O(1), and advancing the
+ *  wheel only visits the timers that have expired (plus the ones that are
+ *  cascaded down, which happens at most once per level).
+ *
+ *  The wheel does not do any locking; the code that owns the wheel must
+ *  serialize access to it.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Length of a tick, in milliseconds */
+#define TIMER_TICK_MS (10u)
+
+/* Levels, and number of slots per level. With 10ms ticks, level 0
+ * covers 640ms, level 1 covers ~41s, level 2 ~44min, and level 3 ~46h.
+ * Timers further in the future are placed in the last slot of level 3,
+ * and are simply re-inserted when they reach level 0 too early */
+#define TIMER_WHEEL_BITS (6u)
+#define TIMER_WHEEL_SLOTS (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS (4u)
+
+
+typedef struct chirouter_timer chirouter_timer_t;
+
+/* Function called when a timer expires. The timer has already been
+ * removed from the wheel, so the function can free it or add it again */
+typedef void (*chirouter_timer_fn_t)(chirouter_timer_t *timer, void *arg);
+
+/* A timer. This is meant to be embedded in the struct it applies to
+ * (or in a small struct with whatever the function needs to know) */
+struct chirouter_timer
+{
+    /* Tick at which the timer expires */
+    uint64_t expires;
+
+    /* Function to call when the timer expires, and its argument */
+    chirouter_timer_fn_t fn;
+    void *arg;
+
+    /* Is the timer in a wheel? */
+    bool pending;
+
+    /* Slot the timer is in */
+    uint8_t level;
+    uint8_t slot;
+
+    /* List pointers */
+    struct chirouter_timer *prev;
+    struct chirouter_timer *next;
+};
+
+
+/* A timer wheel */
+typedef struct chirouter_timer_wheel
+{
+    /* Current tick (all timers expiring at or before this
+     * tick have been run) */
+    uint64_t now;
+
+    /* Number of timers in the wheel */
+    uint64_t num_timers;
+
+    /* Slots */
+    chirouter_timer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} chirouter_timer_wheel_t;
+
+
+/*
+ * chirouter_timer_now_ms - Returns the current time in milliseconds
+ *
+ * This is CLOCK_MONOTONIC time, and is the time base used by all the
+ * functions below.
+ *
+ * Returns: Current time in milliseconds
+ *
+ */
+uint64_t chirouter_timer_now_ms();
+
+
+/*
+ * chirouter_timer_wheel_init - Initializes a timer wheel
+ *
+ * wheel: Timer wheel
+ *
+ * now_ms: Current time (from chirouter_timer_now_ms)
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_timer_wheel_init(chirouter_timer_wheel_t *wheel, uint64_t now_ms);
+
+
+/*
+ * chirouter_timer_init - Initializes a timer
+ *
+ * timer: Timer
+ *
+ * fn: Function to call when the timer expires
+ *
+ * arg: Argument to pass to fn
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_timer_init(chirouter_timer_t *timer, chirouter_timer_fn_t fn, void *arg);
+
+
+/*
+ * chirouter_timer_add - Adds a timer to a wheel
+ *
+ * If the timer is already in the wheel, it is rescheduled.
+ *
+ * wheel: Timer wheel
+ *
+ * timer: Timer (initialized with chirouter_timer_init)
+ *
+ * expires_ms: Time at which the timer must expire. Timers that have
+ *             already expired will expire on the next tick.
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_timer_add(chirouter_timer_wheel_t *wheel, chirouter_timer_t *timer, uint64_t expires_ms);
+
+
+/*
+ * chirouter_timer_del - Removes a timer from a wheel
+ *
+ * Does nothing if the timer is not in the wheel.
+ *
+ * wheel: Timer wheel
+ *
+ * timer: Timer
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_timer_del(chirouter_timer_wheel_t *wheel, chirouter_timer_t *timer);
+
+
+/*
+ * chirouter_timer_wheel_advance - Advances a wheel, running any expired timers
+ *
+ * wheel: Timer wheel
+ *
+ * now_ms: Current time (from chirouter_timer_now_ms)
+ *
+ * Returns: Number of timers that were run
+ *
+ */
+uint64_t chirouter_timer_wheel_advance(chirouter_timer_wheel_t *wheel, uint64_t now_ms);
+
+
+/*
+ * chirouter_timer_wheel_next - Returns the time by which the wheel must be advanced next
+ *
+ * This is the expiry time of the earliest timer in level 0 or, if level 0
+ * is empty, the time at which level 0 completes its rotation (and timers
+ * from the upper levels may have to be cascaded down). It may therefore
+ * be earlier than any of the timers in the wheel, but never later.
+ *
+ * wheel: Timer wheel
+ *
+ * Returns: Time in milliseconds (comparable with chirouter_timer_now_ms),
+ *          or UINT64_MAX if the wheel is empty.
+ *
+ */
+uint64_t chirouter_timer_wheel_next(chirouter_timer_wheel_t *wheel);
+
+
+/*
+ * chirouter_timer_wheel_clear - Removes all the timers from a wheel
+ *
+ * wheel: Timer wheel
+ *
+ * free_fn: If not NULL, called on every timer that was in the wheel
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_timer_wheel_clear(chirouter_timer_wheel_t *wheel, void (*free_fn)(chirouter_timer_t *timer));
+
+#endif
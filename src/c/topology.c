@@ -0,0 +1,868 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This module loads topology files, and configures the routers from them.
+ *
+ *  See topology.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <ctype.h>
+#include <math.h>
+#include <arpa/inet.h>
+
+#include "topology.h"
+#include "log.h"
+
+
+/* A JSON value. Topology files are small, so they are parsed into
+ * a tree of values, and then the tree is walked to build the topology */
+typedef enum
+{
+    JSON_NULL,
+    JSON_FALSE,
+    JSON_TRUE,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+} chirouter_json_type_t;
+
+typedef struct chirouter_json_value
+{
+    chirouter_json_type_t type;
+
+    /* Key, if the value is a member of an object */
+    char *key;
+
+    /* Value of a string or a number */
+    char *string;
+    double number;
+
+    /* Elements of an array, or members of an object */
+    struct chirouter_json_value *elts;
+    size_t num_elts;
+} chirouter_json_value_t;
+
+/* JSON parser state */
+typedef struct chirouter_json_parser
+{
+    /* Text being parsed (NUL-terminated), and current position */
+    const char *text;
+    const char *p;
+
+    char *errbuf;
+    size_t errlen;
+} chirouter_json_parser_t;
+
+
+/*
+ * chirouter_topology_error - Writes an error message to the error buffer
+ *
+ * errbuf: Error buffer
+ *
+ * errlen: Size of the error buffer
+ *
+ * fmt: Format string (as in printf)
+ *
+ * Returns: Always returns -1
+ *
+ */
+static int chirouter_topology_error(char *errbuf, size_t errlen, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(errbuf, errlen, fmt, args);
+    va_end(args);
+
+    return -1;
+}
+
+
+/*
+ * chirouter_json_error - Reports a syntax error (with the line it was found on)
+ *
+ * jp: Parser
+ *
+ * what: Description of the error
+ *
+ * Returns: Always returns -1
+ *
+ */
+static int chirouter_json_error(chirouter_json_parser_t *jp, const char *what)
+{
+    int line = 1;
+
+    for(const char *c = jp->text; c < jp->p; c++)
+        if(*c == '\n')
+            line++;
+
+    return chirouter_topology_error(jp->errbuf, jp->errlen, "Line %d: %s", line, what);
+}
+
+
+/*
+ * chirouter_json_skip_ws - Skips whitespace
+ *
+ * jp: Parser
+ *
+ * Returns: The next character.
+ *
+ */
+static char chirouter_json_skip_ws(chirouter_json_parser_t *jp)
+{
+    while(*jp->p == ' ' || *jp->p == '\t' || *jp->p == '\n' || *jp->p == '\r')
+        jp->p++;
+
+    return *jp->p;
+}
+
+
+/*
+ * chirouter_json_parse_string - Parses a JSON string
+ *
+ * Escaped characters outside ASCII (which topology files
+ * have no use for) are replaced with '?'.
+ *
+ * jp: Parser (positioned on the opening quote)
+ *
+ * s: Out parameter. Newly allocated string.
+ *
+ * Returns: 0 on success, -1 on error.
+ *
+ */
+static int chirouter_json_parse_string(chirouter_json_parser_t *jp, char **s)
+{
+    const char *start = ++jp->p;
+    size_t n = 0;
+    char *out;
+
+    /* The unescaped string is never longer than the escaped one */
+    while(*jp->p != '"')
+    {
+        if(*jp->p == '\0' || *jp->p == '\n')
+            return chirouter_json_error(jp, "Unterminated string");
+        if(*jp->p == '\\' && jp->p[1] != '\0')
+            jp->p++;
+        jp->p++;
+    }
+
+    out = malloc(jp->p - start + 1);
+    if(out == NULL)
+        return chirouter_json_error(jp, "Could not allocate memory");
+
+    for(const char *c = start; c < jp->p; c++)
+    {
+        if(*c != '\\')
+        {
+            out[n++] = *c;
+            continue;
+        }
+
+        switch(*++c)
+        {
+        case '"': case '\\': case '/':
+            out[n++] = *c;
+            break;
+        case 'b': out[n++] = '\b'; break;
+        case 'f': out[n++] = '\f'; break;
+        case 'n': out[n++] = '\n'; break;
+        case 'r': out[n++] = '\r'; break;
+        case 't': out[n++] = '\t'; break;
+        case 'u':
+        {
+            unsigned int code;
+
+            if(jp->p - c < 5 || sscanf(c + 1, "%4x", &code) != 1
+               || !isxdigit(c[1]) || !isxdigit(c[2]) || !isxdigit(c[3]) || !isxdigit(c[4]))
+            {
+                free(out);
+                return chirouter_json_error(jp, "Invalid \\u escape in string");
+            }
+            out[n++] = code < 0x80 ? (char) code : '?';
+            c += 4;
+            break;
+        }
+        default:
+            free(out);
+            return chirouter_json_error(jp, "Invalid escape in string");
+        }
+    }
+    out[n] = '\0';
+
+    jp->p++;
+    *s = out;
+
+    return 0;
+}
+
+
+/*
+ * chirouter_json_free - Frees a JSON value (but not the value itself)
+ *
+ * v: JSON value
+ *
+ * Returns: nothing.
+ *
+ */
+static void chirouter_json_free(chirouter_json_value_t *v)
+{
+    for(size_t i = 0; i < v->num_elts; i++)
+        chirouter_json_free(&v->elts[i]);
+
+    free(v->elts);
+    free(v->key);
+    free(v->string);
+    memset(v, 0, sizeof(*v));
+}
+
+
+/*
+ * chirouter_json_parse_value - Parses a JSON value
+ *
+ * jp: Parser
+ *
+ * v: Out parameter. Parsed value (which must be freed with
+ *    chirouter_json_free, even if an error happens)
+ *
+ * depth: Nesting depth of the value
+ *
+ * Returns: 0 on success, -1 on error.
+ *
+ */
+static int chirouter_json_parse_value(chirouter_json_parser_t *jp, chirouter_json_value_t *v, unsigned int depth)
+{
+    char c = chirouter_json_skip_ws(jp);
+
+    if(c == '{' || c == '[')
+    {
+        char close = (c == '{') ? '}' : ']';
+        size_t max_elts = 0;
+
+        if(depth == TOPOLOGY_MAX_DEPTH)
+            return chirouter_json_error(jp, "Too many nested arrays and objects");
+
+        v->type = (c == '{') ? JSON_OBJECT : JSON_ARRAY;
+        jp->p++;
+
+        if(chirouter_json_skip_ws(jp) == close)
+        {
+            jp->p++;
+            return 0;
+        }
+
+        while(1)
+        {
+            chirouter_json_value_t *elt;
+
+            if(v->num_elts == max_elts)
+            {
+                size_t n = max_elts ? max_elts * 2 : 4;
+                chirouter_json_value_t *elts = realloc(v->elts, n * sizeof(chirouter_json_value_t));
+
+                if(elts == NULL)
+                    return chirouter_json_error(jp, "Could not allocate memory");
+
+                v->elts = elts;
+                max_elts = n;
+            }
+
+            elt = &v->elts[v->num_elts++];
+            memset(elt, 0, sizeof(*elt));
+
+            if(v->type == JSON_OBJECT)
+            {
+                if(chirouter_json_skip_ws(jp) != '"')
+                    return chirouter_json_error(jp, "Expected a string (member name)");
+                if(chirouter_json_parse_string(jp, &elt->key))
+                    return -1;
+                if(chirouter_json_skip_ws(jp) != ':')
+                    return chirouter_json_error(jp, "Expected ':'");
+                jp->p++;
+            }
+
+            if(chirouter_json_parse_value(jp, elt, depth + 1))
+                return -1;
+
+            c = chirouter_json_skip_ws(jp);
+            jp->p++;
+            if(c == close)
+                return 0;
+            if(c != ',')
+            {
+                jp->p--;
+                return chirouter_json_error(jp, (v->type == JSON_OBJECT) ? "Expected ',' or '}'" : "Expected ',' or ']'");
+            }
+        }
+    }
+    else if(c == '"')
+    {
+        v->type = JSON_STRING;
+        return chirouter_json_parse_string(jp, &v->string);
+    }
+    else if(c == '-' || isdigit(c))
+    {
+        char *end;
+
+        errno = 0;
+        v->type = JSON_NUMBER;
+        v->number = strtod(jp->p, &end);
+        if(errno || !isfinite(v->number))
+            return chirouter_json_error(jp, "Invalid number");
+        jp->p = end;
+        return 0;
+    }
+    else if(!strncmp(jp->p, "true", 4) || !strncmp(jp->p, "false", 5) || !strncmp(jp->p, "null", 4))
+    {
+        v->type = (c == 't') ? JSON_TRUE : (c == 'f') ? JSON_FALSE : JSON_NULL;
+        jp->p += (c == 'f') ? 5 : 4;
+        return 0;
+    }
+
+    return chirouter_json_error(jp, (c == '\0') ? "Unexpected end of file" : "Expected a value");
+}
+
+
+/*
+ * chirouter_json_get - Gets a member of a JSON object
+ *
+ * obj: JSON object
+ *
+ * key: Member name
+ *
+ * type: Expected type of the member
+ *
+ * Returns: The member, or NULL if the object does not have
+ *          a member with that name and type.
+ *
+ */
+static chirouter_json_value_t* chirouter_json_get(chirouter_json_value_t *obj, const char *key, chirouter_json_type_t type)
+{
+    for(size_t i = 0; i < obj->num_elts; i++)
+        if(!strcmp(obj->elts[i].key, key))
+            return obj->elts[i].type == type ? &obj->elts[i] : NULL;
+
+    return NULL;
+}
+
+
+/*
+ * chirouter_topology_parse_ip - Parses an IPv4 address or mask
+ *
+ * Masks can also be written as a prefix length.
+ *
+ * s: Address or mask
+ *
+ * is_mask: Is this a mask?
+ *
+ * addr: Out parameter. Address (in network order)
+ *
+ * Returns: 0 on success, -1 if the address is not valid.
+ *
+ */
+static int chirouter_topology_parse_ip(const char *s, bool is_mask, struct in_addr *addr)
+{
+    char *end;
+    long prefix;
+
+    if(inet_pton(AF_INET, s, addr) == 1)
+        return 0;
+
+    if(!is_mask || !isdigit(s[0]))
+        return -1;
+
+    prefix = strtol(s, &end, 10);
+    if(*end != '\0' || prefix > 32)
+        return -1;
+
+    addr->s_addr = prefix ? htonl(0xFFFFFFFFu << (32 - prefix)) : 0;
+
+    return 0;
+}
+
+
+/*
+ * chirouter_topology_parse_mac - Parses a MAC address
+ *
+ * The bytes can be separated by colons (or not).
+ *
+ * s: MAC address
+ *
+ * mac: Out parameter. MAC address.
+ *
+ * Returns: 0 on success, -1 if the address is not valid.
+ *
+ */
+static int chirouter_topology_parse_mac(const char *s, uint8_t mac[ETHER_ADDR_LEN])
+{
+    for(int i = 0; i < ETHER_ADDR_LEN; i++)
+    {
+        if(i > 0 && *s == ':')
+            s++;
+        if(!isxdigit(s[0]) || !isxdigit(s[1]) || sscanf(s, "%2hhx", &mac[i]) != 1)
+            return -1;
+        s += 2;
+    }
+
+    return *s == '\0' ? 0 : -1;
+}
+
+
+/*
+ * chirouter_topology_get_fields - Gets the string members of a JSON object
+ *
+ * obj: JSON object
+ *
+ * what: What the object represents (for error messages)
+ *
+ * keys: Names of the members (NULL-terminated)
+ *
+ * values: Out parameter. Values of the members.
+ *
+ * errbuf, errlen: Error buffer, and its size
+ *
+ * Returns: 0 on success, -1 if a member is missing (or is not a string).
+ *
+ */
+static int chirouter_topology_get_fields(chirouter_json_value_t *obj, const char *what, const char **keys,
+                                         const char **values, char *errbuf, size_t errlen)
+{
+    if(obj->type != JSON_OBJECT)
+        return chirouter_topology_error(errbuf, errlen, "%s is not an object", what);
+
+    for(int i = 0; keys[i] != NULL; i++)
+    {
+        chirouter_json_value_t *v = chirouter_json_get(obj, keys[i], JSON_STRING);
+
+        if(v == NULL)
+            return chirouter_topology_error(errbuf, errlen, "%s is missing '%s' field", what, keys[i]);
+
+        values[i] = v->string;
+    }
+
+    return 0;
+}
+
+
+/*
+ * chirouter_topology_iface_cmp - Compares two interfaces by name (for qsort)
+ */
+static int chirouter_topology_iface_cmp(const void *a, const void *b)
+{
+    return strcmp(((const chirouter_topology_iface_t *) a)->name, ((const chirouter_topology_iface_t *) b)->name);
+}
+
+
+/*
+ * chirouter_topology_iface_index - Looks up an interface by name
+ *
+ * router: Router
+ *
+ * name: Interface name
+ *
+ * Returns: Index of the interface, or -1 if the router has no such interface.
+ *
+ */
+static int chirouter_topology_iface_index(chirouter_topology_router_t *router, const char *name)
+{
+    for(int i = 0; i < router->num_ifaces; i++)
+        if(!strcmp(router->ifaces[i].name, name))
+            return i;
+
+    return -1;
+}
+
+
+/*
+ * chirouter_topology_load_router - Builds a router from its JSON object
+ *
+ * router: Router
+ *
+ * obj: JSON object
+ *
+ * errbuf, errlen: Error buffer, and its size
+ *
+ * Returns: 0 on success, -1 if the router is not valid.
+ *
+ */
+static int chirouter_topology_load_router(chirouter_topology_router_t *router, chirouter_json_value_t *obj,
+                                          char *errbuf, size_t errlen)
+{
+    chirouter_json_value_t *id = chirouter_json_get(obj, "id", JSON_NUMBER);
+    chirouter_json_value_t *ifaces = chirouter_json_get(obj, "interfaces", JSON_ARRAY);
+    chirouter_json_value_t *rtable = chirouter_json_get(obj, "rtable", JSON_ARRAY);
+    chirouter_json_value_t *arp = chirouter_json_get(obj, "arp", JSON_ARRAY);
+    const char *fields[5];
+    int n;
+
+    if(id == NULL)
+        return chirouter_topology_error(errbuf, errlen, "Router is missing 'id' field");
+    if(ifaces == NULL)
+        return chirouter_topology_error(errbuf, errlen, "Router is missing 'interfaces' field");
+    if(rtable == NULL)
+        return chirouter_topology_error(errbuf, errlen, "Router is missing 'rtable' field");
+
+    n = snprintf(router->name, sizeof(router->name), "r%.0f", id->number);
+    if(id->number < 0 || id->number != (long) id->number || n >= (int) sizeof(router->name))
+        return chirouter_topology_error(errbuf, errlen, "Invalid router id: %g", id->number);
+
+    if(ifaces->num_elts > UINT8_MAX || rtable->num_elts > UINT8_MAX)
+        return chirouter_topology_error(errbuf, errlen, "Router %s has too many interfaces or routing table entries", router->name);
+
+    router->ifaces = calloc(ifaces->num_elts, sizeof(chirouter_topology_iface_t));
+    router->rtable = calloc(rtable->num_elts, sizeof(chirouter_topology_route_t));
+    router->arp_entries = calloc(arp ? arp->num_elts : 0, sizeof(chirouter_topology_arp_entry_t));
+    if(ifaces->num_elts && router->ifaces == NULL)
+        return chirouter_topology_error(errbuf, errlen, "Could not allocate memory");
+    if(rtable->num_elts && router->rtable == NULL)
+        return chirouter_topology_error(errbuf, errlen, "Could not allocate memory");
+    if(arp && arp->num_elts && router->arp_entries == NULL)
+        return chirouter_topology_error(errbuf, errlen, "Could not allocate memory");
+
+    for(size_t i = 0; i < ifaces->num_elts; i++)
+    {
+        chirouter_topology_iface_t *iface = &router->ifaces[i];
+        struct in_addr mask;
+
+        if(chirouter_topology_get_fields(&ifaces->elts[i], "Interface", (const char *[]) {"name", "ip", "mask", NULL},
+                                         fields, errbuf, errlen))
+            return -1;
+
+        if(fields[0][0] == '\0' || strlen(fields[0]) > MAX_IFACE_NAMELEN)
+            return chirouter_topology_error(errbuf, errlen, "Invalid interface name in router %s: '%s'", router->name, fields[0]);
+        strcpy(iface->name, fields[0]);
+
+        if(chirouter_topology_parse_ip(fields[1], false, &iface->ip) || chirouter_topology_parse_ip(fields[2], true, &mask))
+            return chirouter_topology_error(errbuf, errlen, "Invalid address or mask in interface %s-%s", router->name, iface->name);
+
+        chirouter_json_value_t *hwaddr = chirouter_json_get(&ifaces->elts[i], "hwaddr", JSON_STRING);
+        if(hwaddr)
+        {
+            if(chirouter_topology_parse_mac(hwaddr->string, iface->mac))
+                return chirouter_topology_error(errbuf, errlen, "Invalid MAC address in interface %s-%s", router->name, iface->name);
+            iface->has_mac = true;
+        }
+
+        if(chirouter_topology_iface_index(router, iface->name) >= 0)
+            return chirouter_topology_error(errbuf, errlen, "Duplicate interface in router %s: %s", router->name, iface->name);
+
+        router->num_ifaces++;
+    }
+
+    /* The controller numbers the interfaces in the order of their names */
+    qsort(router->ifaces, router->num_ifaces, sizeof(chirouter_topology_iface_t), chirouter_topology_iface_cmp);
+
+    for(size_t i = 0; i < rtable->num_elts; i++)
+    {
+        chirouter_topology_route_t *route = &router->rtable[i];
+        chirouter_json_value_t *metric;
+        int iface;
+
+        if(chirouter_topology_get_fields(&rtable->elts[i], "Routing Table Entry",
+                                         (const char *[]) {"destination", "gateway", "mask", "iface", NULL},
+                                         fields, errbuf, errlen))
+            return -1;
+
+        metric = chirouter_json_get(&rtable->elts[i], "metric", JSON_NUMBER);
+        if(metric == NULL)
+            return chirouter_topology_error(errbuf, errlen, "Routing Table Entry is missing 'metric' field");
+
+        if(chirouter_topology_parse_ip(fields[0], false, &route->dest) || chirouter_topology_parse_ip(fields[1], false, &route->gw)
+           || chirouter_topology_parse_ip(fields[2], true, &route->mask) || metric->number < 0 || metric->number > UINT16_MAX)
+            return chirouter_topology_error(errbuf, errlen, "Invalid routing table entry in router %s", router->name);
+
+        iface = chirouter_topology_iface_index(router, fields[3]);
+        if(iface < 0)
+            return chirouter_topology_error(errbuf, errlen, "Incorrect interface in routing table entry: %s", fields[3]);
+
+        route->metric = (uint16_t) metric->number;
+        route->iface = iface;
+        router->len_rtable++;
+    }
+
+    for(size_t i = 0; arp && i < arp->num_elts; i++)
+    {
+        chirouter_topology_arp_entry_t *entry = &router->arp_entries[i];
+        int iface;
+
+        if(chirouter_topology_get_fields(&arp->elts[i], "ARP Entry", (const char *[]) {"ip", "hwaddr", "iface", NULL},
+                                         fields, errbuf, errlen))
+            return -1;
+
+        if(chirouter_topology_parse_ip(fields[0], false, &entry->ip) || chirouter_topology_parse_mac(fields[1], entry->mac))
+            return chirouter_topology_error(errbuf, errlen, "Invalid ARP entry in router %s", router->name);
+
+        iface = chirouter_topology_iface_index(router, fields[2]);
+        if(iface < 0)
+            return chirouter_topology_error(errbuf, errlen, "Incorrect interface in ARP entry: %s", fields[2]);
+
+        entry->iface = iface;
+        router->num_arp_entries++;
+    }
+
+    return 0;
+}
+
+
+/* See topology.h */
+int chirouter_topology_load(const char *filename, chirouter_topology_t *topo, char *errbuf, size_t errlen)
+{
+    FILE *f;
+    char *text;
+    size_t size;
+    chirouter_json_parser_t jp;
+    chirouter_json_value_t root = {0};
+    chirouter_json_value_t *switches;
+    int rc = -1;
+
+    memset(topo, 0, sizeof(*topo));
+
+    f = fopen(filename, "r");
+    if(f == NULL)
+        return chirouter_topology_error(errbuf, errlen, "%s: %s", filename, strerror(errno));
+
+    text = malloc(TOPOLOGY_MAX_FILE_SIZE + 1);
+    if(text == NULL)
+    {
+        fclose(f);
+        return chirouter_topology_error(errbuf, errlen, "Could not allocate memory");
+    }
+
+    size = fread(text, 1, TOPOLOGY_MAX_FILE_SIZE + 1, f);
+    fclose(f);
+    if(size > TOPOLOGY_MAX_FILE_SIZE)
+    {
+        free(text);
+        return chirouter_topology_error(errbuf, errlen, "%s: File is too large", filename);
+    }
+    text[size] = '\0';
+
+    jp.text = jp.p = text;
+    jp.errbuf = errbuf;
+    jp.errlen = errlen;
+
+    if(chirouter_json_parse_value(&jp, &root, 0))
+        goto out;
+
+    if(chirouter_json_skip_ws(&jp) != '\0')
+    {
+        chirouter_json_error(&jp, "Unexpected data after the topology");
+        goto out;
+    }
+
+    if(root.type != JSON_OBJECT || (switches = chirouter_json_get(&root, "switches", JSON_ARRAY)) == NULL)
+    {
+        chirouter_topology_error(errbuf, errlen, "Topology is missing 'switches' field");
+        goto out;
+    }
+
+    topo->routers = calloc(switches->num_elts ? switches->num_elts : 1, sizeof(chirouter_topology_router_t));
+    if(topo->routers == NULL)
+    {
+        chirouter_topology_error(errbuf, errlen, "Could not allocate memory");
+        goto out;
+    }
+
+    for(size_t i = 0; i < switches->num_elts; i++)
+    {
+        chirouter_json_value_t *type = (switches->elts[i].type == JSON_OBJECT)
+                                       ? chirouter_json_get(&switches->elts[i], "type", JSON_STRING) : NULL;
+
+        if(type == NULL)
+        {
+            chirouter_topology_error(errbuf, errlen, "Switch is missing 'type' field");
+            goto out;
+        }
+
+        if(!strcmp(type->string, "switch"))
+            continue;
+
+        if(strcmp(type->string, "router"))
+        {
+            chirouter_topology_error(errbuf, errlen, "Unknown switch type: '%s'", type->string);
+            goto out;
+        }
+
+        if(topo->num_routers == UINT8_MAX)
+        {
+            chirouter_topology_error(errbuf, errlen, "Topology has too many routers");
+            goto out;
+        }
+
+        if(chirouter_topology_load_router(&topo->routers[topo->num_routers++], &switches->elts[i], errbuf, errlen))
+            goto out;
+    }
+
+    if(topo->num_routers == 0)
+    {
+        chirouter_topology_error(errbuf, errlen, "Topology has no routers");
+        goto out;
+    }
+
+    rc = 0;
+
+out:
+    chirouter_json_free(&root);
+    free(text);
+
+    return rc;
+}
+
+
+/*
+ * chirouter_topology_send - Processes a configuration message
+ *
+ * ctx: Server context
+ *
+ * msg: Message (with its payload filled in)
+ *
+ * type: Message type
+ *
+ * payload_len: Payload length
+ *
+ * Returns: 0 on success, -1 if the server rejected the message.
+ *
+ */
+static int chirouter_topology_send(server_ctx_t *ctx, chirouter_msg_t *msg, chirouter_msg_type_t type, uint16_t payload_len)
+{
+    msg->type = type;
+    msg->subtype = NONE;
+    msg->payload_length = htons(payload_len);
+
+    return chirouter_server_process_single_message(ctx, msg);
+}
+
+
+/* See topology.h */
+int chirouter_topology_configure(server_ctx_t *ctx, chirouter_topology_t *topo)
+{
+    chirouter_msg_t msg;
+
+    /* As if the controller had completed the HELLO handshake */
+    ctx->state = CONFIG;
+
+    msg.routers.nrouters = topo->num_routers;
+    if(chirouter_topology_send(ctx, &msg, MSG_TYPE_ROUTERS, 1))
+        return -1;
+
+    for(uint8_t r = 0; r < topo->num_routers; r++)
+    {
+        chirouter_topology_router_t *router = &topo->routers[r];
+        size_t name_len = strlen(router->name);
+
+        msg.router.r_id = r;
+        msg.router.num_interfaces = router->num_ifaces;
+        msg.router.len_rtable = router->len_rtable;
+        memcpy(msg.router.name, router->name, name_len);
+        if(chirouter_topology_send(ctx, &msg, MSG_TYPE_ROUTER, 3 + name_len))
+            return -1;
+
+        for(uint8_t i = 0; i < router->num_ifaces; i++)
+        {
+            chirouter_topology_iface_t *iface = &router->ifaces[i];
+
+            name_len = strlen(iface->name);
+            msg.interface.r_id = r;
+            msg.interface.iface_id = i;
+            memcpy(msg.interface.hwaddr, iface->mac, ETHER_ADDR_LEN);
+            msg.interface.ipaddr = iface->ip.s_addr;
+            memcpy(msg.interface.name, iface->name, name_len);
+            if(chirouter_topology_send(ctx, &msg, MSG_TYPE_INTERFACE, 12 + name_len))
+                return -1;
+        }
+
+        for(uint8_t i = 0; i < router->len_rtable; i++)
+        {
+            chirouter_topology_route_t *route = &router->rtable[i];
+
+            msg.rtable_entry.r_id = r;
+            msg.rtable_entry.iface_id = route->iface;
+            msg.rtable_entry.metric = htons(route->metric);
+            msg.rtable_entry.dest = route->dest.s_addr;
+            msg.rtable_entry.mask = route->mask.s_addr;
+            msg.rtable_entry.gw = route->gw.s_addr;
+            if(chirouter_topology_send(ctx, &msg, MSG_TYPE_RTABLE_ENTRY, 16))
+                return -1;
+        }
+
+        for(unsigned int i = 0; i < router->num_arp_entries; i++)
+        {
+            chirouter_topology_arp_entry_t *entry = &router->arp_entries[i];
+
+            msg.arp_entry.r_id = r;
+            msg.arp_entry.iface_id = entry->iface;
+            memcpy(msg.arp_entry.hwaddr, entry->mac, ETHER_ADDR_LEN);
+            msg.arp_entry.ipaddr = entry->ip.s_addr;
+            if(chirouter_topology_send(ctx, &msg, MSG_TYPE_ARP_ENTRY, 12))
+                return -1;
+        }
+    }
+
+    return chirouter_topology_send(ctx, &msg, MSG_TYPE_END_CONFIG, 0);
+}
+
+
+/* See topology.h */
+void chirouter_topology_free(chirouter_topology_t *topo)
+{
+    for(uint8_t r = 0; r < topo->num_routers; r++)
+    {
+        free(topo->routers[r].ifaces);
+        free(topo->routers[r].rtable);
+        free(topo->routers[r].arp_entries);
+    }
+
+    free(topo->routers);
+    memset(topo, 0, sizeof(*topo));
+}
@@ -0,0 +1,183 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This header file defines the functions that load a topology file
+ *  (the same JSON files used by the controller, in the topologies
+ *  directory) and configure the routers from it, without a controller.
+ *
+ *  Only the routers in the topology are used (switches, hosts, and
+ *  links are ignored). As with the controller, router N is named rN,
+ *  and its interfaces are numbered in the order of their names.
+ *  Interfaces can have a "hwaddr" field with their MAC address;
+ *  otherwise, the MAC address must be set before the routers are
+ *  configured (the controller gets it from Mininet).
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "chirouter.h"
+#include "server.h"
+
+/* Maximum size of a topology file */
+#define TOPOLOGY_MAX_FILE_SIZE (16u * 1024 * 1024)
+
+/* Maximum nesting of JSON arrays and objects in a topology file */
+#define TOPOLOGY_MAX_DEPTH (32u)
+
+/* An interface in a topology */
+typedef struct chirouter_topology_iface
+{
+    char name[MAX_IFACE_NAMELEN + 1];
+    struct in_addr ip;
+
+    /* MAC address, if known */
+    uint8_t mac[ETHER_ADDR_LEN];
+    bool has_mac;
+} chirouter_topology_iface_t;
+
+/* A routing table entry in a topology */
+typedef struct chirouter_topology_route
+{
+    struct in_addr dest;
+    struct in_addr mask;
+    struct in_addr gw;
+    uint16_t metric;
+
+    /* Interface (index into the router's interfaces) */
+    uint8_t iface;
+} chirouter_topology_route_t;
+
+/* A static ARP entry in a topology */
+typedef struct chirouter_topology_arp_entry
+{
+    struct in_addr ip;
+    uint8_t mac[ETHER_ADDR_LEN];
+
+    /* Interface (index into the router's interfaces) */
+    uint8_t iface;
+} chirouter_topology_arp_entry_t;
+
+/* A router in a topology */
+typedef struct chirouter_topology_router
+{
+    char name[MAX_ROUTER_NAMELEN + 1];
+
+    /* Interfaces, sorted by name */
+    chirouter_topology_iface_t *ifaces;
+    uint8_t num_ifaces;
+
+    chirouter_topology_route_t *rtable;
+    uint8_t len_rtable;
+
+    chirouter_topology_arp_entry_t *arp_entries;
+    unsigned int num_arp_entries;
+} chirouter_topology_router_t;
+
+/* A topology */
+typedef struct chirouter_topology
+{
+    chirouter_topology_router_t *routers;
+    uint8_t num_routers;
+} chirouter_topology_t;
+
+
+/*
+ * chirouter_topology_load - Loads a topology file
+ *
+ * filename: Name of the topology file
+ *
+ * topo: Out parameter. The topology (which must be freed
+ *       with chirouter_topology_free, even if an error happens)
+ *
+ * errbuf: Buffer for an error message
+ *
+ * errlen: Size of errbuf
+ *
+ * Returns: 0 on success, -1 if the file could not be read or is not valid.
+ *
+ */
+int chirouter_topology_load(const char *filename, chirouter_topology_t *topo, char *errbuf, size_t errlen);
+
+
+/*
+ * chirouter_topology_configure - Configures the routers from a topology
+ *
+ * Feeds the server the same configuration messages the controller
+ * would send (ROUTERS, ROUTER, INTERFACE, ROUTING TABLE ENTRY,
+ * ARP ENTRY, and END CONFIG), so the routers are configured (and the
+ * server transitions to the RUNNING state) exactly as if they had
+ * been received from the controller.
+ *
+ * ctx: Server context (in the HELLO_WAIT state, with no routers)
+ *
+ * topo: Topology
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_topology_configure(server_ctx_t *ctx, chirouter_topology_t *topo);
+
+
+/*
+ * chirouter_topology_free - Frees a topology
+ *
+ * topo: Topology
+ *
+ * Returns: nothing.
+ *
+ */
+void chirouter_topology_free(chirouter_topology_t *topo);
+
+
+#endif
@@ -54,6 +54,9 @@
 #ifndef SR_UTILS_H
 #define SR_UTILS_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
 /*
  * cksum - Computes a checksum
  *
@@ -79,4 +82,26 @@ uint16_t cksum(const void *_data, int len);
  */
 bool ethernet_addr_is_equal(uint8_t *addr1, uint8_t *addr2);
 
+
+/*
+ * hash_mix - Mixes the bits of a 32-bit value
+ *
+ * This is the finalizer from MurmurHash3 (public domain). It is
+ * defined here so it can be inlined in hash table lookups.
+ *
+ * h: Value to mix
+ *
+ * Returns: 32-bit hash
+ *
+ */
+static inline uint32_t hash_mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
 #endif
@@ -0,0 +1,534 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This module implements the worker threads that process Ethernet
+ *  frames in parallel (one worker per router).
+ *
+ *  See worker.h for descriptions of functions, parameters, and return values.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+
+#include "worker.h"
+#include "server.h"
+#include "utils.h"
+#include "log.h"
+
+
+/*
+ * chirouter_worker_flow_hash - Computes the flow hash of a frame
+ *
+ * For IPv4 datagrams, this is a hash of the 5-tuple (source and
+ * destination addresses, protocol, and TCP/UDP ports). Fragments
+ * only use the addresses and protocol (as only the first fragment
+ * contains the ports) so that all the fragments of a datagram
+ * end up in the same worker. ARP messages are hashed by their
+ * sender and target addresses, and any other frame by its
+ * source MAC address.
+ *
+ * frame: Inbound frame
+ *
+ * Returns: 32-bit hash
+ *
+ */
+static uint32_t chirouter_worker_flow_hash(ethernet_frame_t *frame)
+{
+    ethhdr_t *hdr = (ethhdr_t *) frame->raw;
+    uint8_t *payload = ETHER_PAYLOAD_START(frame->raw);
+    size_t payload_len = frame->length - sizeof(ethhdr_t);
+    uint16_t ethertype = ntohs(hdr->type);
+
+    if(ethertype == ETHERTYPE_IP && payload_len >= sizeof(iphdr_t))
+    {
+        iphdr_t *ip = (iphdr_t *) payload;
+        size_t ihl = ip->ihl * 4;
+        uint32_t h = hash_mix(ip->src) ^ hash_mix(ip->dst ^ ip->proto);
+        bool is_fragment = (ntohs(ip->off) & 0x3FFF) != 0;
+
+        if(!is_fragment && (ip->proto == IPPROTO_TCP || ip->proto == IPPROTO_UDP)
+           && payload_len >= ihl + 4)
+        {
+            uint32_t ports;
+            memcpy(&ports, payload + ihl, sizeof(ports));
+            h ^= hash_mix(ports);
+        }
+
+        return hash_mix(h);
+    }
+    else if(ethertype == ETHERTYPE_ARP && payload_len >= sizeof(arp_packet_t))
+    {
+        arp_packet_t *arp = (arp_packet_t *) payload;
+
+        return hash_mix(hash_mix(arp->spa) ^ arp->tpa);
+    }
+    else
+    {
+        uint32_t src_lo;
+        memcpy(&src_lo, hdr->src + 2, sizeof(src_lo));
+        return hash_mix(src_lo);
+    }
+}
+
+
+/* See worker.h */
+chirouter_worker_t* chirouter_worker_for_frame(server_ctx_t *ctx, chirouter_ctx_t *router, ethernet_frame_t *frame)
+{
+    if(!ctx->flow_affine)
+        return router->worker;
+
+    return &ctx->workers[chirouter_worker_flow_hash(frame) % ctx->num_workers];
+}
+
+
+/*
+ * chirouter_worker_dequeue - Removes the next entry from a worker's queue
+ *
+ * Must only be called from the worker thread.
+ *
+ * worker: Worker
+ *
+ * entry: Entry to fill in
+ *
+ * Returns: true if an entry was dequeued, false if the queue was empty.
+ *
+ */
+static bool chirouter_worker_dequeue(chirouter_worker_t *worker, chirouter_worker_queue_entry_t *entry)
+{
+    chirouter_spsc_queue_t *q = &worker->queue;
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if(head == tail)
+        return false;
+
+    *entry = q->entries[head & (WORKER_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+    return true;
+}
+
+
+/*
+ * chirouter_worker_dequeue_router - Removes the next entry from a worker's queue,
+ *                                   but only if it belongs to a given router
+ *
+ * Must only be called from the worker thread.
+ *
+ * worker: Worker
+ *
+ * router: Router
+ *
+ * frame: Set to the frame of the entry
+ *
+ * Returns: true if an entry was dequeued, false if the queue was empty
+ *          or the next entry belongs to a different router.
+ *
+ */
+static bool chirouter_worker_dequeue_router(chirouter_worker_t *worker, chirouter_ctx_t *router, ethernet_frame_t **frame)
+{
+    chirouter_spsc_queue_t *q = &worker->queue;
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if(head == tail || q->entries[head & (WORKER_QUEUE_SIZE - 1)].router != router)
+        return false;
+
+    *frame = q->entries[head & (WORKER_QUEUE_SIZE - 1)].frame;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+    return true;
+}
+
+
+/* See worker.h */
+int chirouter_worker_enqueue(chirouter_worker_t *worker, chirouter_ctx_t *router, ethernet_frame_t *frame)
+{
+    chirouter_spsc_queue_t *q = &worker->queue;
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+    if(tail - head == WORKER_QUEUE_SIZE)
+    {
+        worker->frames_dropped++;
+        return 1;
+    }
+
+    if(tail - head + 1 > worker->queue_high_water)
+        worker->queue_high_water = tail - head + 1;
+
+    q->entries[tail & (WORKER_QUEUE_SIZE - 1)].router = router;
+    q->entries[tail & (WORKER_QUEUE_SIZE - 1)].frame = frame;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+    sem_post(&worker->pending);
+
+    return 0;
+}
+
+
+/* See worker.h */
+int chirouter_worker_handoff(chirouter_worker_t *worker, chirouter_ctx_t *router, ethernet_frame_t *frame)
+{
+    pthread_mutex_lock(&worker->lock_handoff);
+
+    if(worker->handoff_len == WORKER_HANDOFF_SIZE || atomic_load(&worker->stop))
+    {
+        if(worker->handoff_len == WORKER_HANDOFF_SIZE)
+            worker->handoffs_refused++;
+        pthread_mutex_unlock(&worker->lock_handoff);
+        return 1;
+    }
+
+    uint32_t tail = (worker->handoff_head + worker->handoff_len) % WORKER_HANDOFF_SIZE;
+    worker->handoff[tail].router = router;
+    worker->handoff[tail].frame = frame;
+    worker->handoff_len++;
+    worker->frames_handed_off++;
+
+    pthread_mutex_unlock(&worker->lock_handoff);
+
+    sem_post(&worker->pending);
+
+    return 0;
+}
+
+
+/*
+ * chirouter_worker_dequeue_handoff - Removes frames from a worker's handoff queue
+ *
+ * Removes the next frame in the handoff queue, along with the frames
+ * right after it that belong to the same router (up to GRAPH_VECTOR_SIZE
+ * frames). Must only be called from the worker thread.
+ *
+ * worker: Worker
+ *
+ * router: Set to the router of the frames
+ *
+ * frames: Array of GRAPH_VECTOR_SIZE frames to fill in
+ *
+ * Returns: Number of frames removed (zero if the handoff queue was empty)
+ *
+ */
+static size_t chirouter_worker_dequeue_handoff(chirouter_worker_t *worker, chirouter_ctx_t **router, ethernet_frame_t **frames)
+{
+    size_t n = 0;
+
+    pthread_mutex_lock(&worker->lock_handoff);
+
+    while(worker->handoff_len > 0 && n < GRAPH_VECTOR_SIZE)
+    {
+        chirouter_worker_queue_entry_t *entry = &worker->handoff[worker->handoff_head];
+
+        if(n > 0 && entry->router != *router)
+            break;
+
+        *router = entry->router;
+        frames[n++] = entry->frame;
+        worker->handoff_head = (worker->handoff_head + 1) % WORKER_HANDOFF_SIZE;
+        worker->handoff_len--;
+    }
+
+    pthread_mutex_unlock(&worker->lock_handoff);
+
+    return n;
+}
+
+
+/*
+ * chirouter_worker_run - Worker thread function
+ *
+ * Processes the frames in the worker's queue until it is asked to stop
+ * (and the queue has been drained).
+ *
+ * args: Worker (chirouter_worker_t)
+ *
+ * Returns: NULL
+ *
+ */
+static void* chirouter_worker_run(void *args)
+{
+    chirouter_worker_t *worker = (chirouter_worker_t *) args;
+    chirouter_worker_queue_entry_t entry;
+    ethernet_frame_t *frames[GRAPH_VECTOR_SIZE];
+    size_t n;
+    int rc;
+
+    chirouter_graph_init(&worker->graph, worker->tx_batch);
+    chirouter_graph_thread_set(&worker->graph);
+
+    while(1)
+    {
+        while(sem_wait(&worker->pending) != 0);
+
+        /* Frames handed off by other workers were withheld before
+         * any frame of their flow that is still in the queue */
+        n = chirouter_worker_dequeue_handoff(worker, &entry.router, frames);
+        if(n > 0)
+        {
+            for(size_t i = 1; i < n; i++)
+                sem_trywait(&worker->pending);
+        }
+        else if(!chirouter_worker_dequeue(worker, &entry))
+        {
+            /* We were woken up with empty queues, which happens when
+             * we're asked to stop (or when a previous batch took an entry
+             * before it was posted to the semaphore) */
+            if(atomic_load(&worker->stop))
+                break;
+            continue;
+        }
+        else
+        {
+            /* Any frames for the same router that are already
+             * in the queue are processed in the same batch */
+            frames[0] = entry.frame;
+            n = 1;
+            while(n < GRAPH_VECTOR_SIZE && chirouter_worker_dequeue_router(worker, entry.router, &frames[n]))
+            {
+                sem_trywait(&worker->pending);
+                n++;
+            }
+        }
+
+        rc = chirouter_process_ethernet_frames(entry.router, frames, n);
+        for(size_t i = 0; i < n; i++)
+            chirouter_pktbuf_frame_free(&worker->server->pool, frames[i]);
+        worker->frames_processed += n;
+        worker->batches_processed++;
+
+        if(rc == -1)
+        {
+            chilog(CRITICAL, "Critical error while processing Ethernet frame (worker %u)", worker->id);
+            atomic_store(&worker->server->worker_error, true);
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * chirouter_workers_teardown - Stops the first workers, and frees the worker resources
+ *
+ * Asks the workers to stop, waits for them to finish processing the
+ * frames already in their queues, and frees all the worker resources.
+ *
+ * ctx: Server context
+ *
+ * num_started: Number of workers (starting at worker 0) whose thread
+ *              is running. The remaining workers must not have a
+ *              send buffer, semaphore, or handoff lock.
+ *
+ * Returns: nothing.
+ *
+ */
+static void chirouter_workers_teardown(server_ctx_t *ctx, uint16_t num_started)
+{
+    for(uint16_t i=0; i < num_started; i++)
+    {
+        chirouter_worker_t *worker = &ctx->workers[i];
+
+        /* Once stop is set (holding lock_handoff), no more
+         * frames are handed off to the worker */
+        pthread_mutex_lock(&worker->lock_handoff);
+        atomic_store(&worker->stop, true);
+        pthread_mutex_unlock(&worker->lock_handoff);
+        sem_post(&worker->pending);
+    }
+
+    for(uint16_t i=0; i < num_started; i++)
+    {
+        chirouter_worker_t *worker = &ctx->workers[i];
+
+        pthread_join(worker->thread, NULL);
+        sem_destroy(&worker->pending);
+
+        /* A frame can be handed off to a worker after it checked its
+         * handoff queue for the last time (but before stop was set) */
+        for(; worker->handoff_len > 0; worker->handoff_len--)
+        {
+            chirouter_pktbuf_frame_free(&ctx->pool, worker->handoff[worker->handoff_head].frame);
+            worker->handoff_head = (worker->handoff_head + 1) % WORKER_HANDOFF_SIZE;
+        }
+        pthread_mutex_destroy(&worker->lock_handoff);
+
+        chilog(INFO, "Worker %u: %" PRIu64 " frames processed in %" PRIu64 " batches, %" PRIu64 " frames dropped (queue full), "
+                     "queue high-water mark %" PRIu32 "/%u",
+                     worker->id, worker->frames_processed, worker->batches_processed, worker->frames_dropped,
+                     worker->queue_high_water, WORKER_QUEUE_SIZE);
+        if(ctx->flow_affine)
+            chilog(INFO, "Worker %u: %" PRIu64 " withheld frames handed off to it, %" PRIu64 " refused (handoff queue full)",
+                         worker->id, worker->frames_handed_off, worker->handoffs_refused);
+
+        char name[16];
+        snprintf(name, sizeof(name), "worker %u", worker->id);
+        chirouter_graph_log_stats(&worker->graph, name, DEBUG);
+
+        free(worker->tx_batch);
+    }
+
+    for(int i=0; i < ctx->num_routers; i++)
+        ctx->routers[i].worker = NULL;
+
+    free(ctx->workers);
+    ctx->workers = NULL;
+    chirouter_pktmem_free(&ctx->worker_mem);
+}
+
+
+/* See worker.h */
+int chirouter_workers_start(server_ctx_t *ctx)
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(chirouter_pktmem_alloc(&ctx->worker_mem,
+                              (size_t) ctx->num_workers * WORKER_QUEUE_SIZE * sizeof(chirouter_worker_queue_entry_t),
+                              ctx->hugepages))
+    {
+        chilog(CRITICAL, "Could not allocate worker queues");
+        return -1;
+    }
+
+    ctx->workers = calloc(ctx->num_workers, sizeof(chirouter_worker_t));
+    if(ctx->workers == NULL)
+    {
+        chirouter_pktmem_free(&ctx->worker_mem);
+        return -1;
+    }
+
+    atomic_store(&ctx->worker_error, false);
+
+    for(uint16_t i=0; i < ctx->num_workers; i++)
+    {
+        chirouter_worker_t *worker = &ctx->workers[i];
+        char thread_name[16];
+
+        worker->id = i;
+        worker->server = ctx;
+        worker->tx_batch = malloc(sizeof(chirouter_tx_batch_t));
+        if(worker->tx_batch == NULL)
+        {
+            chilog(CRITICAL, "Could not allocate send buffer for worker %u", i);
+            chirouter_workers_teardown(ctx, i);
+            return -1;
+        }
+        worker->tx_batch->len = 0;
+        worker->queue.entries = (chirouter_worker_queue_entry_t *) ctx->worker_mem.addr + (size_t) i * WORKER_QUEUE_SIZE;
+        atomic_init(&worker->queue.head, 0);
+        atomic_init(&worker->queue.tail, 0);
+        atomic_init(&worker->stop, false);
+        sem_init(&worker->pending, 0, 0);
+        pthread_mutex_init(&worker->lock_handoff, NULL);
+
+        if(pthread_create(&worker->thread, NULL, chirouter_worker_run, worker) != 0)
+        {
+            chilog(CRITICAL, "Could not create worker thread %u", i);
+            sem_destroy(&worker->pending);
+            pthread_mutex_destroy(&worker->lock_handoff);
+            free(worker->tx_batch);
+            chirouter_workers_teardown(ctx, i);
+            return -1;
+        }
+
+        /* Thread names are limited to 16 bytes (including the
+         * terminating null byte), and there are at most
+         * MAX_NUM_WORKERS (which fits in a uint8_t) workers */
+        snprintf(thread_name, sizeof(thread_name), "chirouter-w%hhu", (uint8_t) i);
+        pthread_setname_np(worker->thread, thread_name);
+
+        /* Pin the worker to a CPU. CPU 0 is left for the I/O thread,
+         * unless there are more workers than CPUs. */
+        if(num_cpus > 1)
+        {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET((i + 1) % num_cpus, &cpuset);
+            if(pthread_setaffinity_np(worker->thread, sizeof(cpu_set_t), &cpuset) != 0)
+                chilog(DEBUG, "Could not pin worker %u to CPU %li", i, (i + 1) % num_cpus);
+        }
+    }
+
+    if(ctx->flow_affine)
+    {
+        /* Frames are assigned to workers by flow (see chirouter_worker_for_frame) */
+        chilog(INFO, "Started %u worker threads (flow-affine)", ctx->num_workers);
+        return 0;
+    }
+
+    /* Frames for a router are always handled by the same worker */
+    for(int i=0; i < ctx->num_routers; i++)
+    {
+        chirouter_ctx_t *r = &ctx->routers[i];
+        r->worker = &ctx->workers[r->r_id % ctx->num_workers];
+        chilog(INFO, "Router %s assigned to worker %u", r->name, r->worker->id);
+    }
+
+    chilog(INFO, "Started %u worker threads", ctx->num_workers);
+
+    return 0;
+}
+
+
+/* See worker.h */
+int chirouter_workers_stop(server_ctx_t *ctx)
+{
+    if(ctx->workers == NULL)
+        return 0;
+
+    chirouter_workers_teardown(ctx, ctx->num_workers);
+
+    return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ *  chirouter - A simple, testable IP router
+ *
+ *  This header file defines the worker threads that process Ethernet
+ *  frames when chirouter is run with more than zero workers (-w).
+ *
+ *  Each router is assigned to a single worker, and the I/O thread (the
+ *  one reading messages from the controller) hands off inbound frames to
+ *  that worker through a single-producer/single-consumer queue. This
+ *  preserves the order of frames within a router, while allowing frames
+ *  for different routers to be processed concurrently.
+ *
+ */
+
+/*
+ * This project is based on the Simple Router assignment included in the
+ * Mininet project (https://github.com/mininet/mininet/wiki/Simple-Router) which,
+ * in turn, is based on a programming assignment developed at Stanford
+ * (http://www.scs.stanford.edu/09au-cs144/lab/router.html)
+ *
+ * While most of the code for chirouter has been written from scratch, some
+ * of the original Stanford code is still present in some places and, whenever
+ * possible, we have tried to provide the exact attribution for such code.
+ * Any omissions are not intentional and will be gladly corrected if
+ * you contact us at borja@cs.uchicago.edu
+ */
+
+/*
+ *  Copyright (c) 2016-2018, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "chirouter.h"
+#include "graph.h"
+#include "pktbuf.h"
+
+/* Number of entries in each worker's queue (must be a power of two) */
+#define WORKER_QUEUE_SIZE (4096u)
+
+/* Number of entries in each worker's handoff queue */
+#define WORKER_HANDOFF_SIZE (256u)
+
+/* Maximum number of workers (worker IDs must fit in a uint8_t,
+ * see chirouter_workers_start) */
+#define MAX_NUM_WORKERS (64u)
+
+
+/* An entry in a worker queue: an inbound frame, and the router
+ * that must process it */
+typedef struct chirouter_worker_queue_entry
+{
+    chirouter_ctx_t *router;
+    ethernet_frame_t *frame;
+} chirouter_worker_queue_entry_t;
+
+
+/* Single-producer/single-consumer ring. The producer is the I/O thread,
+ * and the consumer is the worker. The head and tail indices are kept
+ * on separate cache lines to avoid false sharing. */
+typedef struct chirouter_spsc_queue
+{
+    /* Next entry to be consumed (written by the consumer only) */
+    _Atomic uint32_t head __attribute__((aligned(64)));
+
+    /* Next entry to be produced (written by the producer only) */
+    _Atomic uint32_t tail __attribute__((aligned(64)));
+
+    /* Ring of WORKER_QUEUE_SIZE entries */
+    chirouter_worker_queue_entry_t *entries __attribute__((aligned(64)));
+} chirouter_spsc_queue_t;
+
+
+/* A worker thread */
+typedef struct chirouter_worker
+{
+    /* Worker ID */
+    uint16_t id;
+
+    /* Queue of frames to be processed by this worker */
+    chirouter_spsc_queue_t queue;
+
+    /* Number of entries in the queue. The worker sleeps on this
+     * semaphore when its queue is empty */
+    sem_t pending;
+
+    /* Frames handed off to this worker by other workers (see
+     * chirouter_worker_handoff). This is a ring of WORKER_HANDOFF_SIZE
+     * entries, protected by lock_handoff, since it has several producers.
+     * Each entry is also counted in the pending semaphore. */
+    pthread_mutex_t lock_handoff;
+    chirouter_worker_queue_entry_t handoff[WORKER_HANDOFF_SIZE];
+    uint32_t handoff_head;
+    uint32_t handoff_len;
+
+    /* Set to request that the worker exit */
+    atomic_bool stop;
+
+    /* Worker thread */
+    pthread_t thread;
+
+    /* Number of frames processed by this worker
+     * (written only by the worker) */
+    uint64_t frames_processed;
+
+    /* Number of calls to chirouter_process_ethernet_frames
+     * (written only by the worker) */
+    uint64_t batches_processed;
+
+    /* Number of frames dropped because the queue was full, and the
+     * largest number of entries the queue has held (written only by
+     * the I/O thread) */
+    uint64_t frames_dropped;
+    uint32_t queue_high_water;
+
+    /* Number of frames handed off to this worker, and number of frames
+     * that could not be handed off because the handoff queue was full
+     * (and were processed by the worker that tried to hand them off).
+     * Protected by lock_handoff. */
+    uint64_t frames_handed_off;
+    uint64_t handoffs_refused;
+
+    /* Packet processing graph used by this worker, and
+     * the messages it has yet to send */
+    chirouter_graph_t graph;
+    chirouter_tx_batch_t *tx_batch;
+
+    /* Server context */
+    server_ctx_t *server;
+} chirouter_worker_t;
+
+
+/*
+ * chirouter_workers_start - Creates the worker threads
+ *
+ * Assigns each router to a worker, and starts the workers. This
+ * function must be called after all the routers have been configured.
+ *
+ * ctx: Server context. ctx->num_workers must be greater than zero.
+ *
+ * Returns: 0 on success, -1 if an error happens (in which case the
+ *          workers that were started have been stopped, and all the
+ *          worker resources have been freed).
+ *
+ */
+int chirouter_workers_start(server_ctx_t *ctx);
+
+
+/*
+ * chirouter_workers_stop - Stops the worker threads
+ *
+ * Waits for all workers to finish processing the frames already in
+ * their queues, and then frees the worker resources.
+ *
+ * ctx: Server context
+ *
+ * Returns: 0 on success, -1 if an error happens.
+ *
+ */
+int chirouter_workers_stop(server_ctx_t *ctx);
+
+
+/*
+ * chirouter_worker_for_frame - Selects the worker that must process a frame
+ *
+ * ctx: Server context (with workers running)
+ *
+ * router: Router that received the frame
+ *
+ * frame: Inbound frame
+ *
+ * Returns: The router's worker or, in flow-affine mode, the worker
+ *          selected by the hash of the frame's flow.
+ *
+ */
+chirouter_worker_t* chirouter_worker_for_frame(server_ctx_t *ctx, chirouter_ctx_t *router, ethernet_frame_t *frame);
+
+
+/*
+ * chirouter_worker_enqueue - Hands off an inbound frame to a worker
+ *
+ * Must only be called from the I/O thread.
+ *
+ * worker: Worker
+ *
+ * router: Router that must process the frame
+ *
+ * frame: Frame allocated from the server's packet buffer pool. The
+ *        worker will free the frame after processing it.
+ *
+ * Returns: 0 on success, 1 if the queue is full (in which case
+ *          the frame is not enqueued, and the caller still owns it)
+ *
+ */
+int chirouter_worker_enqueue(chirouter_worker_t *worker, chirouter_ctx_t *router, ethernet_frame_t *frame);
+
+
+/*
+ * chirouter_worker_handoff - Hands off a frame to another worker
+ *
+ * In flow-affine mode, the frames withheld while the MAC address of their
+ * next hop is resolved are passed on by the worker that receives the ARP
+ * reply, which is not necessarily the worker their flow is assigned to.
+ * This function hands off such a frame to its flow's worker, so that
+ * it is not reordered with later frames of the same flow. The worker
+ * processes the frame again from the start (it is an unmodified copy of
+ * the inbound frame), ahead of the frames in its queue.
+ *
+ * Can be called from any worker thread.
+ *
+ * worker: Worker the frame is handed off to
+ *
+ * router: Router that must process the frame
+ *
+ * frame: Frame allocated from the server's packet buffer pool. The
+ *        worker will free the frame after processing it.
+ *
+ * Returns: 0 on success, 1 if the worker's handoff queue is full
+ *          or the worker is stopping (in which case the caller
+ *          still owns the frame)
+ *
+ */
+int chirouter_worker_handoff(chirouter_worker_t *worker, chirouter_ctx_t *router, ethernet_frame_t *frame);
+
+#endif
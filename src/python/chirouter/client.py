@@ -15,6 +15,7 @@ class ChirouterMessage(object):
     MSG_TYPE_RTABLE_ENTRY = 5
     MSG_TYPE_END_CONFIG = 6
     MSG_TYPE_ETHERNET_FRAME = 7
+    MSG_TYPE_ARP_ENTRY = 8
 
 
     SUBTYPE_NONE = 0
@@ -132,6 +133,22 @@ class ChirouterMessageRTableEntry(ChirouterMessage):
         return self._pack(16, payload)
 
 
+class ChirouterMessageArpEntry(ChirouterMessage):
+    def __init__(self, rid, iface_id, hwaddr, ipaddr):
+        ChirouterMessage.__init__(self,
+                                  msg_type=ChirouterMessage.MSG_TYPE_ARP_ENTRY,
+                                  subtype=ChirouterMessage.SUBTYPE_NONE)
+
+        self.rid = rid
+        self.iface_id = iface_id
+        self.hwaddr = hwaddr
+        self.ipaddr = ipaddr
+
+    def pack(self):
+        payload = struct.pack("!BB", self.rid, self.iface_id) + self.hwaddr + self.ipaddr
+        return self._pack(12, payload)
+
+
 class ChirouterMessageEndConfig(ChirouterMessage):
     def __init__(self):
         ChirouterMessage.__init__(self,
@@ -251,6 +268,18 @@ class ChirouterClient(object):
 
                 self.send_msg(rtable_msg)
 
+            for arp_entry in router.arp_entries:
+                iface = router.interfaces[arp_entry.iface]
+                rid, iface_id = self.iface_ids[iface]
+
+                arp_msg = ChirouterMessageArpEntry(rid=rid,
+                                                   iface_id=iface_id,
+                                                   hwaddr=arp_entry.hwaddr_packed,
+                                                   ipaddr=arp_entry.ip.packed
+                                                  )
+
+                self.send_msg(arp_msg)
+
             rid += 1
 
         done_msg = ChirouterMessageEndConfig()
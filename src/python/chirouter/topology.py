@@ -70,6 +70,28 @@ class RTableEntry(object):
         return cls(network, gateway_addr, d["metric"], d["iface"])
 
 
+class ArpEntry(object):
+
+    def __init__(self, ip, hwaddr, iface):
+        self.ip = ip
+        self.hwaddr = hwaddr
+        self.iface = iface
+
+    @property
+    def hwaddr_packed(self):
+        return binascii.unhexlify(self.hwaddr.replace(":",""))
+
+    @classmethod
+    def from_dict(cls, d):
+        for f in ("ip", "hwaddr", "iface"):
+            if f not in d:
+                raise ValueError("ARP Entry is missing '{}' field".format(f))
+
+        ip = ipaddress.ip_address(d["ip"])
+
+        return cls(ip, d["hwaddr"], d["iface"])
+
+
 class Switch(object):
 
     def __init__(self, id):
@@ -97,6 +119,7 @@ class Router(Switch):
         super(Router, self).__init__(id)
 
         self.rtable = []
+        self.arp_entries = []
 
     @property
     def name(self):
@@ -119,6 +142,12 @@ class Router(Switch):
 
         self.rtable.append(rtable_entry)
 
+    def add_arp_entry(self, arp_entry):
+        if arp_entry.iface not in self.interfaces:
+            raise ValueError("Incorrect interface in ARP entry: {}".format(arp_entry.iface))
+
+        self.arp_entries.append(arp_entry)
+
     def __repr__(self):
         return "<Router {}>".format(self.name)
 
@@ -136,6 +165,9 @@ class Router(Switch):
         for rtable_entry in d["rtable"]:
             router.add_rtable_entry(RTableEntry.from_dict(rtable_entry))
 
+        for arp_entry in d.get("arp", []):
+            router.add_arp_entry(ArpEntry.from_dict(arp_entry))
+
         return router
 
 class Host(object):